@@ -0,0 +1,649 @@
+#include <bcache.h>
+#include <bio.h>
+#include <devices.h>
+#include <errors.h>
+#include <mem.h>
+#include <lock.h>
+#include <list.h>
+#include <wait.h>
+#include <proc.h>
+
+#define BCACHE_HASH(devid, block) \
+  (((block) ^ ((u32)(devid) << 4)) & (BCACHE_HASH_SIZE - 1))
+
+/* The pool. Buffers never leave it, they just change the block they hold. */
+static bcache_buf_t bcache_bufs[BCACHE_BUFFERS];
+
+/* Hash table: buffers holding a block are chained in the bucket of their
+ * (devid, block). */
+static bcache_buf_t *bcache_hash[BCACHE_HASH_SIZE];
+
+/* Unreferenced buffers, least recently used first. */
+static bcache_buf_t *bcache_lru_head;
+static bcache_buf_t *bcache_lru_tail;
+
+/* Dirty buffers of a device. A device gets one of these the first time one
+ * of its buffers is written. */
+typedef struct bcache_dev {
+  dev_t                 devid;
+  bcache_buf_t        * dirty;    /* Dirty buffers, sorted by block. */
+  u32                   since;    /* Tick when the list stopped being empty. */
+  int                   error;    /* errno of the last failed write. */
+} bcache_dev_t;
+
+static list_t bcache_devs;
+
+/* Dirty data, all devices included. */
+static u32 bcache_dirty_bytes;
+
+/* Timer ticks seen and whether the writeback pass is due. */
+static volatile u32 bcache_ticks;
+static volatile int bcache_writeback_due;
+
+/* The writeback pass sleeps on the disks, so it can't run in the timer
+ * interrupt nor in a bottom half, which would put whoever they interrupted
+ * to sleep. It has a kernel thread of its own, woken up by the timer. */
+static wait_queue_t bcache_writeback_wait;
+static void bcache_writeback(void *data);
+
+/*****************************************************************************/
+/* Internals *****************************************************************/
+/*****************************************************************************/
+
+static void bcache_lru_del(bcache_buf_t *b) {
+  if (b->lru_prev != NULL)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    bcache_lru_head = b->lru_next;
+  if (b->lru_next != NULL)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    bcache_lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = NULL;
+}
+
+/* Recently used buffers go to the tail. */
+static void bcache_lru_add_tail(bcache_buf_t *b) {
+  b->lru_next = NULL;
+  b->lru_prev = bcache_lru_tail;
+  if (bcache_lru_tail != NULL)
+    bcache_lru_tail->lru_next = b;
+  else
+    bcache_lru_head = b;
+  bcache_lru_tail = b;
+}
+
+/* Buffers holding nothing useful go to the head, so they are taken first. */
+static void bcache_lru_add_head(bcache_buf_t *b) {
+  b->lru_prev = NULL;
+  b->lru_next = bcache_lru_head;
+  if (bcache_lru_head != NULL)
+    bcache_lru_head->lru_prev = b;
+  else
+    bcache_lru_tail = b;
+  bcache_lru_head = b;
+}
+
+static bcache_buf_t * bcache_hash_find(dev_t devid, u32 block) {
+  bcache_buf_t *b;
+
+  for (b = bcache_hash[BCACHE_HASH(devid, block)]; b != NULL; b = b->hash_next)
+    if (b->devid == devid && b->block == block)
+      return b;
+  return NULL;
+}
+
+static void bcache_hash_add(bcache_buf_t *b) {
+  u32 h;
+
+  h = BCACHE_HASH(b->devid, b->block);
+  b->hash_next = bcache_hash[h];
+  bcache_hash[h] = b;
+}
+
+/* Takes a buffer out of its chain, if it's in any. */
+static void bcache_hash_del(bcache_buf_t *b) {
+  bcache_buf_t **pp;
+
+  for (pp = &bcache_hash[BCACHE_HASH(b->devid, b->block)];
+       *pp != NULL;
+       pp = &(*pp)->hash_next) {
+    if (*pp == b) {
+      *pp = b->hash_next;
+      break;
+    }
+  }
+  b->hash_next = NULL;
+}
+
+static int bcache_dev_cmp(void *d, void *devid) {
+  return ((bcache_dev_t *)d)->devid == *((dev_t *)devid);
+}
+
+/* Finds the dirty list of a device, creating it if needed. */
+static bcache_dev_t * bcache_dev_get(dev_t devid) {
+  bcache_dev_t *d;
+
+  d = (bcache_dev_t *)list_find(&bcache_devs, bcache_dev_cmp, &devid);
+  if (d != NULL)
+    return d;
+
+  d = (bcache_dev_t *)kalloc(sizeof(bcache_dev_t));
+  if (d == NULL) {
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+  d->devid = devid;
+  d->dirty = NULL;
+  d->since = 0;
+  d->error = 0;
+
+  if (list_add(&bcache_devs, d) == -1) {
+    kfree(d);
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+  return d;
+}
+
+/* Sorted insertion in the device's dirty list. */
+static void bcache_dirty_add(bcache_dev_t *d, bcache_buf_t *b) {
+  bcache_buf_t *prev, *next;
+
+  if (d->dirty == NULL)
+    d->since = bcache_ticks;
+
+  for (prev = NULL, next = d->dirty;
+       next != NULL && next->block < b->block;
+       prev = next, next = next->dirty_next);
+
+  b->dirty_prev = prev;
+  b->dirty_next = next;
+  if (prev != NULL)
+    prev->dirty_next = b;
+  else
+    d->dirty = b;
+  if (next != NULL)
+    next->dirty_prev = b;
+
+  b->flags |= BCACHE_F_DIRTY;
+  bcache_dirty_bytes += BCACHE_BLOCK_SIZE;
+}
+
+static void bcache_dirty_del(bcache_dev_t *d, bcache_buf_t *b) {
+  if (b->dirty_prev != NULL)
+    b->dirty_prev->dirty_next = b->dirty_next;
+  else
+    d->dirty = b->dirty_next;
+  if (b->dirty_next != NULL)
+    b->dirty_next->dirty_prev = b->dirty_prev;
+  b->dirty_prev = b->dirty_next = NULL;
+
+  b->flags &= ~BCACHE_F_DIRTY;
+  bcache_dirty_bytes -= BCACHE_BLOCK_SIZE;
+}
+
+/* Translates the buffer's block into device sectors. */
+static int bcache_sectors(bcache_buf_t *b, u32 *sector, u32 *count) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(b->devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  *count = BCACHE_BLOCK_SIZE / dev->sector_size;
+  *sector = b->block * (*count);
+  return 0;
+}
+
+/* Synchronous transfer of a whole buffer. */
+static int bcache_rw(bcache_buf_t *b, int dir) {
+  u32 sector, count;
+
+  if (bcache_sectors(b, &sector, &count) == -1)
+    return -1;
+  return bio_rw(b->devid, dir, sector, count, b->data);
+}
+
+/* Completion of prefetched blocks. */
+static void bcache_end_io(bio_t *bio) {
+  bcache_buf_t *b;
+
+  b = (bcache_buf_t *)bio->private_data;
+  if (!bio->error)
+    b->flags |= BCACHE_F_VALID;
+  b->flags &= ~BCACHE_F_BUSY;
+  bcache_release(b);
+}
+
+/* Completion of written back blocks. */
+static void bcache_write_end_io(bio_t *bio) {
+  bcache_buf_t *b;
+  bcache_dev_t *d;
+
+  b = (bcache_buf_t *)bio->private_data;
+  if (bio->error) {
+    d = (bcache_dev_t *)list_find(&bcache_devs, bcache_dev_cmp, &(b->devid));
+    if (d != NULL)
+      d->error = bio->error;
+  }
+  b->flags &= ~BCACHE_F_BUSY;
+  bcache_release(b);
+}
+
+/* Writes back every device. */
+static int bcache_sync_all() {
+  bcache_dev_t *d;
+  int i, r;
+
+  r = 0;
+  for (i = 0; (d = (bcache_dev_t *)list_get(&bcache_devs, i)) != NULL; i ++) {
+    if (d->dirty != NULL && bcache_sync(d->devid) == -1)
+      r = -1;
+  }
+  return r;
+}
+
+/*****************************************************************************/
+/* Modules API ***************************************************************/
+/*****************************************************************************/
+
+int bcache_init() {
+  char *data;
+  int i;
+
+  data = (char *)kalloc(BCACHE_BUFFERS * BCACHE_BLOCK_SIZE);
+  if (data == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+
+  bcache_lru_head = bcache_lru_tail = NULL;
+  list_init(&bcache_devs);
+  bcache_dirty_bytes = 0;
+  bcache_ticks = 0;
+  bcache_writeback_due = 0;
+  wait_init(&bcache_writeback_wait);
+  for (i = 0; i < BCACHE_HASH_SIZE; i ++)
+    bcache_hash[i] = NULL;
+
+  for (i = 0; i < BCACHE_BUFFERS; i ++) {
+    bcache_bufs[i].devid = 0;
+    bcache_bufs[i].block = 0;
+    bcache_bufs[i].flags = 0;
+    bcache_bufs[i].count = 0;
+    bcache_bufs[i].data = data + i * BCACHE_BLOCK_SIZE;
+    bcache_bufs[i].hash_next = NULL;
+    bcache_bufs[i].dirty_prev = NULL;
+    bcache_bufs[i].dirty_next = NULL;
+    bcache_lru_add_tail(bcache_bufs + i);
+  }
+
+  return 0;
+}
+
+/*****************************************************************************/
+/* Public API ****************************************************************/
+/*****************************************************************************/
+
+/* Finds or recycles the buffer of a block, whatever is going on with it. */
+static bcache_buf_t * bcache_lookup(dev_t devid, u32 block) {
+  bcache_buf_t *b;
+  dev_t dirty_devid;
+
+  while (1) {
+    lock();
+
+    /* Cache hit. */
+    b = bcache_hash_find(devid, block);
+    if (b != NULL) {
+      if (b->count == 0)
+        bcache_lru_del(b);
+      b->count ++;
+      unlock();
+      return b;
+    }
+
+    /* Recycle the least recently used clean buffer. */
+    for (b = bcache_lru_head;
+         b != NULL && (b->flags & BCACHE_F_DIRTY);
+         b = b->lru_next);
+    if (b != NULL)
+      break;
+
+    /* Either everything is in use or dirty. In the last case write back the
+     * least recently used device and try again. */
+    if (bcache_lru_head == NULL) {
+      unlock();
+      set_errno(E_BUSY);
+      return NULL;
+    }
+    dirty_devid = bcache_lru_head->devid;
+    unlock();
+
+    if (bcache_sync(dirty_devid) == -1)
+      return NULL;
+  }
+
+  bcache_lru_del(b);
+  bcache_hash_del(b);
+
+  b->devid = devid;
+  b->block = block;
+  b->flags = 0;
+  b->count = 1;
+  bcache_hash_add(b);
+
+  unlock();
+  return b;
+}
+
+/* A block being read must not be touched until the read is done, or the
+ * read would overwrite it. */
+static void bcache_wait_read(bcache_buf_t *b) {
+  lock();
+  while ((b->flags & BCACHE_F_BUSY) && b->bio.dir == BIO_READ) {
+    unlock();
+    bio_wait(&(b->bio));
+    lock();
+  }
+  unlock();
+}
+
+bcache_buf_t * bcache_get(dev_t devid, u32 block) {
+  bcache_buf_t *b;
+
+  b = bcache_lookup(devid, block);
+  if (b != NULL)
+    bcache_wait_read(b);
+  return b;
+}
+
+/* The block is read through the buffer's own bio, marked BUSY, just like a
+ * prefetch. Anyone else after the same block waits for it instead of
+ * reading it again into the same data. */
+bcache_buf_t * bcache_read(dev_t devid, u32 block) {
+  bcache_buf_t *b;
+  u32 sector, n;
+  int r, err;
+
+  b = bcache_lookup(devid, block);
+  if (b == NULL)
+    return NULL;
+
+  r = 0;
+  lock();
+  while (r != -1 && !(b->flags & BCACHE_F_VALID)) {
+    /* Being read. Should it fail we'll just try ourselves. */
+    if (b->flags & BCACHE_F_BUSY) {
+      unlock();
+      bio_wait(&(b->bio));
+      lock();
+      continue;
+    }
+
+    r = bcache_sectors(b, &sector, &n);
+    if (r == -1)
+      break;
+
+    /* The completion drops the extra reference. */
+    bio_prepare(&(b->bio), devid, BIO_READ, sector, n, b->data,
+                bcache_end_io, b);
+    b->flags |= BCACHE_F_BUSY;
+    b->count ++;
+    unlock();
+
+    r = bio_submit(&(b->bio));
+    if (r == -1) {
+      err = get_errno();
+      b->flags &= ~BCACHE_F_BUSY;
+      bcache_release(b);
+      set_errno(err);
+    }
+    else {
+      r = bio_wait(&(b->bio));
+    }
+
+    lock();
+  }
+  unlock();
+
+  if (r == -1) {
+    err = get_errno();
+    bcache_release(b);
+    set_errno(err);
+    return NULL;
+  }
+  return b;
+}
+
+int bcache_write(bcache_buf_t *buf) {
+  bcache_dev_t *d;
+  int over;
+
+  /* Without a dirty list just write through. */
+  d = bcache_dev_get(buf->devid);
+  if (d == NULL) {
+    if (bcache_rw(buf, BIO_WRITE) == -1)
+      return -1;
+    buf->flags |= BCACHE_F_VALID;
+    return 0;
+  }
+
+  lock();
+  buf->flags |= BCACHE_F_VALID;
+  if (!(buf->flags & BCACHE_F_DIRTY))
+    bcache_dirty_add(d, buf);
+  over = bcache_dirty_bytes > BCACHE_DIRTY_MAX;
+  unlock();
+
+  if (over)
+    return bcache_sync_all();
+  return 0;
+}
+
+/* All the dirty buffers are queued, in block order, and then the queue is
+ * unplugged, so they reach the disk merged into as few transfers as
+ * possible. Failures are left in the device for bcache_sync() to report.
+ *
+ * A buffer dirtied again while its last write is on its way can't be queued
+ * until that write is done: its bio is still in the queue. The bio is filled
+ * in before the buffer is marked BUSY, so whoever waits on a BUSY buffer
+ * always waits on the request that's actually running. */
+static void bcache_flush(bcache_dev_t *d) {
+  bcache_buf_t *b;
+  u32 sector, n;
+  int r;
+
+  lock();
+  while ((b = d->dirty) != NULL) {
+    if (b->flags & BCACHE_F_BUSY) {
+      b->count ++;
+      unlock();
+      bio_wait(&(b->bio));
+      bcache_release(b);
+      lock();
+      continue;
+    }
+
+    /* Keep it referenced while being written. */
+    bcache_dirty_del(d, b);
+    if (b->count == 0)
+      bcache_lru_del(b);
+    b->count ++;
+
+    sector = n = 0;
+    r = bcache_sectors(b, &sector, &n);
+    bio_prepare(&(b->bio), d->devid, BIO_WRITE, sector, n, b->data,
+                bcache_write_end_io, b);
+    b->flags |= BCACHE_F_BUSY;
+    unlock();
+
+    if (r == -1 || bio_submit(&(b->bio)) == -1) {
+      b->bio.error = get_errno();
+      bcache_write_end_io(&(b->bio));
+    }
+
+    lock();
+  }
+  unlock();
+
+  bio_unplug(d->devid);
+}
+
+/* Waits for every buffer of the device being written, by bcache_flush()
+ * right now or earlier by the writeback pass. Unplugging is not enough: it
+ * does nothing if the queue is being dispatched somewhere else. Each buffer
+ * is referenced meanwhile so it's not recycled under our feet. */
+static void bcache_flush_wait(dev_t devid) {
+  bcache_buf_t *b;
+  int i;
+
+  for (i = 0; i < BCACHE_BUFFERS; i ++) {
+    b = bcache_bufs + i;
+
+    lock();
+    if (b->devid != devid || !(b->flags & BCACHE_F_BUSY) ||
+        b->bio.dir != BIO_WRITE) {
+      unlock();
+      continue;
+    }
+    if (b->count == 0)
+      bcache_lru_del(b);
+    b->count ++;
+    unlock();
+
+    /* Its failure, if any, is in the device already. */
+    bio_wait(&(b->bio));
+    bcache_release(b);
+  }
+}
+
+int bcache_sync(dev_t devid) {
+  bcache_dev_t *d;
+  int err;
+
+  d = (bcache_dev_t *)list_find(&bcache_devs, bcache_dev_cmp, &devid);
+  if (d == NULL)
+    return 0;
+
+  bcache_flush(d);
+  bcache_flush_wait(devid);
+
+  /* Report failures once. */
+  lock();
+  err = d->error;
+  d->error = 0;
+  unlock();
+
+  if (err) {
+    set_errno(err);
+    return -1;
+  }
+  return 0;
+}
+
+void bcache_release(bcache_buf_t *buf) {
+  lock();
+  buf->count --;
+  if (buf->count == 0) {
+    if (buf->flags & BCACHE_F_VALID)
+      bcache_lru_add_tail(buf);
+    else
+      bcache_lru_add_head(buf);
+  }
+  unlock();
+}
+
+/* The requests are just queued. They'll reach the disk, merged, as soon as
+ * the device's queue gets unplugged, which happens at the latest when one of
+ * these blocks is read. */
+void bcache_prefetch(dev_t devid, u32 *blocks, u32 count) {
+  bcache_buf_t *b;
+  u32 i, sector, n;
+
+  for (i = 0; i < count; i ++) {
+    if (blocks[i] == 0)
+      continue;
+
+    b = bcache_lookup(devid, blocks[i]);
+    if (b == NULL)
+      return;
+
+    /* Already there or on its way. */
+    if (b->flags & (BCACHE_F_VALID | BCACHE_F_BUSY)) {
+      bcache_release(b);
+      continue;
+    }
+
+    if (bcache_sectors(b, &sector, &n) == -1) {
+      bcache_release(b);
+      return;
+    }
+
+    /* The reference is kept until the request completes. */
+    bio_prepare(&b->bio, devid, BIO_READ, sector, n, b->data,
+                bcache_end_io, b);
+    b->flags |= BCACHE_F_BUSY;
+    if (bio_submit(&b->bio) == -1) {
+      b->flags &= ~BCACHE_F_BUSY;
+      bcache_release(b);
+      return;
+    }
+  }
+}
+
+void bcache_invalidate(dev_t devid) {
+  int i;
+
+  lock();
+  for (i = 0; i < BCACHE_BUFFERS; i ++) {
+    if (bcache_bufs[i].devid != devid || bcache_bufs[i].count > 0 ||
+        (bcache_bufs[i].flags & BCACHE_F_DIRTY))
+      continue;
+    bcache_lru_del(bcache_bufs + i);
+    bcache_hash_del(bcache_bufs + i);
+    bcache_bufs[i].flags = 0;
+    bcache_lru_add_head(bcache_bufs + i);
+  }
+  unlock();
+}
+
+void bcache_tick() {
+  bcache_ticks ++;
+  if (bcache_ticks % BCACHE_WRITEBACK_TICKS == 0) {
+    bcache_writeback_due = 1;
+    wait_wake_up(&bcache_writeback_wait);
+  }
+}
+
+/* The writeback thread. */
+static void bcache_writeback(void *data) {
+  bcache_dev_t *d;
+  int i;
+
+  while (1) {
+    lock();
+    while (!bcache_writeback_due)
+      wait_sleep(&bcache_writeback_wait);
+    bcache_writeback_due = 0;
+    unlock();
+
+    for (i = 0;
+         (d = (bcache_dev_t *)list_get(&bcache_devs, i)) != NULL;
+         i ++) {
+      /* Don't get in the way of whoever is using the disk right now. */
+      if (d->dirty == NULL || bio_busy(d->devid))
+        continue;
+      if (bcache_ticks - d->since >= BCACHE_DIRTY_EXPIRE)
+        bcache_flush(d);
+    }
+  }
+}
+
+int bcache_start_writeback() {
+  if (proc_kthread(bcache_writeback, NULL) == NULL)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,308 @@
+#include <bio.h>
+#include <devices.h>
+#include <list.h>
+#include <errors.h>
+#include <mem.h>
+#include <string.h>
+#include <lock.h>
+#include <wait.h>
+
+/* Every block device gets its own queue the first time a request is submitted
+ * to it. Requests are chained through their next field, sorted by sector. */
+typedef struct bio_queue {
+  dev_t                 devid;
+  dev_block_device_t  * dev;
+  bio_t               * head;     /* Pending requests, sorted by sector. */
+  u32                   count;    /* Amount of pending requests. */
+  int                   busy;     /* Somebody is dispatching. */
+  wait_queue_t          wait;     /* Waiting for requests to complete. */
+} bio_queue_t;
+
+static list_t bio_queues;
+
+static int bio_queue_cmp(void *q, void *devid) {
+  return ((bio_queue_t *)q)->devid == *((dev_t *)devid);
+}
+
+int bio_init() {
+  list_init(&bio_queues);
+  return 0;
+}
+
+void bio_prepare(bio_t *bio, dev_t devid, int dir, u32 sector, u32 count,
+                 char *buf, bio_end_io_t end_io, void *private_data) {
+  bio->devid = devid;
+  bio->dir = dir;
+  bio->sector = sector;
+  bio->count = count;
+  bio->buf = buf;
+  bio->end_io = end_io;
+  bio->private_data = private_data;
+  bio->done = 0;
+  bio->error = 0;
+  bio->next = NULL;
+}
+
+/* Finds the device's queue, creating it if needed. */
+static bio_queue_t * bio_get_queue(dev_t devid) {
+  dev_block_device_t *dev;
+  bio_queue_t *q;
+
+  q = (bio_queue_t *)list_find(&bio_queues, bio_queue_cmp, &devid);
+  if (q != NULL)
+    return q;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return NULL;
+  }
+
+  q = (bio_queue_t *)kalloc(sizeof(bio_queue_t));
+  if (q == NULL) {
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+  q->devid = devid;
+  q->dev = dev;
+  q->head = NULL;
+  q->count = 0;
+  q->busy = 0;
+  wait_init(&q->wait);
+
+  if (list_add(&bio_queues, q) == -1) {
+    kfree(q);
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+  return q;
+}
+
+/* Sends a run of merged requests to the driver. If their buffers happen to be
+ * contiguous too they are used as they are, otherwise the data goes through
+ * a bounce buffer. Should there be no memory for it, we'll fall back to one
+ * driver call per request. */
+static int bio_dispatch_run(dev_block_device_t *dev, bio_t *first, u32 count,
+                            int contiguous) {
+  int (* op) (dev_block_device_t *, char *, off_t, size_t);
+  size_t ss;
+  char *buf, *p;
+  bio_t *b;
+  int r;
+
+  op = first->dir == BIO_WRITE ? dev->ops->write : dev->ops->read;
+  if (op == NULL) {
+    set_errno(E_NOTIMP);
+    return -1;
+  }
+  ss = dev->sector_size;
+
+  if (contiguous)
+    return op(dev, first->buf, first->sector * ss, count * ss);
+
+  buf = (char *)kalloc(count * ss);
+  if (buf == NULL) {
+    for (b = first; b != NULL; b = b->next) {
+      if (op(dev, b->buf, b->sector * ss, b->count * ss) == -1)
+        return -1;
+    }
+    return 0;
+  }
+
+  if (first->dir == BIO_WRITE) {
+    for (b = first, p = buf; b != NULL; p += b->count * ss, b = b->next)
+      memcpy(p, b->buf, b->count * ss);
+  }
+
+  r = op(dev, buf, first->sector * ss, count * ss);
+
+  if (r != -1 && first->dir == BIO_READ) {
+    for (b = first, p = buf; b != NULL; p += b->count * ss, b = b->next)
+      memcpy(b->buf, p, b->count * ss);
+  }
+
+  kfree(buf);
+  return r;
+}
+
+/* Serves everything in the queue, head to tail. Each round takes the longest
+ * run of requests at the head that can be merged: same direction, each one
+ * starting right where the previous ends and BIO_MAX_SECTORS at most. */
+static void bio_queue_dispatch(bio_queue_t *q) {
+  bio_t *first, *last, *b, *next;
+  u32 count, n;
+  int contiguous, error;
+
+  lock();
+  if (q->busy) {
+    unlock();
+    return;
+  }
+  q->busy = 1;
+
+  while (q->head != NULL) {
+    first = last = q->head;
+    count = first->count;
+    contiguous = 1;
+    for (n = 1;
+
+         last->next != NULL &&
+         last->next->dir == first->dir &&
+         last->next->sector == last->sector + last->count &&
+         count + last->next->count <= BIO_MAX_SECTORS;
+
+         n ++) {
+      if (last->next->buf != last->buf + last->count * q->dev->sector_size)
+        contiguous = 0;
+      last = last->next;
+      count += last->count;
+    }
+    q->head = last->next;
+    q->count -= n;
+    last->next = NULL;
+    unlock();
+
+    error = 0;
+    if (bio_dispatch_run(q->dev, first, count, contiguous) == -1)
+      error = get_errno();
+
+    for (b = first; b != NULL; b = next) {
+      next = b->next;
+      b->next = NULL;
+      b->error = error;
+      b->done = 1;
+      if (b->end_io != NULL)
+        b->end_io(b);
+    }
+
+    lock();
+    wait_wake_up(&q->wait);
+  }
+
+  q->busy = 0;
+  unlock();
+}
+
+/* Tells whether two requests touch the same sectors and one of them writes,
+ * in which case their order matters. */
+static int bio_conflict(bio_t *a, bio_t *b) {
+  if (a->dir == BIO_READ && b->dir == BIO_READ)
+    return 0;
+  return a->sector < b->sector + b->count && b->sector < a->sector + a->count;
+}
+
+int bio_submit(bio_t *bio) {
+  bio_queue_t *q;
+  bio_t **pp, *after;
+  int full;
+
+  if (bio->count == 0 || bio->buf == NULL ||
+      (bio->dir != BIO_READ && bio->dir != BIO_WRITE)) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+
+  q = bio_get_queue(bio->devid);
+  if (q == NULL)
+    return -1;
+
+  bio->done = 0;
+  bio->error = 0;
+  bio->next = NULL;
+
+  lock();
+
+  /* Keep the order of conflicting requests by getting rid of the old ones
+   * first. */
+  for (pp = &q->head; *pp != NULL; pp = &(*pp)->next) {
+    if (bio_conflict(*pp, bio)) {
+      unlock();
+      bio_queue_dispatch(q);
+      lock();
+      break;
+    }
+  }
+
+  /* That does nothing if somebody else is dispatching the queue, and they
+   * may be sleeping on the disk. Whatever conflicting requests are still
+   * queued must go first, so this one goes right behind the last of them
+   * instead of where the order of sectors would put it. */
+  for (after = NULL, pp = &q->head; *pp != NULL; pp = &(*pp)->next)
+    if (bio_conflict(*pp, bio))
+      after = *pp;
+
+  if (after != NULL) {
+    pp = &after->next;
+  }
+  else {
+    /* Sorted insertion. Requests for the same sector keep their arrival
+     * order. */
+    for (pp = &q->head;
+         *pp != NULL && (*pp)->sector <= bio->sector;
+         pp = &(*pp)->next);
+  }
+  bio->next = *pp;
+  *pp = bio;
+  q->count ++;
+  full = q->count >= BIO_BATCH;
+
+  unlock();
+
+  if (full)
+    bio_queue_dispatch(q);
+  return 0;
+}
+
+int bio_unplug(dev_t devid) {
+  bio_queue_t *q;
+
+  q = (bio_queue_t *)list_find(&bio_queues, bio_queue_cmp, &devid);
+  if (q == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  bio_queue_dispatch(q);
+  return 0;
+}
+
+int bio_busy(dev_t devid) {
+  bio_queue_t *q;
+
+  q = (bio_queue_t *)list_find(&bio_queues, bio_queue_cmp, &devid);
+  return q != NULL && q->busy;
+}
+
+int bio_wait(bio_t *bio) {
+  bio_queue_t *q;
+
+  q = (bio_queue_t *)list_find(&bio_queues, bio_queue_cmp, &bio->devid);
+  if (q == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+
+  /* If somebody else is dispatching the queue our request will be served in
+   * due time, and they'll wake us up. */
+  while (!bio->done) {
+    bio_queue_dispatch(q);
+    lock();
+    if (!bio->done)
+      wait_sleep(&q->wait);
+    unlock();
+  }
+
+  if (bio->error) {
+    set_errno(bio->error);
+    return -1;
+  }
+  return 0;
+}
+
+int bio_rw(dev_t devid, int dir, u32 sector, u32 count, char *buf) {
+  bio_t bio;
+
+  bio_prepare(&bio, devid, dir, sector, count, buf, NULL, NULL);
+  if (bio_submit(&bio) == -1)
+    return -1;
+  return bio_wait(&bio);
+}
@@ -27,7 +27,8 @@ int dev_init() {
   list_init(&blk_devs);
   if (memfs_create(DEV_FS_NAME, DEV_FS_DEVID, MEMFS_FLAGS_ALLOW_FILES |
                                               MEMFS_FLAGS_ALLOW_DIRS  |
-                                              MEMFS_FLAGS_ALLOW_NODES) == -1)
+                                              MEMFS_FLAGS_ALLOW_NODES,
+                   DEV_FS_MAX_BYTES, DEV_FS_MAX_INODES) == -1)
     return -1;
   if (vfs_mkdir("/dev", 0755) == -1)
     return -1;
@@ -71,6 +72,174 @@ dev_block_device_t * dev_get_block_device(dev_t devid) {
                                          &devid);
 }
 
+/* Moves count bytes between buf and the device starting at byte off. Drivers
+ * only handle whole sectors, so the sectors at both ends of an unaligned
+ * range go through a bounce sector: reads copy the relevant part out of it,
+ * writes read it, patch it and write it back. Everything in between is
+ * handed to the driver in a single call. */
+static int dev_blk_transfer(dev_block_device_t *dev,
+                            char *buf,
+                            off_t off,
+                            size_t count,
+                            int write) {
+  int (* op) (dev_block_device_t *, char *, off_t, size_t);
+  size_t ss, size, done, n, skip;
+  char *bounce;
+
+  op = write ? dev->ops->write : dev->ops->read;
+  if (op == NULL || dev->ops->read == NULL) {
+    set_errno(E_NOTIMP);
+    return -1;
+  }
+
+  /* Clip the request to the device size. */
+  ss = dev->sector_size;
+  size = dev->sectors * ss;
+  if (off >= size)
+    return 0;
+  if (count > size - off)
+    count = size - off;
+
+  bounce = NULL;
+  for (done = 0; done < count; done += n) {
+    skip = (off + done) % ss;
+
+    if (skip == 0 && count - done >= ss) {
+      /* Aligned: as many whole sectors as we can in one go. */
+      n = (count - done) - (count - done) % ss;
+      if (op(dev, buf + done, off + done, n) == -1)
+        break;
+      continue;
+    }
+
+    /* Partial sector. */
+    if (bounce == NULL) {
+      bounce = (char *)kalloc(ss);
+      if (bounce == NULL) {
+        set_errno(E_NOMEM);
+        return -1;
+      }
+    }
+    n = ss - skip < count - done ? ss - skip : count - done;
+    if (dev->ops->read(dev, bounce, off + done - skip, ss) == -1)
+      break;
+    if (write) {
+      memcpy(bounce + skip, buf + done, n);
+      if (op(dev, bounce, off + done - skip, ss) == -1)
+        break;
+    }
+    else {
+      memcpy(buf + done, bounce + skip, n);
+    }
+  }
+
+  if (bounce != NULL)
+    kfree(bounce);
+
+  /* Errors are only reported if nothing was transferred at all. */
+  if (done < count && done == 0)
+    return -1;
+  return done;
+}
+
+/* Requests access to a block device. */
+int dev_blk_open(dev_t devid, int mode) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+
+  /* Exclusive access works both ways. */
+  if (dev->count > 0 &&
+      ((mode & DEV_MODE_O_EXCL) || (dev->mode & DEV_MODE_O_EXCL))) {
+    set_errno(E_BUSY);
+    return -1;
+  }
+
+  if (dev->ops->open != NULL && dev->ops->open(dev, mode) == -1)
+    return -1;
+
+  dev->count ++;
+  dev->mode |= mode;
+  return 0;
+}
+
+/* Release a block device from use. */
+int dev_blk_release(dev_t devid) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  if (dev->count == 0) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+
+  dev->count --;
+  if (dev->count == 0) {
+    dev->mode = 0;
+    if (dev->ops->release != NULL)
+      return dev->ops->release(dev);
+  }
+  return 0;
+}
+
+int dev_blk_read(dev_t devid, char *buf, off_t off, size_t count) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  return dev_blk_transfer(dev, buf, off, count, 0);
+}
+
+int dev_blk_write(dev_t devid, char *buf, off_t off, size_t count) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  return dev_blk_transfer(dev, buf, off, count, 1);
+}
+
+int dev_blk_flush(dev_t devid) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  if (dev->ops->flush == NULL)
+    return 0;
+  return dev->ops->flush(dev);
+}
+
+int dev_blk_ioctl(dev_t devid, u32 request, void *data) {
+  dev_block_device_t *dev;
+
+  dev = dev_get_block_device(devid);
+  if (dev == NULL) {
+    set_errno(E_NODEV);
+    return -1;
+  }
+  if (dev->ops->ioctl == NULL) {
+    set_errno(E_NOTIMP);
+    return -1;
+  }
+  return dev->ops->ioctl(dev, request, data);
+}
+
 /* Register char device */
 int dev_register_char_device(dev_char_device_t *dev) {
   dev_char_device_t *d;
@@ -142,6 +311,7 @@ int dev_register_char_dev(dev_t devid,
   chr->fops.lseek = ops->lseek;
   chr->fops.ioctl = ops->ioctl;
   chr->fops.readdir = ops->readdir;
+  chr->fops.getdents = ops->getdents;
 
   /* Ask for memory for it's name. */
   chr->name = (char *)kalloc(strlen(name) + 1);
@@ -212,6 +382,7 @@ int dev_set_char_operations(vfs_vnode_t *node, vfs_file_t *filp) {
   filp->f_ops.lseek = chr->fops.lseek;
   filp->f_ops.ioctl = chr->fops.ioctl;
   filp->f_ops.readdir = chr->fops.readdir;
+  filp->f_ops.getdents = chr->fops.getdents;
 
   return 0;
 }
@@ -0,0 +1,587 @@
+#include <apic.h>
+#include <pic.h>
+#include <pit.h>
+#include <sched.h>
+#include <hw.h>
+#include <io.h>
+#include <lock.h>
+#include <smp.h>
+#include <string.h>
+#include <typedef.h>
+
+/*****************************************************************************
+ * ACPI tables                                                               *
+ *****************************************************************************/
+
+/* The Root System Description Pointer is somewhere in the first KB of the
+ * EBDA, whose segment is at 0x40e in the BIOS data area, or in the BIOS ROM,
+ * always 16 bytes aligned. */
+#define ACPI_EBDA_SEGMENT_PTR     0x0000040e
+#define ACPI_EBDA_SEARCH_SIZE     1024
+#define ACPI_ROM_START            0x000e0000
+#define ACPI_ROM_END              0x00100000
+
+#define ACPI_RSDP_SIGNATURE       "RSD PTR "
+#define ACPI_MADT_SIGNATURE       "APIC"
+
+typedef struct {
+  char sig[8];
+  u8 checksum;
+  char oem_id[6];
+  u8 revision;
+  u32 rsdt;
+} __attribute__((__packed__)) acpi_rsdp_t;
+
+/* Every table starts with this header. */
+typedef struct {
+  char sig[4];
+  u32 length;
+  u8 revision;
+  u8 checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  u32 oem_revision;
+  u32 creator_id;
+  u32 creator_revision;
+} __attribute__((__packed__)) acpi_header_t;
+
+/* The MADT is a header, the local APIC address and some flags, followed by
+ * variable length entries. */
+typedef struct {
+  acpi_header_t h;
+  u32 lapic;
+  u32 flags;
+} __attribute__((__packed__)) acpi_madt_t;
+
+#define ACPI_MADT_LAPIC           0
+#define ACPI_MADT_IOAPIC          1
+#define ACPI_MADT_OVERRIDE        2
+
+typedef struct {
+  u8 type;
+  u8 length;
+} __attribute__((__packed__)) acpi_madt_entry_t;
+
+typedef struct {
+  acpi_madt_entry_t e;
+  u8 acpi_id;
+  u8 apic_id;
+  u32 flags;
+} __attribute__((__packed__)) acpi_madt_lapic_t;
+
+#define ACPI_LAPIC_ENABLED        0x00000001
+
+typedef struct {
+  acpi_madt_entry_t e;
+  u8 id;
+  u8 reserved;
+  u32 address;
+  u32 gsi_base;
+} __attribute__((__packed__)) acpi_madt_ioapic_t;
+
+typedef struct {
+  acpi_madt_entry_t e;
+  u8 bus;
+  u8 source;                      /* ISA IRQ. */
+  u32 gsi;                        /* I/O APIC input it's wired to. */
+  u16 flags;
+} __attribute__((__packed__)) acpi_madt_override_t;
+
+/* Override flags. 0 in either field means the bus' default, which for ISA
+ * is active high and edge triggered. */
+#define ACPI_POLARITY_MASK        0x0003
+#define ACPI_POLARITY_LOW         0x0003
+#define ACPI_TRIGGER_MASK         0x000c
+#define ACPI_TRIGGER_LEVEL        0x000c
+
+/* All bytes of a table, checksum included, add up to 0. */
+static int acpi_checksum(void *p, u32 length) {
+  u8 sum;
+  u32 i;
+
+  for (sum = 0, i = 0; i < length; i ++)
+    sum += ((u8 *)p)[i];
+  return sum == 0;
+}
+
+static acpi_rsdp_t * acpi_find_rsdp_in(u32 start, u32 end) {
+  u32 p;
+
+  for (p = start; p + sizeof(acpi_rsdp_t) <= end; p += 16)
+    if (memcmp((void *)p, ACPI_RSDP_SIGNATURE, 8) == 0 &&
+        acpi_checksum((void *)p, sizeof(acpi_rsdp_t)))
+      return (acpi_rsdp_t *)p;
+  return NULL;
+}
+
+/* Finds the MADT through the RSDT. The tables are in RAM or ROM below 4 GB,
+ * which the kernel segments cover whole. */
+static acpi_madt_t * acpi_find_madt() {
+  acpi_rsdp_t *rsdp;
+  acpi_header_t *rsdt, *t;
+  u32 ebda, *entries;
+  int i, n;
+
+  ebda = (u32)*(u16 *)ACPI_EBDA_SEGMENT_PTR << 4;
+  rsdp = NULL;
+  if (ebda != 0)
+    rsdp = acpi_find_rsdp_in(ebda, ebda + ACPI_EBDA_SEARCH_SIZE);
+  if (rsdp == NULL)
+    rsdp = acpi_find_rsdp_in(ACPI_ROM_START, ACPI_ROM_END);
+  if (rsdp == NULL)
+    return NULL;
+
+  rsdt = (acpi_header_t *)rsdp->rsdt;
+  if (!acpi_checksum(rsdt, rsdt->length))
+    return NULL;
+
+  /* The RSDT is the header followed by 32 bits pointers to the rest. */
+  entries = (u32 *)(rsdt + 1);
+  n = (rsdt->length - sizeof(acpi_header_t)) / sizeof(u32);
+  for (i = 0; i < n; i ++) {
+    t = (acpi_header_t *)entries[i];
+    if (memcmp(t->sig, ACPI_MADT_SIGNATURE, 4) == 0 &&
+        acpi_checksum(t, t->length))
+      return (acpi_madt_t *)t;
+  }
+  return NULL;
+}
+
+/*****************************************************************************
+ * Local APIC                                                                *
+ *****************************************************************************/
+
+/* Registers, as offsets in the local APIC page. They're all 32 bits wide and
+ * 16 bytes apart. */
+#define LAPIC_ID                  0x020
+#define LAPIC_TPR                 0x080
+#define LAPIC_EOI                 0x0b0
+#define LAPIC_SVR                 0x0f0
+#define LAPIC_ICR_LOW             0x300
+#define LAPIC_ICR_HIGH            0x310
+#define LAPIC_LVT_TIMER           0x320
+#define LAPIC_TIMER_INIT          0x380
+#define LAPIC_TIMER_CURRENT       0x390
+#define LAPIC_TIMER_DIVIDE        0x3e0
+
+#define LAPIC_SVR_ENABLE          0x00000100
+
+/* LVT bits. */
+#define LAPIC_LVT_MASKED          0x00010000
+#define LAPIC_LVT_ONE_SHOT        0x00000000
+#define LAPIC_LVT_TSC_DEADLINE    0x00040000
+
+#define LAPIC_TIMER_DIVIDE_16     0x00000003
+
+/* Interrupt command register bits. The destination goes in the high half. */
+#define LAPIC_ICR_FIXED           0x00000000
+#define LAPIC_ICR_INIT            0x00000500
+#define LAPIC_ICR_STARTUP         0x00000600
+#define LAPIC_ICR_PENDING         0x00001000
+#define LAPIC_ICR_ASSERT          0x00004000
+#define LAPIC_ICR_LEVEL           0x00008000
+#define LAPIC_ICR_DEST_SHIFT      24
+
+static volatile u32 *lapic;
+
+static u32 lapic_read(u32 reg) {
+  return lapic[reg / sizeof(u32)];
+}
+
+static void lapic_write(u32 reg, u32 value) {
+  lapic[reg / sizeof(u32)] = value;
+}
+
+/* ID of the local APIC of the processor running this. */
+static u8 lapic_id() {
+  return lapic_read(LAPIC_ID) >> 24;
+}
+
+/* Sends an IPI to the local APIC with ID id. Writing the low half sends it,
+ * and there can't be another one until the APIC is done with it. */
+static void lapic_send_ipi(u8 id, u32 command) {
+  u32 flags;
+
+  flags = irq_save();
+  while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    hw_pause();
+  lapic_write(LAPIC_ICR_HIGH, (u32)id << LAPIC_ICR_DEST_SHIFT);
+  lapic_write(LAPIC_ICR_LOW, command);
+  while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    hw_pause();
+  irq_restore(flags);
+}
+
+/*****************************************************************************
+ * I/O APIC                                                                  *
+ *****************************************************************************/
+
+/* The I/O APIC only has two memory mapped registers: one selects an internal
+ * register and the other one accesses it. */
+#define IOAPIC_REGSEL             0x00
+#define IOAPIC_WIN                0x10
+
+/* Internal registers. Each redirection entry takes two, the low one has the
+ * vector and the flags, the high one the destination. */
+#define IOAPIC_VER                0x01
+#define IOAPIC_REDIR(n)           (0x10 + 2 * (n))
+
+#define IOAPIC_REDIR_MASKED       0x00010000
+#define IOAPIC_REDIR_LEVEL        0x00008000
+#define IOAPIC_REDIR_ACTIVE_LOW   0x00002000
+#define IOAPIC_REDIR_DEST_SHIFT   24
+
+static struct {
+  volatile u32 *base;
+  u32 gsi_base;                   /* Input 0 is this GSI. */
+  u32 inputs;
+} ioapics[APIC_MAX_IOAPICS];
+
+static int ioapic_count;
+
+/* Where each ISA IRQ is wired to, and how. */
+static struct {
+  u32 gsi;
+  u32 flags;                      /* IOAPIC_REDIR_LEVEL and _ACTIVE_LOW. */
+} isa_irqs[APIC_ISA_IRQS];
+
+static u32 ioapic_read(int i, u32 reg) {
+  ioapics[i].base[IOAPIC_REGSEL / sizeof(u32)] = reg;
+  return ioapics[i].base[IOAPIC_WIN / sizeof(u32)];
+}
+
+static void ioapic_write(int i, u32 reg, u32 value) {
+  ioapics[i].base[IOAPIC_REGSEL / sizeof(u32)] = reg;
+  ioapics[i].base[IOAPIC_WIN / sizeof(u32)] = value;
+}
+
+/* Devices interrupt the BSP only. */
+static u8 apic_bsp_id;
+
+/* Finds the I/O APIC with input gsi and its input number. */
+static int ioapic_find(u32 gsi, u32 *input) {
+  int i;
+
+  for (i = 0; i < ioapic_count; i ++)
+    if (gsi >= ioapics[i].gsi_base &&
+        gsi < ioapics[i].gsi_base + ioapics[i].inputs) {
+      *input = gsi - ioapics[i].gsi_base;
+      return i;
+    }
+  return -1;
+}
+
+/* Sets the redirection entry of an ISA IRQ, addressed by its number. The
+ * register selection and the access can't be interrupted. */
+static void ioapic_route(int isa, int masked) {
+  u32 input, low, flags;
+  int i;
+
+  i = ioapic_find(isa_irqs[isa].gsi, &input);
+  if (i == -1)
+    return;
+
+  low = (PIC_MASTER_BASE_IRQ + isa) | isa_irqs[isa].flags;
+  if (masked)
+    low |= IOAPIC_REDIR_MASKED;
+
+  /* Fixed delivery to the BSP's local APIC. */
+  flags = irq_save();
+  ioapic_write(i, IOAPIC_REDIR(input) + 1,
+               (u32)apic_bsp_id << IOAPIC_REDIR_DEST_SHIFT);
+  ioapic_write(i, IOAPIC_REDIR(input), low);
+  irq_restore(flags);
+}
+
+/*****************************************************************************
+ * Set up                                                                    *
+ *****************************************************************************/
+
+static int apic_active;
+
+/* Local APIC IDs of the enabled processors, in the MADT's order. */
+static u8 apic_cpus[SMP_MAX_CPUS];
+static int apic_cpus_count;
+
+/* Walks the MADT filling apic_cpus, ioapics and isa_irqs. */
+static void apic_parse_madt(acpi_madt_t *madt) {
+  acpi_madt_entry_t *e;
+  acpi_madt_lapic_t *l;
+  acpi_madt_ioapic_t *io;
+  acpi_madt_override_t *o;
+  u8 *p, *end;
+  int i;
+
+  for (i = 0; i < APIC_ISA_IRQS; i ++) {
+    isa_irqs[i].gsi = i;
+    isa_irqs[i].flags = 0;
+  }
+
+  lapic = (volatile u32 *)madt->lapic;
+  ioapic_count = 0;
+  apic_cpus_count = 0;
+
+  end = (u8 *)madt + madt->h.length;
+  for (p = (u8 *)(madt + 1); p < end; p += e->length) {
+    e = (acpi_madt_entry_t *)p;
+    if (e->length == 0)
+      break;
+
+    switch (e->type) {
+      case ACPI_MADT_LAPIC:
+        l = (acpi_madt_lapic_t *)e;
+        if (!(l->flags & ACPI_LAPIC_ENABLED) ||
+            apic_cpus_count == SMP_MAX_CPUS)
+          break;
+        apic_cpus[apic_cpus_count ++] = l->apic_id;
+        break;
+      case ACPI_MADT_IOAPIC:
+        if (ioapic_count == APIC_MAX_IOAPICS)
+          break;
+        io = (acpi_madt_ioapic_t *)e;
+        ioapics[ioapic_count].base = (volatile u32 *)io->address;
+        ioapics[ioapic_count].gsi_base = io->gsi_base;
+        ioapic_count ++;
+        break;
+      case ACPI_MADT_OVERRIDE:
+        o = (acpi_madt_override_t *)e;
+        if (o->bus != 0 || o->source >= APIC_ISA_IRQS)
+          break;
+        isa_irqs[o->source].gsi = o->gsi;
+        if ((o->flags & ACPI_POLARITY_MASK) == ACPI_POLARITY_LOW)
+          isa_irqs[o->source].flags |= IOAPIC_REDIR_ACTIVE_LOW;
+        if ((o->flags & ACPI_TRIGGER_MASK) == ACPI_TRIGGER_LEVEL)
+          isa_irqs[o->source].flags |= IOAPIC_REDIR_LEVEL;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+/* Enables the local APIC of this processor, accepting every priority. */
+static void apic_lapic_enable() {
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_IRQ);
+}
+
+/* Nothing to do, the switch happens when the interrupt returns. */
+static int apic_resched_handler(itr_frame_t *frame, void *cookie) {
+  return ITR_HANDLED;
+}
+
+int apic_init() {
+  acpi_madt_t *madt;
+  u32 regs[4];
+  int i;
+
+  apic_active = 0;
+
+  hw_cpuid(HW_CPUID_FEATURES, regs);
+  if (!(regs[3] & HW_CPUID_EDX_APIC))
+    return -1;
+
+  madt = acpi_find_madt();
+  if (madt == NULL)
+    return -1;
+  apic_parse_madt(madt);
+  if (ioapic_count == 0)
+    return -1;
+
+  /* From now on the PICs are out. */
+  pic_disable();
+
+  apic_lapic_enable();
+  apic_bsp_id = lapic_id();
+
+  /* Every I/O APIC input starts masked. The maximum redirection entry is in
+   * bits 16-23 of the version register. */
+  for (i = 0; i < ioapic_count; i ++)
+    ioapics[i].inputs = ((ioapic_read(i, IOAPIC_VER) >> 16) & 0xff) + 1;
+  for (i = 0; i < APIC_ISA_IRQS; i ++)
+    ioapic_route(i, 1);
+
+  /* Other processors poke us to reschedule. */
+  itr_set_interrupt_handler(APIC_RESCHED_IRQ,
+                            apic_resched_handler,
+                            NULL,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+
+  apic_active = 1;
+  return 0;
+}
+
+int apic_enabled() {
+  return apic_active;
+}
+
+void apic_send_eoi(itr_irq_t irq) {
+  if (irq < PIC_MASTER_BASE_IRQ || irq > APIC_RESCHED_IRQ)
+    return;
+  lapic_write(LAPIC_EOI, 0);
+}
+
+/* The ISA IRQs keep the vectors they have with the PICs. */
+static int apic_isa_irq(itr_irq_t irq) {
+  if (irq < PIC_MASTER_BASE_IRQ ||
+      irq >= PIC_MASTER_BASE_IRQ + APIC_ISA_IRQS)
+    return -1;
+  return irq - PIC_MASTER_BASE_IRQ;
+}
+
+void apic_mask_irq(itr_irq_t irq) {
+  int isa;
+
+  isa = apic_isa_irq(irq);
+  if (isa != -1)
+    ioapic_route(isa, 1);
+}
+
+void apic_unmask_irq(itr_irq_t irq) {
+  int isa;
+
+  isa = apic_isa_irq(irq);
+  if (isa != -1)
+    ioapic_route(isa, 0);
+}
+
+/*****************************************************************************
+ * Processors                                                                *
+ *****************************************************************************/
+
+int apic_cpu_count() {
+  return apic_active ? apic_cpus_count : 0;
+}
+
+u8 apic_cpu_id(int i) {
+  return apic_cpus[i];
+}
+
+u8 apic_id() {
+  return lapic_id();
+}
+
+void apic_send_ipi(u8 id, itr_irq_t irq) {
+  lapic_send_ipi(id, LAPIC_ICR_FIXED | irq);
+}
+
+/* The universal startup algorithm from the MultiProcessor Specification:
+ * INIT, 10 ms, STARTUP, 200 us, STARTUP. The second STARTUP is ignored by
+ * processors that took the first one. Our shortest wait is a PIT tick, so
+ * that's what both waits are. */
+void apic_start_cpu(u8 id, u32 addr) {
+  lapic_send_ipi(id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+  pit_wait_tick();
+  lapic_send_ipi(id, LAPIC_ICR_STARTUP | (addr >> 12));
+  pit_wait_tick();
+  lapic_send_ipi(id, LAPIC_ICR_STARTUP | (addr >> 12));
+}
+
+/*****************************************************************************
+ * Timer                                                                     *
+ *****************************************************************************/
+
+/* Whether the timer runs in TSC-deadline mode. */
+static int apic_tsc_deadline;
+
+/* Local APIC timer counts or TSC cycles in a tick. */
+static u32 apic_ticks_per_tick;
+
+/* TSC value of the next tick of each processor, in TSC-deadline mode. */
+static u64 apic_next_deadline[SMP_MAX_CPUS];
+
+/* Whether apic_timer_init() succeeded, the APs start theirs then. */
+static int apic_timer_active;
+
+/* Sets the timer to fire at the next tick. In TSC-deadline mode the
+ * deadlines are kept a tick apart, so the handler's latency doesn't make the
+ * clock drift. If we fell behind, e.g. with interrupts disabled for long, the
+ * lost ticks are not made up for. */
+static void apic_timer_arm() {
+  u64 now, *next;
+
+  if (!apic_tsc_deadline) {
+    lapic_write(LAPIC_TIMER_INIT, apic_ticks_per_tick);
+    return;
+  }
+
+  now = hw_rdtsc();
+  next = apic_next_deadline + smp_cpu_id();
+  *next += apic_ticks_per_tick;
+  if (*next <= now)
+    *next = now + apic_ticks_per_tick;
+  hw_wrmsr(HW_MSR_TSC_DEADLINE, *next);
+}
+
+/* Every processor has its own timer. The BSP's keeps the time, the rest only
+ * account their processes' slices. */
+static int apic_timer_handler(itr_frame_t *frame, void *cookie) {
+  apic_timer_arm();
+  if (smp_cpu_id() == 0)
+    pit_tick();
+  else
+    sched_tick();
+  return ITR_HANDLED;
+}
+
+/* Starts this processor's timer. */
+static void apic_timer_start() {
+  if (apic_tsc_deadline) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_TSC_DEADLINE | APIC_TIMER_IRQ);
+    apic_next_deadline[smp_cpu_id()] = hw_rdtsc();
+  }
+  else {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_ONE_SHOT | APIC_TIMER_IRQ);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  }
+  apic_timer_arm();
+}
+
+/* Measures how much the local APIC timer and the TSC advance in a PIT tick.
+ * Interrupts are disabled, so nothing else can take the CPU meanwhile. */
+static void apic_timer_calibrate() {
+  u64 tsc;
+
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+  tsc = hw_rdtsc();
+
+  pit_wait_tick();
+
+  if (apic_tsc_deadline)
+    apic_ticks_per_tick = (u32)(hw_rdtsc() - tsc);
+  else
+    apic_ticks_per_tick = 0xffffffff - lapic_read(LAPIC_TIMER_CURRENT);
+  lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+int apic_timer_init() {
+  u32 regs[4], flags;
+
+  if (!apic_active)
+    return -1;
+
+  hw_cpuid(HW_CPUID_FEATURES, regs);
+  apic_tsc_deadline = (regs[2] & HW_CPUID_ECX_TSC_DEADLINE) != 0;
+
+  flags = irq_save();
+  apic_timer_calibrate();
+  itr_set_interrupt_handler(APIC_TIMER_IRQ,
+                            apic_timer_handler,
+                            NULL,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+  apic_timer_start();
+  apic_timer_active = 1;
+  irq_restore(flags);
+
+  return 0;
+}
+
+/* The APs only need to enable their local APIC and start its timer, the rest
+ * is shared. */
+void apic_init_cpu() {
+  apic_lapic_enable();
+  if (apic_timer_active)
+    apic_timer_start();
+}
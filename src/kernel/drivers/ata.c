@@ -0,0 +1,815 @@
+#include <typedef.h>
+#include <io.h>
+#include <hw.h>
+#include <pic.h>
+#include <interrupts.h>
+#include <devices.h>
+#include <errors.h>
+#include <mem.h>
+#include <string.h>
+#include <lock.h>
+#include <ata.h>
+#include <wait.h>
+
+/* Two legacy channels with up to two drives each. */
+#define ATA_TOTAL_CHANNELS        2
+#define ATA_TOTAL_DRIVES          4
+#define ATA_SECTOR_SIZE           512
+
+/* Legacy (compatibility mode) ports. */
+#define ATA_PRIMARY_BASE          0x01f0
+#define ATA_PRIMARY_CTRL          0x03f6
+#define ATA_SECONDARY_BASE        0x0170
+#define ATA_SECONDARY_CTRL        0x0376
+
+/* Command block registers, relative to the channel base port. */
+#define ATA_DATA_PORT(base)       (base)
+#define ATA_ERROR_PORT(base)      ((base) + 1)
+#define ATA_COUNT_PORT(base)      ((base) + 2)
+#define ATA_LBA_LOW_PORT(base)    ((base) + 3)
+#define ATA_LBA_MID_PORT(base)    ((base) + 4)
+#define ATA_LBA_HIGH_PORT(base)   ((base) + 5)
+#define ATA_DRIVE_PORT(base)      ((base) + 6)
+#define ATA_STATUS_PORT(base)     ((base) + 7)
+#define ATA_COMMAND_PORT(base)    ((base) + 7)
+
+/* The control block has a single port: reading it gives the alternate status,
+ * which doesn't acknowledge the interrupt, writing it sets the device
+ * control register. */
+#define ATA_ALT_STATUS_PORT(ctrl) (ctrl)
+#define ATA_DEV_CTRL_PORT(ctrl)   (ctrl)
+
+/* Status bits. */
+#define ATA_STATUS_ERR            0x01
+#define ATA_STATUS_DRQ            0x08
+#define ATA_STATUS_DF             0x20
+#define ATA_STATUS_DRDY           0x40
+#define ATA_STATUS_BSY            0x80
+#define ATA_STATUS_FLOATING       0xff  /* Nothing attached to the bus. */
+
+/* Device control bits. */
+#define ATA_CTRL_NIEN             0x02  /* Don't raise interrupts. */
+
+/* Drive/head register bits. */
+#define ATA_DRIVE_BASE            0xa0
+#define ATA_DRIVE_LBA             0x40
+#define ATA_DRIVE_SLAVE           0x10
+
+/* Commands. */
+#define ATA_CMD_READ_SECTORS      0x20
+#define ATA_CMD_WRITE_SECTORS     0x30
+#define ATA_CMD_READ_MULTIPLE     0xc4
+#define ATA_CMD_WRITE_MULTIPLE    0xc5
+#define ATA_CMD_SET_MULTIPLE      0xc6
+#define ATA_CMD_READ_DMA          0xc8
+#define ATA_CMD_WRITE_DMA         0xca
+#define ATA_CMD_FLUSH_CACHE       0xe7
+#define ATA_CMD_IDENTIFY          0xec
+
+/* Words of interest in the IDENTIFY data. */
+#define ATA_ID_MODEL              27    /* 20 words, byte swapped. */
+#define ATA_ID_MODEL_LEN          40
+#define ATA_ID_MAX_MULTIPLE       47    /* Low byte. */
+#define ATA_ID_CAPABILITIES       49
+#define ATA_ID_LBA_SECTORS        60    /* 2 words. */
+
+#define ATA_ID_CAP_DMA            0x0100
+#define ATA_ID_CAP_LBA            0x0200
+
+/* Bus master IDE registers, relative to the channel's bus master base. The
+ * secondary channel's registers start 8 ports after the primary's. */
+#define ATA_BM_COMMAND_PORT(bm)   (bm)
+#define ATA_BM_STATUS_PORT(bm)    ((bm) + 2)
+#define ATA_BM_PRDT_PORT(bm)      ((bm) + 4)
+#define ATA_BM_CHANNEL_OFFSET     8
+
+#define ATA_BM_CMD_START          0x01
+#define ATA_BM_CMD_READ           0x08  /* Device to memory. */
+
+#define ATA_BM_STATUS_ACTIVE      0x01
+#define ATA_BM_STATUS_ERROR       0x02
+#define ATA_BM_STATUS_IRQ         0x04
+#define ATA_BM_STATUS_DMA_MASTER  0x20
+#define ATA_BM_STATUS_DMA_SLAVE   0x40
+
+/* PCI configuration space access, used to find the bus master registers of
+ * the IDE controller. */
+#define ATA_PCI_CONFIG_ADDRESS    0x0cf8
+#define ATA_PCI_CONFIG_DATA       0x0cfc
+#define ATA_PCI_ENABLE            0x80000000
+#define ATA_PCI_DEVICES           32
+#define ATA_PCI_FUNCTIONS         8
+#define ATA_PCI_REG_ID            0x00
+#define ATA_PCI_REG_COMMAND       0x04
+#define ATA_PCI_REG_CLASS         0x08
+#define ATA_PCI_REG_BAR4          0x20
+#define ATA_PCI_CLASS_IDE         0x0101  /* Mass storage, IDE. */
+#define ATA_PCI_CMD_IO            0x0001
+#define ATA_PCI_CMD_BUS_MASTER    0x0004
+#define ATA_PCI_BAR_IO            0x0001
+
+/* Limits. A command moves at most 256 sectors (a count of 0 means 256) and a
+ * PRD entry moves at most 64K without crossing a 64K boundary. */
+#define ATA_MAX_SECTORS           256
+#define ATA_PRD_MAX_BYTES         0x10000
+#define ATA_PRD_EOT               0x8000
+#define ATA_MAX_MULTIPLE          16
+
+/* Busy-waiting rounds before giving up while polling. */
+#define ATA_POLL_ROUNDS           1000000
+
+/* MBR layout. */
+#define ATA_MBR_PARTITIONS        0x01be
+#define ATA_MBR_PARTITION_SIZE    16
+#define ATA_MBR_PART_TYPE         4
+#define ATA_MBR_PART_LBA          8
+#define ATA_MBR_PART_SECTORS      12
+#define ATA_MBR_SIGNATURE         0x01fe
+
+/* Physical Region Descriptor: one contiguous chunk of a DMA transfer. */
+typedef struct ata_prd {
+  u32 addr;                     /* Physical address. */
+  u16 bytes;                    /* Byte count, 0 means 64K. */
+  u16 flags;                    /* ATA_PRD_EOT on the last entry. */
+} __attribute__((__packed__)) ata_prd_t;
+
+typedef struct ata_channel {
+  io_port_t       base;         /* Command block base port. */
+  io_port_t       ctrl;         /* Control block port. */
+  io_port_t       bmide;        /* Bus master base port, 0 if no DMA. */
+  itr_irq_t       irq;          /* IRQ assigned to this channel. */
+  dev_t           major;        /* Major used by the drives in the channel. */
+  volatile u8     irq_fired;    /* Set by the interrupt handler. */
+  volatile u8     status;       /* Status read by the interrupt handler. */
+  volatile u8     bm_status;    /* Bus master status read by the handler. */
+  wait_queue_t    wait;         /* Waiting for the interrupt. */
+  ata_prd_t     * prdt;         /* PRD table, one frame. */
+  int             busy;         /* Somebody owns the channel. */
+  wait_queue_t    busy_wait;    /* Waiting for the channel. */
+} ata_channel_t;
+
+typedef struct ata_drive {
+  ata_channel_t * chan;
+  u8              slave;        /* 0 for master, 1 for slave. */
+  u8              present;
+  u8              dma;          /* Use DMA for this drive. */
+  u16             multiple;     /* Sectors per READ/WRITE MULTIPLE block. */
+  u32             sectors;      /* LBA28 sectors. */
+  char            model[ATA_ID_MODEL_LEN + 1];
+} ata_drive_t;
+
+/* Each registered block device: a whole disk or one of its partitions. */
+typedef struct ata_device {
+  dev_block_device_t  blk;
+  ata_drive_t       * drive;
+  u32                 lba;      /* First sector, relative to the disk. */
+} ata_device_t;
+
+/* Declaration of the interrupt handler. */
+int ata_interrupt_handler(itr_frame_t *frame, void *cookie);
+
+static ata_channel_t channels[ATA_TOTAL_CHANNELS] = {
+  {
+    .base = ATA_PRIMARY_BASE,
+    .ctrl = ATA_PRIMARY_CTRL,
+    .irq = PIC_PRIMARY_ATA_IRQ,
+    .major = DEV_IDE0_MAJOR
+  },
+  {
+    .base = ATA_SECONDARY_BASE,
+    .ctrl = ATA_SECONDARY_CTRL,
+    .irq = PIC_SECONDARY_ATA_IRQ,
+    .major = DEV_IDE1_MAJOR
+  }
+};
+
+static ata_drive_t drives[ATA_TOTAL_DRIVES];
+static ata_device_t devices[ATA_TOTAL_DRIVES][1 + ATA_MAX_PARTITIONS];
+
+/*****************************************************************************/
+/* PCI ***********************************************************************/
+/*****************************************************************************/
+
+static u32 ata_pci_read(u8 dev, u8 fn, u8 reg) {
+  outd(ATA_PCI_CONFIG_ADDRESS, ATA_PCI_ENABLE | (dev << 11) | (fn << 8) |
+                               (reg & 0xfc));
+  return ind(ATA_PCI_CONFIG_DATA);
+}
+
+static void ata_pci_write(u8 dev, u8 fn, u8 reg, u32 value) {
+  outd(ATA_PCI_CONFIG_ADDRESS, ATA_PCI_ENABLE | (dev << 11) | (fn << 8) |
+                               (reg & 0xfc));
+  outd(ATA_PCI_CONFIG_DATA, value);
+}
+
+/* Looks for an IDE controller in PCI bus 0 and returns the base port of its
+ * bus master registers, or 0 if there's none. It also turns bus mastering on
+ * since some BIOSes leave it off. Only bus 0 is scanned: that's where the
+ * chipset's IDE controller lives in the machines we care about. */
+static io_port_t ata_pci_find_bus_master() {
+  u32 dev, fn, r32;
+
+  for (dev = 0; dev < ATA_PCI_DEVICES; dev ++) {
+    for (fn = 0; fn < ATA_PCI_FUNCTIONS; fn ++) {
+      r32 = ata_pci_read(dev, fn, ATA_PCI_REG_ID);
+      if ((r32 & 0xffff) == 0xffff)
+        continue;
+      r32 = ata_pci_read(dev, fn, ATA_PCI_REG_CLASS);
+      if ((r32 >> 16) != ATA_PCI_CLASS_IDE)
+        continue;
+      r32 = ata_pci_read(dev, fn, ATA_PCI_REG_BAR4);
+      if (!(r32 & ATA_PCI_BAR_IO))
+        continue;
+
+      ata_pci_write(dev, fn, ATA_PCI_REG_COMMAND,
+                    ata_pci_read(dev, fn, ATA_PCI_REG_COMMAND) |
+                    ATA_PCI_CMD_IO | ATA_PCI_CMD_BUS_MASTER);
+      return (io_port_t)(r32 & 0xfffc);
+    }
+  }
+  return 0;
+}
+
+/*****************************************************************************/
+/* Low level *****************************************************************/
+/*****************************************************************************/
+
+/* Reading the alternate status four times gives the drive the 400ns it needs
+ * to update its status after a command or a drive selection. */
+static u8 ata_delay(ata_channel_t *chan) {
+  inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+  inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+  inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+  return inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+}
+
+/* Busy-waits until the drive is no longer busy. Returns the status or -1 if
+ * the drive never got ready. */
+static int ata_poll(ata_channel_t *chan) {
+  u32 i;
+  u8 r8;
+
+  for (i = 0; i < ATA_POLL_ROUNDS; i ++) {
+    r8 = inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+    if (!(r8 & ATA_STATUS_BSY))
+      return r8;
+  }
+  return -1;
+}
+
+/* Busy-waits until the drive asks for data or reports an error. */
+static int ata_poll_drq(ata_channel_t *chan) {
+  u32 i;
+  u8 r8;
+
+  for (i = 0; i < ATA_POLL_ROUNDS; i ++) {
+    r8 = inb(ATA_ALT_STATUS_PORT(chan->ctrl));
+    if (!(r8 & ATA_STATUS_BSY) &&
+        (r8 & (ATA_STATUS_DRQ | ATA_STATUS_ERR | ATA_STATUS_DF)))
+      return r8;
+  }
+  return -1;
+}
+
+/* Sleeps until the channel's interrupt handler has run, letting other
+ * processes use the CPU in the meantime. It returns the status read by the
+ * handler, which is also what acknowledged the interrupt in the drive. */
+static u8 ata_wait_irq(ata_channel_t *chan) {
+  u8 r8;
+
+  lock();
+  while (!chan->irq_fired)
+    wait_sleep(&chan->wait);
+  chan->irq_fired = 0;
+  r8 = chan->status;
+  unlock();
+
+  return r8;
+}
+
+/* The drives of a channel share its ports, its PRD table and its interrupt,
+ * and a command sleeps while it waits for the interrupt. Whole disks,
+ * partitions and both drives of a channel have queues of their own, so
+ * commands from different devices are kept from getting mixed up by owning
+ * the channel from ata_setup() until the command's last status is read. */
+static void ata_channel_acquire(ata_channel_t *chan) {
+  lock();
+  while (chan->busy)
+    wait_sleep(&chan->busy_wait);
+  chan->busy = 1;
+  unlock();
+}
+
+static void ata_channel_release(ata_channel_t *chan) {
+  lock();
+  chan->busy = 0;
+  wait_wake_up(&chan->busy_wait);
+  unlock();
+}
+
+/* Selects the drive and loads the LBA28 address and sector count. A count of
+ * ATA_MAX_SECTORS is written as 0, which is what the drive expects. */
+static int ata_setup(ata_drive_t *drive, u32 lba, u32 count) {
+  ata_channel_t *chan;
+
+  chan = drive->chan;
+  outb(ATA_DRIVE_PORT(chan->base), ATA_DRIVE_BASE | ATA_DRIVE_LBA |
+                                   (drive->slave ? ATA_DRIVE_SLAVE : 0) |
+                                   ((lba >> 24) & 0x0f));
+  ata_delay(chan);
+  if (ata_poll(chan) == -1) {
+    set_errno(E_IO);
+    return -1;
+  }
+
+  outb(ATA_COUNT_PORT(chan->base), (u8)(count & 0xff));
+  outb(ATA_LBA_LOW_PORT(chan->base), (u8)(lba & 0xff));
+  outb(ATA_LBA_MID_PORT(chan->base), (u8)((lba >> 8) & 0xff));
+  outb(ATA_LBA_HIGH_PORT(chan->base), (u8)((lba >> 16) & 0xff));
+
+  /* Anything the handler saw before this command is stale. */
+  chan->irq_fired = 0;
+  return 0;
+}
+
+/* Issues a command that takes no data and waits for it to complete. */
+static int ata_command(ata_drive_t *drive, u8 cmd) {
+  int r;
+  u8 r8;
+
+  ata_channel_acquire(drive->chan);
+  r = ata_setup(drive, 0, 0);
+  if (r != -1) {
+    outb(ATA_COMMAND_PORT(drive->chan->base), cmd);
+    r8 = ata_wait_irq(drive->chan);
+    if (r8 & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+      set_errno(E_IO);
+      r = -1;
+    }
+  }
+  ata_channel_release(drive->chan);
+
+  return r;
+}
+
+/* Multi-sector PIO. Data moves in blocks of drive->multiple sectors, one
+ * interrupt per block instead of one per sector. Reads get an interrupt
+ * before each block; writes poll for the first one, get an interrupt after
+ * each block asking for the next one, and a last one when everything got
+ * written. */
+static int ata_pio_locked(ata_drive_t *drive, u32 lba, u32 count, char *buf,
+                          int write) {
+  ata_channel_t *chan;
+  u32 block, done, n;
+  int r;
+  u8 cmd;
+
+  chan = drive->chan;
+  block = drive->multiple ? drive->multiple : 1;
+  if (write)
+    cmd = drive->multiple ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE_SECTORS;
+  else
+    cmd = drive->multiple ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ_SECTORS;
+
+  if (ata_setup(drive, lba, count) == -1)
+    return -1;
+  outb(ATA_COMMAND_PORT(chan->base), cmd);
+
+  for (done = 0; done < count; done += n) {
+    n = count - done < block ? count - done : block;
+
+    if (write && done == 0)
+      r = ata_poll_drq(chan);
+    else
+      r = ata_wait_irq(chan);
+
+    if (r == -1 || (r & (ATA_STATUS_ERR | ATA_STATUS_DF)) ||
+        !(r & ATA_STATUS_DRQ)) {
+      set_errno(E_IO);
+      return -1;
+    }
+
+    if (write)
+      rep_outw(ATA_DATA_PORT(chan->base),
+               buf + done * ATA_SECTOR_SIZE,
+               n * ATA_SECTOR_SIZE / 2);
+    else
+      rep_inw(ATA_DATA_PORT(chan->base),
+              buf + done * ATA_SECTOR_SIZE,
+              n * ATA_SECTOR_SIZE / 2);
+  }
+
+  if (write) {
+    r = ata_wait_irq(chan);
+    if (r & (ATA_STATUS_ERR | ATA_STATUS_DF)) {
+      set_errno(E_IO);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Same, owning the channel. */
+static int ata_pio(ata_drive_t *drive, u32 lba, u32 count, char *buf,
+                   int write) {
+  int r;
+
+  ata_channel_acquire(drive->chan);
+  r = ata_pio_locked(drive, lba, count, buf, write);
+  ata_channel_release(drive->chan);
+
+  return r;
+}
+
+/* Bus master DMA. The buffer is described in the PRD table, splitting it at
+ * 64K boundaries, and the controller moves everything by itself, raising a
+ * single interrupt at the end. The controller takes physical addresses, so
+ * this only works with kernel buffers: the kernel's memory is identity
+ * mapped, so their addresses are physical ones. User pages, at VM_USER_ADDR,
+ * are neither identity mapped nor contiguous, and user data has to be copied
+ * to a kernel buffer before getting here. */
+static int ata_dma_locked(ata_drive_t *drive, u32 lba, u32 count, char *buf,
+                          int write) {
+  ata_channel_t *chan;
+  u32 addr, left, n;
+  int i;
+  u8 r8;
+
+  chan = drive->chan;
+
+  addr = (u32)buf;
+  left = count * ATA_SECTOR_SIZE;
+  for (i = 0; left > 0; i ++) {
+    n = ATA_PRD_MAX_BYTES - (addr & (ATA_PRD_MAX_BYTES - 1));
+    if (n > left)
+      n = left;
+    chan->prdt[i].addr = addr;
+    chan->prdt[i].bytes = (u16)(n & 0xffff);
+    chan->prdt[i].flags = 0;
+    addr += n;
+    left -= n;
+  }
+  chan->prdt[i - 1].flags = ATA_PRD_EOT;
+
+  outd(ATA_BM_PRDT_PORT(chan->bmide), (u32)chan->prdt);
+  outb(ATA_BM_COMMAND_PORT(chan->bmide), write ? 0 : ATA_BM_CMD_READ);
+  /* Error and interrupt bits are cleared by writing them back. */
+  outb(ATA_BM_STATUS_PORT(chan->bmide), inb(ATA_BM_STATUS_PORT(chan->bmide)));
+
+  if (ata_setup(drive, lba, count) == -1)
+    return -1;
+  outb(ATA_COMMAND_PORT(chan->base),
+       write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+  outb(ATA_BM_COMMAND_PORT(chan->bmide),
+       (write ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
+
+  r8 = ata_wait_irq(chan);
+
+  outb(ATA_BM_COMMAND_PORT(chan->bmide), write ? 0 : ATA_BM_CMD_READ);
+
+  if ((r8 & (ATA_STATUS_ERR | ATA_STATUS_DF)) ||
+      (chan->bm_status & ATA_BM_STATUS_ERROR)) {
+    set_errno(E_IO);
+    return -1;
+  }
+  return 0;
+}
+
+/* Same, owning the channel. */
+static int ata_dma(ata_drive_t *drive, u32 lba, u32 count, char *buf,
+                   int write) {
+  int r;
+
+  ata_channel_acquire(drive->chan);
+  r = ata_dma_locked(drive, lba, count, buf, write);
+  ata_channel_release(drive->chan);
+
+  return r;
+}
+
+/* Moves count sectors starting at lba, ATA_MAX_SECTORS at a time. DMA needs
+ * word-aligned buffers; odd ones go through PIO. */
+static int ata_transfer(ata_drive_t *drive, u32 lba, u32 count, char *buf,
+                        int write) {
+  u32 n;
+  int r;
+
+  for (; count > 0; count -= n, lba += n, buf += n * ATA_SECTOR_SIZE) {
+    n = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+    if (drive->dma && !((u32)buf & 1))
+      r = ata_dma(drive, lba, n, buf, write);
+    else
+      r = ata_pio(drive, lba, n, buf, write);
+    if (r == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Interrupts handler, the cookie is the channel. Reading the status
+ * acknowledges the interrupt in the drive; the waiting code gets it through
+ * the channel. With bus mastering the controller tells whether the channel
+ * interrupted, otherwise it's assumed it did. */
+int ata_interrupt_handler(itr_frame_t *frame, void *cookie) {
+  ata_channel_t *chan;
+
+  chan = (ata_channel_t *)cookie;
+  if (chan->bmide) {
+    chan->bm_status = inb(ATA_BM_STATUS_PORT(chan->bmide));
+    if (!(chan->bm_status & ATA_BM_STATUS_IRQ))
+      return ITR_NOT_MINE;
+    outb(ATA_BM_STATUS_PORT(chan->bmide), chan->bm_status);
+  }
+  chan->status = inb(ATA_STATUS_PORT(chan->base));
+  chan->irq_fired = 1;
+  wait_wake_up(&chan->wait);
+
+  return ITR_HANDLED;
+}
+
+/*****************************************************************************/
+/* Block device operations ***************************************************/
+/*****************************************************************************/
+
+static int ata_open(dev_block_device_t *dev, dev_mode_t mode) {
+  return 0;
+}
+
+static int ata_release(dev_block_device_t *dev) {
+  return 0;
+}
+
+static int ata_rw(dev_block_device_t *dev, char *buf, off_t off, size_t count,
+                  int write) {
+  ata_device_t *ad;
+  u32 lba, n;
+
+  ad = (ata_device_t *)dev->private_data;
+
+  if (off % ATA_SECTOR_SIZE || count % ATA_SECTOR_SIZE) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+  lba = off / ATA_SECTOR_SIZE;
+  n = count / ATA_SECTOR_SIZE;
+  if (lba > dev->sectors || n > dev->sectors - lba) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+
+  if (ata_transfer(ad->drive, ad->lba + lba, n, buf, write) == -1)
+    return -1;
+  return count;
+}
+
+static int ata_read(dev_block_device_t *dev, char *buf, off_t off,
+                    size_t count) {
+  return ata_rw(dev, buf, off, count, 0);
+}
+
+static int ata_write(dev_block_device_t *dev, char *buf, off_t off,
+                     size_t count) {
+  return ata_rw(dev, buf, off, count, 1);
+}
+
+static int ata_flush(dev_block_device_t *dev) {
+  return ata_command(((ata_device_t *)dev->private_data)->drive,
+                     ATA_CMD_FLUSH_CACHE);
+}
+
+static int ata_ioctl(dev_block_device_t *dev, u32 request, void *data) {
+  ata_drive_t *drive;
+
+  drive = ((ata_device_t *)dev->private_data)->drive;
+
+  switch (request) {
+    case ATA_IOCTL_GET_MODEL:
+      strcpy((char *)data, drive->model);
+      return 0;
+    case ATA_IOCTL_GET_DMA:
+      *((int *)data) = drive->dma;
+      return 0;
+    case ATA_IOCTL_SET_DMA:
+      if (*((int *)data) && !drive->chan->bmide) {
+        set_errno(E_NOTIMP);
+        return -1;
+      }
+      drive->dma = *((int *)data) ? 1 : 0;
+      return 0;
+    default:
+      set_errno(E_INVAL);
+      return -1;
+  }
+}
+
+static dev_block_device_operations_t ata_ops = {
+  .open = ata_open,
+  .release = ata_release,
+  .read = ata_read,
+  .write = ata_write,
+  .flush = ata_flush,
+  .ioctl = ata_ioctl
+};
+
+/*****************************************************************************/
+/* Initialization ************************************************************/
+/*****************************************************************************/
+
+/* Sends IDENTIFY to the drive and loads what we need from the answer. This is
+ * done by polling since interrupts are off in the channel during probing.
+ * Drives that are not there, ATAPI ones and those without LBA support are
+ * ignored. */
+static int ata_identify(ata_drive_t *drive) {
+  ata_channel_t *chan;
+  u16 id[ATA_SECTOR_SIZE / 2];
+  int r, i;
+
+  chan = drive->chan;
+
+  outb(ATA_DRIVE_PORT(chan->base), ATA_DRIVE_BASE |
+                                   (drive->slave ? ATA_DRIVE_SLAVE : 0));
+  ata_delay(chan);
+  outb(ATA_COUNT_PORT(chan->base), 0);
+  outb(ATA_LBA_LOW_PORT(chan->base), 0);
+  outb(ATA_LBA_MID_PORT(chan->base), 0);
+  outb(ATA_LBA_HIGH_PORT(chan->base), 0);
+  outb(ATA_COMMAND_PORT(chan->base), ATA_CMD_IDENTIFY);
+
+  r = ata_delay(chan);
+  if (r == 0 || r == ATA_STATUS_FLOATING)
+    return -1;
+  if (ata_poll(chan) == -1)
+    return -1;
+
+  /* ATAPI and SATA devices set these to their signature instead. */
+  if (inb(ATA_LBA_MID_PORT(chan->base)) || inb(ATA_LBA_HIGH_PORT(chan->base)))
+    return -1;
+
+  r = ata_poll_drq(chan);
+  if (r == -1 || (r & ATA_STATUS_ERR))
+    return -1;
+  rep_inw(ATA_DATA_PORT(chan->base), id, ATA_SECTOR_SIZE / 2);
+  inb(ATA_STATUS_PORT(chan->base));
+
+  if (!(id[ATA_ID_CAPABILITIES] & ATA_ID_CAP_LBA))
+    return -1;
+
+  drive->sectors = id[ATA_ID_LBA_SECTORS] |
+                   ((u32)id[ATA_ID_LBA_SECTORS + 1] << 16);
+  drive->multiple = id[ATA_ID_MAX_MULTIPLE] & 0xff;
+  if (drive->multiple > ATA_MAX_MULTIPLE)
+    drive->multiple = ATA_MAX_MULTIPLE;
+  drive->dma = chan->bmide && (id[ATA_ID_CAPABILITIES] & ATA_ID_CAP_DMA);
+
+  /* The model comes as big endian words padded with spaces. */
+  for (i = 0; i < ATA_ID_MODEL_LEN / 2; i ++) {
+    drive->model[2 * i] = (char)(id[ATA_ID_MODEL + i] >> 8);
+    drive->model[2 * i + 1] = (char)(id[ATA_ID_MODEL + i] & 0xff);
+  }
+  for (i = ATA_ID_MODEL_LEN; i > 0 && drive->model[i - 1] == ' '; i --);
+  drive->model[i] = 0;
+
+  return 0;
+}
+
+/* Sets the READ/WRITE MULTIPLE block size. If the drive refuses it we'll
+ * stick to one sector per interrupt. */
+static void ata_set_multiple(ata_drive_t *drive) {
+  ata_channel_t *chan;
+  int r;
+
+  if (drive->multiple == 0)
+    return;
+
+  chan = drive->chan;
+  if (ata_setup(drive, 0, drive->multiple) == -1) {
+    drive->multiple = 0;
+    return;
+  }
+  outb(ATA_COMMAND_PORT(chan->base), ATA_CMD_SET_MULTIPLE);
+  ata_delay(chan);
+  r = ata_poll(chan);
+  if (r == -1 || (r & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+    drive->multiple = 0;
+  inb(ATA_STATUS_PORT(chan->base));
+}
+
+/* Reads a single sector by polling. Only used while probing. */
+static int ata_poll_read(ata_drive_t *drive, u32 lba, char *buf) {
+  ata_channel_t *chan;
+  int r;
+
+  chan = drive->chan;
+  if (ata_setup(drive, lba, 1) == -1)
+    return -1;
+  outb(ATA_COMMAND_PORT(chan->base), ATA_CMD_READ_SECTORS);
+  ata_delay(chan);
+  r = ata_poll_drq(chan);
+  if (r == -1 || (r & (ATA_STATUS_ERR | ATA_STATUS_DF)))
+    return -1;
+  rep_inw(ATA_DATA_PORT(chan->base), buf, ATA_SECTOR_SIZE / 2);
+  inb(ATA_STATUS_PORT(chan->base));
+  return 0;
+}
+
+static int ata_register(ata_drive_t *drive, ata_device_t *ad, dev_t devid,
+                        u32 lba, u32 sectors) {
+  ad->drive = drive;
+  ad->lba = lba;
+  ad->blk.devid = devid;
+  ad->blk.count = 0;
+  ad->blk.mode = 0;
+  ad->blk.sector_size = ATA_SECTOR_SIZE;
+  ad->blk.sectors = sectors;
+  ad->blk.ops = &ata_ops;
+  ad->blk.private_data = ad;
+  return dev_register_block_device(&ad->blk);
+}
+
+/* Registers the whole disk and every valid primary partition in its MBR. */
+static int ata_register_drive(int d) {
+  ata_drive_t *drive;
+  char mbr[ATA_SECTOR_SIZE];
+  u8 minor, *part;
+  u32 lba, sectors;
+  int i;
+
+  drive = drives + d;
+  minor = drive->slave ? ATA_SLAVE_MINOR : ATA_MASTER_MINOR;
+
+  if (ata_register(drive, &devices[d][0],
+                   DEV_MAKE_DEV(drive->chan->major, minor),
+                   0, drive->sectors) == -1)
+    return -1;
+
+  if (ata_poll_read(drive, 0, mbr) == -1)
+    return 0;
+  if ((u8)mbr[ATA_MBR_SIGNATURE] != 0x55 ||
+      (u8)mbr[ATA_MBR_SIGNATURE + 1] != 0xaa)
+    return 0;
+
+  for (i = 0; i < ATA_MAX_PARTITIONS; i ++) {
+    part = (u8 *)mbr + ATA_MBR_PARTITIONS + i * ATA_MBR_PARTITION_SIZE;
+    memcpy(&lba, part + ATA_MBR_PART_LBA, sizeof(u32));
+    memcpy(&sectors, part + ATA_MBR_PART_SECTORS, sizeof(u32));
+    if (part[ATA_MBR_PART_TYPE] == 0 || sectors == 0)
+      continue;
+    if (lba >= drive->sectors || sectors > drive->sectors - lba)
+      continue;
+    ata_register(drive, &devices[d][i + 1],
+                 DEV_MAKE_DEV(drive->chan->major, minor + i + 1),
+                 lba, sectors);
+  }
+
+  return 0;
+}
+
+int ata_init() {
+  io_port_t bmide;
+  int c, d;
+
+  bmide = ata_pci_find_bus_master();
+
+  for (c = 0; c < ATA_TOTAL_CHANNELS; c ++) {
+    /* Keep the drives quiet while probing. */
+    wait_init(&channels[c].wait);
+    wait_init(&channels[c].busy_wait);
+    channels[c].busy = 0;
+    outb(ATA_DEV_CTRL_PORT(channels[c].ctrl), ATA_CTRL_NIEN);
+    if (inb(ATA_STATUS_PORT(channels[c].base)) == ATA_STATUS_FLOATING)
+      continue;
+
+    /* One frame for the PRD table: aligned and never crossing 64K. */
+    if (bmide) {
+      channels[c].prdt = (ata_prd_t *)mem_allocate_frames(1,
+                                                   MEM_KERNEL_FIRST_FRAME,
+                                                   MEM_USER_FIRST_FRAME);
+      if (channels[c].prdt != NULL)
+        channels[c].bmide = bmide + c * ATA_BM_CHANNEL_OFFSET;
+    }
+
+    for (d = 2 * c; d < 2 * c + 2; d ++) {
+      drives[d].chan = channels + c;
+      drives[d].slave = d % 2;
+      if (ata_identify(drives + d) == -1)
+        continue;
+      drives[d].present = 1;
+      ata_set_multiple(drives + d);
+      if (drives[d].dma)
+        outb(ATA_BM_STATUS_PORT(channels[c].bmide),
+             inb(ATA_BM_STATUS_PORT(channels[c].bmide)) |
+             (drives[d].slave ? ATA_BM_STATUS_DMA_SLAVE
+                              : ATA_BM_STATUS_DMA_MASTER));
+      ata_register_drive(d);
+    }
+
+    itr_set_interrupt_handler(channels[c].irq,
+                              ata_interrupt_handler,
+                              channels + c,
+                              IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+    outb(ATA_DEV_CTRL_PORT(channels[c].ctrl), 0);
+  }
+
+  return 0;
+}
@@ -41,15 +41,13 @@ int kb_init() {
     set_errno(E_NOMEM);
     return -1;
   }
-  itr_set_interrupt_handler(PIC_KEYBOARD_IRQ, kb_interrupt_handler,
+  itr_set_interrupt_handler(PIC_KEYBOARD_IRQ, kb_interrupt_handler, NULL,
                             IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
   return 0;
 }
 
 /* This is the actual interrupt handler. */
-void kb_interrupt_handler(itr_cpu_regs_t regs,
-                          itr_intr_data_t intr,
-                          itr_stack_state_t stack) {
+int kb_interrupt_handler(itr_frame_t *frame, void *cookie) {
   static unsigned char partial[6];
   static int len = 0;
 
@@ -81,9 +79,8 @@ void kb_interrupt_handler(itr_cpu_regs_t regs,
   }
   while (0);
 
-  pic_send_eoi(intr.irq); /* We do this because we're correct people, but the
-                           * keyboard actually clears the line when you read
-                           * from the encoder's buffer. */
+  /* The keyboard clears the line when you read from the encoder's buffer. */
+  return ITR_HANDLED;
 }
 
 int kb_scan_code(char *buf) {
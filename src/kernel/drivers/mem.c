@@ -68,6 +68,17 @@
 static u64 mem_total_frames;      /* Keeps the actual number of pages in main
                                    * memory. */
 
+/* Protects the frames bitmap and the reference counts. */
+static spinlock_t mem_frames_lock = SPINLOCK_INIT;
+
+/* Frames may be shared, e.g. by processes after a fork (see vm.h), so each
+ * frame of RAM has a reference count, 1 when it's allocated. It's only
+ * released when the count drops to 0. The counts go right after the bitmap,
+ * one byte per frame, but only up to the end of the RAM: there's nothing to
+ * share above that and the reserved regions are often up near 4G. */
+static u8 *mem_refs;
+static u32 mem_ram_frames;
+
 /* During the initial, real-mode load of the kernel we used INT 0x12,
  * AX = 0xe820 to get a memory map, which we placed as a continuos list of
  * region descriptors which will be passed to the kernel as an argument. Thus,
@@ -121,20 +132,24 @@ void kalloc_init();
  * to keep track of all pages in the main memory. TODO: Fill the GDT. */
 int mem_setup(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
   struct mem_bios_mmap_entry *e;
-  u64 max_addr;
+  u64 max_addr, max_ram;
   u64 first_frame, last_frame;
 
   /* Scan the memory map obtained from BIOS and the total number of frames. */
-  for (max_addr = 0, e = (struct mem_bios_mmap_entry *)mem_map;
+  for (max_addr = 0, max_ram = 0, e = (struct mem_bios_mmap_entry *)mem_map;
        e->size != 0 || e->base != 0 || e->type != 0;
        e++) {
     if (e->base + e->size > max_addr)
       max_addr = e->base + e->size;
+    if (e->type == MEM_BIOS_MEM_MAP_REGION_AVAILABLE &&
+        e->base + e->size > max_ram)
+      max_ram = e->base + e->size;
   }
   mem_total_frames = max_addr / MEM_FRAME_SIZE;
+  mem_ram_frames = max_ram / MEM_FRAME_SIZE;
 
   /* Initialze the GDT. */
-  gdt_setup((u32)mem_total_frames);
+  gdt_setup();
 
   /* Verify we have enough space to hold the bitmap. */
   for (e = (struct mem_bios_mmap_entry*)mem_map;
@@ -176,10 +191,16 @@ int mem_setup(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
       }
     }
   }
+  /* The reference counts, all 0 since nothing is allocated yet. They fit in
+   * the space checked above, which is much larger than the bitmap. */
+  mem_refs = (u8 *)(u32)(MEM_BITMAP_ADDR +
+                         mem_total_frames / MEM_BITMAP_ENTRIES_PER_BYTE + 1);
+  memset(mem_refs, 0, mem_ram_frames);
+
   /* Once done, let's reserve the memory we know we are using. However, since
    * we won't ever free it, let's mark it as reserved. */
   for (first_frame = 0,
-       last_frame = (MEM_BITMAP_ADDR + mem_total_frames / MEM_BITMAP_ENTRIES_PER_BYTE) / MEM_FRAME_SIZE;
+       last_frame = ((u32)mem_refs + mem_ram_frames) / MEM_FRAME_SIZE;
        first_frame <= last_frame;
        first_frame++) {
     mem_bitmap_set_entry(first_frame, MEM_BITMAP_ENTRY_RESERVED);
@@ -205,13 +226,13 @@ int mem_setup(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
  * be always reserved, therefore we can use 0 to mark certain situations. */
 void * mem_allocate_frames(u32 count, u32 first, u32 last) {
   /* This is the simplest, dummiest way to do this. */
-  u32 f, free_f;
+  u32 f, free_f, flags;
   void *r;
 
   if (last == 0 || last > mem_total_frames)
     last = mem_total_frames;
 
-  lock();
+  flags = spin_lock_irqsave(&mem_frames_lock);
 
   for (r = NULL, free_f = 0, f = first; f < last; f++) {
     if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_FREE)
@@ -222,6 +243,8 @@ void * mem_allocate_frames(u32 count, u32 first, u32 last) {
       /* Good, we found a free spot :) */
       while (free_f > 0) {
         mem_bitmap_set_entry(f - free_f + 1, MEM_BITMAP_ENTRY_USED);
+        if (f - free_f + 1 < mem_ram_frames)
+          mem_refs[f - free_f + 1] = 1;
         free_f--;
       }
       /* Now, we return the address to the first frame. */
@@ -230,16 +253,16 @@ void * mem_allocate_frames(u32 count, u32 first, u32 last) {
     }
   }
 
-  unlock();
+  spin_unlock_irqrestore(&mem_frames_lock, flags);
 
   return r;
 }
 
-/* Marks count frames from first_frame on as free. Of course, if any of the
- * frames in between are reserved we won't change them. Actually, if that
- * happens this call should be wrong. */
+/* Marks count frames from first_frame on as free, those nobody else shares.
+ * Of course, if any of the frames in between are reserved we won't change
+ * them. Actually, if that happens this call should be wrong. */
 void mem_release_frames(void *addr, u32 count) {
-  u32 f, last;
+  u32 f, last, flags;
 
   f = (u32)addr / MEM_FRAME_SIZE;
   if (f >= mem_total_frames)
@@ -249,16 +272,42 @@ void mem_release_frames(void *addr, u32 count) {
   if (last > mem_total_frames)
     last = mem_total_frames;
 
-  lock();
+  flags = spin_lock_irqsave(&mem_frames_lock);
 
   for (; f < last; f++) {
     if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_USED) {
+      if (f < mem_ram_frames && -- mem_refs[f] > 0)
+        continue;
       // fb_printf("fr: %d\n", f);
       mem_bitmap_set_entry(f, MEM_BITMAP_ENTRY_FREE);
     }
   }
 
-  unlock();
+  spin_unlock_irqrestore(&mem_frames_lock, flags);
+}
+
+void mem_share_frames(void *addr, u32 count) {
+  u32 f, last, flags;
+
+  f = (u32)addr / MEM_FRAME_SIZE;
+  last = f + count;
+  if (last > mem_ram_frames)
+    last = mem_ram_frames;
+
+  flags = spin_lock_irqsave(&mem_frames_lock);
+  for (; f < last; f++)
+    if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_USED)
+      mem_refs[f] ++;
+  spin_unlock_irqrestore(&mem_frames_lock, flags);
+}
+
+u32 mem_frame_refs(void *addr) {
+  u32 f;
+
+  f = (u32)addr / MEM_FRAME_SIZE;
+  if (f >= mem_ram_frames || mem_bitmap_get_entry(f) != MEM_BITMAP_ENTRY_USED)
+    return 0;
+  return mem_refs[f];
 }
 
 void mem_inspect() {
@@ -300,6 +349,9 @@ struct mem_entry {
 
 static struct mem_entry mem_head;
 
+/* Protects the list. */
+static spinlock_t kalloc_lock = SPINLOCK_INIT;
+
 /* Initializes the logical allocator. */
 void kalloc_init() {
   mem_head.next = NULL;
@@ -308,8 +360,9 @@ void kalloc_init() {
   mem_head.flags = MEM_ALLOC_ENTRY_NULL;
 }
 
-/* Allocates memory in a malloc fashion for the kernel to use. */
-void * kalloc(u32 bytes) {
+/* Allocates memory in a malloc fashion for the kernel to use. kalloc_lock
+ * must be held, see kalloc(). */
+static void * kalloc_list(u32 bytes) {
   struct mem_entry *e, *n;
   u32 units, frames;
 
@@ -364,12 +417,10 @@ void * kalloc(u32 bytes) {
   }
 }
 
-void kfree(void * ptr) {
+/* kalloc_lock must be held, see kfree(). */
+static void kfree_list(void * ptr) {
   struct mem_entry *e, *f;
 
-  if (ptr == NULL)
-    return; /* Just to avoid silly mistakes. */
-
   e = &mem_head;
   while (1) {
     if (e->next == NULL) {
@@ -408,6 +459,29 @@ void kfree(void * ptr) {
   }
 }
 
+/* The list is shared by everyone, interrupt handlers included. */
+void * kalloc(u32 bytes) {
+  void *r;
+  u32 flags;
+
+  flags = spin_lock_irqsave(&kalloc_lock);
+  r = kalloc_list(bytes);
+  spin_unlock_irqrestore(&kalloc_lock, flags);
+
+  return r;
+}
+
+void kfree(void * ptr) {
+  u32 flags;
+
+  if (ptr == NULL)
+    return; /* Just to avoid silly mistakes. */
+
+  flags = spin_lock_irqsave(&kalloc_lock);
+  kfree_list(ptr);
+  spin_unlock_irqrestore(&kalloc_lock, flags);
+}
+
 void mem_inspect_alloc() {
   struct mem_entry *e;
   fb_printf("mem_inspect_alloc:\n");
@@ -455,6 +529,7 @@ int mem_init() {
   ops.lseek = NULL;
   ops.ioctl = NULL;
   ops.readdir = NULL;
+  ops.getdents = NULL;
 
   dev_register_char_dev(DEV_MAKE_DEV(DEV_MEM_MAJOR, MEM_ZERO_MINOR),
                         "zero",
@@ -6,6 +6,7 @@
 #include <fb.h>
 #include <string.h>
 #include <typedef.h>
+#include <apic.h>
 
 /* PICs ports. */
 #define PIC_MASTER_CMD_PORT     0x20
@@ -80,6 +81,11 @@ void pic_init() {
  * interrupt it must call this function to tell the PIC about it so it clears
  * the interrupt line to the processor. */
 void pic_send_eoi(itr_irq_t irq) {
+  if (apic_enabled()) {
+    apic_send_eoi(irq);
+    return;
+  }
+
   if (irq >= PIC_MASTER_BASE_IRQ &&
       irq <= PIC_MASTER_BASE_IRQ + 7) {
     outb(PIC_MASTER_CMD_PORT, PIC_EOI);
@@ -171,6 +177,11 @@ void pic_remap() {
 void pic_mask_dev(enum pic_dev dev) {
   unsigned char mask;
 
+  if (apic_enabled()) {
+    apic_mask_irq(dev);
+    return;
+  }
+
   if (dev >= PIC_MASTER_BASE_IRQ && dev <= PIC_MASTER_BASE_IRQ + 7) {
     mask = inb(PIC_MASTER_DATA_PORT);
     mask = mask | (1 << (dev - PIC_MASTER_BASE_IRQ));
@@ -187,6 +198,11 @@ void pic_mask_dev(enum pic_dev dev) {
 void pic_unmask_dev(enum pic_dev dev) {
   unsigned char mask;
 
+  if (apic_enabled()) {
+    apic_unmask_irq(dev);
+    return;
+  }
+
   if (dev >= PIC_MASTER_BASE_IRQ && dev <= PIC_MASTER_BASE_IRQ + 7) {
     mask = inb(PIC_MASTER_DATA_PORT);
     mask = mask & ~(1 << (dev - PIC_MASTER_BASE_IRQ));
@@ -198,3 +214,11 @@ void pic_unmask_dev(enum pic_dev dev) {
     outb(PIC_SLAVE_DATA_PORT, mask);
   }
 }
+
+/* Masks every line in both PICs, for good. They're still there though, and a
+ * spurious interrupt may come through anyway, but it'll have a vector
+ * nobody handles. */
+void pic_disable() {
+  outb(PIC_MASTER_DATA_PORT, 0xff);
+  outb(PIC_SLAVE_DATA_PORT, 0xff);
+}
@@ -1,32 +1,62 @@
 #include <pit.h>
 #include <io.h>
 #include <pic.h>
-#include <fb.h>
+#include <bcache.h>
+#include <sched.h>
+#include <timer.h>
+
+u64 counter;
 
 void pit_init() {
 	counter = 0;
 	itr_set_interrupt_handler(PIC_TIMER_IRQ,
 	                    pit_interrupt_handler,
+	                    NULL,
 	                    IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
 
 	//outb(PIT_CMD_REG_DATA_PORT, PIT_BINARYMODE | PIT_MODE0 |
 	//						 PIT_LOBYTE_HIBYTE | PIT_CHANNEL0);
 	outb(PIT_CMD_REG_DATA_PORT, 0x36);
 	outb(PIT_CHANNEL0_DATA_PORT, (u8)PIT_RELOAD_VALUE);
-	outb(PIT_CHANNEL0_DATA_PORT, (u8)PIT_RELOAD_VALUE >> 8);
+	outb(PIT_CHANNEL0_DATA_PORT, (u8)(PIT_RELOAD_VALUE >> 8));
 }
 
-/* Interrupts handler. */
-void pit_interrupt_handler(itr_cpu_regs_t regs,
-                              itr_intr_data_t data,
-                              itr_stack_state_t stack) {
-	fb_printf("counter: %dd\n", counter);
+/* The system tick, whoever is the source. */
+void pit_tick() {
 	++counter;
-	pic_send_eoi(data.irq);
+
+	/* Both just count and defer the actual work to the bottom half. */
+	bcache_tick();
+	timer_tick();
+
+	/* The switch itself waits until the handler is done. */
+	sched_tick();
+}
+
+/* Interrupts handler. */
+int pit_interrupt_handler(itr_frame_t *frame, void *cookie) {
+	pit_tick();
+	return ITR_HANDLED;
+}
+
+/* Channel 2 is not wired to any IRQ, its output is read from the speaker
+ * port instead. In mode 0 the output goes high when the count is over. */
+void pit_wait_tick() {
+	u8 r;
+
+	r = inb(PIT_SPEAKER_PORT);
+	outb(PIT_SPEAKER_PORT, (r & ~PIT_SPEAKER_DATA) | PIT_CHANNEL2_GATE);
+
+	outb(PIT_CMD_REG_DATA_PORT, PIT_BINARYMODE | PIT_MODE0 |
+	                            PIT_LOBYTE_HIBYTE | PIT_CHANNEL2);
+	outb(PIT_CHANNEL2_DATA_PORT, (u8)PIT_RELOAD_VALUE);
+	outb(PIT_CHANNEL2_DATA_PORT, (u8)(PIT_RELOAD_VALUE >> 8));
+
+	while (!(inb(PIT_SPEAKER_PORT) & PIT_CHANNEL2_OUT));
+
+	outb(PIT_SPEAKER_PORT, r);
 }
 
 void pit_interrupt_disabled() {
-	itr_set_interrupt_handler(PIC_TIMER_IRQ,
-	                    pit_interrupt_handler,
-	                    IDT_NOT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+	itr_remove_interrupt_handler(PIC_TIMER_IRQ, pit_interrupt_handler, NULL);
 }
\ No newline at end of file
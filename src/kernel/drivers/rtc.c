@@ -4,6 +4,9 @@
 #include <devices.h>
 #include <typedef.h>
 #include <errors.h>
+#include <pic.h>
+#include <lock.h>
+#include <wait.h>
 
 #define show_call(f, d) fb_printf(#f " :%bd:%bd\n", DEV_MAJOR(d->devid), DEV_MINOR(d->devid))
 
@@ -12,6 +15,12 @@
 /* New VFS-based API *********************************************************/
 /*****************************************************************************/
 
+/* Update-ended interrupts so far, one per second. */
+static volatile u32 rtc_updates;
+
+/* Processes in rtc_sleep(). */
+static wait_queue_t rtc_wait;
+
 static int rtc_open(vfs_vnode_t *node, vfs_file_t *filp) {
 	/* This checks should be improved. */
   if (filp->f_flags == FILE_O_RW)
@@ -20,22 +29,24 @@ static int rtc_open(vfs_vnode_t *node, vfs_file_t *filp) {
 }
 
 static ssize_t rtc_write(vfs_file_t *filp, char *buf, size_t count) {
-	
-	hw_cli();
+	u32 flags;
+
+	flags = irq_save();
 	for(int i = 0; i < count; ++i)
 		set_RTC_register(REGISTER_VALUES[i], buf[i]);
-	hw_sti();
+	irq_restore(flags);
 	//filp->f_pos += count;
 
 	return (ssize_t)count;
 }
 
 static ssize_t rtc_read(vfs_file_t *filp, char *buf, size_t count) {
-	
-	hw_cli();
+	u32 flags;
+
+	flags = irq_save();
 	for(int i = 0; i < count; ++i)
 		buf[i] = get_RTC_register(REGISTER_VALUES[i]);
-	hw_sti();
+	irq_restore(flags);
 	//filp->f_pos += count;
 
 	return (ssize_t)count;
@@ -49,7 +60,8 @@ static vfs_file_operations_t rtc_ops = {
   .write   = rtc_write,
   .lseek   = NULL,
   .ioctl   = NULL,
-  .readdir = NULL
+  .readdir = NULL,
+  .getdents = NULL
 };
 
 
@@ -68,6 +80,40 @@ void rtc_init() {
 	fdrtc = vfs_open("/dev/rtc", FILE_O_RW, 0);
   	if(fdrtc == NULL)
   		kernel_panic("no /dev/rtc\n");
+
+	/* Ask for an interrupt every time the clock is updated. Register C must
+	 * be read, otherwise there won't be a next one. */
+	rtc_updates = 0;
+	wait_init(&rtc_wait);
+	itr_set_interrupt_handler(PIC_CMOS_RTC_IRQ,
+	                          rtc_interrupt_handler,
+	                          NULL,
+	                          IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+	set_RTC_register(REGB_STATUS,
+	                 get_RTC_register(REGB_STATUS) | RTC_UPDATE_INT);
+	get_RTC_register(REGC_STATUS);
+	pic_unmask_dev(PIC_CMOS_RTC_IRQ);
+}
+
+/* Interrupts handler. */
+/* Reading register C acknowledges the interrupt. */
+int rtc_interrupt_handler(itr_frame_t *frame, void *cookie) {
+	if (!(get_RTC_register(REGC_STATUS) & RTC_UPDATE_INT))
+		return ITR_NOT_MINE;
+
+	rtc_updates ++;
+	wait_wake_up(&rtc_wait);
+	return ITR_HANDLED;
+}
+
+void rtc_sleep(u32 seconds) {
+	u32 end;
+
+	lock();
+	end = rtc_updates + seconds;
+	while (rtc_updates < end)
+		wait_sleep(&rtc_wait);
+	unlock();
 }
 
 
@@ -81,20 +127,25 @@ void NMI_disable() {
 }
 
 
+/* The interrupt handler selects register C, so selecting and accessing a
+ * register can't be interrupted. */
 u8 get_RTC_register(u8 reg) {
+	u32 flags = irq_save();
 	outb(CMOS_ADDRESS, reg);
 	u8 ret = inb(CMOS_DATA);
+	irq_restore(flags);
 	return ret;
 }
 
 void set_RTC_register(u8 reg_addres, u8 data) {
+	u32 flags = irq_save();
 	outb(CMOS_ADDRESS, reg_addres);
 	outb(CMOS_DATA, data);
+	irq_restore(flags);
 }
 
 
 int get_update_in_progress_flag() {
-      outb(CMOS_ADDRESS, REGA_STATUS);
-      return (inb(CMOS_DATA) & 0x80);
+      return (get_RTC_register(REGA_STATUS) & 0x80);
 }
 
@@ -11,6 +11,8 @@
 #include <fb.h>
 #include <lock.h>
 #include <vfs.h>
+#include <wait.h>
+#include <softirq.h>
 
 /* We'll manage all four ISA serial ports. */
 #define SERIAL_TOTAL_DEVICES     4
@@ -70,6 +72,9 @@ typedef struct serial_device {
     u8 modem_ctl;               /* MODEM configuration. NOT USED. */
   } config;
   serial_buffer_t read_buf;     /* reading buffer. */
+  wait_queue_t  read_wait;      /* Readers waiting for data. */
+  u8            line_status;    /* Last line status error. */
+  tasklet_t     line_tasklet;   /* Reports it. */
 } serial_device_t;
 
 /* UART is the chipset implementing the serial port. These are it's registers
@@ -183,9 +188,7 @@ typedef struct serial_device {
 #define SERIAL_DEFAULT_DIVISOR                    3
 
 /* Declaration of the interrupt handler. */
-void serial_interrupt_handler(itr_cpu_regs_t regs,
-                              itr_intr_data_t data,
-                              itr_stack_state_t stack);
+int serial_interrupt_handler(itr_frame_t *frame, void *cookie);
 
 
 /* Serial devices. */
@@ -252,12 +255,15 @@ void serial_set_config(serial_device_t *dev) {
 /* Forcefully read a byte from the serial line.
  * TODO: What to do if the buffer fills? Discard older data? */
 void serial_read_byte(serial_device_t *dev) {
-  lock();
+  u32 flags;
+
+  flags = irq_save();
   dev->read_buf.buffer[dev->read_buf.write_head] =
     inb(SERIAL_DATA_PORT(dev->base));
   dev->read_buf.write_head = (dev->read_buf.write_head + 1) %
                               SERIAL_BUFFER_LEN;
-  unlock();
+  wait_wake_up(&dev->read_wait);
+  irq_restore(flags);
 }
 
 /* Forcefully write a byte to the serial line. */
@@ -265,65 +271,65 @@ void serial_write_byte(serial_device_t *dev, char c) {
   outb(SERIAL_DATA_PORT(dev->base), c);
 }
 
-/* Checks the line condition.
- * TODO: Do a real checking and try to recover from the error. */
-void serial_check_line_condition(serial_device_t *dev) {
-  u8 r8;
+/* Reports the line condition, out of the interrupt handler. */
+static void serial_report_line_condition(void *data) {
+  serial_device_t *dev;
 
-  r8 = inb(SERIAL_LINE_STATUS_PORT(dev->base));
+  dev = (serial_device_t *)data;
   fb_printf("[serial %bd]: check_line_condition: %bb\n",
             DEV_MINOR(dev->devid),
-            r8);
+            dev->line_status);
 }
 
-/* Interrupts handler. */
-void serial_interrupt_handler(itr_cpu_regs_t regs,
-                              itr_intr_data_t data,
-                              itr_stack_state_t stack) {
-  int i;
+/* Checks the line condition. Reading the status clears the interrupt, the
+ * printing is left for later.
+ * TODO: Do a real checking and try to recover from the error. */
+void serial_check_line_condition(serial_device_t *dev) {
+  dev->line_status = inb(SERIAL_LINE_STATUS_PORT(dev->base));
+  tasklet_schedule(&dev->line_tasklet);
+}
+
+/* Interrupts handler. There's one registered per device, the cookie, and
+ * COM1/COM3 and COM2/COM4 share their lines, so it only answers for its own
+ * device. */
+int serial_interrupt_handler(itr_frame_t *frame, void *cookie) {
+  serial_device_t *dev;
   u8 r8;
 
-  for (i = 0; i < SERIAL_TOTAL_DEVICES; i ++) {
-    /* Identify the interrupting device(s). */
-    if (devices[i].type == SERIAL_TYPE_UNKNOWN)
-      continue;
-    if (devices[i].irq != data.irq)
-      continue;
-    r8 = inb(SERIAL_INTERRUPT_ID_PORT(devices[i].base));
-    if (!SERIAL_IIR_PENDING(r8))
-      continue;
+  dev = (serial_device_t *)cookie;
+  r8 = inb(SERIAL_INTERRUPT_ID_PORT(dev->base));
+  if (!SERIAL_IIR_PENDING(r8))
+    return ITR_NOT_MINE;
 
-    /* We've got a candidate. */
-    switch (SERIAL_IIR_INTERRUPT(r8)) {
-      case SERIAL_IIR_RCV_DATA_AVAILABLE:
-        serial_read_byte(devices + i);
-        break;
-      case SERIAL_IIR_TRX_HOLDER_EMPTY:
-        /* If there's no data to send to the line, reading again IIR will
-         * cause the UART to clear the interrupt. This would make sense if
-         * we were using a multiprogramming system, but since there's only
-         * one executing process, sending bytes over the serial line is
-         * made in blocking, busy-waiting mode, thus there's not much point
-         * in doing anything with this interrupt. */
-        inb(SERIAL_INTERRUPT_ID_PORT(devices[i].base));
-        break;
-      case SERIAL_IIR_LINE_STATUS:
-        serial_check_line_condition(devices + i);
-        break;
-      case SERIAL_IIR_TIMEOUT:
-        /* This interrupt is issued when there is data in the incoming fifo and
-         * the processor hasn't retrieved it in the time it takes to receive
-         * four chars from the serial link. It'll be triggered after a single
-         * word is received. */
-        serial_read_byte(devices + i);
-        break;
-      default:
-        /* Not handled and not expected. */
-        break;
-    }
+  switch (SERIAL_IIR_INTERRUPT(r8)) {
+    case SERIAL_IIR_RCV_DATA_AVAILABLE:
+      serial_read_byte(dev);
+      break;
+    case SERIAL_IIR_TRX_HOLDER_EMPTY:
+      /* If there's no data to send to the line, reading again IIR will
+       * cause the UART to clear the interrupt. This would make sense if
+       * we were using a multiprogramming system, but since there's only
+       * one executing process, sending bytes over the serial line is
+       * made in blocking, busy-waiting mode, thus there's not much point
+       * in doing anything with this interrupt. */
+      inb(SERIAL_INTERRUPT_ID_PORT(dev->base));
+      break;
+    case SERIAL_IIR_LINE_STATUS:
+      serial_check_line_condition(dev);
+      break;
+    case SERIAL_IIR_TIMEOUT:
+      /* This interrupt is issued when there is data in the incoming fifo and
+       * the processor hasn't retrieved it in the time it takes to receive
+       * four chars from the serial link. It'll be triggered after a single
+       * word is received. */
+      serial_read_byte(dev);
+      break;
+    default:
+      /* Not handled and not expected. */
+      break;
   }
 
-  pic_send_eoi(data.irq);
+  return ITR_HANDLED;
 }
 
 static int serial_open(vfs_vnode_t *node, vfs_file_t *f) {
@@ -359,13 +365,11 @@ static ssize_t serial_read(vfs_file_t *filp, char *buf, size_t count) {
 
   dev = (serial_device_t *)(filp->private_data);
 
-  /* Make this synchronous by staying here until something arrives. I know
-   * this is not a good apporach. */
-  while (dev->read_buf.read_head == dev->read_buf.write_head) {
-    hw_hlt();
-  }
-
+  /* Make this synchronous by sleeping until something arrives. The
+   * interrupt handler wakes us up. */
   lock();
+  while (dev->read_buf.read_head == dev->read_buf.write_head)
+    wait_sleep(&dev->read_wait);
 
   for (bread = 0;
 
@@ -432,6 +436,7 @@ int serial_init() {
   ops.lseek = serial_lseek;
   ops.ioctl = serial_ioctl;
   ops.readdir = NULL;
+  ops.getdents = NULL;
 
   /* Identify the devices and load the current values into our device
    * structures. */
@@ -527,29 +532,24 @@ int serial_init() {
     }
 
     devices[i].read_buf.read_head = devices[i].read_buf.write_head = 0;
+    wait_init(&devices[i].read_wait);
+    tasklet_init(&devices[i].line_tasklet,
+                 serial_report_line_condition,
+                 devices + i);
 
     serial_set_config(devices + i);
 
     dev_register_char_dev(devices[i].devid, devices[i].name, &ops);
   }
 
-  /* Set only the interrupt handlers that must be set. */
+  /* One handler per present device, those sharing a line are chained. */
   for (i = 0; i < SERIAL_TOTAL_DEVICES; i ++) {
-    if (devices[i].type != SERIAL_TYPE_UNKNOWN &&
-        devices[i].irq == PIC_SERIAL_1_IRQ) {
-      itr_set_interrupt_handler(PIC_SERIAL_1_IRQ,
-                                serial_interrupt_handler,
-                                IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
-      break;
-    }
-  }
-  for (i = 0; i < SERIAL_TOTAL_DEVICES; i ++) {
-    if (devices[i].type != SERIAL_TYPE_UNKNOWN &&
-        devices[i].irq == PIC_SERIAL_2_IRQ) {
-      itr_set_interrupt_handler(PIC_SERIAL_2_IRQ,
-                                serial_interrupt_handler,
-                                IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
-    }
+    if (devices[i].type == SERIAL_TYPE_UNKNOWN)
+      continue;
+    itr_set_interrupt_handler(devices[i].irq,
+                              serial_interrupt_handler,
+                              devices + i,
+                              IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
   }
 
   return 0;
@@ -7,6 +7,24 @@
 #define MEMFS_ROOT_INO      1
 #define MEMFS_MAX_FS        5 /* Increase this in case of need. */
 
+/* File data lives in pages taken from the frame allocator, indexed by a radix
+ * tree whose inner nodes are frames too. */
+#define MEMFS_PAGE_SIZE     MEM_FRAME_SIZE
+#define MEMFS_PAGE_SHIFT    12
+#define MEMFS_RADIX_SHIFT   10
+#define MEMFS_RADIX_SLOTS   (1 << MEMFS_RADIX_SHIFT) /* Pointers in a frame. */
+/* Two levels of nodes are enough to index 4G. */
+#define MEMFS_RADIX_MAX_HEIGHT  2
+
+/* Directory entries are hashed by name. The table starts with
+ * MEMFS_DIR_BUCKETS buckets and doubles each time there are more entries
+ * than buckets. */
+#define MEMFS_DIR_BUCKETS   8
+
+/* Nodes are found through a table indexed by inode number, which starts with
+ * MEMFS_INO_TABLE slots and doubles when full. */
+#define MEMFS_INO_TABLE     32
+
 /*****************************************************************************/
 /* Internals *****************************************************************/
 /*****************************************************************************/
@@ -16,8 +34,15 @@ typedef struct memfs_super {
   char                * name;     /* Name of the filesytem type. */
   dev_t                 devid;    /* Fake devid. */
   int                   flags;    /* Flags. */
-  list_t                nodes;    /* Nodes. */
-  int                   last_ino; /* Last assigned inode. */
+  struct memfs_node  ** nodes;    /* Nodes by inode number. */
+  int                 * free_inos;/* Released inode numbers to reuse. */
+  u32                   nfree;    /* Inode numbers in free_inos. */
+  u32                   size;     /* Slots in nodes and free_inos. */
+  int                   last_ino; /* Next never used inode number. */
+  u32                   max_pages;  /* Limits, 0 if there's none. */
+  u32                   max_inodes;
+  u32                   pages;    /* Frames in use for data. */
+  u32                   inodes;   /* Nodes in use. */
 } memfs_super_t;
 
 /* Nodes. */
@@ -26,29 +51,231 @@ typedef struct memfs_node {
   mode_t                mode;     /* mode. */
   size_t                size;     /* size. */
   dev_t                 devid;    /* devid if device. */
-  char                * data;     /* Data */
-  list_t                dentries; /* Dentries if directory. */
+  u32                   nlinks;   /* Dentries referring to the node. */
+  void                * pages;    /* Radix tree root. A single page when
+                                   * height is 0. NULL if there's no data. */
+  u32                   height;   /* Levels of nodes above the pages. */
+  struct memfs_dentry ** buckets;  /* Dentries hash table if directory. */
+  u32                   nbuckets;   /* Buckets in the table, power of 2. */
+  u32                   ndentries;  /* Dentries in the directory. */
+  struct memfs_dentry * first;    /* Dentries in creation order, so that */
+  struct memfs_dentry * last;     /* readdir doesn't depend on the hash. */
   memfs_super_t       * super;    /* Super this node belongs to. */
 } memfs_node_t;
 
-/* Dentries. */
+/* Dentries. Open directories keep a cursor in the creation order list, which
+ * is a dentry without name nor hash. */
 typedef struct memfs_dentry {
   int                   ino;      /* inode number */
   char                * name;     /* dentry name. */
+  u32                   hash;     /* hash of name. */
   memfs_node_t        * dir;      /* dir holding this entry. */
+  struct memfs_dentry * hash_next;  /* Bucket chain. */
+  struct memfs_dentry * prev;     /* Creation order list. */
+  struct memfs_dentry * next;
 } memfs_dentry_t;
 
+/* Position of an open directory, kept in the file's private_data. The mark
+ * sits right after the last entry read, so it stays valid while entries are
+ * added or removed around it. */
+typedef struct memfs_cursor {
+  memfs_dentry_t        mark;     /* Place in the dentries list. */
+  off_t                 pos;      /* f_pos the mark corresponds to. */
+} memfs_cursor_t;
+
 
 /* All filesystems we manage. */
 static memfs_super_t memfs_supers[MEMFS_MAX_FS];
 
 
-/* dentry comparison function */
-static int memfs_dentry_cmp(void *item, void *name) {
-  memfs_dentry_t *dentry;
+/* Gets a zeroed frame for a page or a radix tree node, if the super's quota
+ * allows it. */
+static void * memfs_frame_alloc(memfs_super_t *ms) {
+  void *f;
+
+  if (ms->max_pages != 0 && ms->pages >= ms->max_pages) {
+    set_errno(E_NOSPACE);
+    return NULL;
+  }
+
+  f = mem_allocate_frames(1, MEM_USER_FIRST_FRAME, 0);
+  if (f == NULL) {
+    set_errno(E_NOSPACE);
+    return NULL;
+  }
+  memset(f, 0, MEM_FRAME_SIZE);
+  ms->pages ++;
+  return f;
+}
+
+/* Releases a subtree of the given height. */
+static void memfs_radix_free(memfs_super_t *ms, void *tree, u32 height) {
+  void **slots;
+  u32 i;
+
+  if (tree == NULL)
+    return;
+
+  if (height > 0) {
+    slots = (void **)tree;
+    for (i = 0; i < MEMFS_RADIX_SLOTS; i ++)
+      memfs_radix_free(ms, slots[i], height - 1);
+  }
+  mem_release_frames(tree, 1);
+  ms->pages --;
+}
+
+/* Releases the pages of a subtree from page _from_ on, along with the nodes
+ * left empty. The subtree is _height_ levels high and starts at page _base_. */
+static void memfs_radix_trim(memfs_super_t *ms,
+                             void **slot,
+                             u32 height,
+                             u32 from,
+                             u32 base) {
+  void **slots;
+  u32 i, span;
+
+  if (*slot == NULL)
+    return;
+
+  if (from <= base) {
+    memfs_radix_free(ms, *slot, height);
+    *slot = NULL;
+    return;
+  }
+
+  if (height == 0)
+    return;
+
+  /* Pages under each slot. */
+  span = 1 << (MEMFS_RADIX_SHIFT * (height - 1));
+  slots = (void **)*slot;
+  for (i = 0; i < MEMFS_RADIX_SLOTS; i ++) {
+    if (base + (i + 1) * span > from)
+      memfs_radix_trim(ms, slots + i, height - 1, from, base + i * span);
+  }
+}
+
+/* Finds the idx-th page of a node. Missing pages are NULL unless create is
+ * set, in which case they are allocated along with the nodes leading to them
+ * and the tree grows as much as needed. */
+static char * memfs_page_get(memfs_node_t *node, u32 idx, int create) {
+  void **slot, **root;
+  u32 h;
+
+  /* Make room for idx adding levels on top. */
+  while (node->height < MEMFS_RADIX_MAX_HEIGHT &&
+         (idx >> (MEMFS_RADIX_SHIFT * node->height)) != 0) {
+    if (!create)
+      return NULL;
+    if (node->pages != NULL) {
+      root = (void **)memfs_frame_alloc(node->super);
+      if (root == NULL)
+        return NULL;
+      root[0] = node->pages;
+      node->pages = root;
+    }
+    node->height ++;
+  }
+
+  /* Walk it down. */
+  slot = &(node->pages);
+  for (h = node->height; h > 0; h --) {
+    if (*slot == NULL) {
+      if (!create)
+        return NULL;
+      *slot = memfs_frame_alloc(node->super);
+      if (*slot == NULL)
+        return NULL;
+    }
+    slot = ((void **)*slot) +
+           ((idx >> (MEMFS_RADIX_SHIFT * (h - 1))) & (MEMFS_RADIX_SLOTS - 1));
+  }
+
+  if (*slot == NULL && create)
+    *slot = memfs_frame_alloc(node->super);
+  return (char *)*slot;
+}
+
+/* FNV-1a hash of a dentry name. */
+static u32 memfs_name_hash(char *name) {
+  u32 h;
+
+  for (h = 2166136261u; *name != 0; name ++)
+    h = (h ^ (u8)*name) * 16777619u;
+  return h;
+}
+
+/* Looks for a dentry by name in a directory. */
+static memfs_dentry_t * memfs_dentry_find(memfs_node_t *dir, char *name) {
+  memfs_dentry_t *d;
+  u32 h;
+
+  if (dir->buckets == NULL)
+    return NULL;
+
+  h = memfs_name_hash(name);
+  for (d = dir->buckets[h & (dir->nbuckets - 1)]; d != NULL; d = d->hash_next) {
+    if (d->hash == h && strcmp(d->name, name) == 0)
+      return d;
+  }
+  return NULL;
+}
+
+/* Makes the hash table of a directory _nbuckets_ large, moving the dentries
+ * into the new buckets. */
+static int memfs_dir_rehash(memfs_node_t *dir, u32 nbuckets) {
+  memfs_dentry_t **buckets, *d;
+  u32 i;
+
+  buckets = (memfs_dentry_t **)kalloc(nbuckets * sizeof(memfs_dentry_t *));
+  if (buckets == NULL)
+    return -1;
+  for (i = 0; i < nbuckets; i ++)
+    buckets[i] = NULL;
+
+  for (d = dir->first; d != NULL; d = d->next) {
+    if (d->name == NULL)
+      continue; /* Cursors aren't hashed. */
+    i = d->hash & (nbuckets - 1);
+    d->hash_next = buckets[i];
+    buckets[i] = d;
+  }
+
+  if (dir->buckets != NULL)
+    kfree(dir->buckets);
+  dir->buckets = buckets;
+  dir->nbuckets = nbuckets;
+  return 0;
+}
+
+/* Links d in the creation order list of dir right after _after_, or at the
+ * head if it's NULL. */
+static void memfs_order_insert(memfs_node_t *dir,
+                               memfs_dentry_t *d,
+                               memfs_dentry_t *after) {
+  d->prev = after;
+  d->next = after != NULL ? after->next : dir->first;
+  if (d->next != NULL)
+    d->next->prev = d;
+  else
+    dir->last = d;
+  if (after != NULL)
+    after->next = d;
+  else
+    dir->first = d;
+}
 
-  dentry = (memfs_dentry_t *)item;
-  return strcmp(dentry->name, (char *)name) == 0;
+/* Unlinks d from the creation order list of dir. */
+static void memfs_order_remove(memfs_node_t *dir, memfs_dentry_t *d) {
+  if (d->prev != NULL)
+    d->prev->next = d->next;
+  else
+    dir->first = d->next;
+  if (d->next != NULL)
+    d->next->prev = d->prev;
+  else
+    dir->last = d->prev;
 }
 
 /* Allocates a dentry in a node. */
@@ -56,6 +283,15 @@ static memfs_dentry_t * memfs_dentry_alloc(memfs_node_t *node,
                                            int ino,
                                            char *name) {
   memfs_dentry_t *d;
+  u32 i;
+
+  /* Get the table ready. If it can't grow we can live with longer chains. */
+  if (node->buckets == NULL) {
+    if (memfs_dir_rehash(node, MEMFS_DIR_BUCKETS) == -1)
+      return NULL;
+  } else if (node->ndentries >= node->nbuckets) {
+    memfs_dir_rehash(node, node->nbuckets * 2);
+  }
 
   d = (memfs_dentry_t *)kalloc(sizeof(memfs_dentry_t));
   if (d == NULL)
@@ -64,79 +300,152 @@ static memfs_dentry_t * memfs_dentry_alloc(memfs_node_t *node,
   d->ino = ino;
   d->dir = node;
 
-  d->name = (char *)kalloc(sizeof(name) + 1);
+  d->name = (char *)kalloc(strlen(name) + 1);
   if (d->name == NULL) {
     kfree(d);
     return NULL;
   }
   strcpy(d->name, name);
+  d->hash = memfs_name_hash(name);
 
-  if (list_add(&(node->dentries), d) == -1) {
-    kfree(d->name);
-    kfree(d);
-    return NULL;
-  }
+  i = d->hash & (node->nbuckets - 1);
+  d->hash_next = node->buckets[i];
+  node->buckets[i] = d;
+
+  memfs_order_insert(node, d, node->last);
+  node->ndentries ++;
 
   return d;
 }
 
 /* Removes a dentry from its directory and from memory. */
 static void memfs_dentry_dealloc(memfs_dentry_t *d) {
-  list_find_del(&(d->dir->dentries), memfs_dentry_cmp, d->name);
-  kfree(d->name);
-  kfree(d);
-}
+  memfs_node_t *dir;
+  memfs_dentry_t **pp;
+
+  dir = d->dir;
+  for (pp = &(dir->buckets[d->hash & (dir->nbuckets - 1)]);
+       *pp != NULL;
+       pp = &((*pp)->hash_next)) {
+    if (*pp == d) {
+      *pp = d->hash_next;
+      break;
+    }
+  }
 
-/* node comparison function */
-static int memfs_node_cmp(void *item, void *ino) {
-  memfs_node_t *node;
+  memfs_order_remove(dir, d);
+  dir->ndentries --;
 
-  node = (memfs_node_t *)item;
-  return node->ino == *((int *)ino);
+  kfree(d->name);
+  kfree(d);
 }
 
 /* Looks for a node in a super. */
 static memfs_node_t * memfs_node_lookup(memfs_super_t *ms,
                                         int ino) {
-  return list_find(&(ms->nodes), memfs_node_cmp, &ino);
+  if (ino < MEMFS_ROOT_INO || ino >= ms->last_ino)
+    return NULL;
+  return ms->nodes[ino];
+}
+
+/* Makes the inode table of a super twice as large. */
+static int memfs_ino_table_grow(memfs_super_t *ms) {
+  memfs_node_t **nodes;
+  int *free_inos;
+  u32 size, i;
+
+  size = ms->size > 0 ? ms->size * 2 : MEMFS_INO_TABLE;
+  nodes = (memfs_node_t **)kalloc(size * sizeof(memfs_node_t *));
+  if (nodes == NULL)
+    return -1;
+  free_inos = (int *)kalloc(size * sizeof(int));
+  if (free_inos == NULL) {
+    kfree(nodes);
+    return -1;
+  }
+
+  for (i = 0; i < size; i ++)
+    nodes[i] = i < ms->size ? ms->nodes[i] : NULL;
+  for (i = 0; i < ms->nfree; i ++)
+    free_inos[i] = ms->free_inos[i];
+
+  if (ms->nodes != NULL) {
+    kfree(ms->nodes);
+    kfree(ms->free_inos);
+  }
+  ms->nodes = nodes;
+  ms->free_inos = free_inos;
+  ms->size = size;
+  return 0;
 }
 
-/* Allocates a node in its super. */
+/* Allocates a node in its super. Inode numbers released by removed nodes are
+ * used first. */
 static memfs_node_t * memfs_node_alloc(memfs_super_t *ms,
                                        mode_t mode,
                                        dev_t devid) {
   memfs_node_t *node;
 
-  node = (memfs_node_t *)kalloc(sizeof(memfs_node_t));
-  if (node == NULL)
+  if (ms->max_inodes != 0 && ms->inodes >= ms->max_inodes) {
+    set_errno(E_NOSPACE);
     return NULL;
+  }
 
-  node->ino = ms->last_ino ++;
-  node->super = ms;
+  if (ms->nfree == 0 && ms->last_ino >= ms->size &&
+      memfs_ino_table_grow(ms) == -1) {
+    set_errno(E_NOMEM);
+    return NULL;
+  }
 
-  if (list_add(&(ms->nodes), node) == -1) {
-    kfree(node);
+  node = (memfs_node_t *)kalloc(sizeof(memfs_node_t));
+  if (node == NULL) {
+    set_errno(E_NOMEM);
     return NULL;
   }
+  ms->inodes ++;
+
+  if (ms->nfree > 0)
+    node->ino = ms->free_inos[-- ms->nfree];
+  else
+    node->ino = ms->last_ino ++;
+  node->super = ms;
+  ms->nodes[node->ino] = node;
 
   node->mode = mode;
+  node->size = 0;
   node->devid = devid;
-  node->data = NULL;
-  list_init(&(node->dentries));
+  node->nlinks = 0;
+  node->pages = NULL;
+  node->height = 0;
+  node->buckets = NULL;
+  node->nbuckets = 0;
+  node->ndentries = 0;
+  node->first = NULL;
+  node->last = NULL;
 
   return node;
 }
 
 /* Removes a node and it dentries from its super and from memory. */
 static void memfs_node_dealloc(memfs_node_t *node) {
-  list_find_del(&(node->super->nodes), memfs_node_cmp, &(node->ino));
+  memfs_super_t *ms;
+
+  /* There's always room for the inode number: the table only grows. */
+  ms = node->super;
+  ms->nodes[node->ino] = NULL;
+  ms->free_inos[ms->nfree ++] = node->ino;
+  ms->inodes --;
 
-  if (node->data != NULL)
-    kfree(node->data);
+  memfs_radix_free(ms, node->pages, node->height);
 
-  while (node->dentries.count > 0) {
-    memfs_dentry_dealloc((memfs_dentry_t *)list_get(&(node->dentries), 0));
+  while (node->first != NULL) {
+    if (node->first->name == NULL)
+      memfs_order_remove(node, node->first); /* A cursor. */
+    else
+      memfs_dentry_dealloc(node->first);
   }
+  if (node->buckets != NULL)
+    kfree(node->buckets);
 
   kfree(node);
 }
@@ -158,7 +467,9 @@ static memfs_super_t * memfs_get_super(dev_t devid) {
 static int memfs_init_super(memfs_super_t *ms,
                             char *name,
                             dev_t devid,
-                            int flags) {
+                            int flags,
+                            size_t max_bytes,
+                            size_t max_inodes) {
   ms->name = (char *)kalloc(strlen(name) + 1);
   if (ms->name == NULL) {
     return -1;
@@ -167,24 +478,48 @@ static int memfs_init_super(memfs_super_t *ms,
 
   ms->devid = devid;
   ms->flags = flags;
-  ms->last_ino = 0;
+  ms->last_ino = MEMFS_ROOT_INO;
 
-  list_init(&(ms->nodes));
+  ms->nodes = NULL;
+  ms->free_inos = NULL;
+  ms->nfree = 0;
+  ms->size = 0;
+
+  /* A limit below a page would read as no limit. */
+  ms->max_pages = max_bytes / MEMFS_PAGE_SIZE;
+  if (max_bytes != 0 && ms->max_pages == 0)
+    ms->max_pages = 1;
+  ms->max_inodes = max_inodes;
+  ms->pages = 0;
+  ms->inodes = 0;
 
   return 0;
 }
 
 /* Clears a super. */
 static void memfs_clear_super(memfs_super_t *ms) {
+  int ino;
+
   kfree(ms->name);
   ms->name = NULL;
   ms->devid = 0;
   ms->flags = 0;
-  ms->last_ino = 0;
 
-  while (ms->nodes.count > 0) {
-    memfs_node_dealloc((memfs_node_t *)list_get(&(ms->nodes), 0));
+  for (ino = MEMFS_ROOT_INO; ino < ms->last_ino; ino ++) {
+    if (ms->nodes[ino] != NULL)
+      memfs_node_dealloc(ms->nodes[ino]);
   }
+  if (ms->nodes != NULL) {
+    kfree(ms->nodes);
+    kfree(ms->free_inos);
+  }
+  ms->nodes = NULL;
+  ms->free_inos = NULL;
+  ms->nfree = 0;
+  ms->size = 0;
+  ms->last_ino = 0;
+  ms->max_pages = 0;
+  ms->max_inodes = 0;
 }
 
 /*****************************************************************************/
@@ -204,16 +539,28 @@ int memfs_file_release(vfs_vnode_t *node, vfs_file_t *file) {
   return 0;
 }
 
-/* Called each time a file is closed. */
+/* Called each time a file is closed. Drops the directory cursor. Should the
+ * file be used again (vfs_flush) the next read will set it up from f_pos. */
 int memfs_file_flush(vfs_file_t *file) {
-  /* Nothing special to do. */
+  memfs_cursor_t *c;
+
+  c = (memfs_cursor_t *)file->private_data;
+  if (c != NULL) {
+    memfs_order_remove((memfs_node_t *)(file->ro.f_vnode->private_data),
+                       &(c->mark));
+    kfree(c);
+    file->private_data = NULL;
+  }
   return 0;
 }
 
-/* Read _count_ bytes from _file_ starting at _off_ into _buf_. */
+/* Read _count_ bytes from _file_ starting at _off_ into _buf_. Pages never
+ * written are holes and read as zeros. */
 ssize_t memfs_file_read(vfs_file_t *file, char *buf, size_t count) {
   memfs_node_t *mn;
   off_t off;
+  size_t done, n, poff;
+  char *page;
 
   mn = (memfs_node_t *)(file->ro.f_vnode->private_data);
   off = file->f_pos;
@@ -223,64 +570,169 @@ ssize_t memfs_file_read(vfs_file_t *file, char *buf, size_t count) {
     return 0;
 
   /* Put limits. */
-  if (off + count > mn->size) {
+  if (count > mn->size - off) {
     count = mn->size - off;
   }
 
-  memcpy(buf, (char *)(mn->data) + off, count);
+  for (done = 0; done < count; done += n) {
+    poff = (off + done) & (MEMFS_PAGE_SIZE - 1);
+    n = MEMFS_PAGE_SIZE - poff;
+    if (n > count - done)
+      n = count - done;
+
+    page = memfs_page_get(mn, (off + done) >> MEMFS_PAGE_SHIFT, 0);
+    if (page == NULL)
+      memset(buf + done, 0, n);
+    else
+      memcpy(buf + done, page + poff, n);
+  }
   file->f_pos += count;
 
   return (ssize_t)count;
 }
 
-/* Write _count_ bytes into _file_ starting at _off_ from _buf_. */
+/* Write _count_ bytes into _file_ starting at _off_ from _buf_. Only the pages
+ * touched get allocated, so writing past the end leaves a hole. */
 ssize_t memfs_file_write(vfs_file_t *file,
                          char *buf,
                          size_t count) {
   memfs_node_t *mn;
-  char *new_data;
   off_t off;
+  size_t done, n, poff;
+  char *page;
 
   mn = (memfs_node_t *)(file->ro.f_vnode->private_data);
   off = file->f_pos;
 
-  if (off + count > mn->size) {
-    new_data = (char *)kalloc((off + count) * sizeof(char));
-    if (new_data == NULL) {
-      set_errno(E_NOSPACE);
-      return -1;
+  /* Files can't go beyond 4G. */
+  if (off + count < off)
+    count = -off;
+
+  for (done = 0; done < count; done += n) {
+    poff = (off + done) & (MEMFS_PAGE_SIZE - 1);
+    n = MEMFS_PAGE_SIZE - poff;
+    if (n > count - done)
+      n = count - done;
+
+    page = memfs_page_get(mn, (off + done) >> MEMFS_PAGE_SHIFT, 1);
+    if (page == NULL)
+      break;
+    memcpy(page + poff, buf + done, n);
+  }
+
+  /* Report what could be written, fail only if nothing could. */
+  if (done == 0 && count > 0)
+    return -1;
+
+  if (off + done > mn->size) {
+    mn->size = off + done;
+    file->ro.f_vnode->v_size = mn->size;
+  }
+  file->f_pos += done;
+
+  return (ssize_t)done;
+}
+
+/* Gets the cursor of an open directory, creating it the first time. If the
+ * file was lseek'ed the mark is moved to f_pos, which is the only case where
+ * the list is walked from the head. */
+static memfs_cursor_t * memfs_cursor_get(vfs_file_t *file) {
+  memfs_node_t *mn;
+  memfs_cursor_t *c;
+  memfs_dentry_t *md, *after;
+  off_t i;
+
+  mn = (memfs_node_t *)(file->ro.f_vnode->private_data);
+  c = (memfs_cursor_t *)file->private_data;
+
+  if (c == NULL) {
+    c = (memfs_cursor_t *)kalloc(sizeof(memfs_cursor_t));
+    if (c == NULL) {
+      set_errno(E_NOMEM);
+      return NULL;
     }
-    /* This creates the effect of a hole. ;) */
-    memset(new_data, 0, (off + count) * sizeof(char));
-    /* Copy old data in. */
-    memcpy(new_data, mn->data, mn->size);
-    kfree(mn->data);
-    mn->data = new_data;
-    mn->size = off + count;
+    memset(c, 0, sizeof(memfs_cursor_t));
+    c->mark.dir = mn;
+    memfs_order_insert(mn, &(c->mark), NULL);
+    c->pos = 0;
+    file->private_data = c;
   }
 
-  memcpy(mn->data + off, buf, count);
-  file->f_pos += count;
+  if (c->pos != file->f_pos) {
+    memfs_order_remove(mn, &(c->mark));
+    for (md = mn->first, after = NULL, i = 0;
+         md != NULL && i < file->f_pos;
+         md = md->next) {
+      if (md->name != NULL) {
+        after = md;
+        i ++;
+      }
+    }
+    memfs_order_insert(mn, &(c->mark), after);
+    c->pos = file->f_pos;
+  }
 
-  return (ssize_t)count;
+  return c;
 }
 
-/* Reads the next name in a directory. This is quite different from Linux
- * interface. */
-char * memfs_file_readdir(vfs_file_t *file) {
+/* Moves the cursor past the next entry and returns it, NULL at the end. */
+static memfs_dentry_t * memfs_cursor_next(vfs_file_t *file,
+                                          memfs_cursor_t *c) {
   memfs_node_t *mn;
   memfs_dentry_t *md;
 
   mn = (memfs_node_t *)(file->ro.f_vnode->private_data);
-  md = list_get(&(mn->dentries), file->f_pos);
 
+  /* Skip other files' cursors. */
+  for (md = c->mark.next; md != NULL && md->name == NULL; md = md->next);
   if (md == NULL)
     return NULL;
 
+  memfs_order_remove(mn, &(c->mark));
+  memfs_order_insert(mn, &(c->mark), md);
+  c->pos ++;
   file->f_pos ++;
+  return md;
+}
+
+/* Reads the next name in a directory. This is quite different from Linux
+ * interface. */
+char * memfs_file_readdir(vfs_file_t *file) {
+  memfs_cursor_t *c;
+  memfs_dentry_t *md;
+
+  c = memfs_cursor_get(file);
+  if (c == NULL)
+    return NULL;
+
+  md = memfs_cursor_next(file, c);
+  if (md == NULL)
+    return NULL;
   return md->name;
 }
 
+/* Reads up to _count_ entries of a directory. */
+ssize_t memfs_file_getdents(vfs_file_t *file,
+                            vfs_dirent_t *dirents,
+                            size_t count) {
+  memfs_cursor_t *c;
+  memfs_dentry_t *md;
+  size_t i;
+
+  c = memfs_cursor_get(file);
+  if (c == NULL)
+    return -1;
+
+  for (i = 0; i < count; i ++) {
+    md = memfs_cursor_next(file, c);
+    if (md == NULL)
+      break;
+    dirents[i].d_vno = md->ino;
+    strcpy(dirents[i].d_name, md->name);
+  }
+  return (ssize_t)i;
+}
+
 /*****************************************************************************/
 /* inodes ********************************************************************/
 /*****************************************************************************/
@@ -293,9 +745,7 @@ int memfs_ino_lookup(vfs_vnode_t *dir, vfs_dentry_t *dentry) {
   memfs_dentry_t *md;
 
   mn = (memfs_node_t *)(dir->private_data);
-  md = (memfs_dentry_t *)list_find(&(mn->dentries),
-                                   memfs_dentry_cmp,
-                                   dentry->d_name);
+  md = memfs_dentry_find(mn, dentry->d_name);
   if (md == NULL) {
     set_errno(E_NOENT);
     return -1;
@@ -318,17 +768,18 @@ static int memfs_ino_mknod(vfs_vnode_t *dir,
 
   mn = memfs_node_alloc(mdir->super, mode, devid);
   if (mn == NULL) {
-    set_errno(E_IO);
+    /* errno was set. */
     return -1;
   }
 
   md = memfs_dentry_alloc(mdir, mn->ino, dentry->d_name);
   if (md == NULL) {
     memfs_node_dealloc(mn);
-    set_errno(E_IO);
+    set_errno(E_NOMEM);
     return -1;
   }
 
+  mn->nlinks ++;
   dentry->d_vno = mn->ino;
 
   return 0;
@@ -349,6 +800,76 @@ static int memfs_ino_mkdir(vfs_vnode_t *dir,
   return memfs_ino_mknod(dir, dentry, mode, FILE_NODEV);
 }
 
+/* Removes an entry from dir. The node itself is released by delete_vnode
+ * once nobody uses it. */
+static int memfs_ino_remove(vfs_vnode_t *dir, vfs_dentry_t *dentry, int rmdir) {
+  memfs_node_t *mdir, *mn;
+  memfs_dentry_t *md;
+
+  mdir = (memfs_node_t *)(dir->private_data);
+  md = memfs_dentry_find(mdir, dentry->d_name);
+  if (md == NULL) {
+    set_errno(E_NOENT);
+    return -1;
+  }
+
+  mn = memfs_node_lookup(mdir->super, md->ino);
+  if (mn == NULL) {
+    set_errno(E_CORRUPT);
+    return -1;
+  }
+  if (rmdir && mn->ndentries > 0) {
+    set_errno(E_NOEMPTY);
+    return -1;
+  }
+
+  memfs_dentry_dealloc(md);
+  mn->nlinks --;
+
+  return 0;
+}
+
+/* Removes a non directory entry from dir. */
+static int memfs_ino_unlink(vfs_vnode_t *dir, vfs_dentry_t *dentry) {
+  return memfs_ino_remove(dir, dentry, 0);
+}
+
+/* Removes an empty directory from dir. */
+static int memfs_ino_rmdir(vfs_vnode_t *dir, vfs_dentry_t *dentry) {
+  return memfs_ino_remove(dir, dentry, 1);
+}
+
+/* Sets the size of a file. Pages beyond it go back to the frame allocator
+ * right away and the tail of the last one is cleared, so that growing the
+ * file again reads zeros. */
+static int memfs_ino_truncate(vfs_vnode_t *node, size_t size) {
+  memfs_node_t *mn;
+  u32 from, off;
+  char *page;
+
+  mn = (memfs_node_t *)(node->private_data);
+
+  if (size < mn->size) {
+    /* First page entirely past the end. */
+    from = (size >> MEMFS_PAGE_SHIFT) + ((size & (MEMFS_PAGE_SIZE - 1)) != 0);
+    memfs_radix_trim(mn->super, &(mn->pages), mn->height, from, 0);
+    if (mn->pages == NULL)
+      mn->height = 0;
+
+    off = size & (MEMFS_PAGE_SIZE - 1);
+    if (off != 0) {
+      page = memfs_page_get(mn, size >> MEMFS_PAGE_SHIFT, 0);
+      if (page != NULL)
+        memset(page + off, 0, MEMFS_PAGE_SIZE - off);
+    }
+  }
+
+  mn->size = size;
+  node->v_size = size;
+
+  return 0;
+}
+
 
 /*****************************************************************************/
 /* superblock ****************************************************************/
@@ -361,7 +882,7 @@ static int memfs_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
   memfs_node_t *mn;
 
   ms = (memfs_super_t *)(sb->private_data);
-  mn = (memfs_node_t *)list_find(&(ms->nodes), memfs_node_cmp, &(node->v_no));
+  mn = memfs_node_lookup(ms, node->v_no);
   if (mn == NULL) {
     set_errno(E_NOENT);
     return -1;
@@ -369,6 +890,7 @@ static int memfs_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
 
   node->v_mode = mn->mode;
   node->v_size = mn->size;
+  node->v_nlinks = mn->nlinks;
   node->v_dev = mn->devid;
   node->private_data = mn;
 
@@ -388,10 +910,14 @@ static int memfs_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
       if (ms->flags & MEMFS_FLAGS_ALLOW_NODES)
         node->v_iops.mknod = memfs_ino_mknod;
 
+      node->v_iops.unlink = memfs_ino_unlink;
+      node->v_iops.rmdir = memfs_ino_rmdir;
+
       node->v_fops.open = memfs_file_open;
       node->v_fops.release = memfs_file_release;
       node->v_fops.flush = memfs_file_flush;
       node->v_fops.readdir = memfs_file_readdir;
+      node->v_fops.getdents = memfs_file_getdents;
       break;
     case FILE_TYPE_REGULAR:
       node->v_fops.open = memfs_file_open;
@@ -399,6 +925,7 @@ static int memfs_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
       node->v_fops.flush = memfs_file_flush;
       node->v_fops.read = memfs_file_read;
       node->v_fops.write = memfs_file_write;
+      node->v_iops.truncate = memfs_ino_truncate;
       /* We won't set lseek because the default implemetation works for us. */
       break;
     case FILE_TYPE_FIFO:
@@ -421,7 +948,7 @@ static int memfs_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
  * just won't be called, which is normal in filesystems that don't need
  * to take any special action when this happens. */
 static int memfs_sb_destroy_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
-  /* TODO: Check what happens when open, delete, release. */
+  /* Nodes live on until they are deleted. */
   return 0;
 }
 
@@ -443,8 +970,13 @@ static int memfs_sb_write_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
  * It's not necessary to release any data from the vnode structure since
  * destroy_vnode will be called inmediately after. */
 static int memfs_sb_delete_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
-  /* TODO: Do this. */
-  return -1;
+  memfs_node_t *mn;
+
+  mn = (memfs_node_t *)(node->private_data);
+  memfs_node_dealloc(mn);
+  node->private_data = NULL;
+
+  return 0;
 }
 
 /* Used to notify the superblock it's being mounted. When called the
@@ -459,15 +991,14 @@ static int memfs_sb_mount(vfs_sb_t *sb) {
    * it has a superblock. */
   mn = memfs_node_lookup(ms, MEMFS_ROOT_INO);
   if (mn == NULL) {
+    /* Being the first node it gets MEMFS_ROOT_INO. */
     mn = memfs_node_alloc(ms, FILE_TYPE_DIRECTORY | FILE_PERM_755, FILE_NODEV);
     if (mn == NULL) {
       set_errno(E_IO);
       return -1;
     }
-    mn->ino = MEMFS_ROOT_INO;
-    if (ms->last_ino <= 1) {
-      ms->last_ino = 2;
-    }
+    /* The mountpoint counts as its link. */
+    mn->nlinks = 1;
   }
 
   sb->sb_root_vno = MEMFS_ROOT_INO;
@@ -481,6 +1012,22 @@ static int memfs_sb_unmount(vfs_sb_t *sb) {
   return 0;
 }
 
+/* Reports the usage of the filesystem against its limits. Blocks are the
+ * frames holding data and radix tree nodes. */
+static int memfs_sb_statfs(vfs_sb_t *sb, struct statfs *st) {
+  memfs_super_t *ms;
+
+  ms = (memfs_super_t *)(sb->private_data);
+
+  st->bsize = MEMFS_PAGE_SIZE;
+  st->blocks = ms->max_pages;
+  st->bused = ms->pages;
+  st->files = ms->max_inodes;
+  st->fused = ms->inodes;
+
+  return 0;
+}
+
 
 /*****************************************************************************/
 /* fs_type *******************************************************************/
@@ -501,6 +1048,7 @@ static int memfs_ft_get_sb(vfs_sb_t *sb) {
   sb->sb_ops.delete_vnode = memfs_sb_delete_vnode;
   sb->sb_ops.mount = memfs_sb_mount;
   sb->sb_ops.unmount = memfs_sb_unmount;
+  sb->sb_ops.statfs = memfs_sb_statfs;
 
   return 0;
 }
@@ -524,7 +1072,11 @@ static int memfs_config_fs_type(vfs_fs_type_t *ft) {
 /*****************************************************************************/
 /* memfs API *****************************************************************/
 /*****************************************************************************/
-int memfs_create(char *name, dev_t devid, int flags) {
+int memfs_create(char *name,
+                 dev_t devid,
+                 int flags,
+                 size_t max_bytes,
+                 size_t max_inodes) {
   int i;
 
   if (memfs_get_super(devid) != NULL) {
@@ -540,7 +1092,8 @@ int memfs_create(char *name, dev_t devid, int flags) {
     return -1;
   }
 
-  if (memfs_init_super(memfs_supers + i, name, devid, flags) == -1)
+  if (memfs_init_super(memfs_supers + i, name, devid, flags,
+                       max_bytes, max_inodes) == -1)
     return -1;
 
   if (vfs_fs_type_register(name, memfs_config_fs_type) == -1) {
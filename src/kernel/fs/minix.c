@@ -0,0 +1,946 @@
+#include <vfs.h>
+#include <string.h>
+#include <errors.h>
+#include <mem.h>
+#include <bcache.h>
+#include <fs/minix.h>
+
+#define MINIX_BLOCK_SIZE        BCACHE_BLOCK_SIZE
+#define MINIX_SUPER_BLOCK       1
+#define MINIX_IMAP_BLOCK        2
+#define MINIX_ROOT_INO          1
+
+#define MINIX_SUPER_MAGIC       0x137F  /* 14 characters names. */
+#define MINIX_SUPER_MAGIC2      0x138F  /* 30 characters names. */
+#define MINIX_NAME_MAX          30
+
+/* Zones 0-6 are direct, 7 is indirect and 8 is double indirect. */
+#define MINIX_DIRECT_ZONES      7
+#define MINIX_IND_ZONE          7
+#define MINIX_DIND_ZONE         8
+#define MINIX_ZONES_PER_BLOCK   (MINIX_BLOCK_SIZE / sizeof(u16))
+
+/* Blocks read ahead at most by a single read. */
+#define MINIX_READ_AHEAD        32
+
+/*****************************************************************************/
+/* Internals *****************************************************************/
+/*****************************************************************************/
+
+/* On disk structures. Their fields are naturally aligned, so there's no need
+ * to pack them. */
+
+/* Superblock. */
+typedef struct minix_disk_super {
+  u16                   s_ninodes;        /* Inodes. */
+  u16                   s_nzones;         /* Zones, including metadata. */
+  u16                   s_imap_blocks;    /* Inode bitmap blocks. */
+  u16                   s_zmap_blocks;    /* Zone bitmap blocks. */
+  u16                   s_firstdatazone;  /* First zone holding data. */
+  u16                   s_log_zone_size;  /* log2(zone size / block size) */
+  u32                   s_max_size;       /* Maximum file size. */
+  u16                   s_magic;          /* MINIX_SUPER_MAGIC{,2} */
+  u16                   s_state;          /* Clean or not. */
+} minix_disk_super_t;
+
+/* Inode. */
+typedef struct minix_disk_inode {
+  u16                   i_mode;           /* Same bits as mode_t. */
+  u16                   i_uid;
+  u32                   i_size;
+  u32                   i_time;
+  u8                    i_gid;
+  u8                    i_nlinks;
+  u16                   i_zones[9];       /* Device ID in i_zones[0] for
+                                           * device files. */
+} minix_disk_inode_t;
+
+#define MINIX_INODES_PER_BLOCK  (MINIX_BLOCK_SIZE / sizeof(minix_disk_inode_t))
+
+/* Mounted filesystem. */
+typedef struct minix_super {
+  dev_t                 devid;        /* Device holding it. */
+  minix_disk_super_t    ds;           /* Superblock. */
+  u32                   namelen;      /* 14 or 30. */
+  u32                   dirent_size;  /* namelen + the inode number. */
+  u32                   itable;       /* First block of the inode table. */
+  u32                 * imap;         /* Inode bitmap. */
+  u32                   imap_bits;    /* Meaningful bits in imap. */
+  u32                   imap_hint;    /* imap words below are full. */
+  u32                 * zmap;         /* Zone bitmap. */
+  u32                   zmap_bits;    /* Meaningful bits in zmap. */
+  u32                   zmap_hint;    /* zmap words below are full. */
+} minix_super_t;
+
+/* In memory inode, the vnode's private data. */
+typedef struct minix_inode {
+  minix_disk_inode_t    di;           /* On disk copy. */
+  char                  name[MINIX_NAME_MAX + 1]; /* Returned by readdir. */
+} minix_inode_t;
+
+/* Finds the first clear bit, sets it and returns it. Bit 0 is always set in
+ * Minix bitmaps, so 0 means the map is full. Words are scanned from the hint
+ * on, and it's moved forward since the words skipped are known to be full. */
+static u32 minix_bitmap_alloc(u32 *map, u32 bits, u32 *hint) {
+  u32 w, words, bit;
+
+  words = (bits + 31) / 32;
+  for (w = *hint; w < words; w ++) {
+    if (map[w] == 0xffffffff)
+      continue;
+    bit = w * 32 + __builtin_ctz(~map[w]);
+    if (bit >= bits)
+      break;
+    map[w] |= 1u << (bit % 32);
+    *hint = w;
+    return bit;
+  }
+  *hint = words;
+  return 0;
+}
+
+/* Clears a bit, moving the hint back if needed. */
+static void minix_bitmap_free(u32 *map, u32 bit, u32 *hint) {
+  map[bit / 32] &= ~(1u << (bit % 32));
+  if (bit / 32 < *hint)
+    *hint = bit / 32;
+}
+
+/* Writes the block of a bitmap holding bit. */
+static int minix_bitmap_sync(minix_super_t *ms, u32 *map, u32 first_block,
+                             u32 bit) {
+  bcache_buf_t *b;
+  u32 blk;
+  int r;
+
+  blk = bit / (MINIX_BLOCK_SIZE * 8);
+  b = bcache_get(ms->devid, first_block + blk);
+  if (b == NULL)
+    return -1;
+  memcpy(b->data, (char *)map + blk * MINIX_BLOCK_SIZE, MINIX_BLOCK_SIZE);
+  r = bcache_write(b);
+  bcache_release(b);
+  return r;
+}
+
+/* Allocates a zone and fills it with zeros. Returns 0 on failure. */
+static u32 minix_zone_alloc(minix_super_t *ms) {
+  bcache_buf_t *b;
+  u32 bit, zone;
+
+  bit = minix_bitmap_alloc(ms->zmap, ms->zmap_bits, &ms->zmap_hint);
+  if (bit == 0) {
+    set_errno(E_NOSPACE);
+    return 0;
+  }
+  zone = bit + ms->ds.s_firstdatazone - 1;
+
+  b = bcache_get(ms->devid, zone);
+  if (b == NULL) {
+    minix_bitmap_free(ms->zmap, bit, &ms->zmap_hint);
+    return 0;
+  }
+  memset(b->data, 0, MINIX_BLOCK_SIZE);
+  if (bcache_write(b) == -1 ||
+      minix_bitmap_sync(ms, ms->zmap,
+                        MINIX_IMAP_BLOCK + ms->ds.s_imap_blocks, bit) == -1) {
+    bcache_release(b);
+    minix_bitmap_free(ms->zmap, bit, &ms->zmap_hint);
+    return 0;
+  }
+  bcache_release(b);
+
+  return zone;
+}
+
+/* Frees a zone. */
+static void minix_zone_free(minix_super_t *ms, u32 zone) {
+  u32 bit;
+
+  bit = zone - ms->ds.s_firstdatazone + 1;
+  minix_bitmap_free(ms->zmap, bit, &ms->zmap_hint);
+  minix_bitmap_sync(ms, ms->zmap, MINIX_IMAP_BLOCK + ms->ds.s_imap_blocks, bit);
+}
+
+/* Reads or writes an inode from or to the inode table. */
+static int minix_inode_io(minix_super_t *ms, int ino, minix_disk_inode_t *di,
+                          int write) {
+  bcache_buf_t *b;
+  u32 off;
+  int r;
+
+  if (ino < 1 || ino > ms->ds.s_ninodes) {
+    set_errno(E_NOENT);
+    return -1;
+  }
+
+  b = bcache_read(ms->devid, ms->itable + (ino - 1) / MINIX_INODES_PER_BLOCK);
+  if (b == NULL)
+    return -1;
+
+  off = ((ino - 1) % MINIX_INODES_PER_BLOCK) * sizeof(minix_disk_inode_t);
+  r = 0;
+  if (write) {
+    memcpy(b->data + off, di, sizeof(minix_disk_inode_t));
+    r = bcache_write(b);
+  }
+  else {
+    memcpy(di, b->data + off, sizeof(minix_disk_inode_t));
+  }
+
+  bcache_release(b);
+  return r;
+}
+
+/* Allocates an inode number. Returns 0 on failure. */
+static int minix_inode_alloc(minix_super_t *ms) {
+  u32 bit;
+
+  bit = minix_bitmap_alloc(ms->imap, ms->imap_bits, &ms->imap_hint);
+  if (bit == 0) {
+    set_errno(E_NOSPACE);
+    return 0;
+  }
+  if (minix_bitmap_sync(ms, ms->imap, MINIX_IMAP_BLOCK, bit) == -1) {
+    minix_bitmap_free(ms->imap, bit, &ms->imap_hint);
+    return 0;
+  }
+  return (int)bit;
+}
+
+/* Releases an inode number and its direct zones. Only meant to undo a failed
+ * creation. */
+static void minix_inode_free(minix_super_t *ms, int ino,
+                             minix_disk_inode_t *di) {
+  int i;
+
+  if (FILE_TYPE(di->i_mode) == FILE_TYPE_REGULAR ||
+      FILE_TYPE(di->i_mode) == FILE_TYPE_DIRECTORY) {
+    for (i = 0; i < MINIX_DIRECT_ZONES; i ++)
+      if (di->i_zones[i] != 0)
+        minix_zone_free(ms, di->i_zones[i]);
+  }
+  minix_bitmap_free(ms->imap, ino, &ms->imap_hint);
+  minix_bitmap_sync(ms, ms->imap, MINIX_IMAP_BLOCK, ino);
+}
+
+/* Translates a block of a file into its zone. Holes are 0, unless create is
+ * set, in which case the missing zones get allocated and 0 means failure.
+ * Allocating may change di->i_zones, so the inode needs to be written
+ * afterwards. */
+static u32 minix_bmap(minix_super_t *ms, minix_disk_inode_t *di, u32 fblock,
+                      int create) {
+  bcache_buf_t *b;
+  u16 *slot, *entries;
+  u32 zone, next, idx[2];
+  int levels, i;
+
+  if (fblock < MINIX_DIRECT_ZONES) {
+    slot = &(di->i_zones[fblock]);
+    levels = 0;
+  }
+  else if ((fblock -= MINIX_DIRECT_ZONES) < MINIX_ZONES_PER_BLOCK) {
+    slot = &(di->i_zones[MINIX_IND_ZONE]);
+    idx[0] = fblock;
+    levels = 1;
+  }
+  else if ((fblock -= MINIX_ZONES_PER_BLOCK) <
+           MINIX_ZONES_PER_BLOCK * MINIX_ZONES_PER_BLOCK) {
+    slot = &(di->i_zones[MINIX_DIND_ZONE]);
+    idx[0] = fblock / MINIX_ZONES_PER_BLOCK;
+    idx[1] = fblock % MINIX_ZONES_PER_BLOCK;
+    levels = 2;
+  }
+  else {
+    set_errno(E_LIMIT);
+    return 0;
+  }
+
+  zone = *slot;
+  if (zone == 0) {
+    if (!create)
+      return 0;
+    zone = minix_zone_alloc(ms);
+    if (zone == 0)
+      return 0;
+    *slot = zone;
+  }
+
+  /* Walk down the indirect zones. */
+  for (i = 0; i < levels; i ++) {
+    b = bcache_read(ms->devid, zone);
+    if (b == NULL)
+      return 0;
+    entries = (u16 *)b->data;
+    next = entries[idx[i]];
+    if (next == 0 && create) {
+      next = minix_zone_alloc(ms);
+      if (next != 0) {
+        entries[idx[i]] = next;
+        if (bcache_write(b) == -1) {
+          minix_zone_free(ms, next);
+          next = 0;
+        }
+      }
+    }
+    bcache_release(b);
+    if (next == 0)
+      return 0;
+    zone = next;
+  }
+
+  return zone;
+}
+
+/* Compares a name on disk, padded with zeros but not terminated if it's
+ * namelen long, with a string. */
+static int minix_name_eq(minix_super_t *ms, char *dname, char *name) {
+  u32 i;
+
+  for (i = 0; i < ms->namelen; i ++) {
+    if (dname[i] != name[i])
+      return 0;
+    if (name[i] == '\0')
+      return 1;
+  }
+  return name[i] == '\0';
+}
+
+/* Looks for name in a directory and returns its inode number. */
+static int minix_dir_find(minix_super_t *ms, minix_disk_inode_t *dir,
+                          char *name) {
+  bcache_buf_t *b;
+  u32 pos, off, zone;
+  u16 ino;
+
+  for (pos = 0; pos < dir->i_size; pos += MINIX_BLOCK_SIZE) {
+    zone = minix_bmap(ms, dir, pos / MINIX_BLOCK_SIZE, 0);
+    if (zone == 0)
+      continue;
+    b = bcache_read(ms->devid, zone);
+    if (b == NULL)
+      return -1;
+    for (off = 0;
+         off < MINIX_BLOCK_SIZE && pos + off < dir->i_size;
+         off += ms->dirent_size) {
+      ino = *((u16 *)(b->data + off));
+      if (ino != 0 && minix_name_eq(ms, b->data + off + sizeof(u16), name)) {
+        bcache_release(b);
+        return ino;
+      }
+    }
+    bcache_release(b);
+  }
+
+  set_errno(E_NOENT);
+  return -1;
+}
+
+/* Adds an entry to a directory, reusing the first free slot if any. The
+ * directory's inode is written. */
+static int minix_dir_add(minix_super_t *ms, int dir_ino,
+                         minix_disk_inode_t *dir, char *name, int ino) {
+  bcache_buf_t *b;
+  u32 pos, zone;
+  char *de;
+
+  /* Find a free slot. pos ends up at the end of the directory if none. */
+  for (pos = 0; pos < dir->i_size; pos += ms->dirent_size) {
+    zone = minix_bmap(ms, dir, pos / MINIX_BLOCK_SIZE, 0);
+    if (zone == 0)
+      continue;
+    b = bcache_read(ms->devid, zone);
+    if (b == NULL)
+      return -1;
+    if (*((u16 *)(b->data + pos % MINIX_BLOCK_SIZE)) == 0) {
+      bcache_release(b);
+      break;
+    }
+    bcache_release(b);
+  }
+
+  zone = minix_bmap(ms, dir, pos / MINIX_BLOCK_SIZE, 1);
+  if (zone == 0)
+    return -1;
+  b = bcache_read(ms->devid, zone);
+  if (b == NULL)
+    return -1;
+
+  de = b->data + pos % MINIX_BLOCK_SIZE;
+  memset(de, 0, ms->dirent_size);
+  *((u16 *)de) = (u16)ino;
+  memcpy(de + sizeof(u16), name, strlen(name));
+  if (bcache_write(b) == -1) {
+    bcache_release(b);
+    return -1;
+  }
+  bcache_release(b);
+
+  if (pos >= dir->i_size)
+    dir->i_size = pos + ms->dirent_size;
+
+  return minix_inode_io(ms, dir_ino, dir, 1);
+}
+
+/*****************************************************************************/
+/* files *********************************************************************/
+/*****************************************************************************/
+
+/* Queues the reads of a file's blocks from first to last, at most
+ * MINIX_READ_AHEAD of them, so the disk gets a few large requests instead of
+ * one per block. Returns the last block queued. */
+static u32 minix_read_ahead(minix_super_t *ms, minix_disk_inode_t *di,
+                            u32 first, u32 last) {
+  u32 blocks[MINIX_READ_AHEAD];
+  u32 i;
+
+  if (last - first >= MINIX_READ_AHEAD)
+    last = first + MINIX_READ_AHEAD - 1;
+  for (i = first; i <= last; i ++)
+    blocks[i - first] = minix_bmap(ms, di, i, 0);
+  bcache_prefetch(ms->devid, blocks, last - first + 1);
+
+  return last;
+}
+
+/* Read _count_ bytes from _file_ starting at _off_ into _buf_. */
+static ssize_t minix_file_read(vfs_file_t *file, char *buf, size_t count) {
+  minix_super_t *ms;
+  minix_inode_t *mi;
+  bcache_buf_t *b;
+  u32 fblock, last, queued, zone;
+  size_t done, n, boff;
+  off_t off;
+
+  ms = (minix_super_t *)(file->ro.f_vnode->ro.v_sb->private_data);
+  mi = (minix_inode_t *)(file->ro.f_vnode->private_data);
+  off = file->f_pos;
+
+  /* EOF */
+  if (off >= mi->di.i_size)
+    return 0;
+
+  /* Put limits. */
+  if (off + count > mi->di.i_size)
+    count = mi->di.i_size - off;
+
+  last = (off + count - 1) / MINIX_BLOCK_SIZE;
+  queued = 0;
+
+  for (done = 0; done < count; done += n) {
+    fblock = (off + done) / MINIX_BLOCK_SIZE;
+    boff = (off + done) % MINIX_BLOCK_SIZE;
+    n = MINIX_BLOCK_SIZE - boff;
+    if (n > count - done)
+      n = count - done;
+
+    /* Single block reads don't need read ahead. */
+    if (fblock < last && (done == 0 || fblock > queued))
+      queued = minix_read_ahead(ms, &(mi->di), fblock, last);
+
+    zone = minix_bmap(ms, &(mi->di), fblock, 0);
+    if (zone == 0) {
+      /* A hole. */
+      memset(buf + done, 0, n);
+      continue;
+    }
+
+    b = bcache_read(ms->devid, zone);
+    if (b == NULL) {
+      if (done == 0)
+        return -1;
+      break;
+    }
+    memcpy(buf + done, b->data + boff, n);
+    bcache_release(b);
+  }
+
+  file->f_pos += done;
+  return (ssize_t)done;
+}
+
+/* Write _count_ bytes into _file_ starting at _off_ from _buf_. */
+static ssize_t minix_file_write(vfs_file_t *file, char *buf, size_t count) {
+  minix_super_t *ms;
+  minix_inode_t *mi;
+  bcache_buf_t *b;
+  size_t done, n, boff;
+  u32 zone;
+  off_t off;
+  int err;
+
+  ms = (minix_super_t *)(file->ro.f_vnode->ro.v_sb->private_data);
+  mi = (minix_inode_t *)(file->ro.f_vnode->private_data);
+  off = file->f_pos;
+
+  if (off >= ms->ds.s_max_size) {
+    set_errno(E_NOSPACE);
+    return -1;
+  }
+  if (off + count > ms->ds.s_max_size)
+    count = ms->ds.s_max_size - off;
+
+  err = 0;
+  for (done = 0; done < count; done += n) {
+    boff = (off + done) % MINIX_BLOCK_SIZE;
+    n = MINIX_BLOCK_SIZE - boff;
+    if (n > count - done)
+      n = count - done;
+
+    zone = minix_bmap(ms, &(mi->di), (off + done) / MINIX_BLOCK_SIZE, 1);
+    if (zone == 0) {
+      err = get_errno();
+      break;
+    }
+
+    /* No need to read blocks we'll overwrite completely. */
+    if (n == MINIX_BLOCK_SIZE)
+      b = bcache_get(ms->devid, zone);
+    else
+      b = bcache_read(ms->devid, zone);
+    if (b == NULL) {
+      err = get_errno();
+      break;
+    }
+
+    memcpy(b->data + boff, buf + done, n);
+    if (bcache_write(b) == -1) {
+      err = get_errno();
+      bcache_release(b);
+      break;
+    }
+    bcache_release(b);
+  }
+
+  if (off + done > mi->di.i_size) {
+    mi->di.i_size = off + done;
+    file->ro.f_vnode->v_size = mi->di.i_size;
+  }
+
+  /* Save the size and the zones allocated. */
+  if (minix_inode_io(ms, file->ro.f_vnode->v_no, &(mi->di), 1) == -1 &&
+      err == 0)
+    err = get_errno();
+
+  if (done == 0 && err != 0) {
+    set_errno(err);
+    return -1;
+  }
+
+  file->f_pos += done;
+  return (ssize_t)done;
+}
+
+/* Reads the next name in a directory. f_pos is the offset of the next entry
+ * in the directory. */
+static char * minix_file_readdir(vfs_file_t *file) {
+  minix_super_t *ms;
+  minix_inode_t *mi;
+  bcache_buf_t *b;
+  u32 zone;
+  u16 ino;
+
+  ms = (minix_super_t *)(file->ro.f_vnode->ro.v_sb->private_data);
+  mi = (minix_inode_t *)(file->ro.f_vnode->private_data);
+
+  while (file->f_pos < mi->di.i_size) {
+    zone = minix_bmap(ms, &(mi->di), file->f_pos / MINIX_BLOCK_SIZE, 0);
+    if (zone == 0) {
+      /* Skip the hole. */
+      file->f_pos += MINIX_BLOCK_SIZE - file->f_pos % MINIX_BLOCK_SIZE;
+      continue;
+    }
+
+    b = bcache_read(ms->devid, zone);
+    if (b == NULL)
+      return NULL;
+    ino = *((u16 *)(b->data + file->f_pos % MINIX_BLOCK_SIZE));
+    if (ino != 0) {
+      memcpy(mi->name,
+             b->data + file->f_pos % MINIX_BLOCK_SIZE + sizeof(u16),
+             ms->namelen);
+      mi->name[ms->namelen] = '\0';
+    }
+    bcache_release(b);
+
+    file->f_pos += ms->dirent_size;
+    if (ino != 0)
+      return mi->name;
+  }
+
+  return NULL;
+}
+
+/*****************************************************************************/
+/* inodes ********************************************************************/
+/*****************************************************************************/
+
+/* Looks for a dentry with the given dentry name. */
+static int minix_ino_lookup(vfs_vnode_t *dir, vfs_dentry_t *dentry) {
+  minix_super_t *ms;
+  minix_inode_t *mi;
+  int ino;
+
+  ms = (minix_super_t *)(dir->ro.v_sb->private_data);
+  mi = (minix_inode_t *)(dir->private_data);
+
+  ino = minix_dir_find(ms, &(mi->di), dentry->d_name);
+  if (ino == -1)
+    return -1;
+
+  dentry->d_vno = ino;
+  return 0;
+}
+
+/* Fills in the first zone of a new directory with its "." and ".."
+ * entries. */
+static int minix_dir_init(minix_super_t *ms, int ino, minix_disk_inode_t *di,
+                          int parent_ino) {
+  bcache_buf_t *b;
+  u32 zone;
+  int r;
+
+  zone = minix_bmap(ms, di, 0, 1);
+  if (zone == 0)
+    return -1;
+  b = bcache_read(ms->devid, zone);
+  if (b == NULL)
+    return -1;
+
+  *((u16 *)b->data) = (u16)ino;
+  strcpy(b->data + sizeof(u16), ".");
+  *((u16 *)(b->data + ms->dirent_size)) = (u16)parent_ino;
+  strcpy(b->data + ms->dirent_size + sizeof(u16), "..");
+  r = bcache_write(b);
+  bcache_release(b);
+
+  di->i_size = 2 * ms->dirent_size;
+  return r;
+}
+
+/* Creates any kind of node in dir. */
+static int minix_ino_mknod(vfs_vnode_t *dir,
+                           vfs_dentry_t *dentry,
+                           mode_t mode,
+                           dev_t devid) {
+  minix_super_t *ms;
+  minix_inode_t *mdir;
+  minix_disk_inode_t di;
+  int ino, err, is_dir, r;
+
+  ms = (minix_super_t *)(dir->ro.v_sb->private_data);
+  mdir = (minix_inode_t *)(dir->private_data);
+  is_dir = FILE_TYPE(mode) == FILE_TYPE_DIRECTORY;
+
+  if (strlen(dentry->d_name) > ms->namelen) {
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  ino = minix_inode_alloc(ms);
+  if (ino == 0)
+    return -1;
+
+  memset(&di, 0, sizeof(minix_disk_inode_t));
+  di.i_mode = mode;
+  di.i_nlinks = 1;
+  if (FILE_TYPE(mode) == FILE_TYPE_CHAR_DEV ||
+      FILE_TYPE(mode) == FILE_TYPE_BLOCK_DEV)
+    di.i_zones[0] = devid;
+
+  r = 0;
+  if (is_dir) {
+    /* Linked from "." too. */
+    di.i_nlinks = 2;
+    r = minix_dir_init(ms, ino, &di, dir->v_no);
+  }
+
+  if (r != -1)
+    r = minix_inode_io(ms, ino, &di, 1);
+
+  if (r != -1) {
+    /* The new ".." links the parent. */
+    if (is_dir)
+      mdir->di.i_nlinks ++;
+    r = minix_dir_add(ms, dir->v_no, &(mdir->di), dentry->d_name, ino);
+    if (r == -1 && is_dir)
+      mdir->di.i_nlinks --;
+  }
+
+  if (r == -1) {
+    err = get_errno();
+    minix_inode_free(ms, ino, &di);
+    set_errno(err);
+    return -1;
+  }
+
+  dir->v_size = mdir->di.i_size;
+  dentry->d_vno = ino;
+
+  return 0;
+}
+
+/* Creates a regular file in dir. */
+static int minix_ino_create(vfs_vnode_t *dir,
+                            vfs_dentry_t *dentry,
+                            mode_t mode) {
+  return minix_ino_mknod(dir, dentry, mode, FILE_NODEV);
+}
+
+/* Creates a new directory in dir. */
+static int minix_ino_mkdir(vfs_vnode_t *dir,
+                           vfs_dentry_t *dentry,
+                           mode_t mode) {
+  return minix_ino_mknod(dir, dentry, mode, FILE_NODEV);
+}
+
+/*****************************************************************************/
+/* superblock ****************************************************************/
+/*****************************************************************************/
+
+/* Reads a vnode from the inode table. */
+static int minix_sb_read_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
+  minix_super_t *ms;
+  minix_inode_t *mi;
+  int err;
+
+  ms = (minix_super_t *)(sb->private_data);
+
+  mi = (minix_inode_t *)kalloc(sizeof(minix_inode_t));
+  if (mi == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+
+  if (minix_inode_io(ms, node->v_no, &(mi->di), 0) == -1) {
+    err = get_errno();
+    kfree(mi);
+    set_errno(err);
+    return -1;
+  }
+
+  /* Free inode. */
+  if (mi->di.i_nlinks == 0) {
+    kfree(mi);
+    set_errno(E_NOENT);
+    return -1;
+  }
+
+  node->v_mode = mi->di.i_mode;
+  node->v_size = mi->di.i_size;
+  node->v_dev = FILE_NODEV;
+  node->private_data = mi;
+
+  /* Set the operations based on file type. */
+  switch (FILE_TYPE(node->v_mode)) {
+    case FILE_TYPE_DIRECTORY:
+      node->v_iops.lookup = minix_ino_lookup;
+      node->v_iops.create = minix_ino_create;
+      node->v_iops.mkdir = minix_ino_mkdir;
+      node->v_iops.mknod = minix_ino_mknod;
+      node->v_fops.readdir = minix_file_readdir;
+      break;
+    case FILE_TYPE_REGULAR:
+      node->v_fops.read = minix_file_read;
+      node->v_fops.write = minix_file_write;
+      /* The default lseek works for us. */
+      break;
+    case FILE_TYPE_CHAR_DEV:
+    case FILE_TYPE_BLOCK_DEV:
+      node->v_dev = mi->di.i_zones[0];
+      break;
+    case FILE_TYPE_FIFO:
+    case FILE_TYPE_SYMLINK:
+    case FILE_TYPE_SOCKET:
+    case FILE_TYPE_WHT:
+      break;
+  }
+
+  return 0;
+}
+
+/* Releases the in memory inode. */
+static int minix_sb_destroy_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
+  if (node->private_data != NULL)
+    kfree(node->private_data);
+  node->private_data = NULL;
+  return 0;
+}
+
+/* Saves the vnode metadata in its inode. */
+static int minix_sb_write_vnode(vfs_sb_t *sb, vfs_vnode_t *node) {
+  minix_inode_t *mi;
+
+  mi = (minix_inode_t *)(node->private_data);
+  mi->di.i_mode = node->v_mode;
+
+  return minix_inode_io((minix_super_t *)(sb->private_data), node->v_no,
+                        &(mi->di), 1);
+}
+
+/* Used to notify the superblock it's being mounted. */
+static int minix_sb_mount(vfs_sb_t *sb) {
+  sb->sb_root_vno = MINIX_ROOT_INO;
+  return 0;
+}
+
+/* Used to nofity the superblock is being unmounted. */
+static int minix_sb_unmount(vfs_sb_t *sb) {
+  return bcache_sync(sb->ro.sb_devid);
+}
+
+/* Writes back the dirty buffers of the device. */
+static int minix_sb_sync(vfs_sb_t *sb) {
+  return bcache_sync(sb->ro.sb_devid);
+}
+
+/*****************************************************************************/
+/* fs_type *******************************************************************/
+/*****************************************************************************/
+
+/* Loads a bitmap into memory. */
+static u32 * minix_bitmap_load(dev_t devid, u32 first_block, u32 blocks) {
+  bcache_buf_t *b;
+  char *map;
+  u32 i;
+
+  map = (char *)kalloc(blocks * MINIX_BLOCK_SIZE);
+  if (map == NULL) {
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+
+  for (i = 0; i < blocks; i ++) {
+    b = bcache_read(devid, first_block + i);
+    if (b == NULL) {
+      kfree(map);
+      return NULL;
+    }
+    memcpy(map + i * MINIX_BLOCK_SIZE, b->data, MINIX_BLOCK_SIZE);
+    bcache_release(b);
+  }
+
+  return (u32 *)map;
+}
+
+/* Checks whether a buffer holds a superblock we can handle. */
+static int minix_super_check(minix_disk_super_t *ds) {
+  if (ds->s_magic != MINIX_SUPER_MAGIC && ds->s_magic != MINIX_SUPER_MAGIC2)
+    return -1;
+  /* Only 1K zones. */
+  if (ds->s_log_zone_size != 0)
+    return -1;
+  return 0;
+}
+
+/* Builds the in memory superblock, bitmaps included. */
+static minix_super_t * minix_super_load(dev_t devid) {
+  minix_super_t *ms;
+  bcache_buf_t *b;
+
+  ms = (minix_super_t *)kalloc(sizeof(minix_super_t));
+  if (ms == NULL) {
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+
+  b = bcache_read(devid, MINIX_SUPER_BLOCK);
+  if (b == NULL) {
+    kfree(ms);
+    return NULL;
+  }
+  memcpy(&(ms->ds), b->data, sizeof(minix_disk_super_t));
+  bcache_release(b);
+
+  if (minix_super_check(&(ms->ds)) == -1) {
+    kfree(ms);
+    set_errno(E_INVFS);
+    return NULL;
+  }
+
+  ms->devid = devid;
+  ms->namelen = ms->ds.s_magic == MINIX_SUPER_MAGIC2 ? 30 : 14;
+  ms->dirent_size = ms->namelen + sizeof(u16);
+  ms->itable = MINIX_IMAP_BLOCK + ms->ds.s_imap_blocks + ms->ds.s_zmap_blocks;
+
+  ms->imap_bits = ms->ds.s_ninodes + 1;
+  ms->imap_hint = 0;
+  ms->imap = minix_bitmap_load(devid, MINIX_IMAP_BLOCK, ms->ds.s_imap_blocks);
+  if (ms->imap == NULL) {
+    kfree(ms);
+    return NULL;
+  }
+
+  ms->zmap_bits = ms->ds.s_nzones - ms->ds.s_firstdatazone + 1;
+  ms->zmap_hint = 0;
+  ms->zmap = minix_bitmap_load(devid,
+                               MINIX_IMAP_BLOCK + ms->ds.s_imap_blocks,
+                               ms->ds.s_zmap_blocks);
+  if (ms->zmap == NULL) {
+    kfree(ms->imap);
+    kfree(ms);
+    return NULL;
+  }
+
+  return ms;
+}
+
+static int minix_ft_get_sb(vfs_sb_t *sb) {
+  minix_super_t *ms;
+
+  if (dev_blk_open(sb->ro.sb_devid, DEV_MODE_O_READ | DEV_MODE_O_WRITE) == -1)
+    return -1;
+
+  ms = minix_super_load(sb->ro.sb_devid);
+  if (ms == NULL) {
+    dev_blk_release(sb->ro.sb_devid);
+    return -1;
+  }
+
+  sb->sb_blocksize = MINIX_BLOCK_SIZE;
+  sb->sb_blocks = ms->ds.s_nzones;
+  sb->sb_max_bytes = ms->ds.s_max_size;
+  sb->private_data = ms;
+
+  sb->sb_ops.destroy_vnode = minix_sb_destroy_vnode;
+  sb->sb_ops.read_vnode = minix_sb_read_vnode;
+  sb->sb_ops.write_vnode = minix_sb_write_vnode;
+  sb->sb_ops.mount = minix_sb_mount;
+  sb->sb_ops.unmount = minix_sb_unmount;
+  sb->sb_ops.sync = minix_sb_sync;
+
+  return 0;
+}
+
+static int minix_ft_kill_sb(vfs_sb_t *sb) {
+  minix_super_t *ms;
+
+  ms = (minix_super_t *)(sb->private_data);
+  if (ms == NULL)
+    return 0;
+
+  kfree(ms->imap);
+  kfree(ms->zmap);
+  kfree(ms);
+  sb->private_data = NULL;
+
+  bcache_sync(sb->ro.sb_devid);
+  bcache_invalidate(sb->ro.sb_devid);
+  dev_blk_release(sb->ro.sb_devid);
+
+  return 0;
+}
+
+static int minix_config_fs_type(vfs_fs_type_t *ft) {
+  ft->ft_ops.ft_get_sb = minix_ft_get_sb;
+  ft->ft_ops.ft_kill_sb = minix_ft_kill_sb;
+  return 0;
+}
+
+/*****************************************************************************/
+/* Modules API ***************************************************************/
+/*****************************************************************************/
+
+int minix_init() {
+  return vfs_fs_type_register(MINIX_NAME, minix_config_fs_type);
+}
@@ -9,5 +9,6 @@
 int rootfs_init() {
   return memfs_create(ROOTFS_NAME, ROOTFS_DEVID, MEMFS_FLAGS_ALLOW_FILES |
                                                  MEMFS_FLAGS_ALLOW_DIRS  |
-                                                 MEMFS_FLAGS_ALLOW_NODES);
+                                                 MEMFS_FLAGS_ALLOW_NODES,
+                      ROOTFS_MAX_BYTES, ROOTFS_MAX_INODES);
 }
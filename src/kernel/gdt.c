@@ -1,9 +1,10 @@
 #include <gdt.h>
 #include <mem.h>
 #include <string.h>
+#include <smp.h>
 
 /* Our GDT table will be statically stored. */
-#define GDT_MAX_ENTRIES           32  /* This is more than enough for us. */
+#define GDT_MAX_ENTRIES           64  /* This is more than enough for us. */
 
 
 #define GDT_KERNEL_CODE_OFF       ( GDT_KERNEL_CODE_SEGMENT / \
@@ -11,6 +12,7 @@
 #define GDT_KERNEL_DATA_OFF       ( GDT_KERNEL_DATA_SEGMENT / \
                                     sizeof(gdt_descriptor_t) )
 #define GDT_TSS_OFF               ( GDT_TSS / sizeof(gdt_descriptor_t) )
+#define GDT_TSS_SELECTOR(cpu)     ( GDT_TSS + (cpu) * sizeof(gdt_descriptor_t) )
 
 /* This will be provided by gdt.asm. */
 extern void gdt_load_gdtr(void *);
@@ -22,7 +24,7 @@ extern void gdt_load_ltr(u16);
  * when running code in PL 3 the architecture will use the current task's
  * state segment (TSS) to do the stack switch. There is no other way around
  * this so we'll have to deal with it. So, for the architecture, there will
- * be only ONE task and everything will run in its context. */
+ * be only ONE task per processor and everything will run in its context. */
 typedef struct {
   u16 prev_tss;
   u16 reserved_0;
@@ -69,7 +71,13 @@ typedef struct {
  * Our vars                                                                  *
  *****************************************************************************/
 static gdt_descriptor_t gdt[GDT_MAX_ENTRIES];
-static gdt_tss_t gdt_tss;
+static gdt_tss_t gdt_tss[SMP_MAX_CPUS];
+
+/* What lgdt takes. */
+static struct {
+  u16 limit;
+  gdt_descriptor_t *base_address;
+} __attribute__((__packed__)) gdt_table_descriptor;
 
 /*****************************************************************************
  * Our funcs                                                                 *
@@ -118,20 +126,17 @@ u32 gdt_limit(gdt_descriptor_t d) {
 
 /* Just initializes the GDT. Only called from mem_setup() in a very early stage
  * during the kernel load process. */
-void gdt_setup(u32 mem_total_frames) {
+void gdt_setup() {
   int i;
 
-  struct {
-    u16 limit;
-    gdt_descriptor_t *base_address;
-  } __attribute__((__packed__)) gdt_table_descriptor;
-
-
   for (i = 0; i < GDT_MAX_ENTRIES; gdt[i ++] = GDT_NULL_ENTRY);
 
+  /* The kernel segments span the whole 4 GB, not just the RAM: devices like
+   * the APICs are memory mapped at the top. */
+
   /* Set kernel code segment. */
   gdt[GDT_KERNEL_CODE_OFF] = gdt_descriptor((void *)0x00000000,
-                                            mem_total_frames,
+                                            GDT_LIMIT_4G,
                                             GDT_GRANULARITY_4K           |
                                             GDT_OP_SIZE_32               |
                                             GDT_PRESENT                  |
@@ -143,7 +148,7 @@ void gdt_setup(u32 mem_total_frames) {
 
   /* Set kernel data segment. */
   gdt[GDT_KERNEL_DATA_OFF] = gdt_descriptor((void *)0x00000000,
-                                            mem_total_frames,
+                                            GDT_LIMIT_4G,
                                             GDT_GRANULARITY_4K           |
                                             GDT_OP_SIZE_32               |
                                             GDT_PRESENT                  |
@@ -153,39 +158,45 @@ void gdt_setup(u32 mem_total_frames) {
                                             GDT_DATA_READ_WRITE          |
                                             GDT_DATA_EXPAND_UP);
 
-  /* We will only have a single TSS and only a couple of fields should be used
-   * by the architecture in certain situations. Basically we need it to handle
-   * stack switches when interrupts happen in user mode. Probably I'm wrong
-   * but I think we have no need of keeping a separated kernel stack for each
-   * process if we carefully design the system calls and interrupts handlers
-   * in a way that a task switch never occur when a system call is being
-   * executed unless the system call itself explicitly calls for it, in which
-   * case it should have prepare everything so when the process is scheduled
-   * to run it needs the former stack no more. With that thought in mind, I'm
-   * setting a hardcoded kernel stack pointer here, which means everytime we
-   * come from userspace the stack will end up at the same location and thus
-   * will replace the previous contents it held. */
-  memset(&gdt_tss, 0, sizeof(gdt_tss_t));
-  /* We're setting the read-only fields we need, only those. */
-  gdt_tss.ss0 = GDT_SEGMENT_SELECTOR(GDT_KERNEL_DATA_SEGMENT, GDT_RPL_KERNEL);
-  gdt_tss.esp0 = MEM_KERNEL_ISTACK_TOP;
-  gdt_tss.iomap = sizeof(gdt_tss_t);
-  gdt[GDT_TSS_OFF] = gdt_descriptor(&gdt_tss,
-                                    sizeof(gdt_tss_t),
-                                    GDT_GRANULARITY_1B           |
-                                    GDT_PRESENT                  |
-                                    GDT_DPL_KERNEL               |
-                                    GDT_DESC_TYPE_SYSTEM         |
-                                    GDT_SYSTEM_TSS_32);
+  /* We will only have a single TSS per processor and only a couple of fields
+   * should be used by the architecture in certain situations. Basically we
+   * need it to handle stack switches when interrupts happen in user mode.
+   * Each process has its own kernel stack, so the scheduler updates esp0
+   * through gdt_set_kernel_stack() every time it switches processes. Until
+   * then, the interrupts stack is used. The TSSs of every processor go right
+   * after the kernel segments, so smp_cpu_id() can tell them apart. */
+  memset(gdt_tss, 0, SMP_MAX_CPUS * sizeof(gdt_tss_t));
+  for (i = 0; i < SMP_MAX_CPUS; i ++) {
+    /* We're setting the read-only fields we need, only those. */
+    gdt_tss[i].ss0 = GDT_SEGMENT_SELECTOR(GDT_KERNEL_DATA_SEGMENT,
+                                          GDT_RPL_KERNEL);
+    gdt_tss[i].esp0 = MEM_KERNEL_ISTACK_TOP;
+    gdt_tss[i].iomap = sizeof(gdt_tss_t);
+    gdt[GDT_TSS_OFF + i] = gdt_descriptor(gdt_tss + i,
+                                          sizeof(gdt_tss_t),
+                                          GDT_GRANULARITY_1B           |
+                                          GDT_PRESENT                  |
+                                          GDT_DPL_KERNEL               |
+                                          GDT_DESC_TYPE_SYSTEM         |
+                                          GDT_SYSTEM_TSS_32);
+  }
 
   /* Make the architecture use the new GDT. */
   gdt_table_descriptor.limit = GDT_MAX_ENTRIES * sizeof(gdt_descriptor_t) - 1;
   gdt_table_descriptor.base_address = gdt;
 
+  gdt_load_cpu(0);
+}
+
+void gdt_load_cpu(int cpu) {
   /* Load the GDTR. */
   gdt_load_gdtr(&gdt_table_descriptor);
   /* Load the LTR. */
-  gdt_load_ltr(GDT_SEGMENT_SELECTOR(GDT_TSS, GDT_RPL_KERNEL));
+  gdt_load_ltr(GDT_SEGMENT_SELECTOR(GDT_TSS_SELECTOR(cpu), GDT_RPL_KERNEL));
+}
+
+void gdt_set_kernel_stack(void *esp0) {
+  gdt_tss[smp_cpu_id()].esp0 = (u32)esp0;
 }
 
 gdt_selector_t gdt_alloc(void * base, u32 limit, u64 flags) {
@@ -4,6 +4,24 @@
 global hw_hlt
 global hw_cli
 global hw_sti
+global hw_sti_hlt
+global hw_bsf
+global hw_bsr
+global hw_rdtsc
+global hw_save_flags
+global hw_restore_flags
+global hw_cpuid
+global hw_wrmsr
+global hw_str
+global hw_pause
+global hw_get_cr0
+global hw_set_cr0
+global hw_get_cr2
+global hw_get_cr3
+global hw_set_cr3
+global hw_get_cr4
+global hw_set_cr4
+global hw_invlpg
 
 ; Invoke hlt.
 hw_hlt:
@@ -19,3 +37,116 @@ hw_sti:
 hw_cli:
   cli
   ret
+
+; Enable interrupts and halt. sti delays the interrupts until the next
+; instruction is done, so no interrupt can sneak in between both of them.
+hw_sti_hlt:
+  sti
+  hlt
+  ret
+
+; Return EFLAGS.
+hw_save_flags:
+  pushfd
+  pop eax
+  ret
+
+; Set EFLAGS to the argument.
+hw_restore_flags:
+  push dword [esp + 4]
+  popfd
+  ret
+
+; Bit scan forward. Returns the index of the lowest bit set in the argument,
+; the result is undefined if there's none.
+hw_bsf:
+  bsf eax, [esp + 4]
+  ret
+
+; Bit scan reverse. Returns the index of the highest bit set in the argument,
+; the result is undefined if there's none.
+hw_bsr:
+  bsr eax, [esp + 4]
+  ret
+
+; Read the time stamp counter. It's left in edx:eax, which is where a u64
+; is returned.
+hw_rdtsc:
+  rdtsc
+  ret
+
+; Execute cpuid for the leaf in the first argument and store eax, ebx, ecx and
+; edx, in that order, in the array the second one points to. ebx is
+; callee-saved.
+hw_cpuid:
+  push ebx
+  push edi
+  mov eax, [esp + 12]
+  mov edi, [esp + 16]
+  cpuid
+  mov [edi], eax
+  mov [edi + 4], ebx
+  mov [edi + 8], ecx
+  mov [edi + 12], edx
+  pop edi
+  pop ebx
+  ret
+
+; Write the u64 in the second argument to the model specific register in the
+; first one. wrmsr takes the register in ecx and the value in edx:eax.
+hw_wrmsr:
+  mov ecx, [esp + 4]
+  mov eax, [esp + 8]
+  mov edx, [esp + 12]
+  wrmsr
+  ret
+
+; Return the task register, the selector of the TSS in use.
+hw_str:
+  xor eax, eax
+  str ax
+  ret
+
+; Tell the CPU we're spinning on a lock, it saves power and leaves the
+; pipeline alone when the lock is released. It's a rep nop to older CPUs.
+hw_pause:
+  pause
+  ret
+
+; Control registers. Setting cr3 flushes the TLB.
+hw_get_cr0:
+  mov eax, cr0
+  ret
+
+hw_set_cr0:
+  mov eax, [esp + 4]
+  mov cr0, eax
+  ret
+
+hw_get_cr2:
+  mov eax, cr2
+  ret
+
+hw_get_cr3:
+  mov eax, cr3
+  ret
+
+hw_set_cr3:
+  mov eax, [esp + 4]
+  mov cr3, eax
+  ret
+
+hw_get_cr4:
+  mov eax, cr4
+  ret
+
+hw_set_cr4:
+  mov eax, [esp + 4]
+  mov cr4, eax
+  ret
+
+; Drop the TLB entry of the page holding the address in the argument.
+hw_invlpg:
+  mov eax, [esp + 4]
+  invlpg [eax]
+  ret
@@ -0,0 +1,92 @@
+/* Local APIC and I/O APIC.
+ *
+ * The 8259 PICs are slow to talk to (every EOI is a port write, two for the
+ * slave's lines) and they only know about one processor. Every CPU since the
+ * Pentium has a local APIC instead, memory mapped at 0xfee00000, which takes
+ * interrupts for its processor, and the chipset has one or more I/O APICs
+ * where the device lines end up and which send each interrupt to the local
+ * APIC of choice.
+ *
+ * Where they are is told by the ACPI tables: the MADT lists the local APIC
+ * address, every processor's local APIC, the I/O APICs and the ISA IRQs that
+ * aren't wired to the I/O APIC input of the same number (the PIT is usually
+ * on input 2). If there's no MADT, or no APIC, the PICs stay in charge and
+ * nothing changes.
+ *
+ * Once apic_init() succeeds the PICs are masked for good and the ISA IRQs
+ * come through the I/O APIC with the same vectors they had (see pic.h), so
+ * the drivers don't notice. pic_mask_dev(), pic_unmask_dev() and
+ * pic_send_eoi() forward here, and the EOI is a single write to the local
+ * APIC.
+ *
+ * The local APIC also has a timer. apic_timer_init() calibrates it against
+ * the PIT and makes it the system tick: the PIT is left alone and the timer
+ * is armed in one-shot mode, or in TSC-deadline mode if the CPU has it, for
+ * the next tick every time one comes.
+ *
+ * Processors talk to each other through their local APICs with
+ * interprocessor interrupts (IPIs). That's how the BSP starts the rest (see
+ * smp.h) and how a processor tells another one to reschedule. The I/O APIC
+ * sends every device interrupt to the BSP.
+ */
+
+#ifndef __APIC_H__
+#define __APIC_H__
+
+#include <typedef.h>
+#include <interrupts.h>
+
+/* Vectors of the local APIC's own interrupts. The ISA IRQs keep theirs, from
+ * PIC_MASTER_BASE_IRQ to PIC_SLAVE_BASE_IRQ + 7. The spurious vector must
+ * have its lowest 4 bits set in old APICs. */
+#define APIC_TIMER_IRQ            0x30
+#define APIC_RESCHED_IRQ          0x31
+#define APIC_SPURIOUS_IRQ         0xff
+
+/* Limits. */
+#define APIC_MAX_IOAPICS          4
+#define APIC_ISA_IRQS             16
+
+/* Finds the APICs, masks the PICs and routes the ISA IRQs through the I/O
+ * APIC, all of them masked. Returns -1 if there are no APICs to use, in which
+ * case the PICs keep working. Must be called with interrupts disabled, after
+ * pic_init(). */
+int apic_init();
+
+/* Whether the APICs took over from the PICs. */
+int apic_enabled();
+
+/* Tells the local APIC the interrupt is over. Vectors that don't come from
+ * the APICs, like exceptions, system calls or spurious interrupts, are
+ * ignored. */
+void apic_send_eoi(itr_irq_t irq);
+
+/* Masks and unmasks the I/O APIC input the ISA IRQ with vector irq is wired
+ * to. */
+void apic_mask_irq(itr_irq_t irq);
+void apic_unmask_irq(itr_irq_t irq);
+
+/* Makes the local APIC timer the system tick, at PIT_OUTPUT_FREQUENCY.
+ * Returns -1 if the APICs aren't enabled, the PIT must keep ticking then. */
+int apic_timer_init();
+
+/* Sets up the local APIC of an application processor, timer included if
+ * the BSP's is the system tick. */
+void apic_init_cpu();
+
+/* Processors in the MADT and the local APIC ID of the i-th one. There are
+ * none if the APICs aren't enabled. */
+int apic_cpu_count();
+u8 apic_cpu_id(int i);
+
+/* Local APIC ID of the processor running this. */
+u8 apic_id();
+
+/* Sends interrupt irq to the processor with local APIC ID id. */
+void apic_send_ipi(u8 id, itr_irq_t irq);
+
+/* Wakes the processor with local APIC ID id up in real mode at addr, which
+ * must be a page below 1 MB. */
+void apic_start_cpu(u8 id, u32 addr);
+
+#endif
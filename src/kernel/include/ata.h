@@ -0,0 +1,35 @@
+/* Driver for ATA (IDE) hard disks.
+ *
+ * Both legacy channels are probed and every ATA disk found is published as a
+ * block device through dev_register_block_device(), along with its primary
+ * MBR partitions. Device numbers follow Linux: the primary channel uses
+ * DEV_IDE0_MAJOR and the secondary one DEV_IDE1_MAJOR; the master drive takes
+ * minors 0-63 and the slave 64-127, where the first minor is the whole disk
+ * and the next four are the partitions (e.g. hda3 is 3:3).
+ *
+ * Transfers are driven by IRQ 14/15. They use bus-master DMA whenever the
+ * IDE controller and the drive support it and the buffer allows it, falling
+ * back to multi-sector PIO (READ/WRITE MULTIPLE) otherwise.
+ */
+
+#ifndef __ATA_H__
+#define __ATA_H__
+
+#include <typedef.h>
+
+/* Minors. */
+#define ATA_MASTER_MINOR          0
+#define ATA_SLAVE_MINOR           64
+#define ATA_MAX_PARTITIONS        4   /* Only the MBR primary partitions. */
+
+/* ioctl requests.                                                           */
+/* Request                                   |   Arg pointer type   | in/out */
+/* ------------------------------------------|----------------------|--------*/
+#define ATA_IOCTL_GET_MODEL               1  /*     char[41]        |   out  */
+#define ATA_IOCTL_GET_DMA                 2  /*       int           |   out  */
+#define ATA_IOCTL_SET_DMA                 3  /*       int           |   in   */
+
+/* Probes the ATA channels and registers the block devices found. */
+int ata_init();
+
+#endif
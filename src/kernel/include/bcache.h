@@ -0,0 +1,122 @@
+/* Block buffer cache.
+ *
+ * Disk filesystems don't talk to block devices directly. They ask the cache
+ * for a block of a device, which hands back a buffer holding its data. The
+ * cache keeps a fixed pool of BCACHE_BUFFERS buffers of BCACHE_BLOCK_SIZE
+ * bytes. Buffers are found by (devid, block) through a hash table and, once
+ * nobody uses them, they stay in a LRU list so the least recently used one is
+ * recycled when a block not in the cache is requested.
+ *
+ * Every buffer returned by bcache_get() or bcache_read() is referenced and
+ * must be handed back with bcache_release(). A referenced buffer is never
+ * recycled, so don't hold many of them for long. The typical workflow is:
+ *
+ *    bcache_buf_t *b;
+ *    b = bcache_read(devid, block);
+ *    ... use or modify b->data ...
+ *    bcache_write(b);      (only if modified)
+ *    bcache_release(b);
+ *
+ * The actual I/O goes through the bio request queues, which lets
+ * bcache_prefetch() read lots of blocks with a few merged transfers.
+ *
+ * Writes are delayed (write-back): bcache_write() only marks the buffer dirty
+ * and links it, sorted by block, in the list of dirty buffers of its device.
+ * Dirty buffers reach the disk when
+ *  - bcache_sync() is called for their device, e.g. on unmount or when a file
+ *    opened with FILE_O_SYNC is flushed;
+ *  - the writeback thread, woken up by bcache_tick(), finds the device has
+ *    been dirty for BCACHE_DIRTY_EXPIRE ticks;
+ *  - the dirty data of all devices goes beyond BCACHE_DIRTY_MAX bytes;
+ *  - there's no clean buffer left to recycle.
+ * Since the whole device is written at once, in block order, bursts of small
+ * writes end up as a few sequential transfers.
+ */
+
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <typedef.h>
+#include <bio.h>
+
+/* Size of the cached blocks. It's the Minix block size. */
+#define BCACHE_BLOCK_SIZE         1024
+/* Buffers in the pool. */
+#define BCACHE_BUFFERS            128
+/* Hash table buckets. Must be a power of 2. */
+#define BCACHE_HASH_SIZE          64
+
+/* Dirty data allowed before writers are made to flush it. */
+#define BCACHE_DIRTY_MAX          ((BCACHE_BUFFERS / 2) * BCACHE_BLOCK_SIZE)
+/* The writeback pass runs every BCACHE_WRITEBACK_TICKS ticks and writes out
+ * devices with buffers dirty for at least BCACHE_DIRTY_EXPIRE ticks. At the
+ * PIT's 100 Hz that's every half second and three seconds. */
+#define BCACHE_WRITEBACK_TICKS    50
+#define BCACHE_DIRTY_EXPIRE       300
+
+/* Buffer flags. */
+#define BCACHE_F_VALID            0x00000001  /* data holds the block. */
+#define BCACHE_F_BUSY             0x00000002  /* I/O in progress. */
+#define BCACHE_F_DIRTY            0x00000004  /* Not written yet. */
+
+typedef struct bcache_buf bcache_buf_t;
+
+struct bcache_buf {
+  dev_t               devid;      /* Block device. */
+  u32                 block;      /* Block number in the device. */
+  int                 flags;      /* VALID, BUSY, DIRTY. */
+  int                 count;      /* References. */
+  char              * data;       /* BCACHE_BLOCK_SIZE bytes. */
+
+  /* Internal. */
+  bcache_buf_t      * hash_next;  /* Hash chain. */
+  bcache_buf_t      * lru_prev;   /* LRU list, only when count is 0. */
+  bcache_buf_t      * lru_next;
+  bcache_buf_t      * dirty_prev; /* Device's dirty list, when DIRTY. */
+  bcache_buf_t      * dirty_next;
+  bio_t               bio;        /* Request used for its I/O. */
+};
+
+/* Initializes the buffer cache. */
+int bcache_init();
+
+/* Starts the writeback thread. Needs the scheduler to be running; until
+ * then dirty buffers are only written when the cache asks for it. */
+int bcache_start_writeback();
+
+/* Gets a buffer for a block without reading it. Useful when the whole block
+ * is going to be overwritten. Its data is only meaningful if the VALID flag
+ * is set. If the block is being read it waits for it, so the read can't
+ * overwrite the caller's data. Returns NULL if every buffer is in use. */
+bcache_buf_t * bcache_get(dev_t devid, u32 block);
+
+/* Gets a buffer for a block, reading it from disk if it's not cached. Only
+ * one read of a block is issued at a time, everyone else waits for it. */
+bcache_buf_t * bcache_read(dev_t devid, u32 block);
+
+/* Marks the buffer's data as modified, and VALID. It will be written to disk
+ * later on. Only fails when the dirty data limit is reached and flushing
+ * fails. */
+int bcache_write(bcache_buf_t *buf);
+
+/* Writes all the dirty buffers of a device and waits for them, and for the
+ * ones the writeback pass started. Failures of the writeback pass are
+ * reported here too. */
+int bcache_sync(dev_t devid);
+
+/* Releases a buffer obtained with bcache_get() or bcache_read(). */
+void bcache_release(bcache_buf_t *buf);
+
+/* Starts reading the given blocks, if not cached, without waiting for them.
+ * Blocks set to 0 are skipped. Later bcache_read() calls on them will find
+ * them in the cache. */
+void bcache_prefetch(dev_t devid, u32 *blocks, u32 count);
+
+/* Forgets every unreferenced clean buffer of a device. */
+void bcache_invalidate(dev_t devid);
+
+/* Timer hook. Wakes up the writeback thread from time to time. The pass
+ * itself runs in the thread since it waits for the disks. */
+void bcache_tick();
+
+#endif
@@ -0,0 +1,88 @@
+/* Block I/O request queues.
+ *
+ * This layer sits between filesystems and block device drivers. Instead of
+ * calling the driver once per range, clients describe each transfer in a
+ * bio_t and submit it. Requests are queued per device, kept sorted by sector
+ * (a one-way elevator) and only handed to the driver when the queue gets
+ * unplugged: explicitly with bio_unplug(), implicitly by bio_wait() or when a
+ * batch of BIO_BATCH requests has been collected. At that point requests for
+ * adjacent sectors going in the same direction are merged into a single
+ * driver call of up to BIO_MAX_SECTORS sectors, so lots of small filesystem
+ * reads become a few large (DMA) transfers.
+ *
+ * Completion is reported through the bio's end_io callback, if any, once the
+ * request has been served. The typical workflow is:
+ *
+ *    bio_t bio;
+ *    bio_prepare(&bio, devid, BIO_READ, sector, count, buf, NULL, NULL);
+ *    bio_submit(&bio);
+ *    ... submit more ...
+ *    bio_wait(&bio);
+ *
+ * A submitted bio belongs to the queue until it is completed: don't touch it
+ * nor its buffer until then.
+ */
+
+#ifndef __BIO_H__
+#define __BIO_H__
+
+#include <typedef.h>
+
+/* Directions. */
+#define BIO_READ                  0
+#define BIO_WRITE                 1
+
+/* Largest transfer built by merging requests. */
+#define BIO_MAX_SECTORS           128
+/* Requests queued in a device before it gets unplugged on its own. */
+#define BIO_BATCH                 32
+
+typedef struct bio bio_t;
+
+/* Completion callback. */
+typedef void (* bio_end_io_t) (bio_t *);
+
+struct bio {
+  dev_t           devid;          /* Block device. */
+  int             dir;            /* BIO_READ or BIO_WRITE. */
+  u32             sector;         /* First sector. */
+  u32             count;          /* Amount of sectors. */
+  char          * buf;            /* count sectors long. */
+  bio_end_io_t    end_io;         /* Called when done. May be NULL. */
+  void          * private_data;   /* For the submitter's use. */
+
+  /* Set by the queue. */
+  volatile int    done;           /* Completed. */
+  int             error;          /* 0 or the errno of the failure. */
+  bio_t         * next;           /* Queue link. */
+};
+
+/* Initializes the request queues subsystem. */
+int bio_init();
+
+/* Fills in a bio. */
+void bio_prepare(bio_t *bio, dev_t devid, int dir, u32 sector, u32 count,
+                 char *buf, bio_end_io_t end_io, void *private_data);
+
+/* Queues a request. Requests overlapping a queued one where either of them
+ * writes unplug the queue first, or go right behind it if the queue is being
+ * dispatched elsewhere, so they are never reordered. Completion
+ * callbacks run right after the driver served the request and must not wait
+ * for other requests. */
+int bio_submit(bio_t *bio);
+
+/* Dispatches all the requests queued for the device. */
+int bio_unplug(dev_t devid);
+
+/* Waits for a request to complete, unplugging its queue if needed. Returns
+ * 0 or -1 with the request's error. */
+int bio_wait(bio_t *bio);
+
+/* Tells whether the device's queue is being dispatched, i.e. whether its
+ * driver is busy serving requests. */
+int bio_busy(dev_t devid);
+
+/* Synchronous helper: a single request submitted and waited for. */
+int bio_rw(dev_t devid, int dir, u32 sector, u32 count, char *buf);
+
+#endif
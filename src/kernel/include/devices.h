@@ -60,6 +60,7 @@
 /* Char devices */
 #define DEV_MEM_MAJOR           1     /* char  */
 #define DEV_TTY_MAJOR           4     /* char  */
+#define DEV_MISC_MAJOR         10     /* char  */
 #define DEV_FB_MAJOR           29     /* char  */
 
 /****************************************************************************/
@@ -69,6 +70,9 @@
 #define DEV_FS_MAJOR            DEV_UNNAMED_MAJOR
 #define DEV_FS_MINOR            2
 #define DEV_FS_DEVID            DEV_MAKE_DEV(DEV_FS_MAJOR, DEV_FS_MINOR)
+/* devfs mostly holds device nodes, it needs little room for data. */
+#define DEV_FS_MAX_BYTES        (64 * 1024)
+#define DEV_FS_MAX_INODES       256
 
 /******************/
 /*   Client API   */
@@ -88,6 +92,9 @@ typedef u16   dev_mode_t;
 int dev_blk_open(dev_t, int);
 /* Release a block device from use. */
 int dev_blk_release(dev_t);
+/* Read and write count bytes starting at byte offset off. Neither the offset
+ * nor the count need to be sector aligned. They return the amount of bytes
+ * transferred or -1. */
 int dev_blk_read(dev_t, char *, off_t, size_t);
 int dev_blk_write(dev_t, char *, off_t, size_t);
 int dev_blk_flush(dev_t);
@@ -128,9 +135,13 @@ struct dev_block_device {
   size_t sectors;                      /* Total sectors. */
 
   dev_block_device_operations_t *ops;   /* Operations. */
+  void *private_data;                   /* Driver's own data. */
 };
 
-/* block device operations */
+/* block device operations. Offsets and lengths given to read and write are
+ * in bytes, but they are always multiples of sector_size: dev_blk_read() and
+ * dev_blk_write() take care of unaligned requests, so drivers only deal with
+ * whole sectors. Both return the amount of bytes transferred or -1. */
 struct dev_block_device_operations {
   /* Used to request access to the device. */
   int (* open) (dev_block_device_t *, dev_mode_t);
@@ -23,6 +23,8 @@
 #define E_NOTIMP        19  /* No implemented yet. */
 #define E_INVAL         20  /* Invalid argument, mostly mode. */
 #define E_NOSEEK        21  /* For devices that can not lseek. */
+#define E_ISDIR         22  /* File operation on a dir node. */
+#define E_CHILD         23  /* No child to wait for. */
 
 extern int errno;
 
@@ -7,6 +7,14 @@
 #define MEMFS_FLAGS_ALLOW_FILES         0x00000002
 #define MEMFS_FLAGS_ALLOW_NODES         0x00000004
 
-int memfs_create(char *name, dev_t devid, int flags);
+/* Creates and registers a memfs filesystem type called name. Files can take
+ * up to max_bytes of memory altogether and there can be up to max_inodes
+ * files. Either limit can be 0 meaning there's none. Going beyond them fails
+ * with E_NOSPACE. */
+int memfs_create(char *name,
+                 dev_t devid,
+                 int flags,
+                 size_t max_bytes,
+                 size_t max_inodes);
 
 #endif
@@ -0,0 +1,20 @@
+/* Minix v1 filesystem.
+ *
+ * This is the filesystem mkfs.minix puts on the disk image partitions, the
+ * same one btool handles from the host. Both the 14 and 30 characters names
+ * flavours are supported, but only with 1K zones (s_log_zone_size 0). Disk
+ * blocks are accessed through the buffer cache and the inode and zone bitmaps
+ * are kept in memory while the filesystem is mounted.
+ */
+
+#ifndef __FS_MINIX_H__
+#define __FS_MINIX_H__
+
+#include <devices.h>
+
+#define MINIX_NAME      "minix"
+
+/* Registers the filesystem type. */
+int minix_init();
+
+#endif
@@ -12,6 +12,10 @@
 
 #define ROOTFS_NAME     "rootfs"
 
+/* Limits, so that filling rootfs doesn't starve the rest of the system. */
+#define ROOTFS_MAX_BYTES    (4 * 1024 * 1024)
+#define ROOTFS_MAX_INODES   1024
+
 int rootfs_init();
 
 #endif
@@ -15,6 +15,9 @@ typedef u16                               gdt_selector_t;
 
 #define GDT_NULL_ENTRY                    0x0000000000000000
 
+/* Limit of a segment covering the whole address space, in 4K units. */
+#define GDT_LIMIT_4G                      0x000fffff
+
 /* General flags */
 #define GDT_GRANULARITY_4K                0x0080000000000000
 #define GDT_GRANULARITY_1B                0x0000000000000000
@@ -76,7 +79,8 @@ typedef u16                               gdt_selector_t;
 #define GDT_KERNEL_CODE_SEGMENT           0x08
 #define GDT_KERNEL_DATA_SEGMENT           0x10
 #define GDT_TSS                           0x18
-/* Other descriptors will be allocated dynamically. */
+/* The TSSs of the rest of the processors follow. Other descriptors will be
+ * allocated dynamically. */
 
 #define GDT_RPL_KERNEL                    0x00
 #define GDT_RPL_USER                      0x03
@@ -86,7 +90,11 @@ typedef u16                               gdt_selector_t;
 /*****************************************************************************
  * For mem.c only                                                            *
  *****************************************************************************/
-void gdt_setup(u32);
+void gdt_setup();
+
+/* Loads the GDT and the TSS of processor cpu in the one running this. For
+ * the application processors, gdt_setup() does it for the BSP. */
+void gdt_load_cpu(int cpu);
 
 /*****************************************************************************
  * API                                                                       *
@@ -97,4 +105,8 @@ gdt_descriptor_t gdt_get(gdt_selector_t);
 void * gdt_base(gdt_descriptor_t);
 u32 gdt_limit(gdt_descriptor_t);
 
+/* Sets the stack this CPU switches to when an interrupt comes from user
+ * mode. */
+void gdt_set_kernel_stack(void *esp0);
+
 #endif
@@ -4,6 +4,8 @@
 #ifndef __HW_H__
 #define __HW_H__
 
+#include <typedef.h>
+
 /* halt. */
 void hw_hlt();
 
@@ -13,4 +15,71 @@ void hw_sti();
 /* cli. */
 void hw_cli();
 
+/* sti; hlt. Used to wait for an interrupt after checking a condition with
+ * interrupts disabled, without losing the interrupt in between. */
+void hw_sti_hlt();
+
+/* EFLAGS bits. */
+#define HW_EFLAGS_IF    0x00000200    /* Interrupts enabled. */
+
+/* pushfd; pop eax. Returns EFLAGS. */
+u32 hw_save_flags();
+
+/* push flags; popfd. Sets EFLAGS. */
+void hw_restore_flags(u32 flags);
+
+/* rdtsc. Cycles since reset. */
+u64 hw_rdtsc();
+
+/* bsr. Index of the most significant bit set in x, which must not be 0. */
+u32 hw_bsr(u32 x);
+
+/* bsf. Index of the least significant bit set in x, which must not be 0. */
+u32 hw_bsf(u32 x);
+
+/* cpuid. Leaves eax, ebx, ecx and edx for leaf in regs[0..3]. */
+#define HW_CPUID_FEATURES       1
+#define HW_CPUID_EDX_PSE        0x00000008    /* 4 MB pages. */
+#define HW_CPUID_EDX_APIC       0x00000200    /* Local APIC. */
+#define HW_CPUID_EDX_SEP        0x00000800    /* sysenter and sysexit. */
+#define HW_CPUID_ECX_TSC_DEADLINE 0x01000000  /* APIC timer TSC-deadline. */
+
+void hw_cpuid(u32 leaf, u32 *regs);
+
+/* wrmsr. Sets a model specific register. */
+#define HW_MSR_SYSENTER_CS      0x174
+#define HW_MSR_SYSENTER_ESP     0x175
+#define HW_MSR_SYSENTER_EIP     0x176
+#define HW_MSR_TSC_DEADLINE     0x6e0
+
+void hw_wrmsr(u32 msr, u64 value);
+
+/* str. Selector of the TSS loaded in this CPU. */
+u16 hw_str();
+
+/* pause. To be used in spin loops. */
+void hw_pause();
+
+/* Control registers. */
+#define HW_CR0_WP               0x00010000    /* Ring 0 honors read-only
+                                               * pages too. */
+#define HW_CR0_PG               0x80000000    /* Paging. */
+#define HW_CR4_PSE              0x00000010    /* 4 MB pages. */
+
+u32 hw_get_cr0();
+void hw_set_cr0(u32 cr0);
+
+/* The address of the last page fault. */
+u32 hw_get_cr2();
+
+/* The page directory in use. Setting it flushes the TLB. */
+u32 hw_get_cr3();
+void hw_set_cr3(u32 cr3);
+
+u32 hw_get_cr4();
+void hw_set_cr4(u32 cr4);
+
+/* invlpg. Drops the TLB entry of the page holding addr. */
+void hw_invlpg(void *addr);
+
 #endif
@@ -74,26 +74,91 @@ typedef struct {
   u32 eflags;
 } __attribute__((__packed__)) itr_stack_state_t;
 
-/* All interrupt handlers must follow this signature. Probably they'll never
- * need all this data, so probably we'll remove all this in the future.
- * Or maybe not. */
-typedef void (*interrupt_handler_t)(itr_cpu_regs_t,
-                                    itr_intr_data_t,
-                                    itr_stack_state_t);
+/* The whole frame saved in the interrupted code's kernel stack, exactly as
+ * interrupts.asm left it. user_esp and user_ss are only there if the
+ * interrupt came from ring 3. */
+typedef struct {
+  itr_cpu_regs_t regs;
+  itr_intr_data_t intr;
+  itr_stack_state_t stack;
+  u32 user_esp;
+  u32 user_ss;
+} __attribute__((__packed__)) itr_frame_t;
+
+/* All interrupt handlers must follow this signature. They get a pointer to
+ * the saved frame instead of copies of it, so whatever they write there,
+ * e.g. a system call's result in regs.eax, is what the interrupted code gets
+ * back when the interrupt returns. The cookie is whatever was given when
+ * registering the handler, usually the device. Handlers return ITR_HANDLED
+ * if their device was the one interrupting, ITR_NOT_MINE otherwise. */
+#define ITR_NOT_MINE              0
+#define ITR_HANDLED               1
 
+typedef int (*interrupt_handler_t)(itr_frame_t *, void *);
 
-/* This is the API we'll use to set and remove interrupt handlers. */
 
-/* Add this interrupt handler. It replaces the current handler without even
- * asking. If handler is NULL then nothing will be executed, though making
- * the handler available needs the right flags so it's not necessary to
- * take the handler out in case a temporary disabling is desired. */
-void itr_set_interrupt_handler(itr_irq_t irq,
-                               interrupt_handler_t handler,
-                               u16 flags);
+/* This is the API we'll use to set and remove interrupt handlers.
+ *
+ * Several devices may share an IRQ line, so each IDT entry keeps a chain of
+ * handlers and all of them are called in registration order whenever the
+ * interrupt comes. Each handler only checks its own device. The PIC gets its
+ * end of interrupt once the whole chain is done, handlers must not send it
+ * themselves. */
+
+/* Add this interrupt handler to the chain of irq. The same handler can be
+ * added with different cookies. flags are set in the IDT entry; the gate
+ * must be present for any handler to run. */
+int itr_set_interrupt_handler(itr_irq_t irq,
+                              interrupt_handler_t handler,
+                              void *cookie,
+                              u16 flags);
+
+/* Take the handler added with cookie out of the chain of irq. */
+int itr_remove_interrupt_handler(itr_irq_t irq,
+                                 interrupt_handler_t handler,
+                                 void *cookie);
 
 /* Set all the static part up. This should be called before expecting any
  * interrupt to be correctly handled. */
 int itr_set_up();
 
+/* Loads the IDT itr_set_up() built in the processor running this. For the
+ * application processors. */
+void itr_set_up_cpu();
+
+/* Statistics.
+ *
+ * Each IDT entry counts how many times its chain ran, how many times it
+ * fired with no handler claiming it, and how long the chain took in TSC
+ * cycles.
+ * Durations go into a histogram with a bucket per power of 2, starting at
+ * 2^ITR_HIST_FIRST cycles. It's all readable as text in /dev/interrupts. */
+#define ITR_HIST_FIRST            8
+#define ITR_HIST_BUCKETS          16
+
+#define ITR_STATS_NAME            "interrupts"
+#define ITR_STATS_MINOR           200
+
+typedef struct {
+  u32 count;                      /* Chain runs. */
+  u32 unhandled;                  /* Nobody claimed it. */
+  u32 max;                        /* Longest run, in cycles. */
+  u32 hist[ITR_HIST_BUCKETS];     /* Runs by log2 of their cycles. */
+} itr_stats_t;
+
+/* Registers /dev/interrupts. The dev subsystem must be up. */
+int itr_stats_init();
+
+/* Interrupt handlers nesting level, 0 when not inside a handler. Only the
+ * scheduler should need to set it, since it's part of a process' context. */
+int itr_get_status();
+void itr_set_status(int status);
+
+/* Entry points other than the IDT, i.e. sysenter, build an itr_frame_t
+ * themselves and must account for it like an interrupt: itr_enter() before
+ * handling it and itr_leave() before returning, which runs the deferred work
+ * and may switch processes. */
+void itr_enter();
+void itr_leave(itr_frame_t *frame);
+
 #endif
@@ -33,4 +33,12 @@ u16 inw(io_port_t port);
 /* double word (32) */
 u32 ind(io_port_t port);
 
+/*
+ * x86 REP INSW/OUTSW wrappers. They move count words between the buffer and
+ * the port, which is what block devices need to move whole sectors.
+ * Actual definitions at src/kernel/io.asm.
+ */
+void rep_inw(io_port_t port, void *buf, u32 count);
+void rep_outw(io_port_t port, void *buf, u32 count);
+
 #endif /* __IO_H__ */
@@ -14,9 +14,7 @@ typedef u8 kb_key_event;
 int kb_init();
 
 /* Keyboard interrupt handler. */
-void kb_interrupt_handler(itr_cpu_regs_t,
-                          itr_intr_data_t,
-                          itr_stack_state_t);
+int kb_interrupt_handler(itr_frame_t *, void *);
 
 /* This function will place in buf the next complete scan code. It will
  * return the size of the scan code. A return value of zero means there's
@@ -3,48 +3,89 @@
  * Some routines require to run atomically or otherwise interrupts ocurring
  * in the middle of the execution can corrupt kernel data (e.g. memory is being
  * allocated, and interrupt comes and the handler tries to allocate memory).
- * Since we are not multitasking the only situation on which a code is taken
- * out of the processor is precisely when interrupts come, thus we can rely on
- * cli and sti to avoid race conditions. Thus, critical regions are enclosed
- * by calls to cli and sti. However, this is only valid is the users of the
- * critical regions are aware of the existence of a critical region and operate
- * wisely, which is not efficient because critical regions can be small
- * sections of code inside large functions. In such scenarios the callers would
- * have to block the WHOLE execution of the function, which is not desirable.
- * It should be the responsibility of the function to protect the critical
- * region, but then the function should know whether to execute sti or not
- * after the critial region because arbitrarily issuing sti would lead to
- * undesired problems when running interrupt handlers because they all assume
- * interrupts are disabled when they are being run.
- * Thus, the solution we've come with is a little patch: we'll always cli when
- * entering the critical region, but will conditionally sti when we're done.
- * The condition will check whether we're inside an interrupt handler or not
- * and this will be known by reading a flag which will be set only before
- * entering interrupt handlers and clear after they are done. The rationale
- * behind this is:
- *
- *  If a non-interrupt code reaches the lock first interrupts will be cleared,
- *  then no interrupts will take place (let's hope no exceptions nor NMI
- *  take place). The flag will be cleared so we can issue sti after we're done.
- *
- *  If a interrupt code reaches the lock first then there was no non-interrupt
- *  code in the critical region, otherwise cli would have been called and
- *  interrupt would have not taken place. In such a case, the flag would be
- *  set before calling the handler and cleared after, so during the execution
- *  of the handler sti can not be issued, but after the interrupt is done
- *  iret will set it again.
- *
- * The two scenarios fordid each other to run, and this should be agnostic
- * to the function calling lock and unlock.
- *
- * This is actually implemented in interrupts.c, for it belongs there. This
- * header is just separated from interrupts.h because I hope in a future have
- * a better locking mechanism. */
+ * The scheduler only switches processes when an interrupt handler returns
+ * (or when asked to), so the only situation on which a code is taken out of
+ * the processor is precisely when interrupts come, thus we can rely on cli
+ * and sti to avoid race conditions.
+ *
+ * The catch is that critical regions nest: a function protecting its own
+ * data may be called from inside somebody else's critical region, or from an
+ * interrupt handler, where interrupts are disabled and must stay that way.
+ * Blindly issuing sti when leaving the inner region would open the outer one
+ * to interrupts. Thus, leaving a critical region must put the interrupt flag
+ * back as it was when entering it, and there are two ways of doing it:
+ *
+ *  irq_save() disables interrupts and returns the previous EFLAGS, which the
+ *  caller keeps in a local variable and hands to irq_restore() when it's
+ *  done. This is what code with short critical regions should use:
+ *
+ *    u32 flags;
+ *
+ *    flags = irq_save();
+ *    ...
+ *    irq_restore(flags);
+ *
+ *  lock() and unlock() do the same but keep the flags themselves along with
+ *  a nesting depth: only the outermost lock() saves them and only the
+ *  outermost unlock() restores them. They're handy when the region spans
+ *  several functions, like waiting in a wait queue.
+ *
+ * Since a process can be switched out inside a critical region (that's what
+ * sleeping in a wait queue does), the lock state belongs to the process and
+ * the scheduler saves and restores it with lock_get_state() and
+ * lock_set_state().
+ *
+ * With several processors cli is not enough: the others keep running. So
+ * there's also the kernel lock, a spinlock only one processor at a time can
+ * hold, taken by irq_save(), lock() and interrupt entry (system calls
+ * included) and released by their counterparts. Any kernel code not running
+ * in the idle loop holds it, so the kernel is still run by a single
+ * processor at a time and none of it had to change. The lock is recursive
+ * per processor: the nesting is kept in the lock state, and it's never 0
+ * when the scheduler switches processes, so it's handed over from one
+ * process to the next along with the processor. Kernel threads hold it all
+ * the time they're not sleeping.
+ *
+ * The idle task has nothing to protect, so it halts without the lock. Code
+ * waiting for an interrupt while holding it must drop it meanwhile with
+ * lock_kernel_drop() and lock_kernel_retake(), or no other processor could
+ * take interrupts or system calls.
+ *
+ * That's the coarse part, and it's how most of the kernel is still
+ * protected. Data with locks of its own, see spinlock.h, can do without
+ * irq_save() and lock(): the frame allocator, kalloc() and the VFS dentry and
+ * vnode caches use spinlocks and reader-writer locks, so they'll be ready to
+ * run on several processors at once the day the kernel lock goes away.
+ *
+ * The global locking is actually implemented in interrupts.c, for it
+ * belongs there. This header was separated from interrupts.h because I hoped
+ * to have a better locking mechanism in the future. That's spinlock.h, which
+ * is included here so this header is all anyone needs. */
 
 #ifndef __LOCK_H__
 #define __LOCK_H__
 
+#include <typedef.h>
+#include <spinlock.h>
+
+typedef struct lock_state {
+  int depth;          /* Nested lock() calls. */
+  u32 flags;          /* EFLAGS before the outermost one. */
+  int kernel;         /* Kernel lock nesting. */
+} lock_state_t;
+
+u32 irq_save();
+void irq_restore(u32 flags);
+
 void lock();
 void unlock();
 
+void lock_get_state(lock_state_t *state);
+void lock_set_state(lock_state_t *state);
+
+/* Releases the kernel lock whatever its nesting. Returns the nesting, to be
+ * handed to lock_kernel_retake(). Interrupts must be disabled. */
+int lock_kernel_drop();
+void lock_kernel_retake(int depth);
+
 #endif
@@ -88,9 +88,17 @@ void * mem_allocate_frames(u32 count, u32 first_frame, u32 last_frame);
 
 /* Releases count frames of memory starting from address addr. If addr is not
  * a page frame aligned address then the frame containing address will also be
- * released. */
+ * released. Frames that are shared are only released by their last user. */
 void mem_release_frames(void *addr, u32 count);
 
+/* Adds a user to count allocated frames starting from the one holding addr,
+ * i.e. one more mem_release_frames() is needed to release them. */
+void mem_share_frames(void *addr, u32 count);
+
+/* How many users the allocated frame holding addr has, 0 if it's not
+ * allocated. */
+u32 mem_frame_refs(void *addr);
+
 /* This is the internal logical allocator. It only reserves space inside the
  * kernel heap. */
 void * kalloc(u32 bytes);
@@ -46,6 +46,9 @@ void pic_init();
  * comment above about the reserved IRQs. */
 void pic_remap();
 
+/* Once apic_init() succeeds the APICs take over: these functions forward
+ * there and the PICs stay disabled. */
+
 /* Send end-of-interrupt to the PICs. It must be called after the interrupt
  * handler is done with the interrupt. */
 void pic_send_eoi(itr_irq_t irq);
@@ -59,4 +62,7 @@ void pic_mask_dev(enum pic_dev dev);
  * processor. */
 void pic_unmask_dev(enum pic_dev dev);
 
+/* Masks all lines in both PICs, for when the APICs take over. */
+void pic_disable();
+
 #endif /* __PIC_H__ */
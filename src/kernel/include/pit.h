@@ -11,6 +11,12 @@
 #define PIT_CHANNEL2_DATA_PORT    0x42         //Channel 2 data port (read/write)
 #define PIT_CMD_REG_DATA_PORT     0x43         //Mode/Command register (write only, a read is ignored)
 
+//Channel 2 is controlled through the PC speaker port
+#define PIT_SPEAKER_PORT          0x61
+#define PIT_CHANNEL2_GATE         0x01         //Channel 2 counts while set
+#define PIT_SPEAKER_DATA          0x02         //Channel 2 output to the speaker
+#define PIT_CHANNEL2_OUT          0x20         //Channel 2 output (read only)
+
 
 /*
 Bits         Usage
@@ -57,16 +63,24 @@ Bits         Usage
 
 #define PIT_OSCILATOR_FREQUENCY	1193182
 #define PIT_OUTPUT_FREQUENCY	100
-#define PIT_RELOAD_VALUE	PIT_OSCILATOR_FREQUENCY / PIT_OUTPUT_FREQUENCY
+#define PIT_RELOAD_VALUE	(PIT_OSCILATOR_FREQUENCY / PIT_OUTPUT_FREQUENCY)
 
 
 
-u64 counter;
+/* Ticks since pit_init(). */
+extern u64 counter;
 
 void pit_init();
-void pit_interrupt_handler(itr_cpu_regs_t regs,
-                              itr_intr_data_t data,
-                              itr_stack_state_t stack);
+int pit_interrupt_handler(itr_frame_t *frame, void *cookie);
+
+/* Counts a tick and does the periodic work: the buffer cache, the kernel
+ * timers and the scheduler. The PIT handler calls it, unless another clock
+ * took over (see apic.h). */
+void pit_tick();
+
+/* Busy waits for a tick using channel 2. It doesn't need interrupts, it's
+ * meant to calibrate other clocks. */
+void pit_wait_tick();
 
 void pit_interrupt_disabled();
 
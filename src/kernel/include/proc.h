@@ -3,8 +3,39 @@
 
 #include <typedef.h>
 #include <vfs.h>
+#include <lock.h>
+#include <smp.h>
+#include <interrupts.h>
 
 #define PROC_MAX_FD     10
+#define PROC_MAX_PROC   10
+
+/* Every process has its own kernel stack. Interrupts and system calls coming
+ * from user space land there, and that's where the state of the process is
+ * kept while it's not running. */
+#define PROC_KSTACK_FRAMES  2
+
+/* Room for the arguments of a new program, strings and pointers. They go in
+ * the last page of its stack. */
+#define PROC_ARGS_MAX       2048
+
+/* Process states. */
+#define PROC_UNUSED     0   /* Free slot. */
+#define PROC_READY      1   /* In the run queue. */
+#define PROC_RUNNING    2   /* This is proc_cur of some CPU. */
+#define PROC_BLOCKED    3   /* Waiting for something. */
+#define PROC_ZOMBIE     4   /* Exited, its parent hasn't collected the
+                             * status yet. */
+
+/* Affinity of processes that may run anywhere. */
+#define PROC_AFFINITY_ALL   0xffffffff
+
+/* proc_waitpid() options. */
+#define PROC_WNOHANG    0x00000001  /* Don't wait if no child is done. */
+
+/* Process flags. */
+#define PROC_F_KTHREAD  0x00000001  /* Runs in the kernel. Can be preempted
+                                     * anywhere interrupts are enabled. */
 
 typedef struct proc {
   pid_t           pid;                  /* Process ID. */
@@ -30,10 +61,67 @@ typedef struct proc {
     u16 gs;
   }               segs;                 /* Segments. */
   vfs_file_t    * fdesc[PROC_MAX_FD];   /* File descriptors. */
+  u32           * pgdir;                /* Page directory, NULL for the
+                                         * kernel's. See vm.h. */
+
+  /* Scheduling. */
+  int             state;                /* PROC_READY, PROC_RUNNING... */
+  int             flags;                /* PROC_F_* */
+  int             status;               /* Exit status. */
+  char          * kstack;               /* Kernel stack, NULL for the idle
+                                         * task which uses the boot one. */
+  u32             kesp;                 /* Saved kernel esp when switched
+                                         * out. */
+  int             itr_status;           /* Saved interrupts nesting. */
+  lock_state_t    lock;                 /* Saved lock() state. */
+  int             level;                /* Priority level, 0 is the
+                                         * highest. */
+  u32             ticks;                /* Ticks left in the time slice. */
+  int             cpu;                  /* Processor whose run queue it
+                                         * belongs to, -1 if none yet. It
+                                         * changes when others steal it. */
+  u32             affinity;             /* Processors it may run on, bit i
+                                         * for processor i. */
+  struct proc   * next;                 /* Run queue link. */
 } proc_t;
 
 int proc_init();
-int proc_exec(char *);
-extern proc_t * proc_cur;
+/* Replaces the current process with the binary at path, called with the
+ * NULL terminated argv, which may be NULL. Only returns if it fails. */
+int proc_exec(char *path, char **argv);
+
+/* Runs the binary at path in a new process, a child of the current one,
+ * with arguments argv like proc_exec(). fds[i] is the descriptor of the
+ * current process that becomes the new one's descriptor i, -1 for none; if
+ * fds is NULL it gets all of them. Returns the new PID. */
+pid_t proc_spawn(char *path, char **argv, int *fds);
+
+/* Creates a kernel thread running entry(arg) and makes it ready. When entry
+ * returns the thread exits. */
+proc_t * proc_kthread(void (* entry)(void *), void *arg);
+
+/* Terminates the current process, releasing its resources. Never returns.
+ * The slot stays until the parent collects status with proc_waitpid(),
+ * unless the parent is the kernel. */
+void proc_exit(int status);
+
+/* Duplicates the current process, which entered the kernel with frame.
+ * The child shares its pages copy-on-write and its open files, and returns
+ * from frame too with 0 in eax. Returns the child's PID. */
+pid_t proc_fork(itr_frame_t *frame);
+
+/* Waits for the child pid, any child if it's -1, to exit. Returns its PID
+ * and leaves its exit status in status. Fails with E_CHILD if there's no
+ * such child. With PROC_WNOHANG returns 0 if none is done yet. */
+pid_t proc_waitpid(pid_t pid, int *status, int options);
+
+/* Makes the running context the idle task of an application processor,
+ * with kstack as its kernel stack. */
+int proc_init_cpu(char *kstack);
+
+/* The process running in each processor. */
+extern proc_t * proc_curs[SMP_MAX_CPUS];
+
+#define proc_cur        (proc_curs[smp_cpu_id()])
 
 #endif
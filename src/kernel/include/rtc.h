@@ -4,6 +4,7 @@
 #include <typedef.h>
 #include <vfs.h>
 #include <string.h>
+#include <interrupts.h>
 
 #define CMOS_ADDRESS 	0x70
 #define CMOS_DATA 		0x71
@@ -19,6 +20,10 @@
 #define REG_CENTURY 	0x32
 #define REGA_STATUS	 	0x0A //Register A
 #define REGB_STATUS 	0x0B //Register B
+#define REGC_STATUS 	0x0C //Register C, reading it acknowledges the IRQ
+
+//Update-ended interrupt: enable bit in register B, flag in register C
+#define RTC_UPDATE_INT	0x10
 
 //Formats of the date/time RTC bytes:
 #define BINARY_MODE		0x04
@@ -43,4 +48,8 @@ u8 get_RTC_register(u8);
 void set_RTC_register(u8, u8);
 int get_update_in_progress_flag();
 
+//Sleeps until the RTC has counted some seconds.
+void rtc_sleep(u32 seconds);
+int rtc_interrupt_handler(itr_frame_t *frame, void *cookie);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,99 @@
+/* Scheduler.
+ *
+ * This is a multi-level feedback queue. Ready processes wait in one of
+ * SCHED_LEVELS FIFO run queues, level 0 being the highest priority, and a
+ * bitmap tells which levels have someone waiting, so picking the next process
+ * is just a bsf and a dequeue no matter how many processes there are.
+ *
+ * Processes start at level 0. A process that uses its whole time slice goes
+ * down a level, where slices are twice as long. A process that gives the CPU
+ * away before its slice is over, e.g. waiting for the keyboard or the serial
+ * port, goes up a level. That way interactive processes get the CPU as soon
+ * as they're ready while CPU-bound ones sink and run in longer slices. Every
+ * SCHED_BOOST_TICKS all processes are moved back to level 0 so no one
+ * starves.
+ *
+ * The idle task, which is what's left of the boot context once kmain2 is
+ * done, is not queued: it only runs when all queues are empty.
+ *
+ * Every processor has its own set of queues and its own idle task, the APs'
+ * being what's left of their boot context too. A new process goes to the
+ * least loaded processor and stays there, where its data is likely still in
+ * the cache, unless the work is uneven. A processor with nothing to do takes
+ * a process from the tail of the busiest processor's queues, and every
+ * SCHED_BALANCE_TICKS a busy one pulls a process from a processor running at
+ * least two more. Making a process ready on another processor sends it an
+ * IPI if it has to reschedule.
+ *
+ * Processes only run on the processors in their affinity mask, see
+ * sched_set_affinity(). Stealing and balancing respect it too.
+ *
+ * Switching processes means switching kernel stacks. The state of the
+ * interrupted process stays in the interrupt frame on its own kernel stack
+ * and proc_switch_context() only saves the callee-saved registers and esp, so
+ * the process resumes right where it was taken out, be it the end of an
+ * interrupt handler or a call to sched_yield().
+ *
+ * Preemption takes place when an interrupt handler is about to return, and
+ * only if it interrupted user code or a kernel thread. Kernel code running on
+ * behalf of a process (i.e. system calls) is not preempted, so that the rest
+ * of the kernel doesn't need to be reentrant. Kernel threads must protect
+ * shared data with lock() like interrupt handlers do.
+ */
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <typedef.h>
+#include <proc.h>
+
+/* Priority levels, at most 32 for the bitmap to fit in a u32. */
+#define SCHED_LEVELS        4
+
+/* Slice length of a level. At the PIT's 100 Hz level 0 runs 20 ms and the
+ * lowest one 160 ms. */
+#define SCHED_SLICE_TICKS   2
+#define SCHED_SLICE(level)  (SCHED_SLICE_TICKS << (level))
+
+/* Priority boost period, one second. */
+#define SCHED_BOOST_TICKS   100
+
+/* Load balancing period, 200 ms. */
+#define SCHED_BALANCE_TICKS 20
+
+/* Turns the running context into the idle task p of this processor. */
+int sched_init(proc_t *idle);
+
+/* Makes p ready to run at its level, on its processor. If it's more
+ * important than the process running there it will take the CPU at the next
+ * chance. Interrupts must be disabled. */
+void sched_add(proc_t *p);
+
+/* Lets p run only on the processors whose bits are set in mask, bit i for
+ * processor i. Processors that aren't there are ignored; if none is left
+ * fails with E_INVAL. A process on a processor it can no longer use moves at
+ * the next chance. */
+int sched_set_affinity(proc_t *p, u32 mask);
+
+/* Gives the CPU away. The current process stays ready unless its state was
+ * changed before calling, e.g. to PROC_BLOCKED or PROC_ZOMBIE. Must be
+ * called with interrupts disabled. */
+void sched_schedule();
+
+/* Gives the rest of the slice to the next ready process. */
+void sched_yield();
+
+/* Timer hook, accounts the running process' slice and boosts priorities. */
+void sched_tick();
+
+/* Called when the outermost interrupt handler is about to return to code
+ * running with cs. Switches processes if the slice is over. */
+void sched_preempt(u32 cs);
+
+/* Whether the current slice is over. */
+int sched_need_resched();
+
+/* Whether the idle task is the one running. */
+int sched_idling();
+
+#endif
@@ -0,0 +1,47 @@
+/* Symmetric multiprocessing.
+ *
+ * At boot only one processor runs, the bootstrap processor (BSP). The rest,
+ * the application processors (APs), wait halted until the BSP sends them an
+ * INIT interprocessor interrupt followed by two STARTUPs, which carry the
+ * page where they start running in real mode. That's the trampoline in
+ * smp.asm, copied to SMP_TRAMPOLINE_ADDR, which switches to protected mode
+ * with a flat GDT of its own and calls smp_ap_main() on the stack the BSP
+ * left in smp_ap_stack. From there every AP loads the kernel's GDT, its own
+ * TSS, the IDT, enables its local APIC and timer and becomes the idle task
+ * of its own run queue. The APs are started one at a time because they share
+ * the trampoline and smp_ap_stack.
+ *
+ * The processors are numbered from 0, the BSP, in the order they're started.
+ * Each one has its own TSS, so the task register tells which one is running
+ * the code asking. The local APICs are listed in the ACPI MADT, found by
+ * apic.c, so there's no SMP without APICs.
+ */
+
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <typedef.h>
+
+/* Most processors we'll use. */
+#define SMP_MAX_CPUS          8
+
+/* Where the trampoline is copied. Real mode code starts at a 4K page below
+ * 1 MB whose number goes in the STARTUP IPI. The kernel is below and the
+ * EBDA above. */
+#define SMP_TRAMPOLINE_ADDR   0x00090000
+
+/* Boots the APs. Returns how many processors are running, 1 if there are no
+ * APICs or no other processors. Must be called by the BSP once everything
+ * else is set up, since the APs start scheduling right away. */
+int smp_init();
+
+/* Number of the processor running this. */
+int smp_cpu_id();
+
+/* How many processors are running. */
+int smp_cpu_count();
+
+/* Makes cpu check whether it has to switch processes. */
+void smp_send_resched(int cpu);
+
+#endif
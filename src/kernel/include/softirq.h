@@ -0,0 +1,64 @@
+/* Deferred interrupt work.
+ *
+ * Interrupt handlers run with interrupts disabled, so everything they do
+ * delays every other device. They should only talk to the hardware and leave
+ * the rest for later: that's the top half. The bottom half runs right before
+ * returning from the outermost interrupt to code that had interrupts enabled
+ * (user mode, kernel threads or idle), with interrupts enabled again.
+ *
+ * There are two flavors of bottom halves:
+ *
+ *  Softirqs are a fixed set of handlers, one per SOFTIRQ_* number, marked
+ *  pending by softirq_raise(). They're meant for things done often, like
+ *  running the kernel timers.
+ *
+ *  Tasklets are softirq-run callbacks anyone can define. A tasklet scheduled
+ *  several times before it runs only runs once.
+ *
+ * Bottom halves may be interrupted, and a handler raising more work while
+ * they run gets it done in the same pass. The same softirq may run in two
+ * processes at once if one of them sleeps in it, so handlers protect their
+ * data with irq_save() like everyone else.
+ */
+
+#ifndef __SOFTIRQ_H__
+#define __SOFTIRQ_H__
+
+#include <typedef.h>
+
+/* Softirqs, by priority. */
+#define SOFTIRQ_TIMER           0
+#define SOFTIRQ_TASKLET         1
+#define SOFTIRQ_TOTAL           2
+
+/* Times the pending softirqs are run in a single pass. Whatever is raised
+ * after that waits for the next interrupt, so a flood of interrupts can't
+ * keep the interrupted code away forever. */
+#define SOFTIRQ_MAX_ROUNDS      10
+
+typedef void (* softirq_handler_t)();
+
+typedef struct tasklet {
+  void           (* fn)(void *);
+  void            * data;
+  int               scheduled;    /* Waiting to run. */
+  struct tasklet  * next;
+} tasklet_t;
+
+void softirq_init();
+
+void softirq_set_handler(int nr, softirq_handler_t handler);
+
+/* Marks a softirq as pending. Can be called from anywhere. */
+void softirq_raise(int nr);
+
+/* Runs the pending softirqs. Called with interrupts disabled at the end of
+ * the outermost interrupt handler, returns with them disabled. */
+void softirq_run();
+
+void tasklet_init(tasklet_t *t, void (* fn)(void *), void *data);
+
+/* Makes t run at the next bottom half pass. Can be called from anywhere. */
+void tasklet_schedule(tasklet_t *t);
+
+#endif
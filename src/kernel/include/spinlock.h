@@ -0,0 +1,77 @@
+/* Spinlocks and reader-writer locks.
+ *
+ * With a single processor disabling interrupts is enough to keep a critical
+ * region to ourselves. With several of them it's not: the other processors
+ * keep running no matter what our IF says. A spinlock makes them wait.
+ *
+ * Spinlocks here are ticket locks, like the ones at a butcher's: taking the
+ * lock means atomically taking the next ticket number and waiting until the
+ * ticket being served is ours, releasing it means serving the next one. The
+ * processors get the lock in the order they asked for it, so no one starves
+ * while the rest take turns, which a plain test-and-set lock can't promise.
+ *
+ * A reader-writer lock lets any number of readers in at once, or a single
+ * writer. It's a spinlock, which writers hold all along and readers only
+ * while they sign in, plus a count of the readers inside. A writer waits for
+ * the readers to leave holding the spinlock, so no new reader gets in ahead
+ * of it.
+ *
+ * The locks don't disable interrupts, the _irqsave variants do it before
+ * taking them and put the flags back after releasing them. An interrupt
+ * handler trying to take a lock the code it interrupted holds would spin
+ * forever, so locks taken by handlers must be taken with interrupts disabled
+ * everywhere. So must locks taken by kernel threads, which can be preempted.
+ * Code holding a spinlock must not sleep.
+ *
+ * Every lock counts how many times someone found it taken, to know which
+ * locks are worth splitting. It's only counted when there's waiting to do
+ * anyway, so it doesn't make the common case any slower.
+ */
+
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <typedef.h>
+
+typedef struct spinlock {
+  volatile u16 owner;       /* Ticket being served. */
+  volatile u16 next;        /* Next ticket to hand out. */
+  u32 contended;            /* Times the lock was found taken. */
+} spinlock_t;
+
+#define SPINLOCK_INIT       { 0, 0, 0 }
+
+typedef struct rwlock {
+  spinlock_t lock;          /* Held by writers, and by readers signing in. */
+  volatile int readers;     /* Readers inside. */
+} rwlock_t;
+
+#define RWLOCK_INIT         { SPINLOCK_INIT, 0 }
+
+void spin_init(spinlock_t *l);
+
+/* Takes l, spinning until it's our turn. */
+void spin_lock(spinlock_t *l);
+
+/* Takes l if it's free. Returns whether it was taken. */
+int spin_trylock(spinlock_t *l);
+
+void spin_unlock(spinlock_t *l);
+
+/* The same disabling interrupts first. Returns the previous EFLAGS. */
+u32 spin_lock_irqsave(spinlock_t *l);
+void spin_unlock_irqrestore(spinlock_t *l, u32 flags);
+
+void rw_init(rwlock_t *l);
+
+void read_lock(rwlock_t *l);
+void read_unlock(rwlock_t *l);
+void write_lock(rwlock_t *l);
+void write_unlock(rwlock_t *l);
+
+u32 read_lock_irqsave(rwlock_t *l);
+void read_unlock_irqrestore(rwlock_t *l, u32 flags);
+u32 write_lock_irqsave(rwlock_t *l);
+void write_unlock_irqrestore(rwlock_t *l, u32 flags);
+
+#endif
@@ -1,6 +1,16 @@
 #ifndef __SYSCALL_H__
 #define __SYSCALL_H__
 
+/* System calls come through int 0x80 and, when the CPU has it, sysenter.
+ * See syscall.asm for the sysenter convention. */
 void syscall_init();
 
+/* Sets sysenter up in an application processor, with esp0 as the stack
+ * until the scheduler sets the first process'. */
+void syscall_init_cpu(void *esp0);
+
+/* Sets the stack sysenter switches to in this processor, the scheduler calls
+ * it along with gdt_set_kernel_stack(). */
+void syscall_set_kernel_stack(void *esp0);
+
 #endif
@@ -0,0 +1,40 @@
+/* Kernel timers.
+ *
+ * A timer calls a function from the timer softirq, with interrupts enabled,
+ * once a number of ticks have gone by. Pending timers are kept in a wheel of TIMER_WHEEL_SLOTS
+ * lists indexed by their expiration tick, so adding or removing one takes
+ * constant time and each tick only looks at a single slot. Timers further
+ * away than a whole turn just stay in their slot until their turn comes.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <typedef.h>
+
+#define TIMER_WHEEL_SLOTS   64
+
+typedef struct timer {
+  u64             expires;            /* Tick to fire at. */
+  void         (* fn)(struct timer *);/* Run in the timer softirq. */
+  void          * data;               /* For fn to use. */
+  struct timer  * prev;
+  struct timer  * next;
+  int             pending;            /* In the wheel. */
+} timer_t;
+
+void timer_init();
+
+/* Fires t in ticks timer ticks. t->fn and t->data must be set. */
+void timer_add(timer_t *t, u32 ticks);
+
+/* Removes t if it's still pending. */
+void timer_del(timer_t *t);
+
+/* Timer interrupt hook. */
+void timer_tick();
+
+/* Blocks the current process for a number of ticks. */
+void timer_sleep(u32 ticks);
+
+#endif
@@ -74,6 +74,7 @@ typedef u16 mode_t;   /* File mode. */
 #define FILE_O_CREATE             0x00000004
 #define FILE_O_EXCL               0x00000008
 #define FILE_O_TRUNC              0x00000010
+#define FILE_O_SYNC               0x00000020  /* Write data out on flush. */
 
 /* Seek flags. */
 #define SEEK_SET                  0x00000000
@@ -91,6 +92,15 @@ struct stat {
   dev_t     dev;
 };
 
+/* Filesystem usage. Totals are 0 when the filesystem has no limit. */
+struct statfs {
+  size_t    bsize;    /* Block size. */
+  size_t    blocks;   /* Total blocks. */
+  size_t    bused;    /* Blocks in use. */
+  size_t    files;    /* Total inodes. */
+  size_t    fused;    /* Inodes in use. */
+};
+
 /********************************/
 /* Process-related definitions. */
 /********************************/
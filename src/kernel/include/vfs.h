@@ -56,6 +56,9 @@
 /* Use this if you want to set v_dev on a non-device file. */
 #define FILE_NODEV                  0
 
+/* Longest name a directory entry may have. */
+#define VFS_NAME_MAX                255
+
 /******************************/
 /*  Main internal structures  */
 /******************************/
@@ -74,6 +77,7 @@ typedef struct vfs_vnode                  vfs_vnode_t;
 typedef struct vfs_vnode_operations       vfs_vnode_operations_t;
 typedef struct vfs_file                   vfs_file_t;
 typedef struct vfs_file_operations        vfs_file_operations_t;
+typedef struct vfs_dirent                 vfs_dirent_t;
 
 /*****************************************************************************/
 /* Filesystem types. *********************************************************/
@@ -155,7 +159,8 @@ struct vfs_sb_operations {
   /* Removes a vnode from the filesystem. The vnode is suppossed to exist
    * though only the vnode number and ro.v_sb are guaranteed to be set.
    * It's not necessary to release any data from the vnode structure since
-   * destroy_vnode will be called inmediately after. */
+   * destroy_vnode will be called inmediately after. It's called when the
+   * last reference to a vnode with no links left goes away. */
   int (* delete_vnode) (vfs_sb_t *sb, vfs_vnode_t *node);
 
   /* Used to notify the superblock it's being mounted. */
@@ -163,6 +168,14 @@ struct vfs_sb_operations {
 
   /* Used to nofity the superblock is being unmounted. */
   int (* unmount) (vfs_sb_t *sb);
+
+  /* Writes any cached data of the filesystem to its device. Set it to NULL
+   * if there's nothing to write. */
+  int (* sync) (vfs_sb_t *sb);
+
+  /* Fills st with the filesystem usage. If NULL, vfs_statfs() fails with
+   * E_NOTIMP. */
+  int (* statfs) (vfs_sb_t *sb, struct statfs *st);
 };
 
 /* The superblock structure. */
@@ -227,6 +240,19 @@ struct vfs_vnode_operations {
   int (* mknod) (vfs_vnode_t *dir, vfs_dentry_t *dentry, mode_t mode,
                  dev_t devid);
 
+  /* Removes the entry named after dentry->d_name, which refers to a non
+   * directory, from dir. The vnode it refers to is held by the VFS during
+   * the call, which takes care of its v_nlinks. */
+  int (* unlink) (vfs_vnode_t *dir, vfs_dentry_t *dentry);
+
+  /* Same as unlink but for an empty directory. Must fail with E_NOEMPTY if
+   * it's not empty. */
+  int (* rmdir) (vfs_vnode_t *dir, vfs_dentry_t *dentry);
+
+  /* Sets the size of a regular file, releasing the data beyond it. Growing
+   * the file leaves a hole. v_size must be updated. */
+  int (* truncate) (vfs_vnode_t *node, size_t size);
+
   /* TODO: Many more functions. */
 };
 
@@ -261,6 +287,11 @@ struct vfs_file_operations {
   /* Reads the next name in a directory. This is quite different from Linux
    * interface. */
   char * (* readdir) (vfs_file_t *file);
+
+  /* Reads up to _count_ entries of a directory into _dirents_, going on from
+   * where the previous call stopped. Returns how many were read, 0 at the
+   * end of the directory. If NULL, vfs_getdents() falls back to readdir. */
+  ssize_t (* getdents) (vfs_file_t *file, vfs_dirent_t *dirents, size_t count);
 };
 
 /* vnode structure. */
@@ -269,6 +300,8 @@ struct vfs_vnode {
   int                           v_no;         /* vnode number. */
   mode_t                        v_mode;       /* Type and permissions. */
   size_t                        v_size;       /* File size in bytes. */
+  u32                           v_nlinks;     /* Directory entries referring
+                                               * to this vnode. */
   dev_t                         v_dev;        /* Device ID (if device file). */
   vfs_vnode_operations_t        v_iops;       /* Inode operations. */
   vfs_file_operations_t         v_fops;       /* File operations. */
@@ -300,6 +333,13 @@ struct vfs_file {
   } ro;
 };
 
+/* Directory entry, as returned by getdents. */
+struct vfs_dirent {
+  int                     d_vno;          /* vnode number, 0 if the
+                                           * filesystem can't tell it. */
+  char                    d_name[VFS_NAME_MAX + 1];
+};
+
 /*****************************************************************************/
 /* Others ********************************************************************/
 /*****************************************************************************/
@@ -313,12 +353,22 @@ int vfs_init();
 /*****************************************************************************/
 int vfs_mount(dev_t devid, char *path, char *fs_type);
 int vfs_stat(char *path, struct stat *stat);
+int vfs_statfs(char *path, struct statfs *st);
 int vfs_mkdir(char *path, mode_t mode);
 int vfs_mknod(char *path, mode_t mode, dev_t dev);
+int vfs_unlink(char *path);
+int vfs_rmdir(char *path);
+int vfs_truncate(char *path, size_t size);
 vfs_file_t * vfs_open(char *path, int flags, mode_t mode);
 ssize_t vfs_write(vfs_file_t *filp, void *buf, size_t count);
 ssize_t vfs_read(vfs_file_t *filp, void *buf, size_t count);
 off_t vfs_lseek(vfs_file_t *filp, off_t off, int whence);
+ssize_t vfs_getdents(vfs_file_t *filp, vfs_dirent_t *dirents, size_t count);
+int vfs_flush(vfs_file_t *filp);
 int vfs_close(vfs_file_t *filp);
 
+/* Another reference to filp, for another file descriptor. They share the
+ * offset and each one must be closed. */
+vfs_file_t * vfs_dup(vfs_file_t *filp);
+
 #endif
@@ -0,0 +1,86 @@
+/* Paging.
+ *
+ * Processes used to get a contiguous piece of physical memory and segments
+ * covering it, which means copying a process meant copying all of it. With
+ * paging each process has an address space of its own instead, and pages
+ * can be shared.
+ *
+ * Segments are still there: every process has its code and data segments,
+ * but they all start at linear address VM_USER_ADDR, where the process'
+ * pages are mapped. Below it the whole physical memory is identity mapped
+ * with 4 MB pages, for the kernel only, so the kernel keeps seeing physical
+ * addresses everywhere and nothing there had to change. The kernel part of
+ * the page directory is the same for everybody; the user part is a single
+ * page table, so processes can't be larger than VM_USER_SIZE. Physical
+ * memory from VM_USER_ADDR on can't be reached, the frames for user pages
+ * come from below it.
+ *
+ *  ------------------- 0xffffffff (4G)
+ *  |  IDENTITY (APIC) |
+ *  |------------------| VM_USER_ADDR + VM_USER_SIZE
+ *  |    USER PAGES    |
+ *  |------------------| VM_USER_ADDR (3G)
+ *  |     IDENTITY     |
+ *  ------------------- 0x00000000
+ *
+ * fork() shares all the pages of the parent with the child, read-only for
+ * both and marked copy-on-write. The first one writing to a page takes a
+ * page fault, gets a copy of its own and goes on; if nobody else has the
+ * page anymore it just gets it writable back. The kernel honors read-only
+ * pages too (CR0.WP), so it can't write to a shared page behind the
+ * processes' back.
+ *
+ * Addresses taken by the functions below are offsets in the user segments,
+ * i.e. what the process sees. Page directories are NULL for the kernel's,
+ * which has no user pages and is what kernel threads and the idle tasks
+ * use.
+ */
+
+#ifndef __VM_H__
+#define __VM_H__
+
+#include <typedef.h>
+#include <mem.h>
+
+#define VM_USER_ADDR        0xc0000000
+#define VM_USER_SIZE        0x00400000  /* One page table. */
+#define VM_USER_PAGES       ((VM_USER_SIZE) / (MEM_FRAME_SIZE))
+
+/* Page directory and page table entries. */
+#define VM_PRESENT          0x00000001
+#define VM_WRITE            0x00000002
+#define VM_USER             0x00000004
+#define VM_BIG              0x00000080  /* 4 MB page, directory only. */
+#define VM_COW              0x00000200  /* One of the bits left to us. */
+#define VM_FRAME_MASK       0xfffff000
+
+/* Builds the kernel's page directory and turns paging on in the BSP. It
+ * also takes the page faults from now on. Needs the CPU to have 4 MB pages,
+ * returns -1 if it hasn't. */
+int vm_init();
+
+/* Turns paging on in an application processor. */
+void vm_init_cpu();
+
+/* A new address space with no user pages. Returns NULL if there's no
+ * memory for it. */
+u32 * vm_create();
+
+/* Releases dir along with the pages nobody else shares. dir must not be in
+ * use. */
+void vm_destroy(u32 *dir);
+
+/* Maps zeroed writable pages in dir for [addr, addr + size). */
+int vm_alloc(u32 *dir, u32 addr, u32 size);
+
+/* Where byte addr of dir is for the kernel, NULL if it's not mapped. */
+void * vm_frame(u32 *dir, u32 addr);
+
+/* A copy of dir sharing all its pages copy-on-write. dir may be the one in
+ * use. Returns NULL if there's no memory for it. */
+u32 * vm_fork(u32 *dir);
+
+/* Makes dir the address space of this processor. */
+void vm_activate(u32 *dir);
+
+#endif
@@ -0,0 +1,42 @@
+/* Wait queues.
+ *
+ * A wait queue holds the processes waiting for something to happen, like
+ * data arriving at a device. Code that needs to wait checks its condition
+ * and sleeps in a loop, both with interrupts disabled so the wake up can't
+ * slip in between:
+ *
+ *   lock();
+ *   while (!condition)
+ *     wait_sleep(&queue);
+ *   ...
+ *   unlock();
+ *
+ * Whoever makes the condition true, usually an interrupt handler, calls
+ * wait_wake_up() with interrupts disabled too. Sleepers are blocked and the
+ * scheduler runs someone else in the meantime. The idle task can't block, so
+ * when it sleeps it just halts until the next interrupt.
+ */
+
+#ifndef __WAIT_H__
+#define __WAIT_H__
+
+#include <typedef.h>
+#include <proc.h>
+
+typedef struct wait_queue {
+  proc_t *head;
+  proc_t *tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT     { NULL, NULL }
+
+void wait_init(wait_queue_t *q);
+
+/* Blocks the current process in q until it's woken up. Interrupts must be
+ * disabled, and they are again when this returns. */
+void wait_sleep(wait_queue_t *q);
+
+/* Makes all processes sleeping in q ready. Interrupts must be disabled. */
+void wait_wake_up(wait_queue_t *q);
+
+#endif
@@ -68,7 +68,8 @@
 ;      and then it'll push the IRQ it's serving. Then, it'll call a common
 ;      code.
 ;   2. The common code will store all registers and will call the C generic
-;      handler. Before the call to C, the stack is as follows:
+;      handler with a pointer to them (an itr_frame_t). Before the call to C,
+;      the stack is as follows:
 ;       higher address  SS (if a stack switch occurred)
 ;                       ESP (if a stack switch occurred)
 ;                       EFLAGS
@@ -166,11 +167,20 @@ itr_common_part:
   mov fs, ax
   mov gs, ax
 
-  ; Call the C function. Following C calling convention, this function must
-  ; have this signature:
-  ;   itr_generic_handler(edi, esi, ebp, esp, ebx, edx, ecx, eax, irq, err,
-  ;                       eip, cs, eflags)
+  ; Call the C function with a pointer to the frame we've just finished,
+  ; which starts right at esp. Its C signature is:
+  ;   void itr_interrupt_handler(itr_frame_t *frame)
+  ; Whatever the C code changes in the frame is what popad and iretd below
+  ; will restore.
+  mov eax, esp
+  push eax
   call itr_interrupt_handler
+  add esp, 4
+
+  ; From here on this is shared with other entry points that leave the same
+  ; frame in the stack, like sysenter in syscall.asm.
+global itr_return
+itr_return:
 
   ; Let's do the same checks the processor does: compare the CS stored in the
   ; stack to determine whether a new SS will be loaded or not. Our rule is:
@@ -8,6 +8,12 @@
 #include <gdt.h>
 #include <lock.h>
 #include <hw.h>
+#include <sched.h>
+#include <softirq.h>
+#include <devices.h>
+#include <vfs.h>
+#include <smp.h>
+#include <spinlock.h>
 
 #define IDT_ENTRIES               256
 
@@ -25,72 +31,208 @@ typedef struct {
   itr_idt_entry_t *base_address;
 } __attribute__((__packed__)) itr_lidt_t;
 
+/* A link in a chain of handlers. */
+typedef struct itr_handler_node {
+  interrupt_handler_t         handler;
+  void                      * cookie;
+  struct itr_handler_node   * next;
+} itr_handler_node_t;
+
 /* These are the two globals that will make all this work. */
-/* This array will store all interrupt handlers currently active. The index
- * is the IRQ. */
-interrupt_handler_t *interrupt_handlers;
+/* This array will store the chains of interrupt handlers currently active.
+ * The index is the IRQ. */
+static itr_handler_node_t **interrupt_handlers;
 
 /* This is the actual IDT. This needs to be aligned. */
 itr_idt_entry_t *idt;
 
-/* This is the lock flag. It will be set before interrupts handlers are called
- * and clear right after they return. */
-#define ITR_STATUS_NOT_IN     0
-#define ITR_STATUS_IN         1
-static int itr_status;
+/* Statistics, one entry per IDT entry. */
+static itr_stats_t *itr_stats;
+
+/* This is the lock status: how many interrupt handlers are being run. It's
+ * incremented before handlers are called and decremented right after they
+ * return, so it's only greater than 1 if an exception happens inside a
+ * handler. Each processor has its own, and so does each process, which the
+ * scheduler saves and restores when switching. */
+static int itr_status[SMP_MAX_CPUS];
+
+int itr_get_status() {
+  return itr_status[smp_cpu_id()];
+}
+
+void itr_set_status(int status) {
+  itr_status[smp_cpu_id()] = status;
+}
+
+/* Records a handler run that took cycles. Interrupts are disabled. */
+static void itr_stats_account(itr_irq_t irq, u64 cycles) {
+  itr_stats_t *st;
+  u32 c;
+  int b;
+
+  st = itr_stats + irq;
+  c = cycles > 0xffffffff ? 0xffffffff : (u32)cycles;
+
+  /* Bucket b holds runs of 2^(b + ITR_HIST_FIRST) cycles or more, and less
+   * than twice that. The first and the last one also take whatever falls
+   * outside. */
+  b = c == 0 ? 0 : (int)hw_bsr(c) - ITR_HIST_FIRST;
+  if (b < 0)
+    b = 0;
+  if (b >= ITR_HIST_BUCKETS)
+    b = ITR_HIST_BUCKETS - 1;
+
+  st->count ++;
+  st->hist[b] ++;
+  if (c > st->max)
+    st->max = c;
+}
 
 /* This is the generic handler that will be called from assembly code whenever
- * an interrupt is issued. */
-void itr_interrupt_handler(itr_cpu_regs_t regs,
-                           itr_intr_data_t intr,
-                           itr_stack_state_t stack) {
+ * an interrupt is issued. frame points into the interrupted code's stack. */
+void itr_interrupt_handler(itr_frame_t *frame) {
+  itr_handler_node_t *n;
+  itr_irq_t irq;
+  u64 start;
+  int handled;
 
-  /* At this point IF was cleared. Everyone calling unlock from now on won't
-   * call sti. */
-  itr_status = ITR_STATUS_IN;
+  /* At this point IF was cleared. */
+  itr_enter();
+  irq = frame->intr.irq;
 
   /* No one should call this except for the assembly code, so there's no need
-   * to check intr.irq for correctness. */
-  interrupt_handler_t ih = interrupt_handlers[intr.irq];
-  if (ih != NULL) {
-    /* Call the handler. */
-    (*ih)(regs, intr, stack);
-  }
-  else {
-    fb_printf(">> int: IRQ: %dd, ERR: %dx\n", intr.irq, intr.err);
+   * to check the irq for correctness. */
+  if (interrupt_handlers[irq] == NULL && irq < PIC_MASTER_BASE_IRQ) {
+    /* An exception nobody handles. Returning would just repeat it. */
+    fb_printf(">> int: IRQ: %dd, ERR: %dx\n", irq, frame->intr.err);
 
     hw_hlt();
-
-    /* This only works because we know we only deal with the 8259 PICs.
-     * That said, let's just silence the interrupt -some day we'll also log
-     * it-. */
-    pic_send_eoi(intr.irq);
   }
 
-  /* Now we're leaving, clear the status. */
-  itr_status = ITR_STATUS_NOT_IN;
+  /* Call the whole chain, timing it. */
+  handled = ITR_NOT_MINE;
+  start = hw_rdtsc();
+  for (n = interrupt_handlers[irq]; n != NULL; n = n->next)
+    if ((*n->handler)(frame, n->cookie) == ITR_HANDLED)
+      handled = ITR_HANDLED;
+  if (interrupt_handlers[irq] != NULL)
+    itr_stats_account(irq, hw_rdtsc() - start);
+  if (handled == ITR_NOT_MINE)
+    itr_stats[irq].unhandled ++;
+
+  /* Only interrupts from a controller get an EOI, the rest is ignored. With
+   * the 8259 PICs those are the PIC IRQ vectors. With the APIC they are the
+   * ISA vectors plus APIC_TIMER_IRQ and APIC_RESCHED_IRQ, acknowledged
+   * through the local APIC. Exceptions, system calls and spurious interrupts
+   * never get one. */
+  pic_send_eoi(irq);
+
+  itr_leave(frame);
+}
+
+static void lock_kernel_acquire();
+static void lock_kernel_release();
+
+void itr_enter() {
+  lock_kernel_acquire();
+  itr_status[smp_cpu_id()] ++;
+}
+
+void itr_leave(itr_frame_t *frame) {
+  /* The outermost handler is done. If the interrupted code could take
+   * interrupts, run the work the handlers deferred with them enabled. */
+  if (itr_get_status() == 1 && (frame->stack.eflags & HW_EFLAGS_IF))
+    softirq_run();
+
+  /* This is the time to switch processes if the time slice is over. The
+   * process will be back here when it's scheduled again and will return from
+   * the interrupt as if nothing. */
+  if (itr_get_status() == 1)
+    sched_preempt(frame->stack.cs);
+
+  /* Now we're leaving, clear the status. The processor may not be the one we
+   * entered on, but the kernel lock is held here anyway. */
+  itr_status[smp_cpu_id()] --;
+  lock_kernel_release();
 }
 
-/* Set an interrupt handler. This will activate the entry in the IDT and
- * attach the handler. Use flags to set the flags of the gate. */
-void itr_set_interrupt_handler(itr_irq_t irq,
-                               interrupt_handler_t handler,
-                               u16 flags) {
-  interrupt_handlers[irq] = handler;
+/* Add an interrupt handler. This will set the flags of the IDT entry and
+ * attach the handler at the end of the chain. */
+int itr_set_interrupt_handler(itr_irq_t irq,
+                              interrupt_handler_t handler,
+                              void *cookie,
+                              u16 flags) {
+  itr_handler_node_t *n, **pp;
+  u32 eflags;
+
+  n = (itr_handler_node_t *)kalloc(sizeof(itr_handler_node_t));
+  if (n == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+  n->handler = handler;
+  n->cookie = cookie;
+  n->next = NULL;
+
+  eflags = irq_save();
+  for (pp = interrupt_handlers + irq; *pp != NULL; pp = &(*pp)->next);
+  *pp = n;
   idt[irq].flags = flags;
+  irq_restore(eflags);
+
+  return 0;
+}
+
+int itr_remove_interrupt_handler(itr_irq_t irq,
+                                 interrupt_handler_t handler,
+                                 void *cookie) {
+  itr_handler_node_t *n, **pp;
+  u32 eflags;
+
+  eflags = irq_save();
+  for (pp = interrupt_handlers + irq;
+       *pp != NULL && ((*pp)->handler != handler || (*pp)->cookie != cookie);
+       pp = &(*pp)->next);
+  n = *pp;
+  if (n != NULL)
+    *pp = n->next;
+  irq_restore(eflags);
+
+  if (n == NULL) {
+    set_errno(E_NOKOBJ);
+    return -1;
+  }
+  kfree(n);
+  return 0;
 }
 
 /* These are set in interrupts.asm. */
 extern void itr_set_idt_entries_offsets(itr_idt_entry_t *);
 extern void itr_load_idt(itr_lidt_t *);
 
+/* Tells the CPU where the IDT is. All processors share it. */
+static void itr_load() {
+  itr_lidt_t l;
+
+  /* Load IDT. To load the IDT we need a 6 bytes structure: the lower 2 bytes
+   * are the limit, the upper four are the base address. We can't naturally
+   * pass such struct in the stack, so let's build it up here and pass the
+   * the address to it. */
+  l.base_address = idt;
+  l.limit = IDT_ENTRIES * sizeof(itr_idt_entry_t) - 1;
+                              /* I discovered why -1: Intel adds the limit to
+                               * the base address to figure out the last valid
+                               * address. Then, a value of 0 means there's one
+                               * byte, and that applies to everything else. */
+  itr_load_idt(&l);
+}
+
 /* Initialize IDT and the whole interruption system. */
 int itr_set_up() {
   int i;
-  itr_lidt_t l;
 
-  interrupt_handlers =
-    (interrupt_handler_t *)kalloc(sizeof(interrupt_handler_t) * IDT_ENTRIES);
+  interrupt_handlers = (itr_handler_node_t **)
+    kalloc(sizeof(itr_handler_node_t *) * IDT_ENTRIES);
   if (interrupt_handlers == NULL) {
     set_errno(E_NOMEM);
     return -1;
@@ -102,9 +244,16 @@ int itr_set_up() {
     return -1;
   }
 
+  itr_stats = (itr_stats_t *)kalloc(sizeof(itr_stats_t) * IDT_ENTRIES);
+  if (itr_stats == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+
   /* Clear all interrupt handlers. */
   for (i = 0; i < 256; i++)
     interrupt_handlers[i] = NULL;
+  memset(itr_stats, 0, sizeof(itr_stats_t) * IDT_ENTRIES);
 
   /* Ask the assembly code to fill the offsets. */
   itr_set_idt_entries_offsets(idt);
@@ -117,28 +266,201 @@ int itr_set_up() {
     idt[i].flags = IDT_PRESENT | IDT_GATE_INTR | IDT_DPL_RING_0;
   }
 
-  /* Load IDT. To load the IDT we need a 6 bytes structure: the lower 2 bytes
-   * are the limit, the upper four are the base address. We can't naturally
-   * pass such struct in the stack, so let's build it up here and pass the
-   * the address to it. */
-  l.base_address = idt;
-  l.limit = IDT_ENTRIES * sizeof(itr_idt_entry_t) - 1;
-                              /* I discovered why -1: Intel adds the limit to
-                               * the base address to figure out the last valid
-                               * address. Then, a value of 0 means there's one
-                               * byte, and that applies to everything else. */
-  itr_load_idt(&l);
+  itr_load();
 
   return 0;
 }
 
-/* Keep interrupts from happening. */
-void lock() {
+void itr_set_up_cpu() {
+  itr_load();
+}
+
+/*****************************************************************************
+ * /dev/interrupts                                                           *
+ *****************************************************************************/
+
+/* Longest line: vector, count, unhandled, max and the histogram. */
+#define ITR_STATS_LINE    (4 * 11 + ITR_HIST_BUCKETS * 11 + 2)
+
+/* The text is made when the file is opened, so readers get a consistent
+ * picture no matter how they read it. */
+typedef struct itr_stats_file {
+  size_t  len;
+  char    text[];
+} itr_stats_file_t;
+
+static int itr_stats_open(vfs_vnode_t *node, vfs_file_t *filp) {
+  itr_stats_file_t *sf;
+  itr_stats_t st;
+  u32 flags;
+  int i, j, n;
+
+  for (i = 0, n = 0; i < IDT_ENTRIES; i ++)
+    if (itr_stats[i].count > 0 || itr_stats[i].unhandled > 0)
+      n ++;
+
+  sf = (itr_stats_file_t *)kalloc(sizeof(itr_stats_file_t) +
+                                  (n + 1) * ITR_STATS_LINE);
+  if (sf == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+
+  sf->len = sprintf(sf->text, "vector count unhandled max_cycles "
+                              "log2_cycles_from_%dd\n", ITR_HIST_FIRST);
+  for (i = 0; i < IDT_ENTRIES && n > 0; i ++) {
+    /* Only this entry has to be consistent, keep it short. */
+    flags = irq_save();
+    st = itr_stats[i];
+    irq_restore(flags);
+
+    if (st.count == 0 && st.unhandled == 0)
+      continue;
+    n --;
+
+    sf->len += sprintf(sf->text + sf->len, "%dd %dd %dd %dd",
+                       i, st.count, st.unhandled, st.max);
+    for (j = 0; j < ITR_HIST_BUCKETS; j ++)
+      sf->len += sprintf(sf->text + sf->len, " %dd", st.hist[j]);
+    sf->text[sf->len ++] = '\n';
+  }
+
+  filp->private_data = sf;
+  return 0;
+}
+
+static int itr_stats_release(vfs_vnode_t *node, vfs_file_t *filp) {
+  kfree(filp->private_data);
+  return 0;
+}
+
+static ssize_t itr_stats_read(vfs_file_t *filp, char *buf, size_t count) {
+  itr_stats_file_t *sf;
+
+  sf = (itr_stats_file_t *)filp->private_data;
+  if (filp->f_pos >= sf->len)
+    return 0;
+  if (count > sf->len - filp->f_pos)
+    count = sf->len - filp->f_pos;
+
+  memcpy(buf, sf->text + filp->f_pos, count);
+  filp->f_pos += count;
+  return count;
+}
+
+static ssize_t itr_stats_write(vfs_file_t *filp, char *buf, size_t count) {
+  set_errno(E_ACCESS);
+  return -1;
+}
+
+int itr_stats_init() {
+  vfs_file_operations_t ops;
+
+  ops.open = itr_stats_open;
+  ops.release = itr_stats_release;
+  ops.flush = NULL;
+  ops.read = itr_stats_read;
+  ops.write = itr_stats_write;
+  ops.lseek = NULL;
+  ops.ioctl = NULL;
+  ops.readdir = NULL;
+  ops.getdents = NULL;
+
+  return dev_register_char_dev(DEV_MAKE_DEV(DEV_MISC_MAJOR, ITR_STATS_MINOR),
+                               ITR_STATS_NAME,
+                               &ops);
+}
+
+/*****************************************************************************
+ * Locking, see lock.h                                                       *
+ *****************************************************************************/
+
+/* Current lock() state of each processor. */
+static lock_state_t lock_state[SMP_MAX_CPUS];
+
+/* The kernel lock. */
+static spinlock_t lock_kernel = SPINLOCK_INIT;
+
+/* Only the outermost acquire spins, the processor owns it after that.
+ * Interrupts are disabled in both, otherwise an interrupt could see the
+ * nesting and the lock out of sync. */
+static void lock_kernel_acquire() {
+  lock_state_t *ls;
+
+  ls = lock_state + smp_cpu_id();
+  if (ls->kernel ++ == 0)
+    spin_lock(&lock_kernel);
+}
+
+static void lock_kernel_release() {
+  lock_state_t *ls;
+
+  ls = lock_state + smp_cpu_id();
+  if (-- ls->kernel == 0)
+    spin_unlock(&lock_kernel);
+}
+
+int lock_kernel_drop() {
+  lock_state_t *ls;
+  int depth;
+
+  ls = lock_state + smp_cpu_id();
+  depth = ls->kernel;
+  ls->kernel = 0;
+  if (depth > 0)
+    spin_unlock(&lock_kernel);
+  return depth;
+}
+
+void lock_kernel_retake(int depth) {
+  if (depth == 0)
+    return;
+  spin_lock(&lock_kernel);
+  lock_state[smp_cpu_id()].kernel = depth;
+}
+
+u32 irq_save() {
+  u32 flags;
+
+  flags = hw_save_flags();
   hw_cli();
+  lock_kernel_acquire();
+  return flags;
 }
 
-/* Conditionally enable interrupts. */
+void irq_restore(u32 flags) {
+  lock_kernel_release();
+  hw_restore_flags(flags);
+}
+
+/* Keep interrupts and the other processors from happening. */
+void lock() {
+  lock_state_t *ls;
+  u32 flags;
+
+  flags = irq_save();
+  ls = lock_state + smp_cpu_id();
+  if (ls->depth ++ == 0)
+    ls->flags = flags;
+}
+
+/* Put interrupts back as they were before the outermost lock(). The kernel
+ * lock is released once per unlock(), as irq_save() took it once per
+ * lock(). */
 void unlock() {
-  if (itr_status == ITR_STATUS_NOT_IN)
-    hw_sti();
+  lock_state_t *ls;
+
+  ls = lock_state + smp_cpu_id();
+  if (-- ls->depth == 0)
+    irq_restore(ls->flags);
+  else
+    lock_kernel_release();
+}
+
+void lock_get_state(lock_state_t *state) {
+  *state = lock_state[smp_cpu_id()];
+}
+
+void lock_set_state(lock_state_t *state) {
+  lock_state[smp_cpu_id()] = *state;
 }
@@ -10,6 +10,10 @@
 ;   [esp + 4] holds the port
 ;   [esp    ] holds the return address.
 ;   al, ax, eax will hold the retrieved value according to the case.
+; The rep_Xw family moves a whole buffer of words through a single port:
+;   [esp + 12] holds the amount of words.
+;   [esp + 8]  holds the buffer.
+;   [esp + 4]  holds the port.
 
 [bits 32]
 global outb
@@ -18,6 +22,8 @@ global outd
 global inb
 global inw
 global ind
+global rep_inw
+global rep_outw
 
 outb:
   mov al, [esp + 8]
@@ -51,3 +57,23 @@ ind:
   mov dx, [esp + 4]
   in eax, dx
   ret
+
+rep_inw:
+  push edi
+  mov dx, [esp + 8]
+  mov edi, [esp + 12]
+  mov ecx, [esp + 16]
+  cld
+  rep insw
+  pop edi
+  ret
+
+rep_outw:
+  push esi
+  mov dx, [esp + 8]
+  mov esi, [esp + 12]
+  mov ecx, [esp + 16]
+  cld
+  rep outsw
+  pop esi
+  ret
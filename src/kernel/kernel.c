@@ -4,22 +4,43 @@
 #include <mem.h>
 #include <rtc.h>
 #include <pic.h>
+#include <apic.h>
+#include <pit.h>
 #include <serial.h>
 #include <kb.h>
 #include <errors.h>
 #include <devices.h>
 #include <vfs.h>
 #include <fs/rootfs.h>
+#include <ata.h>
+#include <bio.h>
+#include <bcache.h>
+#include <fs/minix.h>
 <<<<<<< HEAD
 #include <proc.h>
 #include <syscall.h>
 =======
 #include <time.h>
 >>>>>>> projects/time
+#include <sched.h>
+#include <timer.h>
+#include <softirq.h>
+#include <smp.h>
+#include <vm.h>
 
 /* Just the declaration of the second, main kernel routine. */
 void kmain2();
 
+/* First process. It starts as a kernel thread and becomes init. */
+static void kinit(void *path) {
+  char *argv[2];
+
+  argv[0] = (char *)path;
+  argv[1] = NULL;
+  proc_exec((char *)path, argv);
+  kernel_panic("Could not run init :(");
+}
+
 void kmain(void *gdt_base, void *mem_map) {
   /* This is a hack. We need to set the stack to the right place, but we need
    * to do this AFTER the memory allocator has checked and initialized the
@@ -59,14 +80,17 @@ void kmain(void *gdt_base, void *mem_map) {
 void kmain2() {
   vfs_file_t *f;
 
-  #include "../userland/tests/build/hello.h"
-
   /* Now we're here, let's set the panic level to hysterical: nothing here
    * can fail. */
   set_panic_level(PANIC_HYSTERICAL);
 
-  /* Set up the interrupt subsytem. */
+  /* Set up the interrupt subsytem and its bottom halves. */
   itr_set_up();
+  softirq_init();
+
+  /* Turn paging on. It takes the page faults, so it needs the interrupts. */
+  if (vm_init() == -1)
+    kernel_panic("Could not turn paging on :(");
 
   /* Initialize the Virtual File System. */
   vfs_init();
@@ -80,11 +104,21 @@ void kmain2() {
   /* Initializes the dev subsystem. */
   dev_init();
 
+  /* Initializes the block I/O request queues and the buffer cache. */
+  bio_init();
+  bcache_init();
+
+  /* Register the disk filesystems. */
+  minix_init();
+
   set_panic_level(PANIC_PERROR);
 
   /* Complete memory initialization now as a device and filesystem module. */
   mem_init();
 
+  /* Interrupts statistics in /dev/interrupts. */
+  itr_stats_init();
+
 <<<<<<< HEAD
 =======
   memset(buf2, '-', 10);
@@ -96,8 +130,10 @@ void kmain2() {
 
 
 >>>>>>> projects/time
-  /* Initializes the PICs. This mask all interrupts. */
+  /* Initializes the PICs. This mask all interrupts. If there are APICs they
+   * take over, masked too. */
   pic_init();
+  apic_init();
 
   /* Activate the keyboard. */
   kb_init();
@@ -108,21 +144,42 @@ void kmain2() {
   pic_unmask_dev(PIC_SERIAL_1_IRQ);
   pic_unmask_dev(PIC_SERIAL_2_IRQ);
 
+  /* Start the disks. Their IRQs come through the slave PIC. */
+  ata_init();
+  pic_unmask_dev(PIC_SLAVE_PIC_IRQ);
+  pic_unmask_dev(PIC_PRIMARY_ATA_IRQ);
+  pic_unmask_dev(PIC_SECONDARY_ATA_IRQ);
+
+  /* Start the timer. It drives the buffer cache writeback, the kernel timers
+   * and the scheduler. The local APIC timer is preferred over the PIT. */
+  timer_init();
+  pit_init();
+  if (apic_timer_init() == 0)
+    pit_interrupt_disabled();
+  else
+    pic_unmask_dev(PIC_TIMER_IRQ);
+
   /* Start system calls subsystem. */
   syscall_init();
 
   hw_sti();
 
-  /* Test userland. */
-
-  f = vfs_open("/init", FILE_O_WRITE | FILE_O_CREATE, 0755);
-  if (f == NULL) kernel_panic("no /init\n");
-  vfs_write(f, tests_build_hello, tests_build_hello_len);
-  vfs_close(f);
+  /* Mount the MINIX partition of the first disk, where the kernel lives
+   * too. It needs interrupts to be enabled. */
+  vfs_mkdir("/mnt", FILE_PERM_755);
+  if (vfs_mount(DEV_MAKE_DEV(DEV_IDE0_MAJOR, 3), "/mnt", MINIX_NAME) == -1)
+    kernel_panic("Could not mount /mnt :(");
 
+  /* Start the scheduler. From now on this is the idle task. */
   proc_init();
 
-  proc_exec("/init");
+  /* Dirty buffers get written back in a thread of their own. */
+  if (bcache_start_writeback() == -1)
+    kernel_panic("Could not start the buffer cache writeback :(");
+
+  /* Test userland. */
+  if (proc_kthread(kinit, "/mnt/init") == NULL)
+    kernel_panic("Could not run init :(");
 
     
 
@@ -172,7 +229,11 @@ void kmain2() {
 
 
 
-  /* This is the idle loop. */
+  /* Everything is set up, the other processors can start scheduling. */
+  fb_printf("\nProcessors running: %dd\n", smp_init());
+
+  /* This is the idle loop. Whenever a process is ready the timer takes us
+   * out of here. */
   while (1) {
     hw_hlt();
   }
@@ -32,3 +32,31 @@ proc_switch_to_lower_privilege_level:
 
   ; Do the switch.
   iretd
+
+; Called like in C, this function switches kernel stacks. Its arguments are:
+;   (old_esp, new_esp)
+; The callee-saved registers are pushed into the current stack, whose final
+; esp is stored at old_esp. Then the registers are popped from the stack at
+; new_esp, which must have been left by a previous call to this function or
+; built by hand to look like it. Everything else (including the interrupt
+; frame, if we got here from an interrupt handler) stays in each stack, so
+; returning from here means returning into the other process.
+global proc_switch_context
+proc_switch_context:
+  mov eax, [esp + 4]                  ; old_esp
+  mov edx, [esp + 8]                  ; new_esp
+
+  push ebp
+  push ebx
+  push esi
+  push edi
+
+  mov [eax], esp
+  mov esp, edx
+
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+
+  ret
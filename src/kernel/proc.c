@@ -2,8 +2,15 @@
 #include <string.h>
 #include <gdt.h>
 #include <mem.h>
+#include <sched.h>
+#include <lock.h>
+#include <errors.h>
+#include <hw.h>
+#include <vm.h>
+#include <wait.h>
 
-#define PROC_MAX_PROC   10
+/* Processes run in user mode with interrupts enabled. */
+#define PROC_EFLAGS     (0x00000002 | HW_EFLAGS_IF)
 
 /* We only handle a.out omagic format. */
 typedef struct {
@@ -20,48 +27,239 @@ typedef struct {
 /* My processes. */
 static proc_t procs[PROC_MAX_PROC];
 
-/* Pointer to current process. */
-proc_t * proc_cur;
+/* Idle tasks of the application processors. The BSP's is procs[0]. */
+static proc_t proc_idles[SMP_MAX_CPUS];
+
+/* Pointer to current process of each processor. */
+proc_t * proc_curs[SMP_MAX_CPUS];
+
+/* Last PID given. */
+static pid_t proc_last_pid;
+
+/* Parents waiting for their children to exit. */
+static wait_queue_t proc_exited = WAIT_QUEUE_INIT;
+
+/* Where forked and spawned processes leave the kernel, in interrupts.asm. */
+extern void itr_return();
 
 /* Starts the process manager. */
 int proc_init() {
   memset(&procs, 0, PROC_MAX_PROC * sizeof(proc_t));
 
-  /* Prepare the initial process, aka init. */
-  procs[0].pid = 1;
-  procs[0].ppid = 1;  /* init is his own father: the mystery of the trinity. */
+  /* The code running right now becomes the idle task. It keeps the boot
+   * stack and runs whenever there's nothing else to do. */
+  procs[0].pid = 0;
+  procs[0].ppid = 0;
+  procs[0].flags = PROC_F_KTHREAD;
+  procs[0].kstack = NULL;
+  procs[0].cpu = 0;
+  procs[0].affinity = 1 << 0;
 
-  /* Sets the current user space process to the structure set. When ready,
-   * the kernel will call proc_exec() to execute it. */
   proc_cur = procs;
+  proc_last_pid = 0;
+
+  return sched_init(procs);
+}
+
+/* Same for the application processors. Their idle tasks aren't in procs, so
+ * they're never taken for a new process. */
+int proc_init_cpu(char *kstack) {
+  proc_t *p;
+  int cpu;
+
+  cpu = smp_cpu_id();
+  p = proc_idles + cpu;
+  memset(p, 0, sizeof(proc_t));
+  p->pid = 0;
+  p->ppid = 0;
+  p->flags = PROC_F_KTHREAD;
+  p->kstack = kstack;
+  p->cpu = cpu;
+  p->affinity = 1 << cpu;
+
+  proc_cur = p;
+
+  return sched_init(p);
+}
+
+/* Finds a free slot. The slot is returned blocked so no one else takes it
+ * while it's being prepared. Slots are reused along with their kernel stacks:
+ * they can't be freed when the process exits because it's still running on
+ * them. */
+static proc_t * proc_alloc() {
+  proc_t *p;
+  char *kstack;
+  int i;
+
+  lock();
+  for (i = 1; i < PROC_MAX_PROC; i ++)
+    if (procs[i].state == PROC_UNUSED)
+      break;
+  if (i == PROC_MAX_PROC) {
+    unlock();
+    set_errno(E_LIMIT);
+    return NULL;
+  }
 
+  p = procs + i;
+  kstack = p->kstack;
+  memset(p, 0, sizeof(proc_t));
+  p->kstack = kstack;
+  p->state = PROC_BLOCKED;
+  p->cpu = -1;
+  p->affinity = PROC_AFFINITY_ALL;
+  p->pid = ++ proc_last_pid;
+  p->ppid = proc_cur->pid;
+  unlock();
+
+  return p;
+}
+
+/* Gives p a kernel stack if its slot had none. On failure the slot is freed. */
+static int proc_alloc_kstack(proc_t *p) {
+  if (p->kstack != NULL)
+    return 0;
+
+  p->kstack = (char *)kalloc(PROC_KSTACK_FRAMES * MEM_FRAME_SIZE);
+  if (p->kstack == NULL) {
+    p->state = PROC_UNUSED;
+    set_errno(E_NOMEM);
+    return -1;
+  }
   return 0;
 }
 
+/* Allocates the code and data segments of a process limit pages long. They
+ * all start where the user pages are mapped. */
+static int proc_alloc_segments(u32 limit, u16 *code, u16 *data) {
+  *code = gdt_alloc((void *)VM_USER_ADDR,
+                    limit,
+                    GDT_GRANULARITY_4K      |
+                    GDT_OP_SIZE_32          |
+                    GDT_PRESENT             |
+                    GDT_DPL_USER            |
+                    GDT_DESC_TYPE_CODE_DATA |
+                    GDT_CODE_SEGMENT        |
+                    GDT_CODE_EXEC_READ      |
+                    GDT_CODE_NON_CONFORMING);
+  if (*code == 0) {
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  *data = gdt_alloc((void *)VM_USER_ADDR,
+                    limit,
+                    GDT_GRANULARITY_4K      |
+                    GDT_OP_SIZE_32          |
+                    GDT_PRESENT             |
+                    GDT_DPL_USER            |
+                    GDT_DESC_TYPE_CODE_DATA |
+                    GDT_DATA_SEGMENT        |
+                    GDT_DATA_READ_WRITE     |
+                    GDT_DATA_EXPAND_UP);
+  if (*data == 0) {
+    gdt_dealloc(*code);
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Sets the segments of p, user code and data. */
+static void proc_set_segments(proc_t *p, u16 code, u16 data) {
+  p->segs.cs = GDT_SEGMENT_SELECTOR(code, GDT_RPL_USER);
+  p->segs.ds = GDT_SEGMENT_SELECTOR(data, GDT_RPL_USER);
+  p->segs.ss = p->segs.ds;
+  p->segs.es = p->segs.ds;
+  p->segs.gs = p->segs.ds;
+  p->segs.fs = p->segs.ds;
+}
+
+/* First code run by kernel threads. When this is reached from
+ * proc_switch_context() interrupts are disabled and the thread looks like it
+ * called lock() with interrupts enabled, so unlock() enables them. The
+ * kernel lock nesting is one more than that: kernel threads keep it. */
+static void proc_kthread_start(void (* entry)(void *), void *arg) {
+  unlock();
+  entry(arg);
+  proc_exit(0);
+}
+
+proc_t * proc_kthread(void (* entry)(void *), void *arg) {
+  proc_t *p;
+  u32 *sp;
+
+  p = proc_alloc();
+  if (p == NULL)
+    return NULL;
+  if (proc_alloc_kstack(p) == -1)
+    return NULL;
+
+  /* Make the stack look like the thread was switched out by
+   * proc_switch_context() right before calling proc_kthread_start(). */
+  sp = (u32 *)(p->kstack + PROC_KSTACK_FRAMES * MEM_FRAME_SIZE);
+  *(-- sp) = (u32)arg;
+  *(-- sp) = (u32)entry;
+  *(-- sp) = 0;                           /* proc_kthread_start never returns. */
+  *(-- sp) = (u32)proc_kthread_start;     /* Where proc_switch_context goes. */
+  *(-- sp) = 0;                           /* ebp */
+  *(-- sp) = 0;                           /* ebx */
+  *(-- sp) = 0;                           /* esi */
+  *(-- sp) = 0;                           /* edi */
+  p->kesp = (u32)sp;
+
+  p->flags = PROC_F_KTHREAD;
+  p->itr_status = 0;
+  p->lock.depth = 1;
+  p->lock.flags = HW_EFLAGS_IF;
+  p->lock.kernel = 2;
+
+  lock();
+  sched_add(p);
+  unlock();
+
+  return p;
+}
+
 /*****************************************************************************
  * Release                                                                   *
  *****************************************************************************/
 
-/* Helper to release a segment. */
+/* Helper to release a segment. The memory goes with the page directory. */
 static void proc_release_segment(gdt_selector_t s) {
-  gdt_descriptor_t d;
-
-  d = gdt_get(s);
-  if (d == GDT_NULL_ENTRY)
+  if (gdt_get(s) == GDT_NULL_ENTRY)
     return;
 
   gdt_dealloc(s);
-  mem_release_frames(gdt_base(d), gdt_limit(d));
 }
 
-/* Release the resources of a process. */
+/* Release the resources of a process. If it's the one running, it goes on
+ * in the kernel's address space. */
 static void proc_release_memory(proc_t *p) {
+  u32 *dir;
+
+  if (p->pgdir != NULL) {
+    dir = p->pgdir;
+    p->pgdir = NULL;
+    if (p == proc_cur)
+      vm_activate(NULL);
+    vm_destroy(dir);
+  }
+
   proc_release_segment(p->segs.cs);
   proc_release_segment(p->segs.ds);
   proc_release_segment(p->segs.ss);
   proc_release_segment(p->segs.es);
   proc_release_segment(p->segs.fs);
   proc_release_segment(p->segs.gs);
+
+  p->segs.cs = 0;
+  p->segs.ds = 0;
+  p->segs.ss = 0;
+  p->segs.es = 0;
+  p->segs.fs = 0;
+  p->segs.gs = 0;
 }
 
 /* Blank the registers associated to a process. */
@@ -94,18 +292,93 @@ void proc_switch_to_userland(proc_t *p) {
 
 
 /*****************************************************************************
- * Exec                                                                      *
+ * Images                                                                    *
  *****************************************************************************/
 
-/* Replaces the current process with the binary located at path. */
-int proc_exec(char *path) {
+/* What it takes to run a binary, built before touching the process that
+ * will run it. */
+typedef struct {
+  u32 *pgdir;
+  u16 code_segment;
+  u16 data_segment;
+  u32 eip;
+  u32 esp;
+} proc_image_t;
+
+/* Reads size bytes from f into dir at addr, a page at a time: the pages
+ * aren't contiguous anymore. */
+static int proc_load(u32 *dir, vfs_file_t *f, u32 addr, u32 size) {
+  ssize_t r;
+  u32 n;
+
+  while (size > 0) {
+    n = MEM_FRAME_SIZE - addr % MEM_FRAME_SIZE;
+    if (n > size)
+      n = size;
+    r = vfs_read(f, vm_frame(dir, addr), n);
+    if (r == -1 || r == 0)
+      return -1;
+    addr += r;
+    size -= r;
+  }
+  return 0;
+}
+
+/* Copies argv to the top of the stack page ending at top, and leaves the
+ * stack the way _start(argc, argv) expects it, as if it had been called:
+ *
+ *    top  -> the strings
+ *            argv[argc] = NULL
+ *            ...
+ *            argv[0]
+ *            argv
+ *            argc
+ *    esp  -> return address, 0
+ *
+ * argv may be NULL, which is the same as no arguments. */
+static int proc_push_args(u32 *dir, u32 top, char **argv, u32 *esp) {
+  char *page;
+  u32 *args, bytes, str, arr;
+  int argc, i, n;
+
+  for (argc = 0, bytes = 0; argv != NULL && argv[argc] != NULL; argc ++)
+    bytes += strlen(argv[argc]) + 1;
+  if (bytes + (argc + 5) * sizeof(u32) > PROC_ARGS_MAX) {
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  /* It all fits in the last page, so it's contiguous for us too. */
+  page = (char *)vm_frame(dir, top - MEM_FRAME_SIZE) - (top - MEM_FRAME_SIZE);
+
+  str = top - bytes;
+  arr = (str - (argc + 1) * sizeof(u32)) & ~(sizeof(u32) - 1);
+  args = (u32 *)(page + arr);
+  for (i = 0; i < argc; i ++) {
+    n = strlen(argv[i]) + 1;
+    memcpy(page + str, argv[i], n);
+    args[i] = str;
+    str += n;
+  }
+  args[argc] = 0;
+
+  *esp = arr - 3 * sizeof(u32);
+  args = (u32 *)(page + *esp);
+  args[0] = 0;
+  args[1] = argc;
+  args[2] = arr;
+
+  return 0;
+}
+
+/* Builds the image of the binary at path with arguments argv, without
+ * touching any process. */
+static int proc_image_load(char *path, char **argv, proc_image_t *img) {
   vfs_file_t *f;
   a_out_header h;
   struct stat s;
-  ssize_t r, br;
-  char * base;
+  ssize_t r;
   u32 code_limit, data_limit;
-  u16 code_segment, data_segment;
 
   /* TODO: Handle execution permissions. */
   if (vfs_stat(path, &s) == -1)
@@ -136,10 +409,10 @@ int proc_exec(char *path) {
    *     was making while keeping the output file small.
    *  3. The .bss section comes right after the .data section, no alignment
    *     at all for it.
-   * I know virtual memory would solve this gracefully, and I know we might
-   * try to solve the security issues having code and data in the same segment
-   * be, but I leave that to those after me. Or the future me. I need some
-   * linker scripts reference.  */
+   * Virtual memory is here now, but the layout stays: the pages are mapped
+   * from address 0 of the process on, in the same order, and the segments
+   * cover them. Code and data still share the segment, I leave that to those
+   * after me. Or the future me. I need some linker scripts reference.  */
 
   /* Compute the size of .text. */
   code_limit = (sizeof(a_out_header) + h.a_text) / MEM_FRAME_SIZE;
@@ -154,83 +427,122 @@ int proc_exec(char *path) {
   /* Add an extra frame for the stack. */
   data_limit ++;
 
-  /* Request free memory from mem. */
-  base = (char *)mem_allocate_frames(code_limit + data_limit,
-                                     MEM_USER_FIRST_FRAME,
-                                     0);
-  if (base == NULL) {
+  /* A new address space, with zeroed pages for all of it. That's the .bss
+   * done too. */
+  img->pgdir = vm_create();
+  if (img->pgdir == NULL) {
     vfs_close(f);
     return -1;
   }
-
-  /* Request code segment from GDT. */
-  code_segment = gdt_alloc(base,
-                           code_limit + data_limit,
-                           GDT_GRANULARITY_4K      |
-                           GDT_OP_SIZE_32          |
-                           GDT_PRESENT             |
-                           GDT_DPL_USER            |
-                           GDT_DESC_TYPE_CODE_DATA |
-                           GDT_CODE_SEGMENT        |
-                           GDT_CODE_EXEC_READ      |
-                           GDT_CODE_NON_CONFORMING);
-  if (code_segment == 0) {
-    mem_release_frames(base, code_limit + data_limit);
+  if (vm_alloc(img->pgdir, 0, (code_limit + data_limit) * MEM_FRAME_SIZE) ==
+      -1) {
+    vm_destroy(img->pgdir);
     vfs_close(f);
     return -1;
   }
 
-  /* Allocate a segment for data. */
-  data_segment = gdt_alloc(base,
-                           code_limit + data_limit,
-                           GDT_GRANULARITY_4K      |
-                           GDT_OP_SIZE_32          |
-                           GDT_PRESENT             |
-                           GDT_DPL_USER            |
-                           GDT_DESC_TYPE_CODE_DATA |
-                           GDT_DATA_SEGMENT        |
-                           GDT_DATA_READ_WRITE     |
-                           GDT_DATA_EXPAND_UP);
-  if (data_segment == 0) {
+  /* Load the .text segment into memory, the header along. */
+  vfs_lseek(f, 0, SEEK_SET);
+  if (proc_load(img->pgdir, f, 0, sizeof(a_out_header) + h.a_text) == -1) {
+    vm_destroy(img->pgdir);
     vfs_close(f);
-    gdt_dealloc(code_segment);
-    mem_release_frames(base, code_limit + data_limit);
     return -1;
   }
 
-  /* Load the .text segment into memory. */
-  for (vfs_lseek(f, 0, SEEK_SET), br = 0;
-       br < sizeof(a_out_header) + h.a_text;
-       br += r) {
-    r = vfs_read(f, base + br, sizeof(a_out_header) + h.a_text - br);
-    if (r == -1 || r == 0) {
-      vfs_close(f);
-      gdt_dealloc(code_segment);
-      gdt_dealloc(data_segment);
-      mem_release_frames(base, code_limit + data_limit);
-      return -1;
-    }
-  }
-
   /* Load the .data segment into memory. */
-  for (br = 0;
-       br < h.a_data;
-       br += r) {
-    r = vfs_read(f, base + code_limit * MEM_FRAME_SIZE + br, h.a_data - br);
-    if (r == -1 || r == 0) {
-      vfs_close(f);
-      gdt_dealloc(code_segment);
-      gdt_dealloc(data_segment);
-      mem_release_frames(base, code_limit + data_limit);
-      return -1;
-    }
+  if (proc_load(img->pgdir, f, code_limit * MEM_FRAME_SIZE, h.a_data) == -1) {
+    vm_destroy(img->pgdir);
+    vfs_close(f);
+    return -1;
   }
 
   /* We need the file no more so we can close it. */
   vfs_close(f);
 
-  /* zero the .bss segment which is located right after the .data segment. */
-  memset(base + code_limit * MEM_FRAME_SIZE + h.a_data, 0, h.a_bss);
+  /* The arguments go in the stack. */
+  if (proc_push_args(img->pgdir,
+                     (code_limit + data_limit) * MEM_FRAME_SIZE,
+                     argv,
+                     &img->esp) == -1) {
+    vm_destroy(img->pgdir);
+    return -1;
+  }
+
+  /* Request the segments from GDT. */
+  if (proc_alloc_segments(code_limit + data_limit,
+                          &img->code_segment,
+                          &img->data_segment) == -1) {
+    vm_destroy(img->pgdir);
+    return -1;
+  }
+
+  img->eip = h.a_entry;
+  return 0;
+}
+
+/* Gives p the image. p must have nothing of its own by now. */
+static void proc_image_set(proc_t *p, proc_image_t *img) {
+  proc_set_segments(p, img->code_segment, img->data_segment);
+  p->pgdir = img->pgdir;
+
+  p->regs.eip = img->eip;
+  p->regs.esp = img->esp;
+  p->regs.eflags = PROC_EFLAGS;
+
+  /* It's not a kernel thread anymore, if it was. */
+  p->flags &= ~PROC_F_KTHREAD;
+}
+
+/* First code run by processes that start in user mode through frame, see
+ * proc_start_user(). Their stack makes it return to itr_return, which goes
+ * to user mode through the frame. User code doesn't hold the kernel lock,
+ * and interrupts stay disabled until iret. */
+static void proc_user_return() {
+  lock_kernel_drop();
+}
+
+/* Makes p ready to leave to user mode as frame says. p's stack looks like it
+ * was switched out by proc_switch_context() right before calling
+ * proc_user_return(). */
+static void proc_start_user(proc_t *p, itr_frame_t *frame) {
+  u32 *sp;
+
+  sp = (u32 *)(p->kstack + PROC_KSTACK_FRAMES * MEM_FRAME_SIZE);
+  sp -= sizeof(itr_frame_t) / sizeof(u32);
+  memcpy(sp, frame, sizeof(itr_frame_t));
+
+  *(-- sp) = (u32)itr_return;             /* Where proc_user_return goes. */
+  *(-- sp) = (u32)proc_user_return;       /* Where proc_switch_context goes. */
+  *(-- sp) = 0;                           /* ebp */
+  *(-- sp) = 0;                           /* ebx */
+  *(-- sp) = 0;                           /* esi */
+  *(-- sp) = 0;                           /* edi */
+  p->kesp = (u32)sp;
+
+  /* It's not inside any handler nor critical region, just holding the
+   * kernel lock the processor hands it. */
+  p->itr_status = 0;
+  p->lock.depth = 0;
+  p->lock.flags = 0;
+  p->lock.kernel = 1;
+
+  lock();
+  sched_add(p);
+  unlock();
+}
+
+
+/*****************************************************************************
+ * Exec                                                                      *
+ *****************************************************************************/
+
+/* Replaces the current process with the binary located at path. */
+int proc_exec(char *path, char **argv) {
+  proc_image_t img;
+
+  /* Build it first, there's no going back once the old one is released. */
+  if (proc_image_load(path, argv, &img) == -1)
+    return -1;
 
   /* Now we have all we need. We can start deallocating the old resources. */
   proc_release_memory(proc_cur);
@@ -239,19 +551,213 @@ int proc_exec(char *path) {
    *       we'll have to do something here. */
 
   /* And set the new ones. */
-  proc_cur->segs.cs = GDT_SEGMENT_SELECTOR(code_segment, GDT_RPL_USER);
-  proc_cur->segs.ds = GDT_SEGMENT_SELECTOR(data_segment, GDT_RPL_USER);
-  proc_cur->segs.ss = proc_cur->segs.ds;
-  proc_cur->segs.es = proc_cur->segs.ds;
-  proc_cur->segs.gs = proc_cur->segs.ds;
-  proc_cur->segs.fs = proc_cur->segs.ds;
-
-  proc_cur->regs.eip = h.a_entry;
-  proc_cur->regs.esp = (code_limit + data_limit) * MEM_FRAME_SIZE;
-
-  /* Do the switch. */
+  proc_image_set(proc_cur, &img);
+  vm_activate(proc_cur->pgdir);
+
+  /* Do the switch. An interrupt in the middle of it would get the data
+   * segments reloaded, so keep them away until iret enables them again.
+   * User code doesn't hold the kernel lock. */
+  hw_cli();
+  lock_kernel_drop();
   proc_switch_to_userland(proc_cur);
 
   /* And never return, but the compiler doesn't know. */
   return -1;
 }
+
+
+/*****************************************************************************
+ * Spawn                                                                     *
+ *****************************************************************************/
+
+/* Nothing of the caller is copied, not even the page tables: the new process
+ * is built right from the binary. */
+pid_t proc_spawn(char *path, char **argv, int *fds) {
+  proc_t *p;
+  proc_image_t img;
+  itr_frame_t frame;
+  int i, fd;
+
+  /* Check the descriptors before doing anything. */
+  for (i = 0; fds != NULL && i < PROC_MAX_FD; i ++)
+    if (fds[i] != -1 &&
+        (fds[i] < 0 || fds[i] >= PROC_MAX_FD ||
+         proc_cur->fdesc[fds[i]] == NULL)) {
+      set_errno(E_BADFD);
+      return -1;
+    }
+
+  p = proc_alloc();
+  if (p == NULL)
+    return -1;
+  if (proc_alloc_kstack(p) == -1)
+    return -1;
+
+  if (proc_image_load(path, argv, &img) == -1) {
+    p->state = PROC_UNUSED;
+    return -1;
+  }
+  proc_image_set(p, &img);
+
+  /* The descriptors asked for, or all of them. */
+  for (i = 0; i < PROC_MAX_FD; i ++) {
+    fd = fds != NULL ? fds[i] : i;
+    if (fd != -1 && proc_cur->fdesc[fd] != NULL)
+      p->fdesc[i] = vfs_dup(proc_cur->fdesc[fd]);
+  }
+
+  /* It starts leaving to user mode, like after an interrupt. */
+  memset(&frame, 0, sizeof(itr_frame_t));
+  frame.stack.eip = p->regs.eip;
+  frame.stack.cs = p->segs.cs;
+  frame.stack.eflags = p->regs.eflags;
+  frame.user_esp = p->regs.esp;
+  frame.user_ss = p->segs.ss;
+  proc_start_user(p, &frame);
+
+  return p->pid;
+}
+
+
+/*****************************************************************************
+ * Fork                                                                      *
+ *****************************************************************************/
+
+pid_t proc_fork(itr_frame_t *frame) {
+  proc_t *p;
+  itr_frame_t child_frame;
+  u16 code_segment, data_segment;
+  int i;
+
+  p = proc_alloc();
+  if (p == NULL)
+    return -1;
+  if (proc_alloc_kstack(p) == -1)
+    return -1;
+
+  /* Same segments, but its own. */
+  if (proc_alloc_segments(gdt_limit(gdt_get(proc_cur->segs.cs)),
+                          &code_segment,
+                          &data_segment) == -1) {
+    p->state = PROC_UNUSED;
+    return -1;
+  }
+
+  /* Nothing is copied, the pages are shared until someone writes. */
+  p->pgdir = vm_fork(proc_cur->pgdir);
+  if (p->pgdir == NULL) {
+    gdt_dealloc(code_segment);
+    gdt_dealloc(data_segment);
+    p->state = PROC_UNUSED;
+    return -1;
+  }
+  proc_set_segments(p, code_segment, data_segment);
+
+  /* Open files are shared too, offsets included. */
+  for (i = 0; i < PROC_MAX_FD; i ++)
+    if (proc_cur->fdesc[i] != NULL)
+      p->fdesc[i] = vfs_dup(proc_cur->fdesc[i]);
+
+  p->regs = proc_cur->regs;
+  p->level = proc_cur->level;
+  p->affinity = proc_cur->affinity;
+
+  /* The child returns from the same system call, with its own segments and
+   * 0 as the result. */
+  child_frame = *frame;
+  child_frame.regs.eax = 0;
+  child_frame.stack.cs = p->segs.cs;
+  child_frame.user_ss = p->segs.ss;
+  proc_start_user(p, &child_frame);
+
+  return p->pid;
+}
+
+
+/*****************************************************************************
+ * Wait                                                                      *
+ *****************************************************************************/
+
+pid_t proc_waitpid(pid_t pid, int *status, int options) {
+  proc_t *p;
+  int i, children;
+
+  lock();
+  while (1) {
+    for (children = 0, i = 1; i < PROC_MAX_PROC; i ++) {
+      p = procs + i;
+      if (p->state == PROC_UNUSED || p->ppid != proc_cur->pid ||
+          (pid != -1 && p->pid != pid))
+        continue;
+      children ++;
+
+      /* Collect it, the slot is free from now on. */
+      if (p->state == PROC_ZOMBIE) {
+        *status = p->status;
+        p->state = PROC_UNUSED;
+        unlock();
+        return p->pid;
+      }
+    }
+
+    if (children == 0) {
+      unlock();
+      set_errno(E_CHILD);
+      return -1;
+    }
+    if (options & PROC_WNOHANG) {
+      unlock();
+      return 0;
+    }
+
+    /* Every exit wakes everybody up, there aren't many of us. */
+    wait_sleep(&proc_exited);
+  }
+}
+
+
+/*****************************************************************************
+ * Exit                                                                      *
+ *****************************************************************************/
+
+void proc_exit(int status) {
+  int i;
+
+  for (i = 0; i < PROC_MAX_FD; i ++)
+    if (proc_cur->fdesc[i] != NULL) {
+      vfs_close(proc_cur->fdesc[i]);
+      proc_cur->fdesc[i] = NULL;
+    }
+
+  proc_release_memory(proc_cur);
+
+  /* The kernel stack stays: we're standing on it. The slot will be reused
+   * with it later. */
+  lock();
+
+  /* Nobody will wait for the children anymore. There's no init to adopt
+   * them, the kernel does: the dead ones are gone now, the rest will be
+   * when they exit. */
+  for (i = 1; i < PROC_MAX_PROC; i ++)
+    if (procs[i].state != PROC_UNUSED && procs[i].ppid == proc_cur->pid) {
+      procs[i].ppid = 0;
+      if (procs[i].state == PROC_ZOMBIE)
+        procs[i].state = PROC_UNUSED;
+    }
+
+  /* Nobody will wait for this one either if its parent is the kernel. The
+   * slot can't be taken before we leave it, proc_alloc() needs the kernel
+   * lock. */
+  proc_cur->status = status;
+  if (proc_cur->ppid == 0) {
+    proc_cur->state = PROC_UNUSED;
+  }
+  else {
+    proc_cur->state = PROC_ZOMBIE;
+    wait_wake_up(&proc_exited);
+  }
+  sched_schedule();
+
+  /* Never reached. */
+  while (1);
+}
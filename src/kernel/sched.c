@@ -0,0 +1,461 @@
+#include <sched.h>
+#include <proc.h>
+#include <gdt.h>
+#include <mem.h>
+#include <lock.h>
+#include <interrupts.h>
+#include <hw.h>
+#include <syscall.h>
+#include <smp.h>
+#include <errors.h>
+#include <vm.h>
+
+/* Each processor has its own run queues, one per level, and schedules its
+ * own processes. Processes are taken from the head and put at the tail.
+ * Other processors only touch them to steal or to make a process ready, all
+ * under the kernel lock. */
+typedef struct {
+  struct {
+    proc_t *head;
+    proc_t *tail;
+  } queues[SCHED_LEVELS];
+
+  /* Bit i is set when queues[i] is not empty. */
+  u32 bitmap;
+
+  /* Ticks until the next priority boost. */
+  u32 boost;
+
+  /* Ticks until the next load balancing. */
+  u32 balance;
+
+  /* The idle task. */
+  proc_t *idle;
+
+  /* Set when the running process must give the CPU away. */
+  int resched;
+
+  /* Processes queued. */
+  int nr;
+} sched_rq_t;
+
+static sched_rq_t sched_rqs[SMP_MAX_CPUS];
+
+/* The run queue of the processor running this. */
+#define SCHED_RQ            (sched_rqs + smp_cpu_id())
+
+/* Whether p may run on processor cpu. */
+#define SCHED_CAN_RUN(p, cpu) ((p)->affinity & (1 << (cpu)))
+
+/* This must be implemented in assembly. */
+extern void proc_switch_context(u32 *old_esp, u32 new_esp);
+
+int sched_init(proc_t *idle) {
+  sched_rq_t *rq;
+  int i;
+
+  rq = SCHED_RQ;
+  for (i = 0; i < SCHED_LEVELS; i ++) {
+    rq->queues[i].head = NULL;
+    rq->queues[i].tail = NULL;
+  }
+  rq->bitmap = 0;
+  rq->boost = SCHED_BOOST_TICKS;
+  rq->balance = SCHED_BALANCE_TICKS;
+  rq->resched = 0;
+  rq->nr = 0;
+
+  rq->idle = idle;
+  rq->idle->state = PROC_RUNNING;
+  rq->idle->ticks = 0;
+
+  return 0;
+}
+
+/*****************************************************************************
+ * Run queue                                                                 *
+ *****************************************************************************/
+
+/* Helpers, interrupts must be disabled. */
+static void sched_enqueue(sched_rq_t *rq, proc_t *p) {
+  int l;
+
+  l = p->level;
+  p->state = PROC_READY;
+  p->next = NULL;
+  if (rq->queues[l].tail == NULL)
+    rq->queues[l].head = p;
+  else
+    rq->queues[l].tail->next = p;
+  rq->queues[l].tail = p;
+  rq->bitmap |= 1 << l;
+  rq->nr ++;
+}
+
+/* Takes the first process of the highest non-empty level. */
+static proc_t * sched_dequeue(sched_rq_t *rq) {
+  proc_t *p;
+  int l;
+
+  if (rq->bitmap == 0)
+    return NULL;
+
+  l = hw_bsf(rq->bitmap);
+  p = rq->queues[l].head;
+  rq->queues[l].head = p->next;
+  if (rq->queues[l].head == NULL) {
+    rq->queues[l].tail = NULL;
+    rq->bitmap &= ~(1 << l);
+  }
+  p->next = NULL;
+  rq->nr --;
+
+  /* The level might be outdated after a boost. */
+  p->level = l;
+
+  return p;
+}
+
+/* Moves everyone to level 0 keeping their order. The processes' level is
+ * fixed when they're dequeued, so this is O(SCHED_LEVELS). */
+static void sched_boost_all(sched_rq_t *rq) {
+  int l;
+
+  for (l = 1; l < SCHED_LEVELS; l ++) {
+    if (rq->queues[l].head == NULL)
+      continue;
+    if (rq->queues[0].tail == NULL)
+      rq->queues[0].head = rq->queues[l].head;
+    else
+      rq->queues[0].tail->next = rq->queues[l].head;
+    rq->queues[0].tail = rq->queues[l].tail;
+    rq->queues[l].head = NULL;
+    rq->queues[l].tail = NULL;
+  }
+  if (rq->queues[0].head != NULL)
+    rq->bitmap = 1;
+
+  if (proc_cur != rq->idle)
+    proc_cur->level = 0;
+}
+
+/* Takes p, which is after prev in level l, out of rq. */
+static void sched_unlink(sched_rq_t *rq, int l, proc_t *prev, proc_t *p) {
+  if (prev == NULL)
+    rq->queues[l].head = p->next;
+  else
+    prev->next = p->next;
+  if (rq->queues[l].tail == p)
+    rq->queues[l].tail = prev;
+  if (rq->queues[l].head == NULL)
+    rq->bitmap &= ~(1 << l);
+  p->next = NULL;
+  rq->nr --;
+
+  /* Same as in sched_dequeue(). */
+  p->level = l;
+}
+
+/* Takes a queued p out of its run queue. */
+static void sched_remove(proc_t *p) {
+  sched_rq_t *rq;
+  proc_t *q, *prev;
+  int l;
+
+  rq = sched_rqs + p->cpu;
+  for (l = 0; l < SCHED_LEVELS; l ++)
+    for (prev = NULL, q = rq->queues[l].head; q != NULL; prev = q, q = q->next)
+      if (q == p) {
+        sched_unlink(rq, l, prev, p);
+        return;
+      }
+}
+
+/* Load of a processor: what's queued and what's running. */
+static int sched_load(int cpu) {
+  return sched_rqs[cpu].nr + (proc_curs[cpu] != sched_rqs[cpu].idle);
+}
+
+/* New processes go to the least loaded processor they may run on, this one
+ * if it's as good as any. */
+static int sched_pick_cpu(proc_t *p) {
+  int cpu, best, n;
+
+  n = smp_cpu_count();
+  best = smp_cpu_id();
+  if (!SCHED_CAN_RUN(p, best))
+    for (best = 0; best < n - 1 && !SCHED_CAN_RUN(p, best); best ++);
+
+  for (cpu = 0; cpu < n; cpu ++)
+    if (SCHED_CAN_RUN(p, cpu) && sched_load(cpu) < sched_load(best))
+      best = cpu;
+  return best;
+}
+
+void sched_add(proc_t *p) {
+  sched_rq_t *rq;
+  proc_t *cur;
+
+  /* It may have been told to leave its processor while sleeping. */
+  if (p->cpu == -1 || !SCHED_CAN_RUN(p, p->cpu))
+    p->cpu = sched_pick_cpu(p);
+
+  rq = sched_rqs + p->cpu;
+  sched_enqueue(rq, p);
+
+  cur = proc_curs[p->cpu];
+  if (cur == rq->idle || p->level < cur->level) {
+    rq->resched = 1;
+    /* Someone else's, it must hear about it. */
+    if (p->cpu != smp_cpu_id())
+      smp_send_resched(p->cpu);
+  }
+}
+
+/*****************************************************************************
+ * Load balancing                                                            *
+ *****************************************************************************/
+
+/* Takes from rq the process that would wait the longest there and may run
+ * on cpu: the last one of the lowest level. It's also the one least likely
+ * to have its data in the cache of its processor. */
+static proc_t * sched_steal_from(sched_rq_t *rq, int cpu) {
+  proc_t *p, *prev, *victim, *victim_prev;
+  int l;
+
+  for (l = SCHED_LEVELS - 1; l >= 0; l --) {
+    victim = NULL;
+    victim_prev = NULL;
+    for (prev = NULL, p = rq->queues[l].head; p != NULL; prev = p, p = p->next)
+      if (SCHED_CAN_RUN(p, cpu)) {
+        victim = p;
+        victim_prev = prev;
+      }
+    if (victim != NULL) {
+      sched_unlink(rq, l, victim_prev, victim);
+      return victim;
+    }
+  }
+  return NULL;
+}
+
+/* The processor other than cpu with the most processes queued, -1 if
+ * they're all empty. */
+static int sched_busiest(int cpu) {
+  int i, n, busiest;
+
+  n = smp_cpu_count();
+  for (busiest = -1, i = 0; i < n; i ++)
+    if (i != cpu && sched_rqs[i].nr > 0 &&
+        (busiest == -1 || sched_load(i) > sched_load(busiest)))
+      busiest = i;
+  return busiest;
+}
+
+/* Moves a process from the busiest processor to cpu. Only queued processes
+ * move: their context was saved when they were switched out, the kernel
+ * lock makes sure of it, so they can resume anywhere. */
+static proc_t * sched_steal(int cpu) {
+  proc_t *p;
+  int busiest;
+
+  busiest = sched_busiest(cpu);
+  if (busiest == -1)
+    return NULL;
+
+  p = sched_steal_from(sched_rqs + busiest, cpu);
+  if (p != NULL)
+    p->cpu = cpu;
+  return p;
+}
+
+/* Periodic balancing. Idle processors steal as soon as they can, this is
+ * for the busy ones: if the busiest processor has at least two processes
+ * more than this one, one of them comes here. */
+static void sched_balance() {
+  sched_rq_t *rq;
+  proc_t *p;
+  int cpu, busiest;
+
+  cpu = smp_cpu_id();
+  rq = sched_rqs + cpu;
+  busiest = sched_busiest(cpu);
+  if (busiest == -1 || sched_load(busiest) - sched_load(cpu) < 2)
+    return;
+
+  p = sched_steal(cpu);
+  if (p == NULL)
+    return;
+
+  sched_enqueue(rq, p);
+  if (p->level < proc_cur->level)
+    rq->resched = 1;
+}
+
+int sched_set_affinity(proc_t *p, u32 mask) {
+  u32 flags;
+
+  /* Leave the processors that aren't there out. */
+  if (smp_cpu_count() < 32)
+    mask &= (1 << smp_cpu_count()) - 1;
+  if (mask == 0) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+
+  flags = irq_save();
+  p->affinity = mask;
+  if (p->cpu != -1 && !SCHED_CAN_RUN(p, p->cpu)) {
+    if (p->state == PROC_READY) {
+      /* Queued somewhere it can't run, move it. */
+      sched_remove(p);
+      sched_add(p);
+    }
+    else if (p->state == PROC_RUNNING) {
+      /* It'll move when it gives the CPU away, make it do it now. */
+      sched_rqs[p->cpu].resched = 1;
+      if (p->cpu != smp_cpu_id())
+        smp_send_resched(p->cpu);
+    }
+    /* Sleepers move when they wake up. */
+  }
+  irq_restore(flags);
+
+  return 0;
+}
+
+/*****************************************************************************
+ * Switching                                                                 *
+ *****************************************************************************/
+
+/* Gives the CPU to next. Returns when someone gives it back to prev. */
+static void sched_switch(proc_t *prev, proc_t *next) {
+  void *esp0;
+
+  next->state = PROC_RUNNING;
+  if (next->ticks == 0)
+    next->ticks = SCHED_SLICE(next->level);
+  SCHED_RQ->resched = 0;
+
+  if (next == prev)
+    return;
+
+  /* The interrupts nesting level and the lock state belong to the process:
+   * next may have been taken out inside a handler or a critical region and
+   * prev may be in one right now. The kernel lock is held by this processor
+   * on both sides, whatever the nesting. */
+  prev->itr_status = itr_get_status();
+  itr_set_status(next->itr_status);
+  lock_get_state(&prev->lock);
+  lock_set_state(&next->lock);
+
+  /* Interrupts and system calls from user mode must land on next's kernel
+   * stack. */
+  if (next->kstack != NULL)
+    esp0 = next->kstack + PROC_KSTACK_FRAMES * MEM_FRAME_SIZE;
+  else
+    esp0 = (void *)MEM_KERNEL_ISTACK_TOP;
+  gdt_set_kernel_stack(esp0);
+  syscall_set_kernel_stack(esp0);
+
+  /* And its pages. Kernel threads and idle tasks only need the kernel's. */
+  vm_activate(next->pgdir);
+
+  proc_cur = next;
+  proc_switch_context(&prev->kesp, next->kesp);
+}
+
+void sched_schedule() {
+  sched_rq_t *rq;
+  proc_t *prev, *next;
+
+  rq = SCHED_RQ;
+  prev = proc_cur;
+
+  /* Idle is never queued, it's what runs when the queues are empty. The rest
+   * get their feedback here. */
+  if (prev != rq->idle) {
+    if (prev->state != PROC_RUNNING) {
+      /* Left before the slice was over, most likely to wait for I/O. */
+      if (prev->level > 0)
+        prev->level --;
+      prev->ticks = 0;
+    }
+    else {
+      /* Used the whole slice. If it was preempted before that, it keeps the
+       * level and the rest of the slice. */
+      if (prev->ticks == 0 && prev->level < SCHED_LEVELS - 1)
+        prev->level ++;
+      if (SCHED_CAN_RUN(prev, smp_cpu_id()))
+        sched_enqueue(rq, prev);
+      else
+        sched_add(prev);
+    }
+  }
+
+  /* With nothing to do here, do somebody else's. */
+  next = sched_dequeue(rq);
+  if (next == NULL)
+    next = sched_steal(smp_cpu_id());
+  if (next == NULL)
+    next = rq->idle;
+
+  sched_switch(prev, next);
+}
+
+void sched_yield() {
+  lock();
+  sched_schedule();
+  unlock();
+}
+
+/*****************************************************************************
+ * Preemption                                                                *
+ *****************************************************************************/
+
+void sched_tick() {
+  sched_rq_t *rq;
+
+  rq = SCHED_RQ;
+  if (-- rq->boost == 0) {
+    rq->boost = SCHED_BOOST_TICKS;
+    sched_boost_all(rq);
+  }
+
+  /* Idle is only running because there was nothing else to do. Maybe
+   * there's something in somebody else's queue by now. */
+  if (proc_cur == rq->idle) {
+    if (rq->bitmap != 0 || sched_busiest(smp_cpu_id()) != -1)
+      rq->resched = 1;
+    return;
+  }
+
+  if (-- rq->balance == 0) {
+    rq->balance = SCHED_BALANCE_TICKS;
+    sched_balance();
+  }
+
+  if (proc_cur->ticks > 0)
+    proc_cur->ticks --;
+  if (proc_cur->ticks == 0)
+    rq->resched = 1;
+}
+
+int sched_idling() {
+  return proc_cur == SCHED_RQ->idle;
+}
+
+int sched_need_resched() {
+  return SCHED_RQ->resched;
+}
+
+void sched_preempt(u32 cs) {
+  if (!SCHED_RQ->resched)
+    return;
+
+  /* Kernel code running for user processes is not reentrant. */
+  if ((cs & 3) != 3 && !(proc_cur->flags & PROC_F_KTHREAD))
+    return;
+
+  sched_schedule();
+}
@@ -0,0 +1,72 @@
+; Application processors start here, see smp.h.
+;
+; The STARTUP IPI wakes the AP up in real mode at cs:ip = page:0, page being
+; SMP_TRAMPOLINE_ADDR >> 4, which is where smp_init() copies this code. It's
+; linked with the rest of the kernel somewhere else though, so nothing here
+; can use its own labels' addresses: in real mode they're taken as offsets
+; from smp_trampoline, with ds = cs, and in protected mode they're moved to
+; SMP_TRAMPOLINE_ADDR with TRAMP(). Jumping to the kernel is fine, it's where
+; the linker thinks it is.
+;
+; The GDT is a flat one of our own with the same kernel segments as the real
+; one, which smp_ap_main() loads along with the processor's TSS.
+
+[bits 16]
+[extern smp_ap_main]
+[extern smp_ap_stack]
+
+%define SMP_TRAMPOLINE_ADDR     0x00090000
+%define TRAMP(label)            (SMP_TRAMPOLINE_ADDR + (label) - smp_trampoline)
+
+%define CR0_PE                  0x00000001
+%define KERNEL_CODE_SEGMENT     0x08
+%define KERNEL_DATA_SEGMENT     0x10
+
+global smp_trampoline
+global smp_trampoline_end
+
+smp_trampoline:
+  cli
+  mov ax, cs
+  mov ds, ax
+
+  ; o32 so the whole 32 bits base is taken.
+  o32 lgdt [trampoline_gdtr - smp_trampoline]
+
+  mov eax, cr0
+  or eax, CR0_PE
+  mov cr0, eax
+
+  ; Reload cs, the far jump also flushes the real mode prefetched code.
+  jmp dword KERNEL_CODE_SEGMENT:TRAMP(trampoline_pm)
+
+[bits 32]
+trampoline_pm:
+  mov ax, KERNEL_DATA_SEGMENT
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+  mov ss, ax
+  mov esp, [smp_ap_stack]
+
+  ; Absolute, a relative call would be relative to where we were linked.
+  mov eax, smp_ap_main
+  call eax
+
+  ; smp_ap_main() never returns.
+trampoline_halt:
+  hlt
+  jmp trampoline_halt
+
+align 8
+trampoline_gdt:
+  dq 0x0000000000000000         ; Null.
+  dq 0x00cf9a000000ffff         ; Kernel code: base 0, 4 GB, ring 0, 32 bits.
+  dq 0x00cf92000000ffff         ; Kernel data: the same, read/write.
+
+trampoline_gdtr:
+  dw 3 * 8 - 1
+  dd TRAMP(trampoline_gdt)
+
+smp_trampoline_end:
@@ -0,0 +1,132 @@
+#include <smp.h>
+#include <apic.h>
+#include <gdt.h>
+#include <interrupts.h>
+#include <syscall.h>
+#include <proc.h>
+#include <mem.h>
+#include <lock.h>
+#include <pit.h>
+#include <hw.h>
+#include <string.h>
+#include <vm.h>
+
+/* How long the BSP waits for an AP to show up, in PIT ticks. */
+#define SMP_AP_TIMEOUT_TICKS  10
+
+/* The trampoline, in smp.asm. */
+extern char smp_trampoline[];
+extern char smp_trampoline_end[];
+
+/* End of the kernel image, from kernel.ld. */
+extern char kernel_end[];
+
+/* Top of the stack of the AP being started. The trampoline loads it. It's
+ * a kernel stack like any process', and becomes its idle task's. */
+u32 smp_ap_stack;
+
+/* Number the AP being started gets, and whether it made it. */
+static volatile int smp_booting;
+static volatile int smp_ap_started;
+
+/* Processors running and their local APIC IDs, indexed by number. */
+static int smp_cpus = 1;
+static u8 smp_apic_ids[SMP_MAX_CPUS];
+
+int smp_cpu_id() {
+  u16 tr;
+
+  /* There's no TSS before gdt_setup(), and only the BSP is running then. */
+  tr = hw_str();
+  if (tr < GDT_TSS)
+    return 0;
+  return (tr - GDT_TSS) / sizeof(gdt_descriptor_t);
+}
+
+int smp_cpu_count() {
+  return smp_cpus;
+}
+
+void smp_send_resched(int cpu) {
+  apic_send_ipi(smp_apic_ids[cpu], APIC_RESCHED_IRQ);
+}
+
+/* The trampoline jumps here with interrupts disabled and its own GDT, whose
+ * kernel segments are the same as ours. Until the TSS is loaded this
+ * processor would take itself for the BSP. */
+void smp_ap_main() {
+  char *stack;
+  int cpu;
+
+  cpu = smp_booting;
+  stack = (char *)smp_ap_stack - PROC_KSTACK_FRAMES * MEM_FRAME_SIZE;
+
+  gdt_load_cpu(cpu);
+  vm_init_cpu();
+  gdt_set_kernel_stack((void *)smp_ap_stack);
+  itr_set_up_cpu();
+  syscall_init_cpu((void *)smp_ap_stack);
+
+  /* The timer starts ticking here, the run queue must be ready before it
+   * gets a chance to. */
+  lock();
+  apic_init_cpu();
+  proc_init_cpu(stack);
+  unlock();
+
+  smp_ap_started = 1;
+
+  /* This is the AP's idle loop. */
+  hw_sti();
+  while (1) {
+    hw_hlt();
+  }
+}
+
+int smp_init() {
+  char *stack;
+  int i, t;
+  u8 id;
+
+  if (apic_cpu_count() <= 1)
+    return smp_cpus;
+
+  /* The trampoline must not land on the kernel. */
+  if ((u32)kernel_end > SMP_TRAMPOLINE_ADDR)
+    return smp_cpus;
+
+  memcpy((void *)SMP_TRAMPOLINE_ADDR,
+         smp_trampoline,
+         smp_trampoline_end - smp_trampoline);
+  smp_apic_ids[0] = apic_id();
+
+  for (i = 0; i < apic_cpu_count() && smp_cpus < SMP_MAX_CPUS; i ++) {
+    id = apic_cpu_id(i);
+    if (id == smp_apic_ids[0])
+      continue;
+
+    stack = (char *)kalloc(PROC_KSTACK_FRAMES * MEM_FRAME_SIZE);
+    if (stack == NULL)
+      break;
+
+    smp_ap_stack = (u32)(stack + PROC_KSTACK_FRAMES * MEM_FRAME_SIZE);
+    smp_booting = smp_cpus;
+    smp_ap_started = 0;
+    smp_apic_ids[smp_cpus] = id;
+    apic_start_cpu(id, SMP_TRAMPOLINE_ADDR);
+
+    for (t = 0; t < SMP_AP_TIMEOUT_TICKS && !smp_ap_started; t ++)
+      pit_wait_tick();
+
+    /* It may still wake up later, with this stack and number, so both are
+     * left alone and no more processors are started. */
+    if (!smp_ap_started)
+      break;
+
+    lock();
+    smp_cpus ++;
+    unlock();
+  }
+
+  return smp_cpus;
+}
@@ -0,0 +1,119 @@
+#include <softirq.h>
+#include <lock.h>
+#include <hw.h>
+
+static softirq_handler_t softirq_handlers[SOFTIRQ_TOTAL];
+
+/* Bit i is set when softirq i is pending. */
+static volatile u32 softirq_pending;
+
+/* Scheduled tasklets, in order. */
+static tasklet_t *tasklet_head;
+static tasklet_t *tasklet_tail;
+
+static void tasklet_run();
+
+void softirq_init() {
+  int i;
+
+  for (i = 0; i < SOFTIRQ_TOTAL; i ++)
+    softirq_handlers[i] = NULL;
+  softirq_pending = 0;
+
+  tasklet_head = NULL;
+  tasklet_tail = NULL;
+  softirq_set_handler(SOFTIRQ_TASKLET, tasklet_run);
+}
+
+void softirq_set_handler(int nr, softirq_handler_t handler) {
+  softirq_handlers[nr] = handler;
+}
+
+void softirq_raise(int nr) {
+  u32 flags;
+
+  flags = irq_save();
+  softirq_pending |= 1 << nr;
+  irq_restore(flags);
+}
+
+void softirq_run() {
+  lock_state_t saved, clean;
+  u32 pending;
+  int i, rounds;
+
+  /* The interrupted code may have been sleeping inside a critical region
+   * (idle does). That's none of the handlers' business. The kernel lock is
+   * taken by the interrupt, though, and stays so. */
+  lock_get_state(&saved);
+  clean.depth = 0;
+  clean.flags = 0;
+  clean.kernel = saved.kernel;
+  lock_set_state(&clean);
+
+  for (rounds = 0;
+       rounds < SOFTIRQ_MAX_ROUNDS && softirq_pending != 0;
+       rounds ++) {
+    pending = softirq_pending;
+    softirq_pending = 0;
+
+    hw_sti();
+    for (i = 0; i < SOFTIRQ_TOTAL; i ++)
+      if ((pending & (1 << i)) && softirq_handlers[i] != NULL)
+        softirq_handlers[i]();
+    hw_cli();
+  }
+
+  lock_set_state(&saved);
+}
+
+/*****************************************************************************
+ * Tasklets                                                                  *
+ *****************************************************************************/
+
+void tasklet_init(tasklet_t *t, void (* fn)(void *), void *data) {
+  t->fn = fn;
+  t->data = data;
+  t->scheduled = 0;
+  t->next = NULL;
+}
+
+void tasklet_schedule(tasklet_t *t) {
+  u32 flags;
+
+  flags = irq_save();
+  if (!t->scheduled) {
+    t->scheduled = 1;
+    t->next = NULL;
+    if (tasklet_tail == NULL)
+      tasklet_head = t;
+    else
+      tasklet_tail->next = t;
+    tasklet_tail = t;
+    softirq_pending |= 1 << SOFTIRQ_TASKLET;
+  }
+  irq_restore(flags);
+}
+
+/* SOFTIRQ_TASKLET handler. The list is taken whole, anything scheduled while
+ * running goes to the next round. */
+static void tasklet_run() {
+  tasklet_t *t, *next;
+  u32 flags;
+
+  flags = irq_save();
+  t = tasklet_head;
+  tasklet_head = NULL;
+  tasklet_tail = NULL;
+  irq_restore(flags);
+
+  for (; t != NULL; t = next) {
+    flags = irq_save();
+    next = t->next;
+    t->next = NULL;
+    t->scheduled = 0;
+    irq_restore(flags);
+
+    t->fn(t->data);
+  }
+}
@@ -0,0 +1,119 @@
+#include <spinlock.h>
+#include <hw.h>
+
+/*****************************************************************************
+ * Spinlocks                                                                 *
+ *****************************************************************************/
+
+void spin_init(spinlock_t *l) {
+  l->owner = 0;
+  l->next = 0;
+  l->contended = 0;
+}
+
+/* lock xadd is atomic and a full barrier, so nothing in the critical region
+ * is done before the ticket is ours. While waiting we only read the lock,
+ * reads are served from our cache until the owner writes it. */
+void spin_lock(spinlock_t *l) {
+  u16 ticket;
+
+  ticket = __sync_fetch_and_add(&l->next, 1);
+  if (l->owner == ticket)
+    return;
+
+  while (l->owner != ticket)
+    hw_pause();
+
+  /* It's ours now, no need to be atomic. */
+  l->contended ++;
+}
+
+/* The lock is free when the next ticket is the one being served. If it's
+ * still so when we take it, nobody got in between. */
+int spin_trylock(spinlock_t *l) {
+  u16 owner;
+
+  owner = l->owner;
+  return __sync_bool_compare_and_swap(&l->next, owner, (u16)(owner + 1));
+}
+
+/* Only the owner writes owner, but the increment must be a barrier too so
+ * the critical region is done before the next one gets in. */
+void spin_unlock(spinlock_t *l) {
+  __sync_fetch_and_add(&l->owner, 1);
+}
+
+u32 spin_lock_irqsave(spinlock_t *l) {
+  u32 flags;
+
+  flags = hw_save_flags();
+  hw_cli();
+  spin_lock(l);
+  return flags;
+}
+
+void spin_unlock_irqrestore(spinlock_t *l, u32 flags) {
+  spin_unlock(l);
+  hw_restore_flags(flags);
+}
+
+/*****************************************************************************
+ * Reader-writer locks                                                       *
+ *****************************************************************************/
+
+void rw_init(rwlock_t *l) {
+  spin_init(&l->lock);
+  l->readers = 0;
+}
+
+/* Readers only take the spinlock to sign in, which waits for the writer if
+ * there's one, or for the writers ahead in the queue. */
+void read_lock(rwlock_t *l) {
+  spin_lock(&l->lock);
+  __sync_fetch_and_add(&l->readers, 1);
+  spin_unlock(&l->lock);
+}
+
+void read_unlock(rwlock_t *l) {
+  __sync_fetch_and_sub(&l->readers, 1);
+}
+
+/* Once the spinlock is ours no more readers get in, the ones inside just
+ * have to leave. */
+void write_lock(rwlock_t *l) {
+  spin_lock(&l->lock);
+  while (l->readers != 0)
+    hw_pause();
+}
+
+void write_unlock(rwlock_t *l) {
+  spin_unlock(&l->lock);
+}
+
+u32 read_lock_irqsave(rwlock_t *l) {
+  u32 flags;
+
+  flags = hw_save_flags();
+  hw_cli();
+  read_lock(l);
+  return flags;
+}
+
+void read_unlock_irqrestore(rwlock_t *l, u32 flags) {
+  read_unlock(l);
+  hw_restore_flags(flags);
+}
+
+u32 write_lock_irqsave(rwlock_t *l) {
+  u32 flags;
+
+  flags = hw_save_flags();
+  hw_cli();
+  write_lock(l);
+  return flags;
+}
+
+void write_unlock_irqrestore(rwlock_t *l, u32 flags) {
+  write_unlock(l);
+  hw_restore_flags(flags);
+}
@@ -0,0 +1,60 @@
+; Fast system calls entry point.
+;
+; int 0x80 goes through the IDT, a gate check, the generic interrupt stub and
+; the handlers chain before getting to the system calls table. sysenter jumps
+; straight here instead: the CPU takes cs, eip and esp from the MSRs set in
+; syscall_init() (ss being the next descriptor after cs), clears IF and
+; that's it. It saves nothing, not even where to return, so the userland
+; stubs must tell us:
+;   eax : system call number.
+;   ebx, ecx, edx : arguments.
+;   esi : eip to return to.
+;   edi : esp to return with.
+;
+; sysexit would be the natural way back, but it loads cs and ss with flat
+; segments, base 0 and limit 4 GB, no matter what the descriptors say, and our
+; processes live in their own segments. So we build the very same frame
+; int 0x80 would have left and leave through the interrupts return path.
+; The user cs and ss aren't known here, C fills them in from proc_cur.
+;
+; The stack at esp is the current process' kernel stack, the scheduler keeps
+; the MSR in sync with the TSS.
+
+[bits 32]
+[extern syscall_sysenter_handler]
+[extern itr_return]
+
+%define SYSCALL_IRQ 0x80
+%define EFLAGS_IF   0x200
+
+global syscall_sysenter
+syscall_sysenter:
+  ; The same as the CPU pushes for an interrupt coming from ring 3.
+  push 0                      ; ss, set in C.
+  push edi                    ; esp
+  pushfd
+  or dword [esp], EFLAGS_IF   ; eflags, sysenter cleared IF.
+  push 0                      ; cs, set in C.
+  push esi                    ; eip
+
+  ; And what the interrupts stub adds.
+  push 0                      ; Error code.
+  push SYSCALL_IRQ            ; IRQ
+  pushad
+
+  ; ss is the kernel data segment now. ds and friends are still the user's.
+  mov ax, ss
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+
+  ; Call the C function with a pointer to the frame. Its C signature is:
+  ;   void syscall_sysenter_handler(itr_frame_t *frame)
+  mov eax, esp
+  push eax
+  call syscall_sysenter_handler
+  add esp, 4
+
+  ; Restore the user segments and iret like any other interrupt.
+  jmp itr_return
@@ -6,48 +6,231 @@
 #include <hw.h>
 #include <proc.h>
 #include <gdt.h>
+#include <vm.h>
+#include <errors.h>
 
 #define SYSCALL_IRQ                   0x80
 
 /* Let's store our interrupts in a static array. It's not the must efficient
  * way to do this but it's more readable. */
-#define SYSCALL_TOTAL                 2
+#define SYSCALL_TOTAL                 5
 
-static void syscall_fb_printf(itr_cpu_regs_t cpu_regs,
-                              itr_intr_data_t intr_data,
-                              itr_stack_state_t stack) {
+/* Where the process' address addr is for the kernel, NULL if
+ * [addr, addr + size) is not all mapped. It's the process' own view of it,
+ * so writing there honors copy-on-write. size can't be more than a page. */
+static void * syscall_user_ptr(u32 addr, u32 size) {
+  if (proc_cur->pgdir == NULL || size == 0 || addr + size < addr ||
+      vm_frame(proc_cur->pgdir, addr) == NULL ||
+      vm_frame(proc_cur->pgdir, addr + size - 1) == NULL)
+    return NULL;
+  return (void *)(VM_USER_ADDR + addr);
+}
+
+/* Same for a string at addr, at most PROC_ARGS_MAX long. Each page it
+ * touches is checked once. */
+static char * syscall_user_str(u32 addr) {
+  char *s;
+  u32 i;
+
+  for (i = 0; i < PROC_ARGS_MAX; i ++) {
+    if (i == 0 || (addr + i) % MEM_FRAME_SIZE == 0) {
+      if (syscall_user_ptr(addr + i, 1) == NULL)
+        return NULL;
+    }
+    s = (char *)(VM_USER_ADDR + addr + i);
+    if (*s == '\0')
+      return (char *)(VM_USER_ADDR + addr);
+  }
+  return NULL;
+}
+
+/* System calls take their arguments from the registers saved in frame and
+ * return the value the process will find in eax. */
+static int syscall_fb_printf(itr_frame_t *frame) {
   /* TODO: Imprimir con fb_printf la cadena de formato en ebx con su primer
    *       y único parámetro en ecx. */
+  return 0;
 }
 
-static void syscall_exit(itr_cpu_regs_t cpu_regs,
-                         itr_intr_data_t intr_data,
-                         itr_stack_state_t stack) {
-  /* TODO: Do a real exit. */
-  fb_printf("exit called with %dd\n", cpu_regs.ebx);
-  hw_hlt();
+static int syscall_exit(itr_frame_t *frame) {
+  proc_exit(frame->regs.ebx);
+  return 0;
+}
+
+/* The child gets back here too, from a copy of frame. */
+static int syscall_fork(itr_frame_t *frame) {
+  return proc_fork(frame);
+}
+
+/* ebx: pid, ecx: where to leave the status, may be NULL, edx: options. */
+static int syscall_waitpid(itr_frame_t *frame) {
+  int *user_status, status;
+  pid_t pid;
+
+  user_status = NULL;
+  if (frame->regs.ecx != 0) {
+    user_status = (int *)syscall_user_ptr(frame->regs.ecx, sizeof(int));
+    if (user_status == NULL)
+      return -1;
+  }
+
+  pid = proc_waitpid((pid_t)frame->regs.ebx, &status, frame->regs.edx);
+  if (pid > 0 && user_status != NULL)
+    *user_status = status;
+  return pid;
 }
 
-static interrupt_handler_t syscalls[SYSCALL_TOTAL] = {
+/* ebx: path, ecx: NULL terminated argv, may be NULL, edx: PROC_MAX_FD
+ * descriptors for the new process, may be NULL. See proc_spawn(). All of
+ * it stays where it is, in the caller's pages, the kernel sees them while
+ * it runs. Only the argv pointers need translating. */
+static int syscall_spawn(itr_frame_t *frame) {
+  char *path, **argv;
+  u32 *user_argv;
+  int *fds, argc, i;
+  pid_t pid;
+
+  path = syscall_user_str(frame->regs.ebx);
+  if (path == NULL)
+    return -1;
+
+  fds = NULL;
+  if (frame->regs.edx != 0) {
+    fds = (int *)syscall_user_ptr(frame->regs.edx, PROC_MAX_FD * sizeof(int));
+    if (fds == NULL)
+      return -1;
+  }
+
+  if (frame->regs.ecx == 0)
+    return proc_spawn(path, NULL, fds);
+
+  /* Count them, it can't take more than the stack would. */
+  for (argc = 0; argc < PROC_ARGS_MAX / sizeof(u32); argc ++) {
+    user_argv = (u32 *)syscall_user_ptr(frame->regs.ecx + argc * sizeof(u32),
+                                        sizeof(u32));
+    if (user_argv == NULL)
+      return -1;
+    if (*user_argv == 0)
+      break;
+  }
+  if (argc == PROC_ARGS_MAX / sizeof(u32)) {
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  argv = (char **)kalloc((argc + 1) * sizeof(char *));
+  if (argv == NULL) {
+    set_errno(E_NOMEM);
+    return -1;
+  }
+  user_argv = (u32 *)(VM_USER_ADDR + frame->regs.ecx);
+  for (i = 0; i < argc; i ++) {
+    argv[i] = syscall_user_str(user_argv[i]);
+    if (argv[i] == NULL) {
+      kfree(argv);
+      return -1;
+    }
+  }
+  argv[argc] = NULL;
+
+  pid = proc_spawn(path, argv, fds);
+  kfree(argv);
+  return pid;
+}
+
+/* System calls don't share the vector, so they don't need the chain's cookie
+ * nor its return value. */
+typedef int (*syscall_handler_t)(itr_frame_t *);
+
+static syscall_handler_t syscalls[SYSCALL_TOTAL] = {
   syscall_fb_printf,
-  syscall_exit
+  syscall_exit,
+  syscall_fork,
+  syscall_waitpid,
+  syscall_spawn
 };
 
-/* This is the interrupt router. */
-static void syscall(itr_cpu_regs_t cpu_regs,
-             itr_intr_data_t intr_data,
-             itr_stack_state_t stack) {
-  if (cpu_regs.eax < SYSCALL_TOTAL) {
-    syscalls[cpu_regs.eax](cpu_regs, intr_data, stack);
+/* Calls the system call in the saved eax. The result goes back there, so
+ * it's what the process gets when it returns to user mode. */
+static void syscall_dispatch(itr_frame_t *frame) {
+  if (frame->regs.eax < SYSCALL_TOTAL) {
+    frame->regs.eax = (u32)syscalls[frame->regs.eax](frame);
   }
   else {
     /* TODO: Kill the offender. */
+    frame->regs.eax = (u32)-1;
   }
 }
 
-/* Set the interrupt handler. */
+/* This is the interrupt router. */
+static int syscall(itr_frame_t *frame, void *cookie) {
+  syscall_dispatch(frame);
+  return ITR_HANDLED;
+}
+
+/*****************************************************************************
+ * sysenter                                                                  *
+ *****************************************************************************/
+
+/* Whether the CPU has sysenter and the MSRs are set. */
+static int syscall_sysenter_enabled;
+
+/* The entry point, in syscall.asm. */
+extern void syscall_sysenter();
+
+/* Called from syscall_sysenter with the frame it built. Only the process
+ * knows its segments. */
+void syscall_sysenter_handler(itr_frame_t *frame) {
+  itr_enter();
+  frame->stack.cs = proc_cur->segs.cs;
+  frame->user_ss = proc_cur->segs.ss;
+  syscall_dispatch(frame);
+  itr_leave(frame);
+}
+
+/* The SEP feature flag is set in the Pentium Pro even though it doesn't have
+ * sysenter, family 6 processors below model 3 stepping 3 must be ignored. */
+static int syscall_has_sysenter() {
+  u32 regs[4];
+  u32 family, model, stepping;
+
+  hw_cpuid(HW_CPUID_FEATURES, regs);
+  if (!(regs[3] & HW_CPUID_EDX_SEP))
+    return 0;
+
+  family = (regs[0] >> 8) & 0xf;
+  model = (regs[0] >> 4) & 0xf;
+  stepping = regs[0] & 0xf;
+  return !(family == 6 && model < 3 && stepping < 3);
+}
+
+void syscall_set_kernel_stack(void *esp0) {
+  if (syscall_sysenter_enabled)
+    hw_wrmsr(HW_MSR_SYSENTER_ESP, (u32)esp0);
+}
+
+/* Set the interrupt handler and, if possible, sysenter. */
 void syscall_init() {
   itr_set_interrupt_handler(SYSCALL_IRQ,
                             syscall,
+                            NULL,
                             IDT_PRESENT | IDT_DPL_RING_3 | IDT_GATE_INTR);
+
+  if (!syscall_has_sysenter())
+    return;
+
+  syscall_sysenter_enabled = 1;
+  syscall_init_cpu((void *)MEM_KERNEL_ISTACK_TOP);
+}
+
+/* The MSRs are per processor. All of them are assumed to be alike, so they
+ * all have sysenter if the BSP does. */
+void syscall_init_cpu(void *esp0) {
+  if (!syscall_sysenter_enabled)
+    return;
+
+  /* ss is taken as the descriptor after cs, which is our kernel data. */
+  hw_wrmsr(HW_MSR_SYSENTER_CS, GDT_KERNEL_CODE_SEGMENT);
+  hw_wrmsr(HW_MSR_SYSENTER_EIP, (u32)syscall_sysenter);
+  syscall_set_kernel_stack(esp0);
 }
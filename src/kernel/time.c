@@ -110,9 +110,7 @@ void time_set(struct tm *t) {
 
 	//set_RTC_register(REGB_STATUS, 0);
 	fdrtc->f_ops.write(fdrtc, buf, REGISTER_COUNT);
-	hw_cli();
 	set_RTC_register(REG_CENTURY, century);
-	hw_sti();
 
 }
 
@@ -122,14 +120,9 @@ u64 get_seconds(struct tm *t) {
 			t->year*365*24*60*60;
 }
 
-//Detiene la ejecución por algunos segundos.
+//Detiene la ejecución por algunos segundos. El proceso duerme hasta que
+//la interrupción del RTC lo despierta, en lugar de leer el reloj en un ciclo.
 void time_sleep(int s) {
-	struct tm t;
-	time_get(&t);
-	u64 seconds_start = get_seconds(&t);
-	u64 seconds_end	  = seconds_start + s;
-
-	do{
-		time_get(&t);
-	}while(get_seconds(&t) < seconds_end);
+	if (s > 0)
+		rtc_sleep(s);
 }
\ No newline at end of file
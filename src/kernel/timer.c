@@ -0,0 +1,138 @@
+#include <timer.h>
+#include <wait.h>
+#include <pit.h>
+#include <lock.h>
+#include <softirq.h>
+
+/* The wheel. */
+static timer_t *timer_wheel[TIMER_WHEEL_SLOTS];
+
+/* Last tick whose slot was run. */
+static u64 timer_last;
+
+static void timer_run();
+
+void timer_init() {
+  int i;
+
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i ++)
+    timer_wheel[i] = NULL;
+  timer_last = counter;
+
+  softirq_set_handler(SOFTIRQ_TIMER, timer_run);
+}
+
+/* Helpers, interrupts must be disabled. */
+static void timer_link(timer_t *t) {
+  timer_t **slot;
+
+  slot = timer_wheel + t->expires % TIMER_WHEEL_SLOTS;
+  t->prev = NULL;
+  t->next = *slot;
+  if (*slot != NULL)
+    (*slot)->prev = t;
+  *slot = t;
+  t->pending = 1;
+}
+
+static void timer_unlink(timer_t *t) {
+  if (t->prev != NULL)
+    t->prev->next = t->next;
+  else
+    timer_wheel[t->expires % TIMER_WHEEL_SLOTS] = t->next;
+  if (t->next != NULL)
+    t->next->prev = t->prev;
+  t->prev = NULL;
+  t->next = NULL;
+  t->pending = 0;
+}
+
+void timer_add(timer_t *t, u32 ticks) {
+  lock();
+  if (t->pending)
+    timer_unlink(t);
+  /* A timer for now would wait a whole turn. */
+  t->expires = counter + (ticks > 0 ? ticks : 1);
+  timer_link(t);
+  unlock();
+}
+
+void timer_del(timer_t *t) {
+  lock();
+  if (t->pending)
+    timer_unlink(t);
+  unlock();
+}
+
+/* Called from the timer interrupt after counter was incremented. The timers
+ * are run by the softirq. */
+void timer_tick() {
+  softirq_raise(SOFTIRQ_TIMER);
+}
+
+/* First expired timer in the slot of tick, if any. Interrupts must be
+ * disabled. */
+static timer_t * timer_expired(u64 tick) {
+  timer_t *t;
+
+  for (t = timer_wheel[tick % TIMER_WHEEL_SLOTS];
+       t != NULL && t->expires > tick;
+       t = t->next);
+  return t;
+}
+
+/* SOFTIRQ_TIMER handler. Catches up with every tick since the last run, and
+ * calls each expired timer with interrupts enabled. */
+static void timer_run() {
+  timer_t *t;
+  u32 flags;
+
+  flags = irq_save();
+  while (timer_last < counter) {
+    timer_last ++;
+    while ((t = timer_expired(timer_last)) != NULL) {
+      timer_unlink(t);
+      irq_restore(flags);
+      t->fn(t);
+      flags = irq_save();
+    }
+  }
+  irq_restore(flags);
+}
+
+/*****************************************************************************
+ * Sleeping                                                                  *
+ *****************************************************************************/
+
+typedef struct timer_sleeper {
+  wait_queue_t  wait;
+  int           expired;
+} timer_sleeper_t;
+
+static void timer_wake_sleeper(timer_t *t) {
+  timer_sleeper_t *s;
+  u32 flags;
+
+  s = (timer_sleeper_t *)t->data;
+  flags = irq_save();
+  s->expired = 1;
+  wait_wake_up(&s->wait);
+  irq_restore(flags);
+}
+
+void timer_sleep(u32 ticks) {
+  timer_sleeper_t s;
+  timer_t t;
+
+  wait_init(&s.wait);
+  s.expired = 0;
+  t.fn = timer_wake_sleeper;
+  t.data = &s;
+  t.pending = 0;
+  timer_add(&t, ticks);
+
+  lock();
+  while (!s.expired)
+    wait_sleep(&s.wait);
+  unlock();
+}
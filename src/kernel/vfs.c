@@ -55,6 +55,7 @@
 #include <string.h>
 #include <errors.h>
 #include <devices.h>
+#include <lock.h>
 
 #define VFS_MAX_FILES             1024
 #define VFS_DEFAULT_BLK_SIZE      1024
@@ -196,6 +197,8 @@ static vfs_sb_t * vfs_sb_alloc(dev_t devid) {
   sb->sb_ops.delete_vnode = NULL;
   sb->sb_ops.mount = NULL;
   sb->sb_ops.unmount = NULL;
+  sb->sb_ops.sync = NULL;
+  sb->sb_ops.statfs = NULL;
 
   sb->sb_root_vno = 0;
   sb->private_data = NULL;
@@ -210,8 +213,10 @@ static vfs_sb_t * vfs_sb_alloc(dev_t devid) {
 
 /* Deallocs a superblock. */
 static int vfs_sb_dealloc(vfs_sb_t *sb) {
-  /* Tell the filesystem type the superblock is about to be released. */
-  if (sb->ro.sb_fs_type->ft_ops.ft_kill_sb != NULL) {
+  /* Tell the filesystem type the superblock is about to be released. There's
+   * no type yet if probing failed. */
+  if (sb->ro.sb_fs_type != NULL &&
+      sb->ro.sb_fs_type->ft_ops.ft_kill_sb != NULL) {
     if (sb->ro.sb_fs_type->ft_ops.ft_kill_sb(sb) == -1) {
       set_errno(E_IO);
       return -1;
@@ -245,26 +250,96 @@ static int vfs_sb_dealloc(vfs_sb_t *sb) {
  * We identify empty spaces by checking the d_name field to be NULL because
  * all dentries must have a name. And the eviction algorithm is Least
  * Frecuently Used (LFU), which I know is not the best but is simple to
- * implement. */
+ * implement.
+ *
+ * Most lookups find their dentries already there, and all they do is
+ * reading the array, save for the counter. So the array is protected by a
+ * reader-writer lock: lookups that hit take it for reading and bump the
+ * counter atomically, only adding and removing dentries takes it for
+ * writing. The dentries' fields other than the name, the parent and the
+ * counter aren't protected by it. */
 #define VFS_MAX_DENTRIES        100
 static vfs_dentry_t vfs_dentries[VFS_MAX_DENTRIES]; /* Dentries are 24 bytes
                                                      * long, thus this will
                                                      * make the kernel just
                                                      * 2400 bytes larger. */
+static rwlock_t vfs_dentries_lock = RWLOCK_INIT;
 
-/* Resets a dentry to a initial, empty state. */
-static void vfs_dentry_reset(vfs_dentry_t *dentry) {
+/* Resets a dentry to a initial, empty state. vfs_dentries_lock must be held
+ * for writing. */
+static void vfs_dentry_clear(vfs_dentry_t *dentry) {
   if (dentry->d_name != NULL)
     kfree(dentry->d_name);
 
   memset(dentry, 0, sizeof(vfs_dentry_t));
 }
 
+/* The same, taking the lock. */
+static void vfs_dentry_reset(vfs_dentry_t *dentry) {
+  u32 flags;
+
+  flags = write_lock_irqsave(&vfs_dentries_lock);
+  vfs_dentry_clear(dentry);
+  write_unlock_irqrestore(&vfs_dentries_lock, flags);
+}
+
+/* Tells whether dentry is d or one of its ancestors. */
+static int vfs_dentry_is_ancestor(vfs_dentry_t *dentry, vfs_dentry_t *d) {
+  for (; d != NULL; d = d->ro.d_parent) {
+    if (d == dentry)
+      return 1;
+  }
+  return 0;
+}
+
+/* Evicts a dentry from the cache along with its cached descendants, which
+ * would be left pointing to a reused slot otherwise. vfs_dentries_lock must
+ * be held for writing. */
+static void vfs_dentry_evict(vfs_dentry_t *dentry) {
+  int i;
+
+  for (i = 0; i < VFS_MAX_DENTRIES; i ++) {
+    if (vfs_dentries[i].d_name != NULL &&
+        vfs_dentries[i].ro.d_parent == dentry &&
+        vfs_dentries[i].ro.d_mnt_sb == NULL) {
+      vfs_dentry_evict(vfs_dentries + i);
+    }
+  }
+  vfs_dentry_clear(dentry);
+}
+
+/* Looks for a dentry in the cache. vfs_dentries_lock must be held. */
+static vfs_dentry_t * vfs_dentry_find(vfs_dentry_t *parent, char *name) {
+  int i;
+
+  for (i = 0; i < VFS_MAX_DENTRIES; i ++)
+    if (vfs_dentries[i].d_name != NULL &&
+        vfs_dentries[i].ro.d_parent == parent &&
+        strcmp(vfs_dentries[i].d_name, name) == 0)
+      return vfs_dentries + i;
+  return NULL;
+}
+
 /* Allocates a dentry in the cache. */
 static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
   int i;
   int lowest_count, lowest_index;
   vfs_dentry_t *d;
+  u32 flags;
+
+  /* Readers don't get in each other's way. There may be several of them
+   * bumping the counter at once, though. */
+  flags = read_lock_irqsave(&vfs_dentries_lock);
+  d = vfs_dentry_find(parent, name);
+  if (d != NULL)
+    __sync_fetch_and_add(&d->ro.d_count, 1);
+  read_unlock_irqrestore(&vfs_dentries_lock, flags);
+  if (d != NULL)
+    return d;
+
+  /* It's not there, or it wasn't: someone may add it before we get the
+   * lock, so the look up is done again. */
+  flags = write_lock_irqsave(&vfs_dentries_lock);
 
   /* Look for the wanted dentry and in the meantime compute where to store a
    * new dentry in case we need it. */
@@ -281,6 +356,7 @@ static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
         strcmp(vfs_dentries[i].d_name, name) == 0) {
       /* Increment the counter. */
       vfs_dentries[i].ro.d_count ++;
+      write_unlock_irqrestore(&vfs_dentries_lock, flags);
       return vfs_dentries + i;
     }
     /* This is not the one we want but it is a mountpoint, thus it is
@@ -288,6 +364,10 @@ static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
     if (vfs_dentries[i].ro.d_mnt_sb != NULL) {
       continue;
     }
+    /* Neither are the ones in the path to the new dentry. */
+    if (vfs_dentry_is_ancestor(vfs_dentries + i, parent)) {
+      continue;
+    }
     /* This is just normal dentry. Check whether it has the lowest reference
      * counter. */
     if (lowest_index == -1 || vfs_dentries[i].ro.d_count < lowest_count) {
@@ -300,16 +380,18 @@ static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
    * one. */
   if (lowest_index == -1) {
     /* What? Do we really reached the VFS_MAX_DENTRIES mountpoints? How? */
+    write_unlock_irqrestore(&vfs_dentries_lock, flags);
     set_errno(E_LIMIT);
     return NULL;
   }
 
   /* Ok, set the dentry. */
   d = vfs_dentries + lowest_index;
-  vfs_dentry_reset(d);
+  vfs_dentry_evict(d);
 
   d->d_name = (char *)kalloc(strlen(name) + 1);
   if (d->d_name == NULL) {
+    write_unlock_irqrestore(&vfs_dentries_lock, flags);
     set_errno(E_NOMEM);
     return NULL;
   }
@@ -335,6 +417,7 @@ static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
   /* And since someone requested it, it's count is 1, right? */
   d->ro.d_count = 1;
 
+  write_unlock_irqrestore(&vfs_dentries_lock, flags);
   return d;
 }
 
@@ -343,6 +426,9 @@ static vfs_dentry_t * vfs_dentry_get(vfs_dentry_t *parent, char *name) {
  * must be removed. */
 static int vfs_dentry_unmount_sb(vfs_sb_t *sb) {
   int i;
+  u32 flags;
+
+  flags = write_lock_irqsave(&vfs_dentries_lock);
 
   /* First, check whether we can unmount the superblock. */
   for (i = 0; i < VFS_MAX_DENTRIES; i ++) {
@@ -351,6 +437,7 @@ static int vfs_dentry_unmount_sb(vfs_sb_t *sb) {
     }
     if (vfs_dentries[i].ro.d_mnt_sb != NULL &&
         vfs_dentries[i].ro.d_sb == sb) {
+      write_unlock_irqrestore(&vfs_dentries_lock, flags);
       return -1;
     }
   }
@@ -361,10 +448,11 @@ static int vfs_dentry_unmount_sb(vfs_sb_t *sb) {
       continue;
     }
     if (vfs_dentries[i].ro.d_sb == sb) {
-      vfs_dentry_reset(vfs_dentries + i);
+      vfs_dentry_clear(vfs_dentries + i);
     }
   }
 
+  write_unlock_irqrestore(&vfs_dentries_lock, flags);
   return 0;
 }
 
@@ -376,8 +464,13 @@ static int vfs_dentry_unmount_sb(vfs_sb_t *sb) {
  * structures. However, we must put some limits here. */
 #define VFS_MAX_VNODES        1024
 
-/* VNodes. */
+/* VNodes. Looking them up only takes the lock for reading, adding them to
+ * the list and taking them out of it takes it for writing. The reference
+ * counters are changed atomically, and a node only leaves the list when its
+ * counter gets to 0 with the lock held for writing, so nobody can find it and
+ * acquire it while it's being destroyed. */
 static list_t vfs_vnodes;
+static rwlock_t vfs_vnodes_lock = RWLOCK_INIT;
 
 /* vnode key in the cache. */
 typedef struct vfs_vnode_key {
@@ -396,7 +489,7 @@ static int vfs_vnodes_cmp(void *item, void *key) {
   return n->v_no == k->v_no && n->ro.v_sb == k->v_sb;
 }
 
-/* vnodes lookup. */
+/* vnodes lookup. vfs_vnodes_lock must be held. */
 static vfs_vnode_t * vfs_vnode_lookup(vfs_sb_t *sb, int v_no) {
   vfs_vnode_key_t k;
   k.v_sb = sb;
@@ -421,12 +514,17 @@ static vfs_vnode_t * vfs_vnode_prealloc(vfs_sb_t *sb) {
   v->v_mode = 0;
   v->v_size = 0;
   v->v_dev = FILE_NODEV;
+  /* Filesystems not keeping track of links won't see nodes deleted. */
+  v->v_nlinks = 1;
 
   /* TODO: Provide generic implementations if applicable. */
   v->v_iops.lookup = NULL;
   v->v_iops.create = NULL;
   v->v_iops.mkdir = NULL;
   v->v_iops.mknod = NULL;
+  v->v_iops.unlink = NULL;
+  v->v_iops.rmdir = NULL;
+  v->v_iops.truncate = NULL;
 
   v->v_fops.open = NULL;
   v->v_fops.release = NULL;
@@ -435,6 +533,8 @@ static vfs_vnode_t * vfs_vnode_prealloc(vfs_sb_t *sb) {
   v->v_fops.write = NULL;
   v->v_fops.lseek = NULL;
   v->v_fops.ioctl = NULL;
+  v->v_fops.readdir = NULL;
+  v->v_fops.getdents = NULL;
 
   v->ro.v_sb = sb;
   v->ro.v_count = 0;
@@ -447,52 +547,45 @@ static vfs_vnode_t * vfs_vnode_prealloc(vfs_sb_t *sb) {
   return v;
 }
 
-/* Registers a vnode in the vnode cache. */
-static int vfs_vnode_alloc(vfs_vnode_t *node) {
-  return list_add(&vfs_vnodes, node);
-}
-
-/* Destroys the vnode and takes it out the vnodes list if it was already there.
- * This allows destroying a node that has only been preallocated. */
-static int vfs_vnode_dealloc(vfs_vnode_t *node) {
-  vfs_vnode_t *n;
-  vfs_vnode_key_t k;
-
-  /* Try to remove the node from the list. */
-  k.v_no = node->v_no;
-  k.v_sb = node->ro.v_sb;
-  n = list_find_del(&vfs_vnodes, vfs_vnodes_cmp, &k);
-
-  /* Just double check we didn't screw something somewhere sometime. */
-  if (n != NULL && n != node) {
-    set_errno(E_CORRUPT);
-    return -1;
-  }
-
-  kfree(node);
-  return 0;
-}
-
 /* Acquires a vnode. */
 static int vfs_vnode_acquire(vfs_vnode_t *node) {
-  node->ro.v_count ++;
+  __sync_fetch_and_add(&node->ro.v_count, 1);
   return 0;
 }
 
 /* Releases a vnode. If the reference counter reaches zero the node will be
- * destroyed. */
+ * destroyed, and deleted from the filesystem if it was unlinked meanwhile. */
 static int vfs_vnode_release(vfs_vnode_t *node) {
-  node->ro.v_count --;
+  vfs_vnode_key_t k;
+  u32 flags;
+  int last;
+
+  /* The last one takes it out of the cache right away. */
+  flags = write_lock_irqsave(&vfs_vnodes_lock);
+  last = -- node->ro.v_count < 1;
+  if (last) {
+    k.v_no = node->v_no;
+    k.v_sb = node->ro.v_sb;
+    list_find_del(&vfs_vnodes, vfs_vnodes_cmp, &k);
+  }
+  write_unlock_irqrestore(&vfs_vnodes_lock, flags);
 
   /* Ok, this one has to be destroyed. */
-  if (node->ro.v_count < 1) {
+  if (last) {
+    /* Nobody can reach it anymore. */
+    if (node->v_nlinks == 0 &&
+        node->ro.v_sb->sb_ops.delete_vnode != NULL &&
+        node->ro.v_sb->sb_ops.delete_vnode(node->ro.v_sb, node) == -1) {
+      set_errno(E_IO);
+      return -1;
+    }
     /* Tell the superblock this node is being destroyed. */
     if (node->ro.v_sb->sb_ops.destroy_vnode(node->ro.v_sb, node) == -1) {
       set_errno(E_IO);
       return -1;
     }
-    /* And destroy it. */
-    return vfs_vnode_dealloc(node);
+    /* And destroy it. It's already out of the list. */
+    kfree(node);
   }
   return 0;
 }
@@ -500,38 +593,60 @@ static int vfs_vnode_release(vfs_vnode_t *node) {
 /* Load a vnode from cache or from superblock. This adds the node to the list
  * of nodes and acquires it. */
 static vfs_vnode_t * vfs_vnode_get_or_read(vfs_sb_t *sb, int vno) {
-  vfs_vnode_t *n;
+  vfs_vnode_t *n, *other;
+  u32 flags;
+  int r;
 
-  /* Look the node in the cache. */
+  /* Look the node in the cache, and acquire it before anyone can release
+   * it. */
+  flags = read_lock_irqsave(&vfs_vnodes_lock);
   n = vfs_vnode_lookup(sb, vno);
+  if (n != NULL)
+    vfs_vnode_acquire(n);
+  read_unlock_irqrestore(&vfs_vnodes_lock, flags);
+  if (n != NULL)
+    return n;
+
   /* If not there, create it. */
+  /* Reserve space for the node. */
+  n = vfs_vnode_prealloc(sb);
   if (n == NULL) {
-    /* Reserve space for the node. */
-    n = vfs_vnode_prealloc(sb);
-    if (n == NULL) {
-      return NULL;
-    }
+    return NULL;
+  }
 
-    /* Set the required fields to ask the superblock to find it. */
-    n->v_no = vno;
-    n->ro.v_sb = sb;
+  /* Set the required fields to ask the superblock to find it. */
+  n->v_no = vno;
+  n->ro.v_sb = sb;
 
-    /* Ask the superblock to load it. */
-    if (sb->sb_ops.read_vnode(sb, n) == -1) {
-      vfs_vnode_dealloc(n);
-      return NULL;
-    }
+  /* Ask the superblock to load it. This may sleep, so no locks here. Until
+   * it's registered it's not in the list, where there may be another node
+   * with the same number by now, so it's freed rather than deallocated. */
+  if (sb->sb_ops.read_vnode(sb, n) == -1) {
+    kfree(n);
+    return NULL;
+  }
 
-    /* Register tne node in the cache. */
-    if (vfs_vnode_alloc(n) == -1) {
-      sb->sb_ops.destroy_vnode(sb, n);
-      vfs_vnode_dealloc(n);
-      return NULL;
-    }
+  /* Register the node in the cache, acquired, unless somebody else read it
+   * meanwhile. */
+  flags = write_lock_irqsave(&vfs_vnodes_lock);
+  other = vfs_vnode_lookup(sb, vno);
+  if (other != NULL) {
+    vfs_vnode_acquire(other);
+    r = 0;
+  }
+  else {
+    r = list_add(&vfs_vnodes, n);
+    if (r != -1)
+      vfs_vnode_acquire(n);
+  }
+  write_unlock_irqrestore(&vfs_vnodes_lock, flags);
+
+  if (other != NULL || r == -1) {
+    sb->sb_ops.destroy_vnode(sb, n);
+    kfree(n);
+    return other;
   }
 
-  /* Acquire it. */
-  vfs_vnode_acquire(n);
   return n;
 }
 
@@ -550,7 +665,14 @@ static int vfs_vnodes_sb_only_cmp(void *item, void *sb) {
 /* Only checks whether there are vnodes left beloging the to-be-unmounted
  * superblock. */
 static int vfs_vnode_unmount_sb(vfs_sb_t *sb) {
-  if (list_find(&vfs_vnodes, vfs_vnodes_sb_only_cmp, sb) == NULL)
+  vfs_vnode_t *n;
+  u32 flags;
+
+  flags = read_lock_irqsave(&vfs_vnodes_lock);
+  n = list_find(&vfs_vnodes, vfs_vnodes_sb_only_cmp, sb);
+  read_unlock_irqrestore(&vfs_vnodes_lock, flags);
+
+  if (n == NULL)
     return 0;
   return -1;
 }
@@ -608,6 +730,7 @@ static vfs_file_t * vfs_file_open(vfs_vnode_t *node, int flags) {
       filp->f_ops.lseek = node->v_fops.lseek;
       filp->f_ops.ioctl = node->v_fops.ioctl;
       filp->f_ops.readdir = node->v_fops.readdir;
+      filp->f_ops.getdents = node->v_fops.getdents;
       break;
     case FILE_TYPE_CHAR_DEV:
       if (dev_set_char_operations(node, filp) == -1) {
@@ -642,6 +765,13 @@ static vfs_file_t * vfs_file_open(vfs_vnode_t *node, int flags) {
   return filp;
 }
 
+/* Writes out the filesystem's cached data, if it caches anything. */
+static int vfs_sb_sync(vfs_sb_t *sb) {
+  if (sb->sb_ops.sync == NULL)
+    return 0;
+  return sb->sb_ops.sync(sb);
+}
+
 /* Remove an open file. */
 static int vfs_file_close(vfs_file_t *filp) {
   vfs_vnode_t *n;
@@ -658,6 +788,10 @@ static int vfs_file_close(vfs_file_t *filp) {
   if (filp->f_ops.flush != NULL)
     filp->f_ops.flush(filp);
 
+  /* Synchronous files don't leave anything behind in the caches. */
+  if (filp->f_flags & FILE_O_SYNC)
+    vfs_sb_sync(n->ro.v_sb);
+
   /* If this the last opened file on this vnode. */
   if (n->ro.v_count == 1 && filp->f_ops.release != NULL)
     filp->f_ops.release(n, filp);
@@ -716,6 +850,13 @@ static int vfs_create_node(char *path, mode_t mode, dev_t devid) {
   *name = '\0';
   name ++;
 
+  /* Names must fit in a vfs_dirent_t. */
+  if (strlen(name) > VFS_NAME_MAX) {
+    kfree(parent_path);
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
   /* Load parent. */
   if (* parent_path == '\0')
     parent = vfs_root_dentry;
@@ -1067,6 +1208,38 @@ int vfs_stat(char *path, struct stat *stat) {
   return 0;
 }
 
+/* Usage of the filesystem holding path. */
+int vfs_statfs(char *path, struct statfs *st) {
+  vfs_dentry_t *d;
+  vfs_vnode_t *n;
+  vfs_sb_t *sb;
+  int r;
+
+  d = vfs_lookup(path);
+  if (d == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  n = vfs_node_from_dentry(d);
+  if (n == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  sb = n->ro.v_sb;
+  if (sb->sb_ops.statfs == NULL) {
+    set_errno(E_NOTIMP);
+    r = -1;
+  } else {
+    r = sb->sb_ops.statfs(sb, st);
+  }
+
+  vfs_vnode_release(n);
+
+  return r;
+}
+
 /* Create a directory. */
 int vfs_mkdir(char *path, mode_t mode) {
   /* Just avoid problems with the mode. */
@@ -1089,6 +1262,130 @@ int vfs_mknod(char *path, mode_t mode, dev_t dev) {
   return vfs_create_node(path, mode, dev);
 }
 
+/* Removing files and directories is quite similar as well. The entry goes
+ * away right now but the vnode lives on until the last open file using it is
+ * closed. */
+static int vfs_remove_node(char *path, int dir) {
+  vfs_dentry_t *d;
+  vfs_vnode_t *node, *parent_node;
+  int (* remove) (vfs_vnode_t *, vfs_dentry_t *);
+  int r;
+  u32 flags;
+
+  d = vfs_lookup(path);
+  if (d == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  /* "/" and mountpoints can't go. */
+  if (d->ro.d_parent == NULL || d->ro.d_mnt_sb != NULL) {
+    set_errno(E_BUSY);
+    return -1;
+  }
+
+  node = vfs_node_from_dentry(d);
+  if (node == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  if (dir && FILE_TYPE(node->v_mode) != FILE_TYPE_DIRECTORY) {
+    vfs_vnode_release(node);
+    set_errno(E_NODIR);
+    return -1;
+  }
+  if (!dir && FILE_TYPE(node->v_mode) == FILE_TYPE_DIRECTORY) {
+    vfs_vnode_release(node);
+    set_errno(E_ISDIR);
+    return -1;
+  }
+
+  parent_node = vfs_node_from_dentry(d->ro.d_parent);
+  if (parent_node == NULL) {
+    vfs_vnode_release(node);
+    /* errno was already set. */
+    return -1;
+  }
+
+  remove = dir ? parent_node->v_iops.rmdir : parent_node->v_iops.unlink;
+  if (remove == NULL) {
+    set_errno(E_NOTIMP);
+    r = -1;
+  } else {
+    r = remove(parent_node, d);
+  }
+
+  if (r != -1) {
+    node->v_nlinks --;
+    flags = write_lock_irqsave(&vfs_dentries_lock);
+    vfs_dentry_evict(d);
+    write_unlock_irqrestore(&vfs_dentries_lock, flags);
+  }
+
+  vfs_vnode_release(parent_node);
+  /* If this was the last reference the node gets deleted here. */
+  vfs_vnode_release(node);
+
+  return r;
+}
+
+/* unlink. */
+int vfs_unlink(char *path) {
+  return vfs_remove_node(path, 0);
+}
+
+/* rmdir. */
+int vfs_rmdir(char *path) {
+  return vfs_remove_node(path, 1);
+}
+
+/* Changes the size of a regular file. */
+static int vfs_node_truncate(vfs_vnode_t *node, size_t size) {
+  if (FILE_TYPE(node->v_mode) == FILE_TYPE_DIRECTORY) {
+    set_errno(E_ISDIR);
+    return -1;
+  }
+  if (FILE_TYPE(node->v_mode) != FILE_TYPE_REGULAR) {
+    set_errno(E_INVAL);
+    return -1;
+  }
+  if (node->v_iops.truncate == NULL) {
+    set_errno(E_NOTIMP);
+    return -1;
+  }
+  return node->v_iops.truncate(node, size);
+}
+
+/* truncate. */
+int vfs_truncate(char *path, size_t size) {
+  vfs_dentry_t *d;
+  vfs_vnode_t *node;
+  int r;
+
+  d = vfs_lookup(path);
+  if (d == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  node = vfs_node_from_dentry(d);
+  if (node == NULL) {
+    /* errno was already set. */
+    return -1;
+  }
+
+  if (!(node->v_mode & FILE_PERM_USR_WRITE)) {
+    set_errno(E_ACCESS);
+    r = -1;
+  } else {
+    r = vfs_node_truncate(node, size);
+  }
+
+  vfs_vnode_release(node);
+  return r;
+}
+
 /* Opens a file. */
 vfs_file_t * vfs_open(char *path, int flags, mode_t mode) {
   vfs_vnode_t *node;
@@ -1142,7 +1439,15 @@ vfs_file_t * vfs_open(char *path, int flags, mode_t mode) {
     return NULL;
   }
 
-  /* Implement O_TRUNC */
+  /* Opening for writing with O_TRUNC empties regular files. */
+  if ((flags & FILE_O_TRUNC) && (flags & FILE_O_WRITE) &&
+      FILE_TYPE(node->v_mode) == FILE_TYPE_REGULAR &&
+      vfs_node_truncate(node, 0) == -1) {
+    err = get_errno();
+    vfs_vnode_release(node);
+    set_errno(err);
+    return NULL;
+  }
 
   /* Open the file. */
   filp = vfs_file_open(node, flags);
@@ -1198,6 +1503,35 @@ off_t vfs_lseek(vfs_file_t *filp, off_t off, int whence) {
   return filp->f_pos;
 }
 
+/* Reads directory entries. Filesystems without getdents are served one name
+ * at a time through readdir. */
+ssize_t vfs_getdents(vfs_file_t *filp, vfs_dirent_t *dirents, size_t count) {
+  size_t i;
+  char *name;
+
+  if (FILE_TYPE(filp->ro.f_vnode->v_mode) != FILE_TYPE_DIRECTORY) {
+    set_errno(E_NODIR);
+    return -1;
+  }
+
+  if (filp->f_ops.getdents != NULL)
+    return filp->f_ops.getdents(filp, dirents, count);
+
+  if (filp->f_ops.readdir == NULL) {
+    set_errno(E_NOTIMP);
+    return -1;
+  }
+
+  for (i = 0; i < count; i ++) {
+    name = filp->f_ops.readdir(filp);
+    if (name == NULL)
+      break;
+    dirents[i].d_vno = 0;
+    memcpy(dirents[i].d_name, name, strlen(name) + 1);
+  }
+  return (ssize_t)i;
+}
+
 /* Unmounts a mounted superblock. */
 int vfs_sb_unmount(vfs_sb_t *sb) {
   vfs_dentry_t *mp;
@@ -1241,7 +1575,24 @@ int vfs_sb_unmount(vfs_sb_t *sb) {
   return 0;
 }
 
+/* Flushes a file. Data is only guaranteed to reach the disk if the file was
+ * opened with FILE_O_SYNC. */
+int vfs_flush(vfs_file_t *filp) {
+  if (filp->f_ops.flush != NULL && filp->f_ops.flush(filp) == -1)
+    return -1;
+  if (filp->f_flags & FILE_O_SYNC)
+    return vfs_sb_sync(filp->ro.f_vnode->ro.v_sb);
+  return 0;
+}
+
 int vfs_close(vfs_file_t *filp) {
-  /* TODO: Check if this makes sense. */
+  /* Other descriptors may still use it, the last one closes it. */
+  if (__sync_sub_and_fetch(&filp->ro.f_count, 1) > 0)
+    return 0;
   return vfs_file_close(filp);
 }
+
+vfs_file_t * vfs_dup(vfs_file_t *filp) {
+  __sync_fetch_and_add(&filp->ro.f_count, 1);
+  return filp;
+}
@@ -0,0 +1,248 @@
+#include <vm.h>
+#include <mem.h>
+#include <string.h>
+#include <interrupts.h>
+#include <proc.h>
+#include <errors.h>
+#include <fb.h>
+#include <hw.h>
+
+#define VM_PAGE_FAULT_IRQ   14
+
+/* Error code bits of a page fault. */
+#define VM_ERR_PRESENT      0x00000001  /* The page was there, it's a
+                                         * protection fault. */
+#define VM_ERR_WRITE        0x00000002
+
+/* Directory entry of the user pages. */
+#define VM_USER_PDE         ((VM_USER_ADDR) >> 22)
+
+/* Device memory (the APICs) is at the top, it must not be cached. */
+#define VM_NO_CACHE         0x00000010
+
+/* User pages come from the frames we can reach. */
+#define VM_LAST_FRAME       ((VM_USER_ADDR) / (MEM_FRAME_SIZE))
+
+/* The kernel's page directory. Every other one is a copy of it, plus the
+ * user page table. */
+static u32 *vm_kernel_dir;
+
+/* The user page table of dir. */
+static u32 * vm_table(u32 *dir) {
+  return (u32 *)(dir[VM_USER_PDE] & VM_FRAME_MASK);
+}
+
+static void * vm_new_frame() {
+  return mem_allocate_frames(1, MEM_USER_FIRST_FRAME, VM_LAST_FRAME);
+}
+
+/*****************************************************************************
+ * Address spaces                                                            *
+ *****************************************************************************/
+
+u32 * vm_create() {
+  u32 *dir, *table;
+
+  dir = (u32 *)vm_new_frame();
+  table = (u32 *)vm_new_frame();
+  if (dir == NULL || table == NULL) {
+    if (dir != NULL)
+      mem_release_frames(dir, 1);
+    if (table != NULL)
+      mem_release_frames(table, 1);
+    set_errno(E_NOMEM);
+    return NULL;
+  }
+
+  memcpy(dir, vm_kernel_dir, MEM_FRAME_SIZE);
+  memset(table, 0, MEM_FRAME_SIZE);
+  dir[VM_USER_PDE] = (u32)table | VM_PRESENT | VM_WRITE | VM_USER;
+
+  return dir;
+}
+
+void vm_destroy(u32 *dir) {
+  u32 *table;
+  int i;
+
+  table = vm_table(dir);
+  for (i = 0; i < VM_USER_PAGES; i ++)
+    if (table[i] & VM_PRESENT)
+      mem_release_frames((void *)(table[i] & VM_FRAME_MASK), 1);
+
+  mem_release_frames(table, 1);
+  mem_release_frames(dir, 1);
+}
+
+int vm_alloc(u32 *dir, u32 addr, u32 size) {
+  u32 *table;
+  void *frame;
+  u32 i, last;
+
+  if (addr >= VM_USER_SIZE || size > VM_USER_SIZE - addr) {
+    set_errno(E_LIMIT);
+    return -1;
+  }
+
+  table = vm_table(dir);
+  last = (addr + size + MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE;
+  for (i = addr / MEM_FRAME_SIZE; i < last; i ++) {
+    if (table[i] & VM_PRESENT)
+      continue;
+
+    /* What's been mapped so far goes away with dir. */
+    frame = vm_new_frame();
+    if (frame == NULL) {
+      set_errno(E_NOMEM);
+      return -1;
+    }
+    memset(frame, 0, MEM_FRAME_SIZE);
+    table[i] = (u32)frame | VM_PRESENT | VM_WRITE | VM_USER;
+  }
+
+  return 0;
+}
+
+void * vm_frame(u32 *dir, u32 addr) {
+  u32 pte;
+
+  if (addr >= VM_USER_SIZE)
+    return NULL;
+
+  pte = vm_table(dir)[addr / MEM_FRAME_SIZE];
+  if (!(pte & VM_PRESENT))
+    return NULL;
+  return (char *)(pte & VM_FRAME_MASK) + addr % MEM_FRAME_SIZE;
+}
+
+/* Nothing is copied here, just the page table: the pages become read-only
+ * and copy-on-write for both. */
+u32 * vm_fork(u32 *dir) {
+  u32 *child, *table, *child_table;
+  int i;
+
+  child = vm_create();
+  if (child == NULL)
+    return NULL;
+
+  table = vm_table(dir);
+  child_table = vm_table(child);
+  for (i = 0; i < VM_USER_PAGES; i ++) {
+    if (!(table[i] & VM_PRESENT))
+      continue;
+    if (table[i] & VM_WRITE)
+      table[i] = (table[i] & ~VM_WRITE) | VM_COW;
+    child_table[i] = table[i];
+    mem_share_frames((void *)(table[i] & VM_FRAME_MASK), 1);
+  }
+
+  /* The parent may still have its pages writable in the TLB. Only this
+   * processor may: a process runs in one at a time and switching between
+   * address spaces flushes it. */
+  if (hw_get_cr3() == (u32)dir)
+    hw_set_cr3((u32)dir);
+
+  return child;
+}
+
+void vm_activate(u32 *dir) {
+  if (dir == NULL)
+    dir = vm_kernel_dir;
+  if (hw_get_cr3() != (u32)dir)
+    hw_set_cr3((u32)dir);
+}
+
+/*****************************************************************************
+ * Page faults                                                               *
+ *****************************************************************************/
+
+/* Gives the page at addr, mapped by *pte, to the process writing to it. If
+ * the frame is shared it gets a copy, otherwise it's the last one and takes
+ * the frame as it is. */
+static int vm_copy_on_write(u32 *pte, u32 addr) {
+  void *old, *frame;
+
+  old = (void *)(*pte & VM_FRAME_MASK);
+  if (mem_frame_refs(old) == 1) {
+    *pte = (*pte & ~VM_COW) | VM_WRITE;
+  }
+  else {
+    frame = vm_new_frame();
+    if (frame == NULL)
+      return -1;
+    memcpy(frame, old, MEM_FRAME_SIZE);
+    *pte = (u32)frame | (*pte & ~(VM_FRAME_MASK | VM_COW)) | VM_WRITE;
+    mem_release_frames(old, 1);
+  }
+
+  hw_invlpg((void *)addr);
+  return 0;
+}
+
+static int vm_page_fault(itr_frame_t *frame, void *cookie) {
+  u32 addr, *pte;
+
+  /* Writes to copy-on-write pages, by the process or by the kernel on its
+   * behalf. */
+  addr = hw_get_cr2();
+  if (addr >= VM_USER_ADDR && addr - VM_USER_ADDR < VM_USER_SIZE &&
+      (frame->intr.err & VM_ERR_PRESENT) && (frame->intr.err & VM_ERR_WRITE)) {
+    pte = vm_table((u32 *)hw_get_cr3()) +
+          (addr - VM_USER_ADDR) / MEM_FRAME_SIZE;
+    if ((*pte & VM_COW) && vm_copy_on_write(pte, addr) == 0)
+      return ITR_HANDLED;
+  }
+
+  fb_printf(">> page fault: addr: %dx, err: %dx, eip: %dx\n",
+            addr, frame->intr.err, frame->stack.eip);
+
+  /* Anything else is a bug. The process' or ours. */
+  if ((frame->stack.cs & 0x3) != 0)
+    proc_exit(-1);
+  kernel_panic("Page fault in the kernel :(");
+
+  return ITR_HANDLED;
+}
+
+/*****************************************************************************
+ * Set up                                                                    *
+ *****************************************************************************/
+
+int vm_init() {
+  u32 regs[4];
+  int i;
+
+  hw_cpuid(HW_CPUID_FEATURES, regs);
+  if (!(regs[3] & HW_CPUID_EDX_PSE))
+    return -1;
+
+  vm_kernel_dir = (u32 *)mem_allocate_frames(1,
+                                             MEM_KERNEL_FIRST_FRAME,
+                                             MEM_USER_FIRST_FRAME);
+  if (vm_kernel_dir == NULL)
+    return -1;
+
+  /* The whole 4G, 4 MB at a time, but the user pages. */
+  for (i = 0; i < 1024; i ++) {
+    vm_kernel_dir[i] = ((u32)i << 22) | VM_PRESENT | VM_WRITE | VM_BIG;
+    if (i > VM_USER_PDE)
+      vm_kernel_dir[i] |= VM_NO_CACHE;
+  }
+  vm_kernel_dir[VM_USER_PDE] = 0;
+
+  if (itr_set_interrupt_handler(VM_PAGE_FAULT_IRQ, vm_page_fault, NULL,
+                                IDT_PRESENT | IDT_DPL_RING_0 |
+                                IDT_GATE_INTR) == -1)
+    return -1;
+
+  vm_init_cpu();
+  return 0;
+}
+
+/* Everything is identity mapped, so nothing moves when paging is turned
+ * on. */
+void vm_init_cpu() {
+  hw_set_cr4(hw_get_cr4() | HW_CR4_PSE);
+  hw_set_cr3((u32)vm_kernel_dir);
+  hw_set_cr0(hw_get_cr0() | HW_CR0_PG | HW_CR0_WP);
+}
@@ -0,0 +1,48 @@
+#include <wait.h>
+#include <sched.h>
+#include <hw.h>
+#include <lock.h>
+
+void wait_init(wait_queue_t *q) {
+  q->head = NULL;
+  q->tail = NULL;
+}
+
+void wait_sleep(wait_queue_t *q) {
+  int depth;
+
+  /* There's no one to give the CPU to, the caller will check again after
+   * the interrupt. The other processors may need the kernel lock
+   * meanwhile. */
+  if (sched_idling()) {
+    depth = lock_kernel_drop();
+    hw_sti_hlt();
+    hw_cli();
+    lock_kernel_retake(depth);
+    return;
+  }
+
+  /* Blocked processes are not in the run queues, so the same link is used
+   * here. */
+  proc_cur->state = PROC_BLOCKED;
+  proc_cur->next = NULL;
+  if (q->tail == NULL)
+    q->head = proc_cur;
+  else
+    q->tail->next = proc_cur;
+  q->tail = proc_cur;
+
+  sched_schedule();
+}
+
+void wait_wake_up(wait_queue_t *q) {
+  proc_t *p;
+
+  while (q->head != NULL) {
+    p = q->head;
+    q->head = p->next;
+    p->next = NULL;
+    sched_add(p);
+  }
+  q->tail = NULL;
+}
@@ -5,4 +5,24 @@ int fb_printf(char *, int);
 
 void exit(int);
 
+/* Returns the child's PID to the parent and 0 to the child, -1 if it
+ * fails. */
+int fork();
+
+/* waitpid() options. */
+#define WNOHANG 1
+
+/* Waits for the child pid, or any if it's -1. Returns its PID and its exit
+ * status in status unless it's NULL. */
+int waitpid(int pid, int *status, int options);
+
+/* File descriptors a process can have. */
+#define SPAWN_MAX_FD 10
+
+/* Runs the program at path in a new child process, without copying this
+ * one, and returns its PID. argv is NULL terminated. fds, if not NULL, has
+ * SPAWN_MAX_FD entries: fds[i] is the descriptor of ours that becomes the
+ * child's descriptor i, -1 for none. If it's NULL the child gets them all. */
+int spawn(char *path, char **argv, int *fds);
+
 #endif
@@ -2,6 +2,77 @@
 
 SYSCALL_FB_PRINTF equ 0
 SYSCALL_EXIT      equ 1
+SYSCALL_FORK      equ 2
+SYSCALL_WAITPID   equ 3
+SYSCALL_SPAWN     equ 4
+
+CPUID_FEATURES    equ 1
+CPUID_EDX_SEP     equ 0x800
+
+section .data
+
+; Whether to enter the kernel with sysenter: -1 not known yet, 0 no, 1 yes.
+use_sysenter: dd -1
+
+section .text
+
+; Every system call goes through here. The number is in eax and the arguments
+; in ebx, ecx and edx. The result is returned in eax.
+;
+; sysenter is much cheaper than int 0x80, but it doesn't save where to return
+; so the kernel expects the eip in esi and the esp in edi. They're
+; callee-saved, that's why they're pushed first.
+do_syscall:
+  cmp dword [use_sysenter], 0
+  jl .detect
+  je .int80
+
+  push esi
+  push edi
+  mov esi, .back
+  mov edi, esp
+  sysenter
+.back:
+  pop edi
+  pop esi
+  ret
+
+.int80:
+  int 0x80
+  ret
+
+; Ask cpuid once. The Pentium Pro says it has sysenter but it hasn't, that's
+; family 6 below model 3 stepping 3, same as the kernel checks.
+.detect:
+  push eax
+  push ebx
+  push ecx
+  push edx
+  mov eax, CPUID_FEATURES
+  cpuid
+  mov dword [use_sysenter], 0
+  test edx, CPUID_EDX_SEP
+  jz .detected
+  and eax, 0xfff            ; Family, model and stepping.
+  cmp eax, 0x633
+  jae .has_sysenter
+  cmp eax, 0x600
+  jb .has_sysenter
+  mov ebx, eax
+  and ebx, 0xf0
+  cmp ebx, 0x30             ; Model 3 or above is fine.
+  jae .has_sysenter
+  and eax, 0x0f
+  cmp eax, 0x03             ; Stepping 3 or above too.
+  jb .detected
+.has_sysenter:
+  mov dword [use_sysenter], 1
+.detected:
+  pop edx
+  pop ecx
+  pop ebx
+  pop eax
+  jmp do_syscall
 
 global fb_printf
 fb_printf:
@@ -10,12 +81,44 @@ fb_printf:
   ;         eax : código de identificación de fb_printf
   ;         ebx : dirección de memoria de la cadena de formato.
   ;         ecx : valor del único parámetro extra a fb_printf.
+  ;       La llamada se hace con do_syscall.
   ret
-  
+
 global exit
 exit:
   ; eip | ebx
   mov eax, SYSCALL_EXIT
   mov ebx, [esp + 4]
-  int 0x80
+  call do_syscall
   ret ; Though this should not ret.
+
+global fork
+fork:
+  ; eip
+  mov eax, SYSCALL_FORK
+  call do_syscall
+  ret ; Twice, the child returns 0.
+
+global waitpid
+waitpid:
+  ; ebx | eip | pid | status | options
+  push ebx
+  mov eax, SYSCALL_WAITPID
+  mov ebx, [esp + 8]
+  mov ecx, [esp + 12]
+  mov edx, [esp + 16]
+  call do_syscall
+  pop ebx
+  ret
+
+global spawn
+spawn:
+  ; ebx | eip | path | argv | fds
+  push ebx
+  mov eax, SYSCALL_SPAWN
+  mov ebx, [esp + 8]
+  mov ecx, [esp + 12]
+  mov edx, [esp + 16]
+  call do_syscall
+  pop ebx
+  ret
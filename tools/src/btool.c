@@ -10,6 +10,8 @@ void help(int argc, char *argv[]) {
 "         mbr     : Partitions the disk and installs boot code into MBR.\n"
 "         boot    : Installs the bootloader into the given partition.\n"
 "         kernel  : Installs the kernel.\n"
+"         install : Installs a file in the root of a MINIX partition, same\n"
+"                   arguments as kernel.\n"
 "         help : Prints this small help and exits.\n"
   , PROG);
 }
@@ -24,7 +26,7 @@ int main(int argc, char *argv[]) {
     return mbr_write(argc, argv);
   else if (strcmp(CMD, "boot") == 0)
     return bootloader_write(argc, argv);
-  else if (strcmp(CMD, "kernel") == 0)
+  else if (strcmp(CMD, "kernel") == 0 || strcmp(CMD, "install") == 0)
     return minix_write(argc, argv);
   else
     help(argc, argv);
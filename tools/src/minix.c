@@ -155,16 +155,16 @@ unsigned short minix_add_file_block(minix_inode_t *inode) {
     for (k = 0; k < sb.s_nzones && MAP_GET_BIT(zones_map, k); k ++);
     if (k == sb.s_nzones)
       scream_and_quit("No space left on device.");
-    inode->i_zones[fb] = sb.s_firstdatazone + k;
+    inode->i_zones[fb] = sb.s_firstdatazone - 1 + k;
     MAP_SET_BIT(zones_map, k);
-    return sb.s_firstdatazone + k;
+    return sb.s_firstdatazone - 1 + k;
   }
   else if (fb < 7 + 512) {
     if (fb == 7) {
       for (k = 0; k < sb.s_nzones && MAP_GET_BIT(zones_map, k); k ++);
       if (k == sb.s_nzones)
         scream_and_quit("No space left on device.");
-      inode->i_zones[7] = sb.s_firstdatazone + k;
+      inode->i_zones[7] = sb.s_firstdatazone - 1 + k;
       MAP_SET_BIT(zones_map, k);
     }
     blk.blk = inode->i_zones[7];
@@ -174,18 +174,18 @@ unsigned short minix_add_file_block(minix_inode_t *inode) {
     if (k == sb.s_nzones)
       scream_and_quit("No space left on device.");
 
-    ((unsigned short *)blk.data)[fb - 7] = sb.s_firstdatazone + k;
+    ((unsigned short *)blk.data)[fb - 7] = sb.s_firstdatazone - 1 + k;
     MAP_SET_BIT(zones_map, k);
     minix_store_block(&blk);
 
-    return sb.s_firstdatazone + k;
+    return sb.s_firstdatazone - 1 + k;
   }
   else {
     if (fb == 7 + 512) {
       for (k = 0; k < sb.s_nzones && MAP_GET_BIT(zones_map, k); k ++);
       if (k == sb.s_nzones)
         scream_and_quit("No space left on device.");
-      inode->i_zones[8] = sb.s_firstdatazone + k;
+      inode->i_zones[8] = sb.s_firstdatazone - 1 + k;
       MAP_SET_BIT(zones_map, k);
     }
     blk.blk = inode->i_zones[8];
@@ -195,7 +195,7 @@ unsigned short minix_add_file_block(minix_inode_t *inode) {
       for (k = 0; k < sb.s_nzones && MAP_GET_BIT(zones_map, k); k ++);
       if (k == sb.s_nzones)
         scream_and_quit("No space left on device.");
-      ((unsigned short *)blk.data)[(fb - 7 - 512) / 512] = sb.s_firstdatazone + k;
+      ((unsigned short *)blk.data)[(fb - 7 - 512) / 512] = sb.s_firstdatazone - 1 + k;
       MAP_SET_BIT(zones_map, k);
       minix_store_block(&blk);
     }
@@ -205,11 +205,11 @@ unsigned short minix_add_file_block(minix_inode_t *inode) {
     for (k = 0; k < sb.s_nzones && MAP_GET_BIT(zones_map, k); k ++);
     if (k == sb.s_nzones)
       scream_and_quit("No space left on device.");
-    ((unsigned short *)blk.data)[(fb - 7 - 512) % 512] = sb.s_firstdatazone + k;
+    ((unsigned short *)blk.data)[(fb - 7 - 512) % 512] = sb.s_firstdatazone - 1 + k;
     MAP_SET_BIT(zones_map, k);
     minix_store_block(&blk);
 
-    return sb.s_firstdatazone + k;
+    return sb.s_firstdatazone - 1 + k;
   }
 }
 
@@ -249,28 +249,28 @@ void minix_trunc_inode(minix_inode_t *inode) {
 
   for (i = 0; i < fb; i ++) {
     if (i < 7) {
-      MAP_UNSET_BIT(zones_map, inode->i_zones[i] - sb.s_firstdatazone);
+      MAP_UNSET_BIT(zones_map, inode->i_zones[i] - sb.s_firstdatazone + 1);
     }
     else if (i < 7 + 512) {
       if (i == 7) {
         blk.blk = inode->i_zones[7];
         minix_load_block(&blk);
-        MAP_UNSET_BIT(zones_map, blk.blk - sb.s_firstdatazone);
+        MAP_UNSET_BIT(zones_map, blk.blk - sb.s_firstdatazone + 1);
       }
-      MAP_UNSET_BIT(zones_map, ((unsigned short *)blk.data)[i - 7] - sb.s_firstdatazone);
+      MAP_UNSET_BIT(zones_map, ((unsigned short *)blk.data)[i - 7] - sb.s_firstdatazone + 1);
     }
     else {
       if (i == 7 + 512) {
         blk.blk = inode->i_zones[8];
         minix_load_block(&blk);
-        MAP_UNSET_BIT(zones_map, blk.blk - sb.s_firstdatazone);
+        MAP_UNSET_BIT(zones_map, blk.blk - sb.s_firstdatazone + 1);
       }
       if ((i - 7 - 512) % 512 == 0) {
         blk2.blk = ((unsigned short *)blk.data)[(i - 7 - 512) / 512];
         minix_load_block(&blk2);
-        MAP_UNSET_BIT(zones_map, blk2.blk - sb.s_firstdatazone);
+        MAP_UNSET_BIT(zones_map, blk2.blk - sb.s_firstdatazone + 1);
       }
-      MAP_UNSET_BIT(zones_map, ((unsigned short *)blk2.data)[(i - 7 - 512) % 512] - sb.s_firstdatazone);
+      MAP_UNSET_BIT(zones_map, ((unsigned short *)blk2.data)[(i - 7 - 512) % 512] - sb.s_firstdatazone + 1);
     }
   }
 }
@@ -279,11 +279,13 @@ void minix_trunc_inode(minix_inode_t *inode) {
 
 void minix_help(int argc, char *argv[]) {
   printf(
-"usage: %s %s DISK_IMAGE KERNEL [ PARTNO ]\n"
+"usage: %s %s DISK_IMAGE KERNEL [ PARTNO [ NAME ] ]\n"
 "       DISK_IMAGE : path to the full disk image file.\n"
 "       KERNEL     : path to the kernel image to install at PARTNO.\n"
 "       PARTNO     : The partition to install the kernel at. If not\n"
-"                    present, the active partition is selected.\n"
+"                    present or 0, the active partition is selected.\n"
+"       NAME       : Name of the file in the partition's root directory.\n"
+"                    Defaults to kernel.\n"
   , CMD, HELP_OPT);
 }
 
@@ -299,8 +301,10 @@ int minix_write(int argc, char *argv[]) {
   #define imgf      argv[2]
   #define kerf      argv[3]
   #define _partno   argv[4]
+  #define _name     argv[5]
 
   int partno, br, done;
+  char *name;
   // size_t r;
   struct stat kstat;
   int kerb, i, k, count; // , slb;
@@ -312,7 +316,11 @@ int minix_write(int argc, char *argv[]) {
   if (fread(&mbr, 1, sizeof(struct mbr), img) != sizeof(struct mbr))
     scream_and_quit("Could not read mbr.");
 
-  if (argc > 4) {
+  name = argc > 5 ? _name : "kernel";
+  if (strlen(name) > MINIX_MAX_NAME_LEN)
+    scream_and_quit("Name too long.");
+
+  if (argc > 4 && atoi(_partno) != 0) {
     partno = atoi(_partno) - 1;
   }
   else {
@@ -372,22 +380,22 @@ int minix_write(int argc, char *argv[]) {
       sb.s_zmap_blocks * MINIX_BLOCK_SIZE)
     scream_and_quit("Could not read zones map.");
 
-  /* Let's try to find the file /kernel */
+  /* Let's try to find the file /NAME */
   /* First, let's locate the root inode, which is the first inode in MINIX. */
   minix_load_inode(MINIX_ROOT_INODE, &root);
 
-  /* Scan root inode looking for "kernel" and delete it if found. */
+  /* Scan root inode looking for NAME and delete it if found. */
   for (i = 0; i < (root.i_size - 1) / MINIX_BLOCK_SIZE + 1; i++) {
     bmain.blk = minix_file_block_2_block(&root, i);
     minix_load_block(&bmain);
 
-    /* Check the existence of /kernel. */
+    /* Check the existence of /NAME. */
     for (k = 0, dentries = (minix_direntry_t *)bmain.data;
          k < MINIX_DENTRIES_PER_BLOCK &&
          i * MINIX_BLOCK_SIZE + k * sizeof(minix_direntry_t) < root.i_size;
          k ++) {
       if (dentries[k].inode != 0 &&
-          memcmp("kernel", dentries[k].name, strlen("kernel") + 1) == 0) {
+          memcmp(name, dentries[k].name, strlen(name) + 1) == 0) {
         /* Load inode */
         minix_load_inode(dentries[k].inode, &inode);
         /* Truncate it */
@@ -398,7 +406,7 @@ int minix_write(int argc, char *argv[]) {
         MAP_UNSET_BIT(inodes_map, dentries[k].inode);
         /* Clear the entry. */
         dentries[k].inode = 0; /* Mark it as a hole. */
-        memset(dentries[k].name, 0, strlen("kernel"));
+        memset(dentries[k].name, 0, strlen(name));
         /* And flush it. Now we can reuse bmain. */
         minix_store_block(&bmain);
 
@@ -460,10 +468,10 @@ int minix_write(int argc, char *argv[]) {
 
   fclose(img2);
 
-  /* Prepare dentry for "kernel". */
+  /* Prepare dentry for NAME. */
   memset(&dentry, 0, sizeof(minix_direntry_t));
   dentry.inode = i;
-  strcpy(dentry.name, "kernel");
+  memcpy(dentry.name, name, strlen(name));
 
   /* Load / */
   minix_load_inode(MINIX_ROOT_INODE, &root);